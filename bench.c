@@ -0,0 +1,516 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Microbenchmarks of the hot helpers on
+// synthetic in-memory data, so a change to one kernel
+// can be measured without an image or the disk in the
+// way.  Each benchmark is warmed up, then timed over a
+// number of samples sized to take a few milliseconds
+// each; the median of the samples is reported with its
+// spread.  Build with optimization for numbers worth
+// comparing, e.g. make bench CFLAGS="-Wall -O2".
+//
+// Usage: ./bench [name filter]
+//-----------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "exfat.h"
+#include "bitset.h"
+#include "directory.h"
+#include "fat.h"
+#include "file.h"
+#include "list.h"
+#include "runindex.h"
+
+#define NANOSECONDS 1000000000ULL
+#define WARMUP_NS (100 * 1000000ULL)
+#define SAMPLE_NS (10 * 1000000ULL)
+#define SAMPLES 21
+
+#define BITMAP_BYTES (KILOBYTE_SIZE * KILOBYTE_SIZE)
+#define NAME_COUNT 4096
+#define CHAIN_CLUSTERS 65536
+#define ENTRY_SETS 4096
+
+/* Runs the kernel once over its data and returns a value that depends on the work done */
+typedef uint64_t (*Kernel)(void *context);
+
+typedef struct Benchmark {
+
+    const char *name;
+    Kernel kernel;
+    void *context;
+    uint64_t items;     /* operations per call of the kernel */
+    uint64_t bytes;     /* input bytes per call of the kernel */
+
+} Benchmark ;
+
+typedef struct BenchData {
+
+    uint32_t *bitmap_words;
+    Bitset *bitmap;
+
+    uint16_t *unicode_names[NAME_COUNT];
+    char *ascii_names[NAME_COUNT];
+    uint8_t name_lengths[NAME_COUNT];
+    uint64_t name_characters;
+
+    exfat volume;
+    uint32_t *fat;
+    RunIndex *runs;
+    DirectoryEntry chain_entry;
+
+    uint8_t *entries;
+    uint32_t entry_count;
+
+} BenchData ;
+
+/* Results are folded in here so the compiler cannot drop the work */
+static volatile uint64_t sink;
+
+static uint64_t nanoseconds(){
+
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * NANOSECONDS + (uint64_t) now.tv_nsec;
+}
+
+static uint64_t cycles(){
+
+#ifdef HAVE_TSC
+    /* Reference cycles of the time stamp counter, not core clock cycles under turbo */
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static uint64_t nextRandom(uint64_t *state){
+
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static int compareDoubles(const void *a, const void *b){
+
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+static void formatRate(double bytes_per_second, char *buffer, size_t size){
+
+    const char *units[] = {"B/s", "KB/s", "MB/s", "GB/s", "TB/s"};
+    int unit = 0;
+
+    while(bytes_per_second >= 1000.0 && unit < 4){
+        bytes_per_second /= 1000.0;
+        unit++;
+    }
+    snprintf(buffer, size, "%.2f %s", bytes_per_second, units[unit]);
+}
+
+/*------------------------------------------------------
+// runBenchmark
+//
+// PURPOSE: Warms a kernel up, sizes a batch of calls to
+// take about SAMPLE_NS, then times SAMPLES batches and
+// prints the median ns/op, cycles/op and bytes/s along
+// with the median absolute deviation of the samples.
+// INPUT PARAMETERS:
+//     Takes in the Benchmark to run.
+//------------------------------------------------------*/
+static void runBenchmark(const Benchmark *benchmark){
+
+    double ns_per_op[SAMPLES];
+    double cycles_per_op[SAMPLES];
+    double deviation[SAMPLES];
+    uint64_t batch = 0;
+    uint64_t start = nanoseconds();
+    uint64_t elapsed;
+    uint64_t cycle_start;
+    double median;
+    double spread;
+    char rate[32];
+
+    /* Warm caches, branch predictors and the clock, counting how many calls fit */
+    do {
+        sink += benchmark->kernel(benchmark->context);
+        batch++;
+        elapsed = nanoseconds() - start;
+    } while(elapsed < WARMUP_NS);
+
+    batch = (uint64_t) ((double) batch * SAMPLE_NS / elapsed);
+    if(batch == 0){
+        batch = 1;
+    }
+
+    for(int sample = 0; sample < SAMPLES; sample++){
+        start = nanoseconds();
+        cycle_start = cycles();
+        for(uint64_t call = 0; call < batch; call++){
+            sink += benchmark->kernel(benchmark->context);
+        }
+        cycles_per_op[sample] = (double) (cycles() - cycle_start) / (batch * benchmark->items);
+        ns_per_op[sample] = (double) (nanoseconds() - start) / (batch * benchmark->items);
+    }
+
+    qsort(ns_per_op, SAMPLES, sizeof (double), compareDoubles);
+    qsort(cycles_per_op, SAMPLES, sizeof (double), compareDoubles);
+    median = ns_per_op[SAMPLES / 2];
+    for(int sample = 0; sample < SAMPLES; sample++){
+        deviation[sample] = ns_per_op[sample] > median ? ns_per_op[sample] - median : median - ns_per_op[sample];
+    }
+    qsort(deviation, SAMPLES, sizeof (double), compareDoubles);
+    spread = median > 0 ? 100.0 * deviation[SAMPLES / 2] / median : 0;
+
+    formatRate((double) benchmark->bytes / benchmark->items * NANOSECONDS / median, rate, sizeof (rate));
+#ifdef HAVE_TSC
+    printf("%-28s %12.3f %12.2f %14s %8.1f%%\n", benchmark->name, median, cycles_per_op[SAMPLES / 2], rate, spread);
+#else
+    printf("%-28s %12.3f %12s %14s %8.1f%%\n", benchmark->name, median, "-", rate, spread);
+#endif
+}
+
+/* numUnsetBits and its replacements, over an allocation bitmap as calculateFreeSpace reads it */
+
+static uint64_t benchNumUnsetBits(void *context){
+
+    BenchData *data = context;
+    uint64_t total = 0;
+
+    for(uint64_t i = 0; i < BITMAP_BYTES / 4; i++){
+        total += numUnsetBits(data->bitmap_words[i]);
+    }
+    return total;
+}
+
+static uint64_t benchPopcount32(void *context){
+
+    BenchData *data = context;
+    uint64_t total = 0;
+
+    for(uint64_t i = 0; i < BITMAP_BYTES / 4; i++){
+        total += 32 - __builtin_popcount(data->bitmap_words[i]);
+    }
+    return total;
+}
+
+static uint64_t benchCountSetBits(void *context){
+
+    BenchData *data = context;
+
+    return data->bitmap->size - countSetBits(data->bitmap, 0, data->bitmap->size);
+}
+
+/* unicode2ascii and its replacements, over directory entry names */
+
+static uint64_t benchUnicode2ascii(void *context){
+
+    BenchData *data = context;
+    uint64_t total = 0;
+    char *name;
+
+    for(int i = 0; i < NAME_COUNT; i++){
+        name = unicode2ascii(data->unicode_names[i], data->name_lengths[i]);
+        total += (uint8_t) name[0];
+        free(name);
+    }
+    return total;
+}
+
+/* Narrows into a caller buffer, without the allocation */
+static uint64_t benchNarrowScalar(void *context){
+
+    BenchData *data = context;
+    uint64_t total = 0;
+    char name[MAX_NAME_LENGTH + 1];
+
+    for(int i = 0; i < NAME_COUNT; i++){
+        for(int c = 0; c < data->name_lengths[i]; c++){
+            name[c] = (char) data->unicode_names[i][c];
+        }
+        name[data->name_lengths[i]] = '\0';
+        total += (uint8_t) name[0];
+    }
+    return total;
+}
+
+#ifdef __SSE2__
+/* Narrows 16 characters per step, masking first so packus truncates like the cast does */
+static uint64_t benchNarrowSse2(void *context){
+
+    BenchData *data = context;
+    const __m128i low_bytes = _mm_set1_epi16(0x00ff);
+    uint64_t total = 0;
+    char name[MAX_NAME_LENGTH + 16];
+    const uint16_t *source;
+    int length;
+    int c;
+
+    for(int i = 0; i < NAME_COUNT; i++){
+        source = data->unicode_names[i];
+        length = data->name_lengths[i];
+        for(c = 0; c + 16 <= length; c += 16){
+            __m128i first = _mm_and_si128(_mm_loadu_si128((const __m128i *) (source + c)), low_bytes);
+            __m128i second = _mm_and_si128(_mm_loadu_si128((const __m128i *) (source + c + 8)), low_bytes);
+            _mm_storeu_si128((__m128i *) (name + c), _mm_packus_epi16(first, second));
+        }
+        for(; c < length; c++){
+            name[c] = (char) source[c];
+        }
+        name[length] = '\0';
+        total += (uint8_t) name[0];
+    }
+    return total;
+}
+#endif
+
+/* Chain building with the legacy List versus the extent index */
+
+static void appendToList(uint32_t cluster, void *context){
+
+    insert((List *) context, cluster);
+}
+
+static uint64_t benchChainList(void *context){
+
+    BenchData *data = context;
+    List *chain = createList();
+    uint64_t size;
+
+    walkClusterChain(-1, &data->volume, data->fat, data->chain_entry.first_cluster, CHAIN_CLUSTERS,
+                     appendToList, chain, NULL);
+    size = chain->size;
+    truncateList(chain, 0);
+    free(chain);
+    return size;
+}
+
+static uint64_t benchChainExtents(void *context){
+
+    BenchData *data = context;
+    ExfatFile *file = openEntry(-1, &data->volume, data->fat, &data->chain_entry);
+    uint64_t count = file->extent_count;
+
+    closeFile(file);
+    return count;
+}
+
+/* FAT run detection over the whole table, and following the chain through the resulting index */
+
+static uint64_t benchScanRuns(void *context){
+
+    BenchData *data = context;
+    RunIndex *index = createRunIndex((uint64_t) data->volume.cluster_count + FIRST_DATA_CLUSTER, UINT64_MAX);
+    uint64_t count;
+
+    scanFatEntries(index, data->fat + FIRST_DATA_CLUSTER, FIRST_DATA_CLUSTER, data->volume.cluster_count);
+    count = index->count;
+    destroyRunIndex(index);
+    return count;
+}
+
+static uint64_t benchChainRuns(void *context){
+
+    BenchData *data = context;
+    const FatRun *run;
+    uint32_t cluster = data->chain_entry.first_cluster;
+    uint64_t runs = 0;
+
+    while(isValidCluster(&data->volume, cluster) && (run = findRun(data->runs, cluster)) != NULL){
+        cluster = run->next;
+        runs++;
+    }
+    return runs;
+}
+
+/* Directory entry parsing and name hashing */
+
+static uint64_t benchParseEntrySets(void *context){
+
+    BenchData *data = context;
+    DirectoryEntry entry;
+    uint64_t total = 0;
+    uint32_t used;
+
+    for(uint32_t i = 0; i < data->entry_count; i += used > 0 ? used : 1){
+        used = parseEntrySet(data->entries, data->entry_count, i, 0, &entry);
+        if(used > 0){
+            total += entry.data_length;
+        }
+    }
+    return total;
+}
+
+static uint64_t benchNameHash(void *context){
+
+    BenchData *data = context;
+    uint64_t total = 0;
+
+    for(int i = 0; i < NAME_COUNT; i++){
+        total += nameHash(data->ascii_names[i]);
+    }
+    return total;
+}
+
+/*------------------------------------------------------
+// buildData
+//
+// PURPOSE: Builds the synthetic inputs: a part-used
+// allocation bitmap, names of 1 to 64 characters, a FAT
+// holding one fragmented chain and a directory of entry
+// sets for those names.
+// INPUT PARAMETERS:
+//     Takes in the BenchData to fill.
+//------------------------------------------------------*/
+static void buildData(BenchData *data){
+
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    uint32_t cluster;
+    uint32_t run;
+    uint32_t placed;
+    uint32_t next_free;
+    uint8_t *raw;
+    int secondary;
+
+    /* Bitmap: runs of used and free clusters, as a volume in use looks */
+    data->bitmap = createBitset((uint64_t) BITMAP_BYTES * 8);
+    assert(data->bitmap != NULL);
+    for(uint64_t bit = 0; bit < data->bitmap->size; bit += run){
+        run = 1 + nextRandom(&state) % 512;
+        if(nextRandom(&state) % 3 != 0){
+            for(uint64_t i = bit; i < bit + run && i < data->bitmap->size; i++){
+                setBit(data->bitmap, i);
+            }
+        }
+    }
+    data->bitmap_words = (uint32_t *) data->bitmap->words;
+
+    /* Names, stored both as the entry holds them and as ASCII */
+    data->name_characters = 0;
+    for(int i = 0; i < NAME_COUNT; i++){
+        data->name_lengths[i] = (uint8_t) (1 + nextRandom(&state) % 64);
+        data->unicode_names[i] = malloc(data->name_lengths[i] * sizeof (uint16_t));
+        data->ascii_names[i] = malloc(data->name_lengths[i] + 1);
+        assert(data->unicode_names[i] != NULL && data->ascii_names[i] != NULL);
+        for(int c = 0; c < data->name_lengths[i]; c++){
+            data->ascii_names[i][c] = (char) ('a' + nextRandom(&state) % 26);
+            data->unicode_names[i][c] = (uint16_t) data->ascii_names[i][c];
+        }
+        data->ascii_names[i][data->name_lengths[i]] = '\0';
+        data->name_characters += data->name_lengths[i];
+    }
+
+    /* FAT: one chain of runs of 1 to 16 clusters with gaps between them */
+    memset(&data->volume, 0, sizeof (exfat));
+    data->volume.sector_size = 9;
+    data->volume.cluster_size = 3;
+    data->volume.cluster_count = CHAIN_CLUSTERS * 3;
+    data->fat = malloc(((size_t) data->volume.cluster_count + FIRST_DATA_CLUSTER) * FAT_ENTRY_SIZE);
+    assert(data->fat != NULL);
+    memset(data->fat, 0, ((size_t) data->volume.cluster_count + FIRST_DATA_CLUSTER) * FAT_ENTRY_SIZE);
+
+    cluster = FIRST_DATA_CLUSTER;
+    placed = 0;
+    while(placed < CHAIN_CLUSTERS){
+        run = 1 + nextRandom(&state) % 16;
+        if(run > CHAIN_CLUSTERS - placed){
+            run = CHAIN_CLUSTERS - placed;
+        }
+        for(uint32_t i = 0; i + 1 < run; i++){
+            data->fat[cluster + i] = cluster + i + 1;
+        }
+        placed += run;
+        next_free = cluster + run + (uint32_t) (nextRandom(&state) % 3);
+        data->fat[cluster + run - 1] = placed == CHAIN_CLUSTERS ? END_OF_CHAIN : next_free;
+        cluster = next_free;
+    }
+
+    data->runs = createRunIndex((uint64_t) data->volume.cluster_count + FIRST_DATA_CLUSTER, UINT64_MAX);
+    scanFatEntries(data->runs, data->fat + FIRST_DATA_CLUSTER, FIRST_DATA_CLUSTER, data->volume.cluster_count);
+
+    memset(&data->chain_entry, 0, sizeof (DirectoryEntry));
+    data->chain_entry.first_cluster = FIRST_DATA_CLUSTER;
+    data->chain_entry.data_length = (uint64_t) CHAIN_CLUSTERS * clusterBytes(&data->volume);
+    data->chain_entry.valid_data_length = data->chain_entry.data_length;
+
+    /* Directory: one entry set per name */
+    data->entries = calloc((size_t) ENTRY_SETS * (2 + (MAX_NAME_LENGTH + 14) / 15), ENTRY_SIZE);
+    assert(data->entries != NULL);
+    data->entry_count = 0;
+    for(int i = 0; i < ENTRY_SETS; i++){
+        secondary = 1 + (data->name_lengths[i % NAME_COUNT] + NAME_CHARACTERS_PER_ENTRY - 1) / NAME_CHARACTERS_PER_ENTRY;
+
+        raw = data->entries + (size_t) data->entry_count++ * ENTRY_SIZE;
+        raw[0] = ENTRY_TYPE_FILE;
+        raw[1] = (uint8_t) secondary;
+
+        raw = data->entries + (size_t) data->entry_count++ * ENTRY_SIZE;
+        raw[0] = ENTRY_TYPE_STREAM_EXTENSION;
+        raw[1] = FLAG_ALLOCATION_POSSIBLE;
+        raw[3] = data->name_lengths[i % NAME_COUNT];
+        memcpy(raw + 8, &data->chain_entry.data_length, 8);
+        memcpy(raw + 24, &data->chain_entry.data_length, 8);
+
+        for(int c = 0; c < data->name_lengths[i % NAME_COUNT]; c += NAME_CHARACTERS_PER_ENTRY){
+            raw = data->entries + (size_t) data->entry_count++ * ENTRY_SIZE;
+            raw[0] = ENTRY_TYPE_FILE_NAME;
+            for(int k = 0; k < NAME_CHARACTERS_PER_ENTRY && c + k < data->name_lengths[i % NAME_COUNT]; k++){
+                memcpy(raw + 2 + 2 * k, &data->unicode_names[i % NAME_COUNT][c + k], 2);
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[]){
+
+    BenchData *data = malloc(sizeof (BenchData));
+    const char *filter = argc > 1 ? argv[1] : NULL;
+
+    assert(data != NULL);
+    buildData(data);
+
+    Benchmark benchmarks[] = {
+        {"numUnsetBits",         benchNumUnsetBits,   data, BITMAP_BYTES / 4, BITMAP_BYTES},
+        {"popcount32",           benchPopcount32,     data, BITMAP_BYTES / 4, BITMAP_BYTES},
+        {"countSetBits",         benchCountSetBits,   data, BITMAP_BYTES / 4, BITMAP_BYTES},
+        {"unicode2ascii",        benchUnicode2ascii,  data, NAME_COUNT, data->name_characters * 2},
+        {"narrow (scalar)",      benchNarrowScalar,   data, NAME_COUNT, data->name_characters * 2},
+#ifdef __SSE2__
+        {"narrow (sse2)",        benchNarrowSse2,     data, NAME_COUNT, data->name_characters * 2},
+#endif
+        {"chain (List)",         benchChainList,      data, CHAIN_CLUSTERS, (uint64_t) CHAIN_CLUSTERS * FAT_ENTRY_SIZE},
+        {"chain (extents)",      benchChainExtents,   data, CHAIN_CLUSTERS, (uint64_t) CHAIN_CLUSTERS * FAT_ENTRY_SIZE},
+        {"chain (run index)",    benchChainRuns,      data, CHAIN_CLUSTERS, (uint64_t) CHAIN_CLUSTERS * FAT_ENTRY_SIZE},
+        {"FAT runs",             benchScanRuns,       data, CHAIN_CLUSTERS * 3, (uint64_t) CHAIN_CLUSTERS * 3 * FAT_ENTRY_SIZE},
+        {"parseEntrySet",        benchParseEntrySets, data, ENTRY_SETS, (uint64_t) data->entry_count * ENTRY_SIZE},
+        {"nameHash",             benchNameHash,       data, NAME_COUNT, data->name_characters},
+    };
+
+    printf("%-28s %12s %12s %14s %9s\n", "benchmark", "ns/op", "cycles/op", "bytes/s", "+/-");
+    for(size_t i = 0; i < sizeof (benchmarks) / sizeof (benchmarks[0]); i++){
+        if(filter == NULL || strstr(benchmarks[i].name, filter) != NULL){
+            runBenchmark(&benchmarks[i]);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
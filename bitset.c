@@ -0,0 +1,182 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Implement a fixed size Bitset data
+// structure.  Bits are packed into 64 bit words so
+// that whole regions can be compared a word at a time,
+// testAndSetBit is atomic so several threads may mark
+// bits in the same set.
+//-----------------------------------------*/
+#include <stdlib.h>
+#include <assert.h>
+
+#include "bitset.h"
+
+/*------------------------------------------------------
+// createBitset
+//
+// PURPOSE: Allocates a Bitset able to hold the given
+// number of bits, with every bit initially unset.
+// INPUT PARAMETERS:
+//    Takes in the number of bits the set must hold.
+// OUTPUT PARAMETERS:
+//     Returns a pointer to the newly allocated Bitset, or
+// NULL if the allocation failed.
+//------------------------------------------------------*/
+Bitset *createBitset(uint64_t size){
+
+    Bitset *bitset = malloc(sizeof (Bitset));
+
+    if(bitset != NULL){
+        bitset->size = size;
+        bitset->word_count = (size + 63) / 64;
+        bitset->words = calloc(bitset->word_count + 1, sizeof (uint64_t));
+
+        if(bitset->words == NULL){
+            free(bitset);
+            bitset = NULL;
+        }
+    }
+    return bitset;
+}
+
+/*------------------------------------------------------
+// destroyBitset
+//
+// PURPOSE: Frees a Bitset and the words it owns.
+// INPUT PARAMETERS:
+//    Takes in a pointer to the Bitset to free, NULL is
+// ignored.
+//------------------------------------------------------*/
+void destroyBitset(Bitset *bitset){
+
+    if(bitset != NULL){
+        free(bitset->words);
+        free(bitset);
+    }
+}
+
+void setBit(Bitset *bitset, uint64_t index){
+
+    assert(index < bitset->size);
+    bitset->words[index / 64] |= (uint64_t) 1 << (index % 64);
+}
+
+void clearBit(Bitset *bitset, uint64_t index){
+
+    assert(index < bitset->size);
+    bitset->words[index / 64] &= ~((uint64_t) 1 << (index % 64));
+}
+
+int testBit(const Bitset *bitset, uint64_t index){
+
+    assert(index < bitset->size);
+    return (bitset->words[index / 64] >> (index % 64)) & 1;
+}
+
+/*------------------------------------------------------
+// testAndSetBit
+//
+// PURPOSE: Atomically sets a bit and reports whether it
+// was already set, so that concurrent walkers can claim
+// bits without a lock.
+// INPUT PARAMETERS:
+//    Takes in a pointer to a Bitset and the index of the
+// bit to set.
+// OUTPUT PARAMETERS:
+//     Returns 1 if the bit was already set, 0 otherwise.
+//------------------------------------------------------*/
+int testAndSetBit(Bitset *bitset, uint64_t index){
+
+    uint64_t mask = (uint64_t) 1 << (index % 64);
+    uint64_t previous;
+
+    assert(index < bitset->size);
+    previous = __atomic_fetch_or(&bitset->words[index / 64], mask, __ATOMIC_RELAXED);
+
+    return (previous & mask) != 0;
+}
+
+/*------------------------------------------------------
+// findNextSet
+//
+// PURPOSE: Finds the first set bit in [start, end), whole
+// words of unset bits are skipped with a count trailing
+// zeros instruction.
+// INPUT PARAMETERS:
+//    Takes in a pointer to a Bitset along with the first
+// bit and one past the last bit of the range.
+// OUTPUT PARAMETERS:
+//     Returns the index of the first set bit, or end if
+// every bit in the range is unset.
+//------------------------------------------------------*/
+uint64_t findNextSet(const Bitset *bitset, uint64_t start, uint64_t end){
+
+    uint64_t word;
+
+    if(end > bitset->size){
+        end = bitset->size;
+    }
+    while(start < end){
+        word = bitset->words[start / 64] >> (start % 64);
+        if(word != 0){
+            start += __builtin_ctzll(word);
+            return start < end ? start : end;
+        }
+        start = (start / 64 + 1) * 64;
+    }
+    return end;
+}
+
+/* Same as findNextSet for the first unset bit */
+uint64_t findNextClear(const Bitset *bitset, uint64_t start, uint64_t end){
+
+    uint64_t word;
+
+    if(end > bitset->size){
+        end = bitset->size;
+    }
+    while(start < end){
+        word = ~bitset->words[start / 64] >> (start % 64);
+        if(word != 0){
+            start += __builtin_ctzll(word);
+            return start < end ? start : end;
+        }
+        start = (start / 64 + 1) * 64;
+    }
+    return end;
+}
+
+/*------------------------------------------------------
+// countSetBits
+//
+// PURPOSE: Counts the set bits in the range [start, end),
+// whole words are counted with a popcount.
+// INPUT PARAMETERS:
+//    Takes in a pointer to a Bitset along with the first
+// bit and one past the last bit of the range.
+// OUTPUT PARAMETERS:
+//     Returns the number of set bits in the range.
+//------------------------------------------------------*/
+uint64_t countSetBits(const Bitset *bitset, uint64_t start, uint64_t end){
+
+    uint64_t count = 0;
+
+    if(end > bitset->size){
+        end = bitset->size;
+    }
+
+    while(start < end && (start % 64) != 0){
+        count += testBit(bitset, start);
+        start++;
+    }
+    while(start + 64 <= end){
+        count += __builtin_popcountll(bitset->words[start / 64]);
+        start += 64;
+    }
+    while(start < end){
+        count += testBit(bitset, start);
+        start++;
+    }
+    return count;
+}
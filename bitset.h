@@ -0,0 +1,38 @@
+//
+// Fixed size bitset used to hold per-cluster state in memory.
+//
+
+#ifndef FSREADER_BITSET_H
+#define FSREADER_BITSET_H
+
+#include <stdint.h>
+
+typedef struct Bitset {
+
+    uint64_t *words;
+    uint64_t size;        /* in bits */
+    uint64_t word_count;
+
+} Bitset ;
+
+
+Bitset *createBitset(uint64_t size);
+
+void destroyBitset(Bitset *bitset);
+
+void setBit(Bitset *bitset, uint64_t index);
+
+void clearBit(Bitset *bitset, uint64_t index);
+
+int testBit(const Bitset *bitset, uint64_t index);
+
+int testAndSetBit(Bitset *bitset, uint64_t index);
+
+uint64_t findNextSet(const Bitset *bitset, uint64_t start, uint64_t end);
+
+uint64_t findNextClear(const Bitset *bitset, uint64_t start, uint64_t end);
+
+uint64_t countSetBits(const Bitset *bitset, uint64_t start, uint64_t end);
+
+
+#endif //FSREADER_BITSET_H
@@ -0,0 +1,463 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: A block cache shared by every thread in
+// front of the metadata reads of a volume (boot region,
+// FAT, allocation bitmap and directories).  The volume
+// is cached in 4KB blocks, each keyed by its descriptor
+// and block number, under a fixed memory budget.  The
+// blocks are split across shards, each with its own lock
+// and CLOCK hand, so threads reading different blocks
+// rarely wait on each other.  A thread whose misses fall
+// on consecutive blocks is reading sequentially; its
+// readahead window doubles with each such miss, the
+// blocks are fetched in one read and posix_fadvise is
+// told about the window that follows.  Readahead blocks
+// enter the cache unreferenced, so the CLOCK hand takes
+// them first if they are never used.
+//-----------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <assert.h>
+
+#include "cache.h"
+#include "exfat.h"
+
+#define CACHE_SHARDS 16
+#define MIN_SHARD_SLOTS 8
+#define MAX_READAHEAD_BLOCKS (CACHE_BYPASS_SIZE / CACHE_BLOCK_SIZE)
+#define NO_SLOT UINT32_MAX
+
+typedef struct CacheSlot {
+
+    int volume_fd;
+    uint64_t block;
+    uint32_t next;          /* next slot in the same hash bucket */
+    uint8_t valid;
+    uint8_t referenced;     /* CLOCK bit, cleared as the hand passes */
+
+} CacheSlot ;
+
+typedef struct CacheShard {
+
+    pthread_mutex_t lock;
+    CacheSlot *slots;
+    uint8_t *data;          /* slot_count blocks */
+    uint32_t *buckets;      /* first slot of each hash chain */
+    uint32_t slot_count;
+    uint32_t bucket_mask;
+    uint32_t hand;
+    uint32_t used;
+
+} CacheShard ;
+
+static CacheShard *shards = NULL;
+
+static atomic_uint_fast64_t hits[TRACE_SOURCES];
+static atomic_uint_fast64_t misses[TRACE_SOURCES];
+static atomic_uint_fast64_t readaheads;
+static atomic_uint_fast64_t readahead_blocks;
+static atomic_uint_fast64_t evictions;
+
+/* The last miss of this thread, to spot sequential reads */
+static _Thread_local int stream_fd = -1;
+static _Thread_local uint64_t stream_next = 0;
+static _Thread_local uint32_t stream_window = 1;
+
+static uint64_t blockHash(int volume_fd, uint64_t block){
+
+    uint64_t hash = (block ^ ((uint64_t) volume_fd << 48)) * 0x9e3779b97f4a7c15ULL;
+
+    return hash ^ (hash >> 29);
+}
+
+static CacheShard *shardOf(uint64_t hash){
+
+    return &shards[(hash >> 58) % CACHE_SHARDS];
+}
+
+/* Returns the slot holding the block, or NO_SLOT; the caller holds the shard lock */
+static uint32_t findSlot(CacheShard *shard, uint64_t hash, int volume_fd, uint64_t block){
+
+    uint32_t slot = shard->buckets[hash & shard->bucket_mask];
+
+    while(slot != NO_SLOT && (shard->slots[slot].volume_fd != volume_fd || shard->slots[slot].block != block)){
+        slot = shard->slots[slot].next;
+    }
+    return slot;
+}
+
+static void unlinkSlot(CacheShard *shard, uint32_t slot){
+
+    CacheSlot *victim = &shard->slots[slot];
+    uint32_t *link = &shard->buckets[blockHash(victim->volume_fd, victim->block) & shard->bucket_mask];
+
+    while(*link != slot){
+        link = &shard->slots[*link].next;
+    }
+    *link = victim->next;
+    victim->valid = 0;
+}
+
+/*------------------------------------------------------
+// insertBlock
+//
+// PURPOSE: Puts a block into its shard unless it is there
+// already, evicting with the CLOCK algorithm when the
+// shard is full.
+// INPUT PARAMETERS:
+//     Takes in the descriptor and block number, the block's
+// bytes and whether it was asked for (referenced) or only
+// read ahead.
+//------------------------------------------------------*/
+static void insertBlock(int volume_fd, uint64_t block, const uint8_t *bytes, int referenced){
+
+    uint64_t hash = blockHash(volume_fd, block);
+    CacheShard *shard = shardOf(hash);
+    CacheSlot *slot;
+    uint32_t index;
+
+    pthread_mutex_lock(&shard->lock);
+
+    if(findSlot(shard, hash, volume_fd, block) == NO_SLOT){
+        if(shard->used < shard->slot_count){
+            index = shard->used++;
+        }
+        else {
+            while(shard->slots[shard->hand].referenced){
+                shard->slots[shard->hand].referenced = 0;
+                shard->hand = (shard->hand + 1) % shard->slot_count;
+            }
+            index = shard->hand;
+            shard->hand = (shard->hand + 1) % shard->slot_count;
+            if(shard->slots[index].valid){
+                unlinkSlot(shard, index);
+                atomic_fetch_add(&evictions, 1);
+            }
+        }
+
+        slot = &shard->slots[index];
+        slot->volume_fd = volume_fd;
+        slot->block = block;
+        slot->valid = 1;
+        slot->referenced = (uint8_t) referenced;
+        slot->next = shard->buckets[hash & shard->bucket_mask];
+        shard->buckets[hash & shard->bucket_mask] = index;
+        memcpy(shard->data + (size_t) index * CACHE_BLOCK_SIZE, bytes, CACHE_BLOCK_SIZE);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/* Copies part of a cached block out, returning 0 if it is not cached */
+static int copyCached(int volume_fd, uint64_t block, size_t within, void *destination, size_t length){
+
+    uint64_t hash = blockHash(volume_fd, block);
+    CacheShard *shard = shardOf(hash);
+    uint32_t slot;
+
+    pthread_mutex_lock(&shard->lock);
+    slot = findSlot(shard, hash, volume_fd, block);
+    if(slot != NO_SLOT){
+        memcpy(destination, shard->data + (size_t) slot * CACHE_BLOCK_SIZE + within, length);
+        shard->slots[slot].referenced = 1;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return slot != NO_SLOT;
+}
+
+/*------------------------------------------------------
+// cacheOpen
+//
+// PURPOSE: Creates the cache, sized to a memory budget.
+// A budget too small for a few blocks per shard leaves
+// caching off.
+// INPUT PARAMETERS:
+//     Takes in the budget in bytes.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success (including a budget of 0), -1
+// if the memory could not be allocated.
+//------------------------------------------------------*/
+int cacheOpen(uint64_t budget){
+
+    uint64_t slots = budget / CACHE_BLOCK_SIZE / CACHE_SHARDS;
+    uint32_t buckets = 1;
+    CacheShard *shard;
+
+    if(slots < MIN_SHARD_SLOTS){
+        return 0;
+    }
+    if(slots > UINT32_MAX / 2){
+        slots = UINT32_MAX / 2;
+    }
+    while(buckets < slots){
+        buckets *= 2;
+    }
+
+    shards = calloc(CACHE_SHARDS, sizeof (CacheShard));
+    if(shards == NULL){
+        return -1;
+    }
+    for(int i = 0; i < CACHE_SHARDS; i++){
+        shard = &shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->slot_count = (uint32_t) slots;
+        shard->bucket_mask = buckets - 1;
+        shard->slots = calloc(slots, sizeof (CacheSlot));
+        shard->data = malloc(slots * CACHE_BLOCK_SIZE);
+        shard->buckets = malloc(buckets * sizeof (uint32_t));
+        if(shard->slots == NULL || shard->data == NULL || shard->buckets == NULL){
+            cacheClose();
+            return -1;
+        }
+        memset(shard->buckets, 0xff, buckets * sizeof (uint32_t));
+    }
+    return 0;
+}
+
+void cacheClose(){
+
+    if(shards == NULL){
+        return;
+    }
+    for(int i = 0; i < CACHE_SHARDS; i++){
+        free(shards[i].slots);
+        free(shards[i].data);
+        free(shards[i].buckets);
+        pthread_mutex_destroy(&shards[i].lock);
+    }
+    free(shards);
+    shards = NULL;
+}
+
+int caching(){
+
+    return shards != NULL;
+}
+
+/*------------------------------------------------------
+// cacheDrop
+//
+// PURPOSE: Forgets every block of a descriptor, for when
+// it is closed and its number may be reused.
+// INPUT PARAMETERS:
+//     Takes in the volume's descriptor.
+//------------------------------------------------------*/
+void cacheDrop(int volume_fd){
+
+    CacheShard *shard;
+
+    if(shards == NULL){
+        return;
+    }
+    for(int i = 0; i < CACHE_SHARDS; i++){
+        shard = &shards[i];
+        pthread_mutex_lock(&shard->lock);
+        for(uint32_t slot = 0; slot < shard->used; slot++){
+            if(shard->slots[slot].valid && shard->slots[slot].volume_fd == volume_fd){
+                unlinkSlot(shard, slot);
+                shard->slots[slot].referenced = 0;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/*------------------------------------------------------
+// cacheAdvise
+//
+// PURPOSE: Tells the kernel a range of the volume will be
+// read soon, so it can start reading it in.
+// INPUT PARAMETERS:
+//     Takes in the volume's descriptor and the byte range.
+//------------------------------------------------------*/
+void cacheAdvise(int volume_fd, uint64_t offset, uint64_t length){
+
+    if(length > 0){
+        posix_fadvise(volume_fd, (off_t) offset, (off_t) length, POSIX_FADV_WILLNEED);
+    }
+}
+
+/*------------------------------------------------------
+// fillBlocks
+//
+// PURPOSE: Reads a missing block, along with the blocks
+// the rest of the request needs and, when this thread is
+// reading sequentially, its readahead window, all in one
+// read.  The blocks go into the cache and the requested
+// bytes are copied out.
+// INPUT PARAMETERS:
+//     Takes in the descriptor, the first missing block,
+// the offset within it, the destination and the number
+// of bytes still wanted.
+// OUTPUT PARAMETERS:
+//     Returns the number of bytes copied, short at the end
+// of the volume, or -1 on an I/O error.
+//------------------------------------------------------*/
+static ssize_t fillBlocks(int volume_fd, uint64_t block, size_t within, uint8_t *destination, size_t length){
+
+    uint64_t needed = (within + length + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE;
+    uint64_t count = 1;
+    uint64_t full;
+    uint8_t *staging;
+    ssize_t bytes;
+    size_t copied;
+
+    if(stream_fd == volume_fd && block == stream_next){
+        if(stream_window < MAX_READAHEAD_BLOCKS){
+            stream_window *= 2;
+        }
+        count = stream_window;
+        atomic_fetch_add(&readaheads, 1);
+    }
+    else {
+        stream_window = 1;
+    }
+    if(count < needed){
+        count = needed < MAX_READAHEAD_BLOCKS ? needed : MAX_READAHEAD_BLOCKS;
+    }
+
+    staging = malloc(count * CACHE_BLOCK_SIZE);
+    assert(staging != NULL);
+
+    bytes = readBytes(volume_fd, staging, count * CACHE_BLOCK_SIZE, block * CACHE_BLOCK_SIZE);
+    if(bytes < 0){
+        free(staging);
+        return -1;
+    }
+
+    full = (uint64_t) bytes / CACHE_BLOCK_SIZE;
+    for(uint64_t i = 0; i < full; i++){
+        insertBlock(volume_fd, block + i, staging + i * CACHE_BLOCK_SIZE, i < needed);
+    }
+    if(full > needed){
+        atomic_fetch_add(&readahead_blocks, full - needed);
+    }
+
+    stream_fd = volume_fd;
+    stream_next = block + count;
+    if(stream_window > 1){
+        cacheAdvise(volume_fd, stream_next * CACHE_BLOCK_SIZE, (uint64_t) stream_window * 2 * CACHE_BLOCK_SIZE);
+    }
+
+    copied = (size_t) bytes > within ? (size_t) bytes - within : 0;
+    if(copied > length){
+        copied = length;
+    }
+    memcpy(destination, staging + within, copied);
+    free(staging);
+    return (ssize_t) copied;
+}
+
+/*------------------------------------------------------
+// cacheRead
+//
+// PURPOSE: Reads bytes of the volume through the cache,
+// reading missing blocks in.
+// INPUT PARAMETERS:
+//     Takes in the volume's descriptor, the buffer to
+// fill, the number of bytes, the byte offset and the
+// source the read is counted under.
+// OUTPUT PARAMETERS:
+//     Returns what readBytes would: the number of bytes
+// read, short at the end of the volume, or -1.
+//------------------------------------------------------*/
+ssize_t cacheRead(int volume_fd, void *buffer, size_t length, uint64_t offset, TraceSource source){
+
+    uint8_t *destination = buffer;
+    size_t copied = 0;
+    uint64_t block;
+    size_t within;
+    size_t chunk;
+    ssize_t filled;
+
+    while(copied < length){
+        block = (offset + copied) / CACHE_BLOCK_SIZE;
+        within = (size_t) ((offset + copied) % CACHE_BLOCK_SIZE);
+        chunk = CACHE_BLOCK_SIZE - within;
+        if(chunk > length - copied){
+            chunk = length - copied;
+        }
+
+        if(copyCached(volume_fd, block, within, destination + copied, chunk)){
+            atomic_fetch_add(&hits[source], 1);
+            copied += chunk;
+            continue;
+        }
+
+        atomic_fetch_add(&misses[source], 1);
+        filled = fillBlocks(volume_fd, block, within, destination + copied, length - copied);
+        if(filled < 0){
+            return -1;
+        }
+        copied += (size_t) filled;
+        if(filled == 0 || (size_t) filled < chunk){
+            break;
+        }
+    }
+    return (ssize_t) copied;
+}
+
+void cacheStats(CacheStats *stats){
+
+    memset(stats, 0, sizeof (CacheStats));
+    for(int source = 0; source < TRACE_SOURCES; source++){
+        stats->hits[source] = atomic_load(&hits[source]);
+        stats->misses[source] = atomic_load(&misses[source]);
+    }
+    stats->readaheads = atomic_load(&readaheads);
+    stats->readahead_blocks = atomic_load(&readahead_blocks);
+    stats->evictions = atomic_load(&evictions);
+
+    if(shards != NULL){
+        for(int i = 0; i < CACHE_SHARDS; i++){
+            pthread_mutex_lock(&shards[i].lock);
+            stats->blocks_used += shards[i].used;
+            stats->blocks_total += shards[i].slot_count;
+            pthread_mutex_unlock(&shards[i].lock);
+        }
+    }
+}
+
+/*------------------------------------------------------
+// printCacheStats
+//
+// PURPOSE: Prints the hit and miss counters by source,
+// the readahead and eviction counts and how much of the
+// budget is in use.
+// INPUT PARAMETERS:
+//     Takes in the stream to print to.
+//------------------------------------------------------*/
+void printCacheStats(FILE *output){
+
+    CacheStats stats;
+    uint64_t total_hits = 0;
+    uint64_t total_misses = 0;
+    uint64_t lookups;
+
+    cacheStats(&stats);
+    fprintf(output, "cache %-10s %12s %12s %8s\n", "source", "hits", "misses", "hit rate");
+    for(int source = 0; source < TRACE_SOURCES; source++){
+        lookups = stats.hits[source] + stats.misses[source];
+        total_hits += stats.hits[source];
+        total_misses += stats.misses[source];
+        if(lookups > 0){
+            fprintf(output, "cache %-10s %12llu %12llu %7.1f%%\n", traceSourceName(source),
+                    (unsigned long long) stats.hits[source], (unsigned long long) stats.misses[source],
+                    100.0 * stats.hits[source] / lookups);
+        }
+    }
+    lookups = total_hits + total_misses;
+    fprintf(output, "cache %-10s %12llu %12llu %7.1f%%\n", "total", (unsigned long long) total_hits,
+            (unsigned long long) total_misses, lookups > 0 ? 100.0 * total_hits / lookups : 0.0);
+    fprintf(output, "cache %llu readahead(s) bringing in %llu block(s), %llu eviction(s), %llu of %llu KB used\n",
+            (unsigned long long) stats.readaheads, (unsigned long long) stats.readahead_blocks,
+            (unsigned long long) stats.evictions,
+            (unsigned long long) stats.blocks_used * CACHE_BLOCK_SIZE / KILOBYTE_SIZE,
+            (unsigned long long) stats.blocks_total * CACHE_BLOCK_SIZE / KILOBYTE_SIZE);
+}
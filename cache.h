@@ -0,0 +1,48 @@
+//
+// Shared block cache in front of the volume's metadata reads.
+//
+
+#ifndef FSREADER_CACHE_H
+#define FSREADER_CACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "trace.h"
+
+#define CACHE_BLOCK_SIZE 4096
+#define CACHE_BYPASS_SIZE (32 * CACHE_BLOCK_SIZE)     /* larger reads, like loading the whole FAT, skip the cache */
+#define DEFAULT_CACHE_BUDGET (32 * 1024 * 1024)
+
+typedef struct CacheStats {
+
+    uint64_t hits[TRACE_SOURCES];       /* blocks found in the cache, by source */
+    uint64_t misses[TRACE_SOURCES];     /* blocks read from the volume, by source */
+    uint64_t readaheads;                /* sequential misses that read ahead */
+    uint64_t readahead_blocks;          /* blocks brought in ahead of use */
+    uint64_t evictions;
+    uint64_t blocks_used;
+    uint64_t blocks_total;
+
+} CacheStats ;
+
+
+int cacheOpen(uint64_t budget);
+
+void cacheClose();
+
+int caching();
+
+ssize_t cacheRead(int volume_fd, void *buffer, size_t length, uint64_t offset, TraceSource source);
+
+void cacheDrop(int volume_fd);
+
+void cacheAdvise(int volume_fd, uint64_t offset, uint64_t length);
+
+void cacheStats(CacheStats *stats);
+
+void printCacheStats(FILE *output);
+
+
+#endif //FSREADER_CACHE_H
@@ -0,0 +1,449 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Implement the "carve" command, recovery of
+// files by their signatures when no directory entry is
+// left.  Only clusters the allocation bitmap marks free
+// are read, in large reads of contiguous free clusters.
+// Headers and footers of every known file type are
+// found in one pass of the vectorized pattern search.
+// A file must start at a cluster boundary and is taken
+// to be contiguous, it ends at its footer, at the next
+// header, at the next allocated cluster or at the
+// type's size limit.  The cluster heap is split into
+// one range per thread.
+//-----------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "carve.h"
+#include "bitset.h"
+#include "fat.h"
+#include "parallel.h"
+#include "pattern.h"
+#include "memory.h"
+
+#define CARVE_READ_SIZE (4 * KILOBYTE_SIZE * KILOBYTE_SIZE)
+#define CARRY_SIZE 16
+#define MEGABYTE ((uint64_t) KILOBYTE_SIZE * KILOBYTE_SIZE)
+
+typedef struct Signature {
+
+    const char *extension;
+    uint8_t header[8];
+    size_t header_length;
+    uint8_t footer[8];
+    size_t footer_length;   /* 0 when the type has no footer */
+    size_t footer_extra;    /* bytes that follow the footer */
+    uint64_t max_size;
+
+} Signature ;
+
+static const Signature signatures[] = {
+    { "jpg", { 0xff, 0xd8, 0xff }, 3, { 0xff, 0xd9 }, 2, 0, 32 * MEGABYTE },
+    { "png", { 0x89, 'P', 'N', 'G', 0x0d, 0x0a, 0x1a, 0x0a }, 8,
+             { 'I', 'E', 'N', 'D', 0xae, 0x42, 0x60, 0x82 }, 8, 0, 32 * MEGABYTE },
+    /* The end of central directory record is 22 bytes, the comment that may follow is not kept */
+    { "zip", { 'P', 'K', 0x03, 0x04 }, 4, { 'P', 'K', 0x05, 0x06 }, 4, 18, 256 * MEGABYTE },
+    { "mp3", { 'I', 'D', '3' }, 3, { 0 }, 0, 0, 32 * MEGABYTE },
+    { "pdf", { '%', 'P', 'D', 'F', '-' }, 5, { '%', '%', 'E', 'O', 'F' }, 5, 0, 64 * MEGABYTE },
+};
+
+#define SIGNATURE_COUNT ((int) (sizeof (signatures) / sizeof (signatures[0])))
+
+/* An EPUB is a ZIP whose first member is the uncompressed "mimetype" file */
+static const char epub_mimetype[] = "mimetypeapplication/epub+zip";
+#define EPUB_MIMETYPE_OFFSET 30
+
+typedef struct CarvedFile {
+
+    uint32_t cluster;
+    char extension[8];
+    uint64_t size;
+    int complete;   /* ended at its footer */
+
+} CarvedFile ;
+
+typedef struct CarveScan {
+
+    int volume_fd;
+    exfat *volume;
+    Bitset *bitmap;
+    const char *output_directory;
+    PatternSet patterns;
+    int pattern_signature[MAX_PATTERNS];
+    int pattern_is_footer[MAX_PATTERNS];
+
+    pthread_mutex_t lock;
+    CarvedFile *carved;
+    uint64_t carved_count;
+    uint64_t carved_capacity;
+    uint64_t free_clusters;
+    uint64_t read_size;         /* bytes each thread reads at once */
+
+} CarveScan ;
+
+typedef struct Hit {
+
+    size_t position;
+    int pattern;
+
+} Hit ;
+
+/* State of one thread */
+typedef struct Carver {
+
+    CarveScan *scan;
+    uint8_t *buffer;
+    Hit *hits;
+    size_t hit_count;
+    size_t hit_capacity;
+
+    int output_fd;
+    CarvedFile current;
+    int signature;          /* signature being carved, -1 if none */
+    uint64_t tail;          /* bytes after a footer still to copy */
+
+} Carver ;
+
+static int collectHit(size_t position, int pattern, void *context){
+
+    Carver *carver = context;
+
+    if(carver->hit_count == carver->hit_capacity){
+        carver->hit_capacity = carver->hit_capacity == 0 ? 256 : carver->hit_capacity * 2;
+        carver->hits = realloc(carver->hits, carver->hit_capacity * sizeof (Hit));
+        assert(carver->hits != NULL);
+    }
+    carver->hits[carver->hit_count].position = position;
+    carver->hits[carver->hit_count].pattern = pattern;
+    carver->hit_count++;
+    return 0;
+}
+
+static void finishCarve(Carver *carver){
+
+    CarveScan *scan = carver->scan;
+
+    if(carver->signature < 0){
+        return;
+    }
+    close(carver->output_fd);
+
+    pthread_mutex_lock(&scan->lock);
+    if(scan->carved_count == scan->carved_capacity){
+        scan->carved_capacity = scan->carved_capacity == 0 ? 64 : scan->carved_capacity * 2;
+        scan->carved = realloc(scan->carved, scan->carved_capacity * sizeof (CarvedFile));
+        assert(scan->carved != NULL);
+    }
+    scan->carved[scan->carved_count++] = carver->current;
+    pthread_mutex_unlock(&scan->lock);
+
+    carver->signature = -1;
+    carver->tail = 0;
+}
+
+static void startCarve(Carver *carver, int signature, uint32_t cluster, const uint8_t *data, size_t available){
+
+    CarveScan *scan = carver->scan;
+    const char *extension = signatures[signature].extension;
+    char *path = malloc(strlen(scan->output_directory) + 32);
+
+    assert(path != NULL);
+
+    if(strcmp(extension, "zip") == 0 && available >= EPUB_MIMETYPE_OFFSET + sizeof (epub_mimetype) - 1 &&
+       memcmp(data + EPUB_MIMETYPE_OFFSET, epub_mimetype, sizeof (epub_mimetype) - 1) == 0){
+        extension = "epub";
+    }
+
+    sprintf(path, "%s/f%08u.%s", scan->output_directory, cluster, extension);
+    carver->output_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(carver->output_fd < 0){
+        printf("Unable to create '%s'\n", path);
+    }
+    else {
+        carver->signature = signature;
+        carver->tail = 0;
+        memset(&carver->current, 0, sizeof (CarvedFile));
+        carver->current.cluster = cluster;
+        strcpy(carver->current.extension, extension);
+    }
+    free(path);
+}
+
+/* Appends data to the file being carved, ending it at the type's size limit */
+static void appendCarve(Carver *carver, const uint8_t *data, size_t length){
+
+    uint64_t limit;
+
+    if(carver->signature < 0 || length == 0){
+        return;
+    }
+    limit = signatures[carver->signature].max_size - carver->current.size;
+    if(length > limit){
+        length = (size_t) limit;
+    }
+    if(write(carver->output_fd, data, length) != (ssize_t) length){
+        printf("Unable to write carved file f%08u\n", carver->current.cluster);
+    }
+    carver->current.size += length;
+    if(carver->current.size >= signatures[carver->signature].max_size){
+        finishCarve(carver);
+    }
+}
+
+/*------------------------------------------------------
+// carveChunk
+//
+// PURPOSE: Applies the pattern hits of one chunk of free
+// clusters to the carving state: aligned headers start a
+// new file, the footer of the current type ends it and
+// everything in between is written out.
+// INPUT PARAMETERS:
+//     Takes in the thread state, the chunk data (preceded
+// by carry bytes of the previous chunk), the carry and
+// chunk lengths, the first cluster of the chunk and the
+// end of the thread's own range.
+// OUTPUT PARAMETERS:
+//     Returns 1 once the thread has reached a header past
+// its own range, which belongs to the next thread.
+//------------------------------------------------------*/
+static int carveChunk(Carver *carver, const uint8_t *data, size_t carry, size_t length,
+                      uint32_t first_cluster, uint64_t range_end){
+
+    CarveScan *scan = carver->scan;
+    uint32_t cluster_bytes = clusterBytes(scan->volume);
+    const uint8_t *chunk = data + carry;
+    size_t cursor = 0;
+    size_t position;
+    size_t end;
+    uint64_t cluster;
+    int signature;
+
+    /* Bytes still owed after a footer found at the end of the previous chunk */
+    if(carver->signature >= 0 && carver->tail > 0){
+        end = carver->tail < length ? (size_t) carver->tail : length;
+        appendCarve(carver, chunk, end);
+        carver->tail -= end;
+        cursor = end;
+        if(carver->tail == 0){
+            finishCarve(carver);
+        }
+    }
+
+    for(size_t i = 0; i < carver->hit_count; i++){
+        signature = scan->pattern_signature[carver->hits[i].pattern];
+
+        if(!scan->pattern_is_footer[carver->hits[i].pattern]){
+            if(carver->hits[i].position < carry){
+                continue;
+            }
+            position = carver->hits[i].position - carry;
+            if(position % cluster_bytes != 0 || position < cursor){
+                continue;
+            }
+            appendCarve(carver, chunk + cursor, position - cursor);
+            finishCarve(carver);
+            cursor = position;
+
+            cluster = first_cluster + position / cluster_bytes;
+            if(cluster - FIRST_DATA_CLUSTER >= range_end){
+                return 1;
+            }
+            startCarve(carver, signature, (uint32_t) cluster, chunk + position, length - position);
+        }
+        else if(carver->signature == signature && carver->tail == 0){
+            /* Footers that ended inside the carry bytes were seen with the previous chunk */
+            end = carver->hits[i].position + signatures[carver->signature].footer_length;
+            if(end <= carry || end - carry <= cursor){
+                continue;
+            }
+            end -= carry;
+            carver->tail = signatures[carver->signature].footer_extra;
+            if(end + carver->tail > length){
+                carver->tail -= length - end;
+                end = length;
+            }
+            else {
+                end += carver->tail;
+                carver->tail = 0;
+            }
+            appendCarve(carver, chunk + cursor, end - cursor);
+            cursor = end;
+            if(carver->signature >= 0){
+                carver->current.complete = 1;
+                if(carver->tail == 0){
+                    finishCarve(carver);
+                }
+            }
+        }
+    }
+
+    appendCarve(carver, chunk + cursor, length - cursor);
+    return 0;
+}
+
+/*------------------------------------------------------
+// carveRange
+//
+// PURPOSE: Carves the free clusters whose index lies in
+// [start, end).  A file that starts in the range is
+// followed past its end.
+// INPUT PARAMETERS:
+//     Takes in the range of cluster indexes (cluster - 2)
+// and the CarveScan state.
+//------------------------------------------------------*/
+static void carveRange(uint64_t start, uint64_t end, void *context){
+
+    Carver carver;
+    CarveScan *scan = context;
+    exfat *volume = scan->volume;
+    uint32_t cluster_bytes = clusterBytes(volume);
+    uint64_t read_clusters = scan->read_size / cluster_bytes;
+    uint64_t index = start;
+    uint64_t run_end;
+    uint64_t previous_end = UINT64_MAX;
+    uint64_t free_clusters = 0;
+    size_t carry = 0;
+    size_t length;
+    int past_range = 0;
+
+    memset(&carver, 0, sizeof (Carver));
+    carver.scan = scan;
+    carver.signature = -1;
+    if(read_clusters == 0){
+        read_clusters = 1;
+    }
+    carver.buffer = malloc(CARRY_SIZE + read_clusters * cluster_bytes);
+    assert(carver.buffer != NULL);
+
+    while(!past_range && index < volume->cluster_count && (index < end || carver.signature >= 0)){
+
+        index = findNextClear(scan->bitmap, index, carver.signature >= 0 ? volume->cluster_count : end);
+        if(index >= volume->cluster_count || (index >= end && carver.signature < 0)){
+            break;
+        }
+
+        /* An allocated cluster, or a gap between reads, ends a contiguous file */
+        if(index != previous_end){
+            finishCarve(&carver);
+            carry = 0;
+            if(index >= end){
+                break;
+            }
+        }
+
+        run_end = findNextSet(scan->bitmap, index, index + read_clusters);
+        if(index < end){
+            free_clusters += (run_end < end ? run_end : end) - index;
+        }
+        length = (size_t) (run_end - index) * cluster_bytes;
+
+        if(readBytes(scan->volume_fd, carver.buffer + CARRY_SIZE, length,
+                     clusterOffset(volume, (uint32_t) (index + FIRST_DATA_CLUSTER))) != (ssize_t) length){
+            printf("Unable to read clusters %llu-%llu\n", (unsigned long long) index + FIRST_DATA_CLUSTER,
+                   (unsigned long long) run_end + FIRST_DATA_CLUSTER - 1);
+            finishCarve(&carver);
+            previous_end = UINT64_MAX;
+            index = run_end;
+            continue;
+        }
+
+        carver.hit_count = 0;
+        searchPatterns(&scan->patterns, carver.buffer + CARRY_SIZE - carry, carry + length, collectHit, &carver);
+        past_range = carveChunk(&carver, carver.buffer + CARRY_SIZE - carry, carry, length,
+                                (uint32_t) (index + FIRST_DATA_CLUSTER), end);
+
+        /* Keep the end of the chunk so footers spanning two reads are still found */
+        carry = scan->patterns.max_length - 1;
+        memmove(carver.buffer + CARRY_SIZE - carry, carver.buffer + CARRY_SIZE + length - carry, carry);
+
+        previous_end = run_end;
+        index = run_end;
+    }
+
+    finishCarve(&carver);
+    __atomic_fetch_add(&scan->free_clusters, free_clusters, __ATOMIC_RELAXED);
+    free(carver.hits);
+    free(carver.buffer);
+}
+
+static int compareCarved(const void *left, const void *right){
+
+    const CarvedFile *a = left;
+    const CarvedFile *b = right;
+
+    return (a->cluster > b->cluster) - (a->cluster < b->cluster);
+}
+
+/*------------------------------------------------------
+// commandCarve
+//
+// PURPOSE: Runs the "carve" command, writing every file
+// found in free clusters to the output directory as
+// f<first cluster>.<type>.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct and the directory
+// to write carved files to.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 if the allocation bitmap
+// could not be read.
+//------------------------------------------------------*/
+int commandCarve(int volume_fd, exfat *volume, const char *output_directory){
+
+    CarveScan scan;
+    int pattern;
+
+    assert(volume != NULL && output_directory != NULL);
+
+    memset(&scan, 0, sizeof (CarveScan));
+    scan.volume_fd = volume_fd;
+    scan.volume = volume;
+    scan.output_directory = output_directory;
+    pthread_mutex_init(&scan.lock, NULL);
+
+    scan.bitmap = loadAllocationBitmap(volume_fd, volume, NULL);
+    if(scan.bitmap == NULL){
+        return -1;
+    }
+
+    initPatternSet(&scan.patterns);
+    for(int i = 0; i < SIGNATURE_COUNT; i++){
+        pattern = addPattern(&scan.patterns, signatures[i].header, signatures[i].header_length);
+        scan.pattern_signature[pattern] = i;
+        scan.pattern_is_footer[pattern] = 0;
+
+        if(signatures[i].footer_length > 0){
+            pattern = addPattern(&scan.patterns, signatures[i].footer, signatures[i].footer_length);
+            scan.pattern_signature[pattern] = i;
+            scan.pattern_is_footer[pattern] = 1;
+        }
+    }
+    assert(scan.patterns.max_length - 1 <= CARRY_SIZE);
+
+    /* Every thread holds one read buffer, together they take a table's share of the memory ceiling */
+    scan.read_size = memoryShare((uint64_t) CARVE_READ_SIZE * threadCount()) / threadCount();
+
+    parallelRanges(volume->cluster_count, carveRange, &scan);
+
+    if(scan.carved_count > 0){
+        qsort(scan.carved, scan.carved_count, sizeof (CarvedFile), compareCarved);
+    }
+    for(uint64_t i = 0; i < scan.carved_count; i++){
+        printf("f%08u.%s: %llu bytes%s\n", scan.carved[i].cluster, scan.carved[i].extension,
+               (unsigned long long) scan.carved[i].size, scan.carved[i].complete ? "" : " (no footer)");
+    }
+    printf("\nCarved %llu file(s) from %llu free cluster(s)\n",
+           (unsigned long long) scan.carved_count, (unsigned long long) scan.free_clusters);
+
+    free(scan.carved);
+    destroyBitset(scan.bitmap);
+    pthread_mutex_destroy(&scan.lock);
+    return 0;
+}
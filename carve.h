@@ -0,0 +1,14 @@
+//
+// Signature based carving of files from unallocated clusters.
+//
+
+#ifndef FSREADER_CARVE_H
+#define FSREADER_CARVE_H
+
+#include "exfat.h"
+
+
+int commandCarve(int volume_fd, exfat *volume, const char *output_directory);
+
+
+#endif //FSREADER_CARVE_H
@@ -0,0 +1,222 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Implement the Catalog, a flat table of the
+// entries below a directory.  Each row holds the decoded
+// timestamps and size of one entry set, the row of its
+// parent directory and the offset of its name in a shared
+// pool, so a catalog of millions of entries stores every
+// name once and full paths are only rebuilt on output.
+// Under a memory ceiling the walk stops, and the catalog
+// is marked truncated, once the rows and the keys needed
+// to sort them would outgrow their share.
+//-----------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#include "catalog.h"
+#include "memory.h"
+
+/* The sort keys and row numbers of a row, three of each for a timeline */
+#define SORT_BYTES_PER_ROW (3 * (sizeof (uint64_t) + sizeof (uint32_t)))
+
+typedef struct CatalogWalk {
+
+    Catalog *catalog;
+    int volume_fd;
+    exfat *volume;
+    uint32_t parent;
+    int depth;
+    int recursive;
+
+} CatalogWalk ;
+
+/*------------------------------------------------------
+// formatTicks
+//
+// PURPOSE: Formats a time in 10ms ticks since the epoch
+// as "YYYY-MM-DD HH:MM:SS.cc" in UTC.
+// INPUT PARAMETERS:
+//     Takes in the ticks along with the buffer to write to
+// and its size.
+//------------------------------------------------------*/
+void formatTicks(int64_t ticks, char *buffer, size_t size){
+
+    time_t seconds = (time_t) (ticks / 100);
+    struct tm date;
+    size_t length;
+
+    gmtime_r(&seconds, &date);
+    length = strftime(buffer, size, "%Y-%m-%d %H:%M:%S", &date);
+    snprintf(buffer + length, size - length, ".%02d", (int) (ticks % 100));
+}
+
+static uint32_t addName(Catalog *catalog, const char *name){
+
+    uint32_t length = (uint32_t) strlen(name) + 1;
+    uint32_t offset = catalog->names_length;
+
+    if(catalog->names_length + length > catalog->names_capacity){
+        assert(catalog->names_capacity < UINT32_MAX / 2);
+        while(catalog->names_length + length > catalog->names_capacity){
+            catalog->names_capacity *= 2;
+        }
+        catalog->names = realloc(catalog->names, catalog->names_capacity);
+        assert(catalog->names != NULL);
+    }
+
+    memcpy(catalog->names + offset, name, length);
+    catalog->names_length += length;
+    return offset;
+}
+
+static int addEntry(DirectoryEntry *entry, void *context){
+
+    CatalogWalk *walk = context;
+    Catalog *catalog = walk->catalog;
+    CatalogEntry *row;
+    CatalogWalk child;
+    char *name;
+
+    if(catalog->truncated){
+        return WALK_STOP;
+    }
+    if(!fitsMemory((uint64_t) (catalog->count + 1) * (sizeof (CatalogEntry) + SORT_BYTES_PER_ROW) +
+                   catalog->names_length + MAX_NAME_LENGTH * 3 + 1)){
+        catalog->truncated = 1;
+        return WALK_STOP;
+    }
+
+    if(catalog->count == catalog->capacity){
+        assert(catalog->capacity < CATALOG_NO_PARENT / 2);
+        catalog->capacity *= 2;
+        catalog->entries = realloc(catalog->entries, catalog->capacity * sizeof (CatalogEntry));
+        assert(catalog->entries != NULL);
+    }
+
+    name = entryName(entry);
+    assert(name != NULL);
+
+    row = &catalog->entries[catalog->count];
+    row->parent = walk->parent;
+    row->name_offset = addName(catalog, name);
+    row->file_attributes = entry->file_attributes;
+    row->data_length = entry->data_length;
+    row->create_ticks = entryTicks(entry->create_timestamp, entry->create_10ms, entry->create_utc_offset);
+    row->modify_ticks = entryTicks(entry->modify_timestamp, entry->modify_10ms, entry->modify_utc_offset);
+    row->access_ticks = entryTicks(entry->access_timestamp, 0, entry->access_utc_offset);
+    catalog->count++;
+    free(name);
+
+    if(walk->recursive && isDirectory(entry) && walk->depth < MAX_TREE_DEPTH){
+        child = *walk;
+        child.parent = catalog->count - 1;
+        child.depth = walk->depth + 1;
+        walkDirectory(walk->volume_fd, walk->volume, NULL, entry->first_cluster, entry->data_length,
+                      entry->general_flags, 0, addEntry, &child);
+    }
+    return WALK_CONTINUE;
+}
+
+/*------------------------------------------------------
+// buildCatalog
+//
+// PURPOSE: Reads the entries of a directory, and of all of
+// its subdirectories when recursive is set, into a new
+// Catalog.  Rows are in walk order: every directory comes
+// before the entries it holds.  Check truncated when a
+// memory ceiling is set.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct, the path of the
+// directory and whether to descend into subdirectories.
+// OUTPUT PARAMETERS:
+//     Returns the Catalog, or NULL if the path is not a
+// directory.
+//------------------------------------------------------*/
+Catalog *buildCatalog(int volume_fd, exfat *volume, const char *root_path, int recursive){
+
+    Catalog *catalog;
+    CatalogWalk walk;
+    DirectoryEntry root;
+
+    if(resolvePath(volume_fd, volume, NULL, root_path, &root) != 0 || !isDirectory(&root)){
+        return NULL;
+    }
+
+    catalog = calloc(1, sizeof (Catalog));
+    assert(catalog != NULL);
+    catalog->capacity = 1024;
+    catalog->entries = malloc(catalog->capacity * sizeof (CatalogEntry));
+    catalog->names_capacity = 16 * 1024;
+    catalog->names = malloc(catalog->names_capacity);
+    assert(catalog->entries != NULL && catalog->names != NULL);
+
+    /* Paths are printed as "/dir/name", without a trailing '/' on the root */
+    catalog->root = malloc(strlen(root_path) + 2);
+    assert(catalog->root != NULL);
+    sprintf(catalog->root, "%s%s", root_path[0] == '/' ? "" : "/", root_path);
+    while(strlen(catalog->root) > 0 && catalog->root[strlen(catalog->root) - 1] == '/'){
+        catalog->root[strlen(catalog->root) - 1] = '\0';
+    }
+
+    walk.catalog = catalog;
+    walk.volume_fd = volume_fd;
+    walk.volume = volume;
+    walk.parent = CATALOG_NO_PARENT;
+    walk.depth = 0;
+    walk.recursive = recursive;
+
+    walkDirectory(volume_fd, volume, NULL, root.first_cluster, root.data_length, root.general_flags, 0,
+                  addEntry, &walk);
+
+    return catalog;
+}
+
+void destroyCatalog(Catalog *catalog){
+
+    if(catalog != NULL){
+        free(catalog->entries);
+        free(catalog->names);
+        free(catalog->root);
+        free(catalog);
+    }
+}
+
+const char *catalogName(const Catalog *catalog, uint32_t row){
+
+    return catalog->names + catalog->entries[row].name_offset;
+}
+
+/*------------------------------------------------------
+// catalogPath
+//
+// PURPOSE: Rebuilds the full path of a row from the names
+// of the row and of its parent directories.
+// INPUT PARAMETERS:
+//     Takes in the Catalog, the row, and the buffer to
+// write the path to along with its size.
+// OUTPUT PARAMETERS:
+//     Returns the buffer, holding a path truncated to fit.
+//------------------------------------------------------*/
+char *catalogPath(const Catalog *catalog, uint32_t row, char *buffer, size_t size){
+
+    uint32_t ancestors[MAX_TREE_DEPTH + 1];
+    int depth = 0;
+    size_t length;
+
+    while(row != CATALOG_NO_PARENT && depth <= MAX_TREE_DEPTH){
+        ancestors[depth++] = row;
+        row = catalog->entries[row].parent;
+    }
+
+    length = (size_t) snprintf(buffer, size, "%s", catalog->root);
+    while(depth > 0 && length < size){
+        depth--;
+        length += (size_t) snprintf(buffer + length, size - length, "/%s", catalogName(catalog, ancestors[depth]));
+    }
+    return buffer;
+}
@@ -0,0 +1,58 @@
+//
+// Compact in-memory catalog of the entries below a directory.
+//
+
+#ifndef FSREADER_CATALOG_H
+#define FSREADER_CATALOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "exfat.h"
+#include "directory.h"
+
+#define CATALOG_NO_PARENT UINT32_MAX
+
+/* One entry set, names are kept once in a shared pool rather than as full paths */
+typedef struct CatalogEntry {
+
+    uint32_t parent;            /* row of the containing directory */
+    uint32_t name_offset;       /* into Catalog.names */
+    uint16_t file_attributes;
+    uint64_t data_length;
+
+    /* 10 ms ticks since the epoch, see entryTicks */
+    int64_t create_ticks;
+    int64_t modify_ticks;
+    int64_t access_ticks;
+
+} CatalogEntry ;
+
+typedef struct Catalog {
+
+    CatalogEntry *entries;
+    uint32_t count;
+    uint32_t capacity;
+
+    char *names;
+    uint32_t names_length;
+    uint32_t names_capacity;
+
+    char *root;                 /* "/dir", or "" for the root directory */
+    int truncated;              /* the walk stopped at the memory ceiling */
+
+} Catalog ;
+
+
+void formatTicks(int64_t ticks, char *buffer, size_t size);
+
+Catalog *buildCatalog(int volume_fd, exfat *volume, const char *root_path, int recursive);
+
+void destroyCatalog(Catalog *catalog);
+
+const char *catalogName(const Catalog *catalog, uint32_t row);
+
+char *catalogPath(const Catalog *catalog, uint32_t row, char *buffer, size_t size);
+
+
+#endif //FSREADER_CATALOG_H
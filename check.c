@@ -0,0 +1,621 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Implement the "check" command, a read-only
+// consistency check of an exfat volume.  The FAT and
+// the allocation bitmap are loaded into memory, every
+// cluster chain reachable from the directory tree is
+// walked and the clusters it uses are compared against
+// the bitmap.  The FAT and bitmap passes are split
+// across all cores.
+//-----------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "check.h"
+#include "bitset.h"
+#include "directory.h"
+#include "fat.h"
+#include "memory.h"
+#include "parallel.h"
+#include "runindex.h"
+
+/* Maximum number of individual clusters listed for each kind of problem */
+#define MAX_REPORTED 20
+
+/* Room for the deepest path walkTree reaches */
+#define CHECK_PATH_SIZE ((MAX_TREE_DEPTH + 2) * (MAX_NAME_LENGTH + 1))
+#define NO_PARENT UINT64_MAX
+
+/* Problems found while walking a single chain */
+#define PROBLEM_OUT_OF_RANGE 0x01
+#define PROBLEM_CROSS_LINKED 0x02
+#define PROBLEM_FREE_CLUSTER 0x04
+#define PROBLEM_LENGTH_MISMATCH 0x08
+#define PROBLEM_BAD_CLUSTER 0x10
+
+/* Chains hold no path, it is rebuilt from the entries of their directories when reported */
+typedef struct CheckedChain {
+
+    const char *label;            /* the system chains' names, NULL for entries of the tree */
+    uint64_t parent;              /* chain of the directory holding the entry, NO_PARENT in the root */
+    uint32_t entry_cluster;       /* where the entry set is */
+    uint32_t entry_index;
+    uint32_t first_cluster;
+    uint64_t data_length;
+    uint8_t general_flags;
+    int length_known;
+
+    /* filled in by the chain pass */
+    int problems;
+    uint32_t problem_cluster;     /* cluster the first problem was found at */
+    uint32_t problem_value;       /* FAT entry that was out of range */
+    uint32_t free_cluster;        /* first cluster of the chain marked free */
+    uint64_t clusters_walked;
+
+} CheckedChain ;
+
+typedef struct VolumeCheck {
+
+    int volume_fd;
+    exfat *volume;
+    uint32_t *fat;
+    Bitset *bitmap;       /* allocation bitmap, bit (cluster - 2) */
+    Bitset *referenced;   /* clusters used by some chain */
+    Bitset *cross_linked; /* clusters claimed by more than one chain */
+    Bitset *bad_entries;  /* allocated clusters whose FAT entry is out of range */
+    Bitset *directories;  /* directories already visited, guards against loops */
+
+    CheckedChain *chains;
+    uint64_t chain_count;
+    uint64_t chain_capacity;
+    uint64_t parents[MAX_TREE_DEPTH + 2];   /* while collecting, the last directory chain at each depth */
+
+    uint64_t orphaned;
+    uint64_t unmarked;
+    uint64_t out_of_range_entries;
+
+} VolumeCheck ;
+
+typedef struct ChainOwner {
+
+    uint32_t cluster;
+    uint64_t chain;
+
+} ChainOwner ;
+
+typedef struct NameLookup {
+
+    uint32_t entry_cluster;
+    uint32_t entry_index;
+    char *name;
+
+} NameLookup ;
+
+static void addChain(VolumeCheck *check, const char *label, uint32_t first_cluster,
+                     uint64_t data_length, uint8_t general_flags){
+
+    CheckedChain *chain;
+
+    if(check->chain_count == check->chain_capacity){
+        check->chain_capacity = check->chain_capacity == 0 ? 1024 : check->chain_capacity * 2;
+        check->chains = realloc(check->chains, check->chain_capacity * sizeof (CheckedChain));
+        assert(check->chains != NULL);
+    }
+
+    chain = &check->chains[check->chain_count++];
+    memset(chain, 0, sizeof (CheckedChain));
+    chain->label = label;
+    chain->parent = NO_PARENT;
+    chain->first_cluster = first_cluster;
+    chain->data_length = data_length;
+    chain->general_flags = general_flags;
+    chain->length_known = 1;
+}
+
+static int collectChain(const char *path, DirectoryEntry *entry, void *context){
+
+    VolumeCheck *check = context;
+    CheckedChain *chain;
+    uint64_t depth = 0;
+
+    /* "/a/b" is two deep, its directory is the last one seen one level up */
+    for(const char *c = path; *c != '\0'; c++){
+        depth += *c == '/';
+    }
+
+    addChain(check, NULL, entry->first_cluster, entry->data_length, entry->general_flags);
+    chain = &check->chains[check->chain_count - 1];
+    chain->parent = depth > 1 ? check->parents[depth - 1] : NO_PARENT;
+    chain->entry_cluster = entry->entry_cluster;
+    chain->entry_index = entry->entry_index;
+
+    if(isDirectory(entry)){
+        check->parents[depth] = check->chain_count - 1;
+        /* A directory whose first cluster was already visited would loop forever */
+        if(!isValidCluster(check->volume, entry->first_cluster) ||
+           testAndSetBit(check->directories, entry->first_cluster - FIRST_DATA_CLUSTER)){
+            return WALK_SKIP;
+        }
+    }
+    return WALK_CONTINUE;
+}
+
+/*------------------------------------------------------
+// collectSystemChains
+//
+// PURPOSE: Adds the chains of the root directory, the
+// allocation bitmap(s) and the up-case table, which are
+// not reachable as regular files.
+// INPUT PARAMETERS:
+//     Takes in a pointer to the VolumeCheck state.
+//------------------------------------------------------*/
+static void collectSystemChains(VolumeCheck *check){
+
+    exfat *volume = check->volume;
+    uint32_t cluster_bytes = clusterBytes(volume);
+    uint8_t *buffer = malloc(cluster_bytes);
+    uint32_t first_cluster;
+    uint64_t data_length;
+    uint8_t type;
+
+    assert(buffer != NULL);
+    /* The root directory has no DataLength to compare the chain against */
+    addChain(check, "<root directory>", volume->root_cluster, 0, 0);
+    check->chains[check->chain_count - 1].length_known = 0;
+
+    if(readBytesAs(check->volume_fd, buffer, cluster_bytes, clusterOffset(volume, volume->root_cluster),
+                   TRACE_DIRECTORY) == (ssize_t) cluster_bytes){
+        for(uint32_t i = 0; i < cluster_bytes / ENTRY_SIZE; i++){
+            type = buffer[i * ENTRY_SIZE];
+            if(type == ENTRY_TYPE_END_OF_DIRECTORY){
+                break;
+            }
+            if(type == ENTRY_TYPE_BITMAP || type == ENTRY_TYPE_UPCASE){
+                memcpy(&first_cluster, buffer + i * ENTRY_SIZE + 20, 4);
+                memcpy(&data_length, buffer + i * ENTRY_SIZE + 24, 8);
+                addChain(check, type == ENTRY_TYPE_BITMAP ? "<allocation bitmap>" : "<up-case table>",
+                         first_cluster, data_length, 0);
+            }
+        }
+    }
+    free(buffer);
+}
+
+/*------------------------------------------------------
+// walkChain
+//
+// PURPOSE: Follows one chain through the in-memory FAT,
+// claiming each cluster in the referenced bitset.  The
+// walk stops at the end of chain marker, an out of range
+// entry, or a cluster some chain already claimed (which
+// also ends a chain that loops back on itself).
+// INPUT PARAMETERS:
+//     Takes in a pointer to the VolumeCheck state and the
+// chain to walk, whose problem fields are filled in.
+//------------------------------------------------------*/
+static void walkChain(VolumeCheck *check, CheckedChain *chain){
+
+    exfat *volume = check->volume;
+    uint32_t cluster_bytes = clusterBytes(volume);
+    uint64_t expected = (chain->data_length + cluster_bytes - 1) / cluster_bytes;
+    uint64_t limit = volume->cluster_count;
+    uint32_t cluster = chain->first_cluster;
+    uint32_t next;
+    int contiguous = (chain->general_flags & FLAG_NO_FAT_CHAIN) != 0;
+
+    if(cluster == 0 && chain->data_length == 0){
+        return;
+    }
+    if(contiguous){
+        limit = expected;
+    }
+
+    while(chain->clusters_walked < limit){
+
+        if(!isValidCluster(volume, cluster)){
+            chain->problems |= PROBLEM_OUT_OF_RANGE;
+            chain->problem_cluster = cluster;
+            break;
+        }
+        if(testAndSetBit(check->referenced, cluster - FIRST_DATA_CLUSTER)){
+            chain->problems |= PROBLEM_CROSS_LINKED;
+            chain->problem_cluster = cluster;
+            testAndSetBit(check->cross_linked, cluster - FIRST_DATA_CLUSTER);
+            chain->clusters_walked++;
+            break;
+        }
+        if(!testBit(check->bitmap, cluster - FIRST_DATA_CLUSTER) && !(chain->problems & PROBLEM_FREE_CLUSTER)){
+            chain->problems |= PROBLEM_FREE_CLUSTER;
+            chain->free_cluster = cluster;
+        }
+        chain->clusters_walked++;
+
+        if(contiguous){
+            cluster++;
+            continue;
+        }
+
+        next = readFatEntry(check->volume_fd, check->volume, check->fat, cluster);
+        if(next == END_OF_CHAIN){
+            break;
+        }
+        if(next == BAD_CLUSTER){
+            chain->problems |= PROBLEM_BAD_CLUSTER;
+            chain->problem_cluster = cluster;
+            break;
+        }
+        if(!isValidCluster(volume, next)){
+            chain->problems |= PROBLEM_OUT_OF_RANGE;
+            chain->problem_cluster = cluster;
+            chain->problem_value = next;
+            break;
+        }
+        cluster = next;
+    }
+
+    if(!(chain->problems & (PROBLEM_OUT_OF_RANGE | PROBLEM_CROSS_LINKED | PROBLEM_BAD_CLUSTER)) &&
+       chain->length_known && chain->clusters_walked != expected){
+        chain->problems |= PROBLEM_LENGTH_MISMATCH;
+    }
+}
+
+static void walkChains(uint64_t start, uint64_t end, void *context){
+
+    VolumeCheck *check = context;
+
+    for(uint64_t i = start; i < end; i++){
+        walkChain(check, &check->chains[i]);
+    }
+}
+
+/* FAT pass: allocated clusters must hold a link, an end of chain or a bad cluster marker */
+static void checkFatEntries(uint64_t start, uint64_t end, void *context){
+
+    VolumeCheck *check = context;
+    uint64_t found = 0;
+    uint32_t entry;
+
+    for(uint64_t i = start; i < end; i++){
+        if(!testBit(check->bitmap, i)){
+            continue;
+        }
+        entry = readFatEntry(check->volume_fd, check->volume, check->fat, (uint32_t) (i + FIRST_DATA_CLUSTER));
+        if(entry != END_OF_CHAIN && entry != BAD_CLUSTER && entry != 0 && !isValidCluster(check->volume, entry)){
+            /* Slices meet inside a word, so neighbours may mark the same one */
+            testAndSetBit(check->bad_entries, i);
+            found++;
+        }
+    }
+    __atomic_fetch_add(&check->out_of_range_entries, found, __ATOMIC_RELAXED);
+}
+
+/* Bitmap pass: compares the allocation bitmap with the clusters the chains referenced, a word at a time */
+static void compareBitmap(uint64_t start, uint64_t end, void *context){
+
+    VolumeCheck *check = context;
+    uint64_t orphaned = 0;
+    uint64_t unmarked = 0;
+
+    for(uint64_t word = start; word < end; word++){
+        orphaned += __builtin_popcountll(check->bitmap->words[word] & ~check->referenced->words[word]);
+        unmarked += __builtin_popcountll(check->referenced->words[word] & ~check->bitmap->words[word]);
+    }
+    __atomic_fetch_add(&check->orphaned, orphaned, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&check->unmarked, unmarked, __ATOMIC_RELAXED);
+}
+
+static int compareOwners(const void *left, const void *right){
+
+    const ChainOwner *a = left;
+    const ChainOwner *b = right;
+
+    if(a->cluster != b->cluster){
+        return a->cluster < b->cluster ? -1 : 1;
+    }
+    return a->chain < b->chain ? -1 : (a->chain > b->chain);
+}
+
+/* Only the entry set at the wanted location has its name decoded */
+static int matchLocation(DirectoryEntry *entry, void *context){
+
+    NameLookup *lookup = context;
+
+    if(entry->entry_cluster != lookup->entry_cluster || entry->entry_index != lookup->entry_index){
+        return WALK_SKIP;
+    }
+    return WALK_CONTINUE;
+}
+
+static int copyName(DirectoryEntry *entry, void *context){
+
+    NameLookup *lookup = context;
+
+    lookup->name = entryName(entry);
+    return WALK_STOP;
+}
+
+/*------------------------------------------------------
+// chainPath
+//
+// PURPOSE: Rebuilds the path of a chain for a report,
+// finding its name and those of its directories again by
+// where their entry sets are.  Only chains with a problem
+// are named, so the rereads are few.
+// INPUT PARAMETERS:
+//     Takes in a pointer to the VolumeCheck state, the
+// index of the chain and a buffer of CHECK_PATH_SIZE
+// bytes to write the path to.
+// OUTPUT PARAMETERS:
+//     Returns the buffer.
+//------------------------------------------------------*/
+static char *chainPath(VolumeCheck *check, uint64_t index, char *path){
+
+    CheckedChain *chain = &check->chains[index];
+    CheckedChain *parent;
+    NameLookup lookup;
+    size_t used;
+
+    if(chain->label != NULL){
+        snprintf(path, CHECK_PATH_SIZE, "%s", chain->label);
+        return path;
+    }
+
+    lookup.entry_cluster = chain->entry_cluster;
+    lookup.entry_index = chain->entry_index;
+    lookup.name = NULL;
+    if(chain->parent == NO_PARENT){
+        path[0] = '\0';
+        walkDirectoryFiltered(check->volume_fd, check->volume, check->fat, check->volume->root_cluster, 0, 0, 0,
+                              matchLocation, copyName, &lookup);
+    }
+    else {
+        chainPath(check, chain->parent, path);
+        parent = &check->chains[chain->parent];
+        walkDirectoryFiltered(check->volume_fd, check->volume, check->fat, parent->first_cluster,
+                              parent->data_length, parent->general_flags, 0, matchLocation, copyName, &lookup);
+    }
+
+    used = strlen(path);
+    snprintf(path + used, CHECK_PATH_SIZE - used, "/%s", lookup.name != NULL ? lookup.name : "?");
+    free(lookup.name);
+    return path;
+}
+
+/*------------------------------------------------------
+// reportCrossLinks
+//
+// PURPOSE: Walks every chain a second time, only as far as
+// the chain pass got, to find all owners of the clusters
+// that were claimed twice.  A chain that owns a cluster
+// twice loops back on itself.
+// INPUT PARAMETERS:
+//     Takes in a pointer to the VolumeCheck state.
+//------------------------------------------------------*/
+static void reportCrossLinks(VolumeCheck *check){
+
+    ChainOwner *owners = NULL;
+    char *path;
+    uint64_t owner_count = 0;
+    uint64_t owner_capacity = 0;
+    uint64_t first;
+    CheckedChain *chain;
+    uint32_t cluster;
+
+    for(uint64_t i = 0; i < check->chain_count; i++){
+        chain = &check->chains[i];
+        cluster = chain->first_cluster;
+
+        for(uint64_t step = 0; step < chain->clusters_walked && isValidCluster(check->volume, cluster); step++){
+            if(testBit(check->cross_linked, cluster - FIRST_DATA_CLUSTER)){
+                if(owner_count == owner_capacity){
+                    owner_capacity = owner_capacity == 0 ? 64 : owner_capacity * 2;
+                    owners = realloc(owners, owner_capacity * sizeof (ChainOwner));
+                    assert(owners != NULL);
+                }
+                owners[owner_count].cluster = cluster;
+                owners[owner_count].chain = i;
+                owner_count++;
+            }
+            cluster = (chain->general_flags & FLAG_NO_FAT_CHAIN) ? cluster + 1 :
+                      readFatEntry(check->volume_fd, check->volume, check->fat, cluster);
+        }
+    }
+
+    if(owner_count > 0){
+        qsort(owners, owner_count, sizeof (ChainOwner), compareOwners);
+    }
+
+    path = malloc(CHECK_PATH_SIZE);
+    assert(path != NULL);
+    for(uint64_t i = 0; i < owner_count; i = first){
+        printf("Cross-linked cluster %u:", owners[i].cluster);
+        for(first = i; first < owner_count && owners[first].cluster == owners[i].cluster; first++){
+            if(first > i && owners[first].chain == owners[first - 1].chain){
+                printf(" (loops back on itself)");
+            }
+            else {
+                printf(" %s", chainPath(check, owners[first].chain, path));
+            }
+        }
+        printf("\n");
+    }
+    free(path);
+    free(owners);
+}
+
+static uint64_t reportChainProblems(VolumeCheck *check){
+
+    uint32_t cluster_bytes = clusterBytes(check->volume);
+    uint64_t problems = 0;
+    CheckedChain *chain;
+    char *path = malloc(CHECK_PATH_SIZE);
+
+    assert(path != NULL);
+    for(uint64_t i = 0; i < check->chain_count; i++){
+        chain = &check->chains[i];
+        if(chain->problems & ~PROBLEM_CROSS_LINKED){
+            chainPath(check, i, path);
+        }
+
+        if(chain->problems & PROBLEM_OUT_OF_RANGE){
+            if(chain->problem_value != 0){
+                printf("%s: FAT entry of cluster %u points out of range (0x%08x > %u)\n",
+                       path, chain->problem_cluster, chain->problem_value, check->volume->cluster_count + 1);
+            }
+            else {
+                printf("%s: cluster %u is out of range\n", path, chain->problem_cluster);
+            }
+            problems++;
+        }
+        if(chain->problems & PROBLEM_BAD_CLUSTER){
+            printf("%s: chain runs into a bad cluster after cluster %u\n", path, chain->problem_cluster);
+            problems++;
+        }
+        if(chain->problems & PROBLEM_FREE_CLUSTER){
+            printf("%s: chain uses cluster %u which the bitmap marks free\n", path, chain->free_cluster);
+            problems++;
+        }
+        if(chain->problems & PROBLEM_LENGTH_MISMATCH){
+            printf("%s: DataLength %llu needs %llu cluster(s), chain has %llu\n", path,
+                   (unsigned long long) chain->data_length,
+                   (unsigned long long) ((chain->data_length + cluster_bytes - 1) / cluster_bytes),
+                   (unsigned long long) chain->clusters_walked);
+            problems++;
+        }
+        if(chain->problems & PROBLEM_CROSS_LINKED){
+            problems++;
+        }
+    }
+    free(path);
+    return problems;
+}
+
+/* Prints up to MAX_REPORTED runs of set bits of a bitset, as cluster numbers */
+static void reportClusterRuns(const char *title, const Bitset *first, const Bitset *second_inverted){
+
+    uint64_t runs = 0;
+    uint64_t start;
+    uint64_t i = 0;
+    uint64_t size = first->size;
+
+    #define IN_SET(index) (testBit(first, index) && (second_inverted == NULL || !testBit(second_inverted, index)))
+
+    printf("%s:", title);
+    while(i < size && runs < MAX_REPORTED){
+        if(IN_SET(i)){
+            start = i;
+            while(i < size && IN_SET(i)){
+                i++;
+            }
+            if(i - start == 1){
+                printf(" %llu", (unsigned long long) start + FIRST_DATA_CLUSTER);
+            }
+            else {
+                printf(" %llu-%llu", (unsigned long long) start + FIRST_DATA_CLUSTER,
+                       (unsigned long long) i - 1 + FIRST_DATA_CLUSTER);
+            }
+            runs++;
+        }
+        i++;
+    }
+    if(runs == MAX_REPORTED){
+        printf(" ...");
+    }
+    printf("\n");
+
+    #undef IN_SET
+}
+
+/*------------------------------------------------------
+// commandCheck
+//
+// PURPOSE: Runs the "check" command.  Reports cross-linked
+// clusters, allocated clusters no chain uses, chains that
+// run into free clusters, FAT entries that point past
+// cluster_count + 1 and chains whose length does not match
+// their DataLength.  Nothing is written to the volume.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume along
+// with a pointer to the exfat volume struct.
+// OUTPUT PARAMETERS:
+//     Returns the number of problems found, or -1 if the
+// FAT or bitmap could not be read.
+//------------------------------------------------------*/
+int commandCheck(int volume_fd, exfat *volume){
+
+    VolumeCheck check;
+    uint64_t problems;
+
+    assert(volume != NULL);
+
+    memset(&check, 0, sizeof (VolumeCheck));
+    check.volume_fd = volume_fd;
+    check.volume = volume;
+
+    printf("Checking %u clusters of %u bytes...\n", volume->cluster_count, clusterBytes(volume));
+
+    /* Under a memory ceiling a FAT too large for its share is indexed by runs, or read through the block cache */
+    if(fitsMemory(((uint64_t) volume->cluster_count + FIRST_DATA_CLUSTER) * FAT_ENTRY_SIZE)){
+        check.fat = loadFat(volume_fd, volume);
+        if(check.fat == NULL){
+            printf("Unable to read the FAT\n");
+            return -1;
+        }
+    }
+    else {
+        runIndexOpen(volume_fd, volume);
+    }
+    check.bitmap = loadAllocationBitmap(volume_fd, volume, check.fat);
+    if(check.bitmap == NULL){
+        free(check.fat);
+        return -1;
+    }
+
+    check.referenced = createBitset(volume->cluster_count);
+    check.cross_linked = createBitset(volume->cluster_count);
+    check.bad_entries = createBitset(volume->cluster_count);
+    check.directories = createBitset(volume->cluster_count);
+    assert(check.referenced != NULL && check.cross_linked != NULL);
+    assert(check.bad_entries != NULL && check.directories != NULL);
+
+    /* Directory pass: collect every chain reachable from the root */
+    collectSystemChains(&check);
+    walkTree(volume_fd, volume, check.fat, "", volume->root_cluster, 0, 0, collectChain, &check);
+
+    /* Chain pass, then the FAT and bitmap passes, each split across all cores */
+    parallelRanges(check.chain_count, walkChains, &check);
+    parallelRanges(volume->cluster_count, checkFatEntries, &check);
+    parallelRanges(check.bitmap->word_count, compareBitmap, &check);
+
+    problems = reportChainProblems(&check);
+    reportCrossLinks(&check);
+
+    if(check.out_of_range_entries > 0){
+        reportClusterRuns("FAT entries out of range at clusters", check.bad_entries, NULL);
+        problems += check.out_of_range_entries;
+    }
+    if(check.orphaned > 0){
+        printf("%llu orphaned cluster(s), allocated but used by no chain\n", (unsigned long long) check.orphaned);
+        reportClusterRuns("Orphaned clusters", check.bitmap, check.referenced);
+        problems += check.orphaned;
+    }
+    if(check.unmarked > 0){
+        printf("%llu cluster(s) in use by a chain but marked free\n", (unsigned long long) check.unmarked);
+    }
+
+    printf("\nChecked %llu chain(s): %llu problem(s) found\n",
+           (unsigned long long) check.chain_count, (unsigned long long) problems);
+
+    free(check.chains);
+    free(check.fat);
+    destroyBitset(check.bitmap);
+    destroyBitset(check.referenced);
+    destroyBitset(check.cross_linked);
+    destroyBitset(check.bad_entries);
+    destroyBitset(check.directories);
+
+    return (int) (problems > 0x7fffffff ? 0x7fffffff : problems);
+}
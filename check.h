@@ -0,0 +1,14 @@
+//
+// Read-only consistency check of the FAT against the allocation bitmap.
+//
+
+#ifndef FSREADER_CHECK_H
+#define FSREADER_CHECK_H
+
+#include "exfat.h"
+
+
+int commandCheck(int volume_fd, exfat *volume);
+
+
+#endif //FSREADER_CHECK_H
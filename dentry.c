@@ -0,0 +1,668 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: A path to entry (dentry) cache in front of
+// resolvePath.  Two kinds of items share one memory
+// budget and one LRU list: resolved paths, kept whether
+// they were found or not so a missing path is answered
+// without a scan, and parsed directories, kept as the
+// packed entry sets of every file in them indexed by
+// NameHash.  Resolving many paths under one directory
+// reads and parses that directory once, after which each
+// name costs a binary search.  Names compare without
+// regard to case, as they do in resolvePath, so paths
+// are keyed in lower case.
+//-----------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "dentry.h"
+
+#define DENTRY_PATH 0
+#define DENTRY_DIRECTORY 1
+
+#define MIN_BUCKETS 64
+#define BYTES_PER_BUCKET 4096
+
+/* A DirectoryEntry is packed as its fields up to the name, then name_length characters */
+#define RECORD_HEADER_SIZE offsetof(DirectoryEntry, unicode_name)
+
+/* One name of a parsed directory, sorted by hash and then on-disk order */
+typedef struct NameSlot {
+
+    uint16_t hash;
+    uint8_t length;
+    uint32_t order;
+    size_t record;          /* offset of the packed entry set */
+
+} NameSlot ;
+
+typedef struct Dentry {
+
+    struct Dentry *hash_next;
+    struct Dentry *newer;
+    struct Dentry *older;
+
+    int kind;
+    int volume_fd;
+    uint64_t hash;
+    size_t bytes;           /* charged against the budget */
+
+    /* DENTRY_PATH */
+    char *path;
+    int found;
+    uint8_t *record;
+
+    /* DENTRY_DIRECTORY */
+    uint32_t first_cluster;
+    uint32_t count;
+    NameSlot *names;
+    uint8_t *records;
+
+} Dentry ;
+
+/* Collects a directory's entry sets while it is walked */
+typedef struct DirectoryScan {
+
+    NameSlot *names;
+    uint32_t count;
+    uint32_t capacity;
+    uint8_t *records;
+    size_t used;
+    size_t size;
+
+} DirectoryScan ;
+
+static pthread_mutex_t dentry_lock = PTHREAD_MUTEX_INITIALIZER;
+static Dentry **buckets = NULL;
+static uint64_t bucket_mask;
+static Dentry *newest = NULL;
+static Dentry *oldest = NULL;
+static uint64_t budget_bytes;
+static DentryStats counters;
+
+static size_t recordSize(const DirectoryEntry *entry){
+
+    return RECORD_HEADER_SIZE + (size_t) entry->name_length * sizeof (uint16_t);
+}
+
+static void packEntry(uint8_t *record, const DirectoryEntry *entry){
+
+    memcpy(record, entry, recordSize(entry));
+}
+
+static void unpackEntry(const uint8_t *record, DirectoryEntry *entry){
+
+    memcpy(entry, record, RECORD_HEADER_SIZE);
+    memcpy(entry->unicode_name, record + RECORD_HEADER_SIZE, (size_t) entry->name_length * sizeof (uint16_t));
+    entry->unicode_name[entry->name_length] = 0;
+}
+
+static uint64_t pathHash(int volume_fd, const char *path, size_t length){
+
+    uint64_t hash = 0xcbf29ce484222325ULL ^ (uint64_t) volume_fd;
+
+    for(size_t i = 0; i < length; i++){
+        hash = (hash ^ (uint8_t) path[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint64_t directoryHash(int volume_fd, uint32_t first_cluster){
+
+    uint64_t hash = (((uint64_t) volume_fd << 32) | first_cluster) * 0x9e3779b97f4a7c15ULL;
+
+    return hash ^ (hash >> 29);
+}
+
+/* The caller holds dentry_lock for all the list and table helpers below */
+static void unlinkRecent(Dentry *item){
+
+    if(item->newer != NULL){
+        item->newer->older = item->older;
+    }
+    else {
+        newest = item->older;
+    }
+    if(item->older != NULL){
+        item->older->newer = item->newer;
+    }
+    else {
+        oldest = item->newer;
+    }
+    item->newer = NULL;
+    item->older = NULL;
+}
+
+static void markRecent(Dentry *item){
+
+    if(item == newest){
+        return;
+    }
+    if(item->newer != NULL || item->older != NULL || oldest == item){
+        unlinkRecent(item);
+    }
+    item->older = newest;
+    if(newest != NULL){
+        newest->newer = item;
+    }
+    newest = item;
+    if(oldest == NULL){
+        oldest = item;
+    }
+}
+
+static void freeDentry(Dentry *item){
+
+    free(item->path);
+    free(item->record);
+    free(item->names);
+    free(item->records);
+    free(item);
+}
+
+static void removeDentry(Dentry *item){
+
+    Dentry **link = &buckets[item->hash & bucket_mask];
+
+    while(*link != item){
+        link = &(*link)->hash_next;
+    }
+    *link = item->hash_next;
+    unlinkRecent(item);
+    counters.bytes_used -= item->bytes;
+    freeDentry(item);
+}
+
+static Dentry *findPath(int volume_fd, const char *path, size_t length){
+
+    uint64_t hash = pathHash(volume_fd, path, length);
+    Dentry *item = buckets[hash & bucket_mask];
+
+    while(item != NULL && (item->kind != DENTRY_PATH || item->hash != hash || item->volume_fd != volume_fd ||
+                           strlen(item->path) != length || memcmp(item->path, path, length) != 0)){
+        item = item->hash_next;
+    }
+    return item;
+}
+
+static Dentry *findDirectory(int volume_fd, uint32_t first_cluster){
+
+    uint64_t hash = directoryHash(volume_fd, first_cluster);
+    Dentry *item = buckets[hash & bucket_mask];
+
+    while(item != NULL && (item->kind != DENTRY_DIRECTORY || item->volume_fd != volume_fd ||
+                           item->first_cluster != first_cluster)){
+        item = item->hash_next;
+    }
+    return item;
+}
+
+/*------------------------------------------------------
+// insertDentry
+//
+// PURPOSE: Adds an item to the table, evicting the least
+// recently used items until it fits the budget.  An item
+// larger than the whole budget is not kept.
+// INPUT PARAMETERS:
+//     Takes in the item, with its hash and size set.
+// OUTPUT PARAMETERS:
+//     Returns 1 if the table took the item, 0 if the
+// caller still owns it.
+//------------------------------------------------------*/
+static int insertDentry(Dentry *item){
+
+    if(item->bytes > budget_bytes){
+        return 0;
+    }
+    while(counters.bytes_used + item->bytes > budget_bytes && oldest != NULL){
+        removeDentry(oldest);
+        counters.evictions++;
+    }
+
+    item->hash_next = buckets[item->hash & bucket_mask];
+    buckets[item->hash & bucket_mask] = item;
+    item->newer = NULL;
+    item->older = NULL;
+    markRecent(item);
+    counters.bytes_used += item->bytes;
+    return 1;
+}
+
+static void cachePath(int volume_fd, const char *path, size_t length, const DirectoryEntry *entry){
+
+    Dentry *item;
+
+    pthread_mutex_lock(&dentry_lock);
+    if(findPath(volume_fd, path, length) != NULL){
+        pthread_mutex_unlock(&dentry_lock);
+        return;
+    }
+
+    item = calloc(1, sizeof (Dentry));
+    assert(item != NULL);
+    item->kind = DENTRY_PATH;
+    item->volume_fd = volume_fd;
+    item->hash = pathHash(volume_fd, path, length);
+    item->path = strndup(path, length);
+    assert(item->path != NULL);
+    item->found = entry != NULL;
+    item->bytes = sizeof (Dentry) + length + 1;
+    if(entry != NULL){
+        item->record = malloc(recordSize(entry));
+        assert(item->record != NULL);
+        packEntry(item->record, entry);
+        item->bytes += recordSize(entry);
+    }
+
+    if(!insertDentry(item)){
+        freeDentry(item);
+    }
+    pthread_mutex_unlock(&dentry_lock);
+}
+
+static int compareNames(const void *first, const void *second){
+
+    const NameSlot *a = first;
+    const NameSlot *b = second;
+
+    if(a->hash != b->hash){
+        return a->hash < b->hash ? -1 : 1;
+    }
+    return a->order < b->order ? -1 : (a->order > b->order);
+}
+
+static int collectEntry(DirectoryEntry *entry, void *context){
+
+    DirectoryScan *scan = context;
+    size_t size = recordSize(entry);
+    NameSlot *slot;
+
+    if(scan->count == scan->capacity){
+        scan->capacity = scan->capacity == 0 ? 64 : scan->capacity * 2;
+        scan->names = realloc(scan->names, scan->capacity * sizeof (NameSlot));
+        assert(scan->names != NULL);
+    }
+    while(scan->used + size > scan->size){
+        scan->size = scan->size == 0 ? 4096 : scan->size * 2;
+        scan->records = realloc(scan->records, scan->size);
+        assert(scan->records != NULL);
+    }
+
+    slot = &scan->names[scan->count];
+    slot->hash = entry->name_hash;
+    slot->length = entry->name_length;
+    slot->order = scan->count++;
+    slot->record = scan->used;
+    packEntry(scan->records + scan->used, entry);
+    scan->used += size;
+    return WALK_CONTINUE;
+}
+
+/*------------------------------------------------------
+// scanDirectory
+//
+// PURPOSE: Reads and parses every entry set of a directory
+// into a directory item, its names sorted for lookup.
+// INPUT PARAMETERS:
+//     Takes in the volume descriptor, the exfat volume
+// struct, the in-memory FAT (may be NULL) and the
+// directory's own entry.
+// OUTPUT PARAMETERS:
+//     Returns the new item, or NULL if a cluster of the
+// directory could not be read; a partial listing could
+// wrongly answer that a name is missing.
+//------------------------------------------------------*/
+static Dentry *scanDirectory(int volume_fd, exfat *volume, const uint32_t *fat, const DirectoryEntry *directory){
+
+    DirectoryScan scan;
+    Dentry *item;
+
+    memset(&scan, 0, sizeof (DirectoryScan));
+    if(walkDirectory(volume_fd, volume, fat, directory->first_cluster, directory->data_length,
+                     directory->general_flags, 0, collectEntry, &scan) < 0){
+        free(scan.names);
+        free(scan.records);
+        return NULL;
+    }
+    if(scan.count > 1){
+        qsort(scan.names, scan.count, sizeof (NameSlot), compareNames);
+    }
+
+    item = calloc(1, sizeof (Dentry));
+    assert(item != NULL);
+    item->kind = DENTRY_DIRECTORY;
+    item->volume_fd = volume_fd;
+    item->first_cluster = directory->first_cluster;
+    item->hash = directoryHash(volume_fd, directory->first_cluster);
+    item->count = scan.count;
+    item->names = scan.names;
+    item->records = scan.records;
+    item->bytes = sizeof (Dentry) + scan.count * sizeof (NameSlot) + scan.used;
+    return item;
+}
+
+/*------------------------------------------------------
+// searchDirectory
+//
+// PURPOSE: Finds a name in a parsed directory.  Only the
+// names with a matching hash and length are decoded, and
+// of several sets with the same name the first on disk
+// wins, as in a walk.
+// INPUT PARAMETERS:
+//     Takes in the directory item, the name with its hash
+// and length, and the entry to fill.
+// OUTPUT PARAMETERS:
+//     Returns 0 if the name was found, -1 otherwise.
+//------------------------------------------------------*/
+static int searchDirectory(const Dentry *directory, const char *name, uint16_t hash, uint8_t length,
+                           DirectoryEntry *entry){
+
+    uint32_t low = 0;
+    uint32_t high = directory->count;
+    uint32_t middle;
+    char *candidate;
+    int match;
+
+    while(low < high){
+        middle = low + (high - low) / 2;
+        if(directory->names[middle].hash < hash){
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+
+    for(; low < directory->count && directory->names[low].hash == hash; low++){
+        if(directory->names[low].length != length){
+            continue;
+        }
+        unpackEntry(directory->records + directory->names[low].record, entry);
+        candidate = entryName(entry);
+        match = candidate != NULL && strcasecmp(candidate, name) == 0;
+        free(candidate);
+        if(match){
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*------------------------------------------------------
+// lookupChild
+//
+// PURPOSE: Looks a name up in a directory, parsing the
+// directory into the cache the first time it is used.
+// INPUT PARAMETERS:
+//     Takes in the volume descriptor, the exfat volume
+// struct, the in-memory FAT (may be NULL), the directory's
+// entry, the name and the entry to fill.
+// OUTPUT PARAMETERS:
+//     Returns 0 if the name was found, -1 if it was not
+// and -2 if the directory could not be read.
+//------------------------------------------------------*/
+static int lookupChild(int volume_fd, exfat *volume, const uint32_t *fat, const DirectoryEntry *directory,
+                       const char *name, DirectoryEntry *entry){
+
+    uint16_t hash = nameHash(name);
+    uint8_t length = (uint8_t) strlen(name);
+    Dentry *item;
+    int result;
+
+    pthread_mutex_lock(&dentry_lock);
+    item = findDirectory(volume_fd, directory->first_cluster);
+    if(item != NULL){
+        counters.directory_hits++;
+        markRecent(item);
+        result = searchDirectory(item, name, hash, length, entry);
+        pthread_mutex_unlock(&dentry_lock);
+        return result;
+    }
+    counters.directory_scans++;
+    pthread_mutex_unlock(&dentry_lock);
+
+    /* Scanned without the lock, another thread may add the same directory meanwhile */
+    item = scanDirectory(volume_fd, volume, fat, directory);
+    if(item == NULL){
+        return -2;
+    }
+    result = searchDirectory(item, name, hash, length, entry);
+
+    pthread_mutex_lock(&dentry_lock);
+    if(findDirectory(volume_fd, directory->first_cluster) != NULL || !insertDentry(item)){
+        freeDentry(item);
+    }
+    pthread_mutex_unlock(&dentry_lock);
+    return result;
+}
+
+/*------------------------------------------------------
+// dentryOpen
+//
+// PURPOSE: Creates the cache, sized to a memory budget.
+// INPUT PARAMETERS:
+//     Takes in the budget in bytes, 0 leaves caching off.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 if the table could not be
+// allocated.
+//------------------------------------------------------*/
+int dentryOpen(uint64_t budget){
+
+    uint64_t count = MIN_BUCKETS;
+
+    if(budget == 0){
+        return 0;
+    }
+    while(count < budget / BYTES_PER_BUCKET){
+        count *= 2;
+    }
+
+    buckets = calloc(count, sizeof (Dentry *));
+    if(buckets == NULL){
+        return -1;
+    }
+    bucket_mask = count - 1;
+    budget_bytes = budget;
+    memset(&counters, 0, sizeof (DentryStats));
+    return 0;
+}
+
+void dentryClose(){
+
+    pthread_mutex_lock(&dentry_lock);
+    while(oldest != NULL){
+        removeDentry(oldest);
+    }
+    free(buckets);
+    buckets = NULL;
+    pthread_mutex_unlock(&dentry_lock);
+}
+
+int dentryCaching(){
+
+    return buckets != NULL;
+}
+
+/*------------------------------------------------------
+// dentryResolve
+//
+// PURPOSE: Resolves a path as resolvePath does, answering
+// from the cache where it can.  The path is normalised to
+// lower case with "." and empty components dropped, and
+// each prefix is looked up in turn so sibling paths share
+// their parents' work.  Results that rest on a directory
+// that could not be read are not cached.
+// INPUT PARAMETERS:
+//     Takes in the resolvePath parameters.
+// OUTPUT PARAMETERS:
+//     Returns 0 if the path was found, -1 otherwise.
+//------------------------------------------------------*/
+int dentryResolve(int volume_fd, exfat *volume, const uint32_t *fat, const char *path, DirectoryEntry *entry){
+
+    size_t path_length = strlen(path);
+    char *key = malloc(path_length + 2);
+    char *names = malloc(path_length + 1);
+    char *name;
+    size_t key_length = 0;
+    size_t start;
+    int cacheable = 1;
+    int result = 0;
+    Dentry *item;
+    DirectoryEntry directory;
+
+    assert(key != NULL && names != NULL);
+
+    /* names holds the components one after another, each followed by a NUL */
+    start = 0;
+    name = names;
+    for(size_t i = 0; i <= path_length; i++){
+        if(i < path_length && path[i] != '/'){
+            continue;
+        }
+        if(i > start && !(i - start == 1 && path[start] == '.')){
+            memcpy(name, path + start, i - start);
+            name[i - start] = '\0';
+            name += i - start + 1;
+            key[key_length++] = '/';
+            for(size_t k = start; k < i; k++){
+                key[key_length++] = (char) tolower((unsigned char) path[k]);
+            }
+        }
+        start = i + 1;
+    }
+    key[key_length] = '\0';
+
+    pthread_mutex_lock(&dentry_lock);
+    item = findPath(volume_fd, key, key_length);
+    if(item != NULL){
+        counters.path_hits++;
+        markRecent(item);
+        if(item->found){
+            unpackEntry(item->record, entry);
+        }
+        else {
+            counters.negative_hits++;
+            result = -1;
+        }
+        pthread_mutex_unlock(&dentry_lock);
+        free(key);
+        free(names);
+        return result;
+    }
+    counters.path_misses++;
+    pthread_mutex_unlock(&dentry_lock);
+
+    rootEntry(volume, entry);
+    name = names;
+    for(size_t prefix = 1; prefix <= key_length && result == 0; name += strlen(name) + 1){
+
+        /* The prefix ends before the next separator */
+        while(prefix < key_length && key[prefix] != '/'){
+            prefix++;
+        }
+
+        pthread_mutex_lock(&dentry_lock);
+        item = findPath(volume_fd, key, prefix);
+        if(item != NULL){
+            markRecent(item);
+            if(item->found){
+                unpackEntry(item->record, entry);
+            }
+            else {
+                result = -1;
+            }
+            pthread_mutex_unlock(&dentry_lock);
+            prefix++;
+            continue;
+        }
+        pthread_mutex_unlock(&dentry_lock);
+
+        if(!isDirectory(entry) || strlen(name) > MAX_NAME_LENGTH){
+            result = -1;
+        }
+        else {
+            directory = *entry;
+            result = lookupChild(volume_fd, volume, fat, &directory, name, entry);
+            if(result == -2){
+                cacheable = 0;
+                result = -1;
+            }
+        }
+        if(cacheable){
+            cachePath(volume_fd, key, prefix, result == 0 ? entry : NULL);
+        }
+        prefix++;
+    }
+
+    /* A path that failed part way is remembered in full too, so a repeat takes one lookup */
+    if(result != 0 && cacheable){
+        cachePath(volume_fd, key, key_length, NULL);
+    }
+    free(key);
+    free(names);
+    return result;
+}
+
+/*------------------------------------------------------
+// dentryDrop
+//
+// PURPOSE: Forgets every item of a descriptor, for when
+// it is closed and its number may be reused.
+// INPUT PARAMETERS:
+//     Takes in the volume's descriptor.
+//------------------------------------------------------*/
+void dentryDrop(int volume_fd){
+
+    Dentry *item;
+    Dentry *older;
+
+    if(buckets == NULL){
+        return;
+    }
+    pthread_mutex_lock(&dentry_lock);
+    for(item = newest; item != NULL; item = older){
+        older = item->older;
+        if(item->volume_fd == volume_fd){
+            removeDentry(item);
+        }
+    }
+    pthread_mutex_unlock(&dentry_lock);
+}
+
+void dentryStats(DentryStats *stats){
+
+    pthread_mutex_lock(&dentry_lock);
+    *stats = counters;
+    stats->bytes_total = buckets != NULL ? budget_bytes : 0;
+    pthread_mutex_unlock(&dentry_lock);
+}
+
+/*------------------------------------------------------
+// printDentryStats
+//
+// PURPOSE: Prints the path and directory counters and
+// how much of the budget is in use.
+// INPUT PARAMETERS:
+//     Takes in the stream to print to.
+//------------------------------------------------------*/
+void printDentryStats(FILE *output){
+
+    DentryStats stats;
+
+    dentryStats(&stats);
+    fprintf(output, "dentry %llu path hit(s) (%llu negative), %llu path miss(es)\n",
+            (unsigned long long) stats.path_hits, (unsigned long long) stats.negative_hits,
+            (unsigned long long) stats.path_misses);
+    fprintf(output, "dentry %llu directory scan(s), %llu lookup(s) in parsed directories, %llu eviction(s), "
+            "%llu of %llu KB used\n", (unsigned long long) stats.directory_scans,
+            (unsigned long long) stats.directory_hits, (unsigned long long) stats.evictions,
+            (unsigned long long) stats.bytes_used / KILOBYTE_SIZE,
+            (unsigned long long) stats.bytes_total / KILOBYTE_SIZE);
+}
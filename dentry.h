@@ -0,0 +1,45 @@
+//
+// Path to entry (dentry) cache in front of resolvePath.
+//
+
+#ifndef FSREADER_DENTRY_H
+#define FSREADER_DENTRY_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "exfat.h"
+#include "directory.h"
+
+#define DEFAULT_DENTRY_BUDGET (8 * 1024 * 1024)
+
+typedef struct DentryStats {
+
+    uint64_t path_hits;         /* paths answered from the cache, found or not */
+    uint64_t negative_hits;     /* of those, paths known not to exist */
+    uint64_t path_misses;
+    uint64_t directory_hits;    /* components looked up in an already parsed directory */
+    uint64_t directory_scans;   /* directories read and parsed */
+    uint64_t evictions;
+    uint64_t bytes_used;
+    uint64_t bytes_total;
+
+} DentryStats ;
+
+
+int dentryOpen(uint64_t budget);
+
+void dentryClose();
+
+int dentryCaching();
+
+int dentryResolve(int volume_fd, exfat *volume, const uint32_t *fat, const char *path, DirectoryEntry *entry);
+
+void dentryDrop(int volume_fd);
+
+void dentryStats(DentryStats *stats);
+
+void printDentryStats(FILE *output);
+
+
+#endif //FSREADER_DENTRY_H
@@ -0,0 +1,563 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Implement the "diff" command, comparing the
+// directory trees of two volumes.  Each pair of matching
+// directories is read from both volumes and fingerprinted
+// over its raw entry set bytes.  When the fingerprints
+// agree nothing in the directory changed, so its entries
+// are not matched by name and only its subdirectories
+// are visited.  Otherwise the entry sets are matched by
+// name and fingerprinted one by one, and file contents
+// are compared only when the size is unchanged but the
+// clusters, valid length or modification time are not.
+// Directory pairs are compared in parallel.  A pair
+// whose first clusters were both queued before, or that
+// lies MAX_TREE_DEPTH below the root, is not compared
+// again, so a looped tree on either side still ends.
+//-----------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "diff.h"
+#include "bitset.h"
+#include "directory.h"
+#include "file.h"
+#include "workqueue.h"
+#include "cache.h"
+#include "dentry.h"
+#include "memory.h"
+#include "parallel.h"
+
+#define COMPARE_BUFFER_SIZE (KILOBYTE_SIZE * KILOBYTE_SIZE)
+#define FINGERPRINT_SEED 0xcbf29ce484222325ULL
+#define FINGERPRINT_PRIME 0x100000001b3ULL
+#define OEM_NAME_OFFSET 3
+#define CLUSTER_COUNT_OFFSET 92
+#define SECTOR_SHIFT_OFFSET 108
+
+#define CHANGE_ADDED 'A'
+#define CHANGE_REMOVED 'D'
+#define CHANGE_MODIFIED 'M'
+
+/* One side of the comparison */
+typedef struct DiffVolume {
+
+    int volume_fd;
+    exfat *volume;
+    Bitset *visited;        /* first clusters of the directories already queued */
+
+} DiffVolume ;
+
+/* The entries of one directory as read from one volume */
+typedef struct DiffDirectory {
+
+    uint8_t *entries;
+    uint32_t used;              /* entries before the end of directory marker */
+    uint64_t fingerprint;
+
+} DiffDirectory ;
+
+typedef struct DiffSet {
+
+    uint32_t index;             /* of the file entry within DiffDirectory.entries */
+    uint32_t length;            /* in entries */
+    uint64_t fingerprint;
+    char *name;
+
+} DiffSet ;
+
+typedef struct DiffChange {
+
+    char *path;
+    char kind;
+    char *detail;
+
+} DiffChange ;
+
+typedef struct DiffWork {
+
+    char *path;
+    unsigned int depth;
+    DirectoryEntry first;
+    DirectoryEntry second;
+
+} DiffWork ;
+
+typedef struct DiffScan {
+
+    DiffVolume sides[2];
+
+    DiffChange *changes;
+    unsigned long change_count;
+    unsigned long change_capacity;
+
+    unsigned long directories;
+    unsigned long identical_directories;
+    unsigned long content_compares;
+    size_t compare_size;        /* bytes of each file a worker compares at once */
+
+    pthread_mutex_t lock;
+
+} DiffScan ;
+
+/*------------------------------------------------------
+// fingerprint
+//
+// PURPOSE: Hashes a run of bytes 8 at a time, FNV style
+// with an extra shift so that every input bit reaches the
+// high half of the 64 bit result.
+// INPUT PARAMETERS:
+//    Takes in the bytes and their count, a multiple of 8.
+// OUTPUT PARAMETERS:
+//     Returns the 64 bit fingerprint.
+//------------------------------------------------------*/
+static uint64_t fingerprint(const uint8_t *bytes, size_t length){
+
+    uint64_t hash = FINGERPRINT_SEED;
+    uint64_t word;
+
+    for(size_t i = 0; i + 8 <= length; i += 8){
+        memcpy(&word, bytes + i, 8);
+        hash = (hash ^ word) * FINGERPRINT_PRIME;
+        hash ^= hash >> 29;
+    }
+    return hash ^ length;
+}
+
+static void addChange(DiffScan *scan, const char *path, char kind, const char *detail){
+
+    pthread_mutex_lock(&scan->lock);
+
+    if(scan->change_count == scan->change_capacity){
+        scan->change_capacity = scan->change_capacity == 0 ? 64 : scan->change_capacity * 2;
+        scan->changes = realloc(scan->changes, scan->change_capacity * sizeof (DiffChange));
+        assert(scan->changes != NULL);
+    }
+    scan->changes[scan->change_count].path = strdup(path);
+    scan->changes[scan->change_count].kind = kind;
+    scan->changes[scan->change_count].detail = strdup(detail);
+    scan->change_count++;
+
+    pthread_mutex_unlock(&scan->lock);
+}
+
+static char *childPath(const char *path, const char *name){
+
+    char *child = malloc(strlen(path) + strlen(name) + 2);
+
+    assert(child != NULL);
+    sprintf(child, "%s/%s", path, name);
+    return child;
+}
+
+static DiffWork *createDiffWork(const char *path, unsigned int depth, const DirectoryEntry *first,
+                                const DirectoryEntry *second){
+
+    DiffWork *work = malloc(sizeof (DiffWork));
+
+    assert(work != NULL);
+    work->path = strdup(path);
+    work->depth = depth;
+    work->first = *first;
+    work->second = *second;
+    return work;
+}
+
+/* Marks a directory queued on one side, returns 1 if it was not queued before */
+static int markVisited(const DiffVolume *side, const DirectoryEntry *entry){
+
+    return !isValidCluster(side->volume, entry->first_cluster) ||
+           !testAndSetBit(side->visited, entry->first_cluster - FIRST_DATA_CLUSTER);
+}
+
+/* Queues a pair of subdirectories unless both were queued before or they are too deep, which would loop forever */
+static void queueDirectories(DiffScan *scan, WorkQueue *queue, const DiffWork *work, const char *path,
+                             const DirectoryEntry *first, const DirectoryEntry *second){
+
+    int first_new;
+    int second_new;
+
+    if(work->depth >= MAX_TREE_DEPTH){
+        return;
+    }
+    first_new = markVisited(&scan->sides[0], first);
+    second_new = markVisited(&scan->sides[1], second);
+    if(first_new || second_new){
+        pushWork(queue, createDiffWork(path, work->depth + 1, first, second));
+    }
+}
+
+static void readDiffDirectory(const DiffVolume *side, const DirectoryEntry *entry, DiffDirectory *directory){
+
+    uint32_t cluster_total = 0;
+    uint32_t entry_count;
+
+    directory->entries = readDirectory(side->volume_fd, side->volume, NULL, entry->first_cluster, entry->data_length,
+                                       entry->general_flags, NULL, &cluster_total);
+    entry_count = (uint32_t) ((uint64_t) cluster_total * clusterBytes(side->volume) / ENTRY_SIZE);
+
+    directory->used = 0;
+    while(directory->used < entry_count &&
+          directory->entries[(size_t) directory->used * ENTRY_SIZE] != ENTRY_TYPE_END_OF_DIRECTORY){
+        directory->used++;
+    }
+    directory->fingerprint = fingerprint(directory->entries, (size_t) directory->used * ENTRY_SIZE);
+}
+
+/* Finds the live entry sets of a directory, the names are decoded only when wanted */
+static DiffSet *listSets(const DiffDirectory *directory, uint32_t *count, int with_names){
+
+    DirectoryEntry entry;
+    DiffSet *sets;
+    uint32_t *matches = malloc(((size_t) directory->used + 1) * sizeof (uint32_t));
+    uint32_t found;
+    uint32_t length;
+
+    assert(matches != NULL);
+    found = findEntries(directory->entries, directory->used, ENTRY_TYPE_FILE, matches);
+    sets = malloc(((size_t) found + 1) * sizeof (DiffSet));
+    assert(sets != NULL);
+
+    *count = 0;
+    for(uint32_t i = 0; i < found; i++){
+        length = parseEntrySet(directory->entries, directory->used, matches[i], 0, &entry);
+        if(length == 0){
+            continue;
+        }
+        sets[*count].index = matches[i];
+        sets[*count].length = length;
+        sets[*count].fingerprint = fingerprint(directory->entries + (size_t) matches[i] * ENTRY_SIZE,
+                                               (size_t) length * ENTRY_SIZE);
+        sets[*count].name = with_names || isDirectory(&entry) ? entryName(&entry) : NULL;
+        (*count)++;
+    }
+
+    free(matches);
+    return sets;
+}
+
+static void freeSets(DiffSet *sets, uint32_t count){
+
+    for(uint32_t i = 0; i < count; i++){
+        free(sets[i].name);
+    }
+    free(sets);
+}
+
+static int compareSetNames(const void *a, const void *b){
+
+    return strcasecmp(((const DiffSet *) a)->name, ((const DiffSet *) b)->name);
+}
+
+/* Compares the bytes of two files of the same size, a chunk at a time */
+static int contentsDiffer(DiffScan *scan, const DirectoryEntry *first, const DirectoryEntry *second){
+
+    ExfatFile *files[2];
+    uint8_t *buffers[2];
+    uint64_t offset = 0;
+    ssize_t counts[2];
+    int differ = 0;
+
+    __atomic_add_fetch(&scan->content_compares, 1, __ATOMIC_RELAXED);
+
+    files[0] = openEntry(scan->sides[0].volume_fd, scan->sides[0].volume, NULL, first);
+    files[1] = openEntry(scan->sides[1].volume_fd, scan->sides[1].volume, NULL, second);
+    buffers[0] = malloc(scan->compare_size);
+    buffers[1] = malloc(scan->compare_size);
+    assert(buffers[0] != NULL && buffers[1] != NULL);
+
+    while(!differ && offset < first->data_length){
+        counts[0] = readFile(files[0], buffers[0], scan->compare_size, offset);
+        counts[1] = readFile(files[1], buffers[1], scan->compare_size, offset);
+
+        if(counts[0] <= 0 || counts[0] != counts[1] || memcmp(buffers[0], buffers[1], (size_t) counts[0]) != 0){
+            differ = 1;
+        }
+        offset += scan->compare_size;
+    }
+
+    free(buffers[0]);
+    free(buffers[1]);
+    closeFile(files[0]);
+    closeFile(files[1]);
+    return differ;
+}
+
+static int timestampsDiffer(const DirectoryEntry *first, const DirectoryEntry *second){
+
+    return first->create_timestamp != second->create_timestamp || first->modify_timestamp != second->modify_timestamp ||
+           first->access_timestamp != second->access_timestamp || first->create_10ms != second->create_10ms ||
+           first->modify_10ms != second->modify_10ms || first->create_utc_offset != second->create_utc_offset ||
+           first->modify_utc_offset != second->modify_utc_offset || first->access_utc_offset != second->access_utc_offset;
+}
+
+/*------------------------------------------------------
+// compareEntries
+//
+// PURPOSE: Reports how an entry that exists in both
+// volumes changed, its entry sets having different bytes.
+// Subdirectories are queued to be compared in turn.
+// INPUT PARAMETERS:
+//    Takes in the scan, the queue, the work item of the
+// parent directory, the entry's path and its entry in
+// each volume.
+//------------------------------------------------------*/
+static void compareEntries(DiffScan *scan, WorkQueue *queue, const DiffWork *work, const char *path,
+                           const DirectoryEntry *first, const DirectoryEntry *second){
+
+    char detail[256];
+    size_t length = 0;
+
+    detail[0] = '\0';
+
+    if(isDirectory(first) != isDirectory(second)){
+        addChange(scan, path, CHANGE_MODIFIED, isDirectory(first) ? "directory became a file" : "file became a directory");
+        return;
+    }
+    if(isDirectory(first)){
+        queueDirectories(scan, queue, work, path, first, second);
+    }
+
+    if(first->data_length != second->data_length && !isDirectory(first)){
+        length += (size_t) snprintf(detail + length, sizeof (detail) - length, "resized %llu -> %llu, ",
+                                    (unsigned long long) first->data_length, (unsigned long long) second->data_length);
+    }
+    else if(!isDirectory(first) &&
+            (first->first_cluster != second->first_cluster || first->valid_data_length != second->valid_data_length ||
+             first->modify_timestamp != second->modify_timestamp || first->modify_10ms != second->modify_10ms) &&
+            contentsDiffer(scan, first, second)){
+        length += (size_t) snprintf(detail + length, sizeof (detail) - length, "content, ");
+    }
+    if(first->file_attributes != second->file_attributes){
+        length += (size_t) snprintf(detail + length, sizeof (detail) - length, "attributes, ");
+    }
+    if(timestampsDiffer(first, second)){
+        length += (size_t) snprintf(detail + length, sizeof (detail) - length, "timestamps, ");
+    }
+
+    /* Directories moved to other clusters but otherwise the same are compared below, not reported */
+    if(length >= 2){
+        detail[length - 2] = '\0';
+        addChange(scan, path, CHANGE_MODIFIED, detail);
+    }
+}
+
+/* Queues the subdirectories of a directory that is byte for byte the same in both volumes */
+static void visitIdenticalDirectory(DiffScan *scan, WorkQueue *queue, DiffWork *work, DiffDirectory *directory){
+
+    DirectoryEntry entry;
+    DiffSet *sets;
+    uint32_t count;
+    char *path;
+
+    sets = listSets(directory, &count, 0);
+    for(uint32_t i = 0; i < count; i++){
+        if(sets[i].name == NULL){
+            continue;
+        }
+        parseEntrySet(directory->entries, directory->used, sets[i].index, 0, &entry);
+        path = childPath(work->path, sets[i].name);
+        queueDirectories(scan, queue, work, path, &entry, &entry);
+        free(path);
+    }
+    freeSets(sets, count);
+    __atomic_add_fetch(&scan->identical_directories, 1, __ATOMIC_RELAXED);
+}
+
+static void reportOneSide(DiffScan *scan, const DiffDirectory *directory, const DiffSet *set, const char *path, char kind){
+
+    DirectoryEntry entry;
+    char *child = childPath(path, set->name);
+
+    parseEntrySet(directory->entries, directory->used, set->index, 0, &entry);
+    addChange(scan, child, kind, isDirectory(&entry) ? "directory" : "file");
+    free(child);
+}
+
+/*------------------------------------------------------
+// compareDirectories
+//
+// PURPOSE: Work function comparing one directory that
+// exists in both volumes.
+// INPUT PARAMETERS:
+//    Takes in the DiffWork item, the queue and the scan.
+//------------------------------------------------------*/
+static void compareDirectories(void *item, WorkQueue *queue, void *context){
+
+    DiffScan *scan = context;
+    DiffWork *work = item;
+    DiffDirectory directories[2];
+    DiffSet *sets[2];
+    uint32_t counts[2];
+    uint32_t i = 0;
+    uint32_t j = 0;
+    DirectoryEntry first;
+    DirectoryEntry second;
+    char *path;
+    int order;
+
+    __atomic_add_fetch(&scan->directories, 1, __ATOMIC_RELAXED);
+    readDiffDirectory(&scan->sides[0], &work->first, &directories[0]);
+    readDiffDirectory(&scan->sides[1], &work->second, &directories[1]);
+
+    if(directories[0].entries == NULL || directories[1].entries == NULL){
+        addChange(scan, work->path[0] == '\0' ? "/" : work->path, CHANGE_MODIFIED, "directory could not be read");
+    }
+    else if(directories[0].used == directories[1].used && directories[0].fingerprint == directories[1].fingerprint){
+        visitIdenticalDirectory(scan, queue, work, &directories[0]);
+    }
+    else {
+        sets[0] = listSets(&directories[0], &counts[0], 1);
+        sets[1] = listSets(&directories[1], &counts[1], 1);
+        qsort(sets[0], counts[0], sizeof (DiffSet), compareSetNames);
+        qsort(sets[1], counts[1], sizeof (DiffSet), compareSetNames);
+
+        while(i < counts[0] || j < counts[1]){
+            order = i == counts[0] ? 1 : j == counts[1] ? -1 : strcasecmp(sets[0][i].name, sets[1][j].name);
+
+            if(order < 0){
+                reportOneSide(scan, &directories[0], &sets[0][i++], work->path, CHANGE_REMOVED);
+            }
+            else if(order > 0){
+                reportOneSide(scan, &directories[1], &sets[1][j++], work->path, CHANGE_ADDED);
+            }
+            else {
+                parseEntrySet(directories[0].entries, directories[0].used, sets[0][i].index, 0, &first);
+                parseEntrySet(directories[1].entries, directories[1].used, sets[1][j].index, 0, &second);
+
+                /* Same bytes: unchanged, though a subdirectory's own entries may still differ */
+                if(sets[0][i].fingerprint != sets[1][j].fingerprint || isDirectory(&first)){
+                    path = childPath(work->path, sets[0][i].name);
+                    compareEntries(scan, queue, work, path, &first, &second);
+                    free(path);
+                }
+                i++;
+                j++;
+            }
+        }
+
+        freeSets(sets[0], counts[0]);
+        freeSets(sets[1], counts[1]);
+    }
+
+    free(directories[0].entries);
+    free(directories[1].entries);
+    free(work->path);
+    free(work);
+}
+
+/* Checks the boot sector's OEM name and geometry, readVolume follows the geometry to the root directory */
+static int isExfatVolume(int volume_fd){
+
+    char oem_name[8];
+    uint8_t shifts[2];
+    uint32_t cluster_count;
+
+    if(readBytes(volume_fd, oem_name, sizeof (oem_name), OEM_NAME_OFFSET) != (ssize_t) sizeof (oem_name) ||
+       memcmp(oem_name, "EXFAT   ", sizeof (oem_name)) != 0){
+        return 0;
+    }
+    if(readBytes(volume_fd, &cluster_count, sizeof (cluster_count), CLUSTER_COUNT_OFFSET) !=
+       (ssize_t) sizeof (cluster_count) ||
+       readBytes(volume_fd, shifts, sizeof (shifts), SECTOR_SHIFT_OFFSET) != (ssize_t) sizeof (shifts)){
+        return 0;
+    }
+    return shifts[0] >= 9 && shifts[0] <= 12 && shifts[0] + shifts[1] <= 25 && cluster_count != 0;
+}
+
+static int compareChanges(const void *a, const void *b){
+
+    return strcmp(((const DiffChange *) a)->path, ((const DiffChange *) b)->path);
+}
+
+/*------------------------------------------------------
+// commandDiff
+//
+// PURPOSE: Runs "diff <other volume>", listing every
+// entry added (A), removed (D) or modified (M) in the
+// other volume, sorted by path, followed by how many
+// directories were compared and skipped as identical.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct and the arguments
+// that follow the command.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 otherwise.
+//------------------------------------------------------*/
+int commandDiff(int volume_fd, exfat *volume, int argc, char *argv[]){
+
+    DiffScan scan;
+    DirectoryEntry roots[2];
+    WorkQueue *queue;
+    int other_fd;
+
+    if(argc != 1){
+        printf("Usage: diff <other volume>\n");
+        return -1;
+    }
+    other_fd = open(argv[0], O_RDONLY);
+    if(other_fd < 0){
+        printf("Unable to open file: '%s'\n", argv[0]);
+        return -1;
+    }
+    if(!isExfatVolume(other_fd)){
+        printf("'%s' is not an exFAT volume\n", argv[0]);
+        cacheDrop(other_fd);
+        close(other_fd);
+        return -1;
+    }
+
+    memset(&scan, 0, sizeof (DiffScan));
+    scan.sides[0].volume_fd = volume_fd;
+    scan.sides[0].volume = volume;
+    scan.sides[1].volume_fd = other_fd;
+    scan.sides[1].volume = readVolume(other_fd);
+    scan.sides[0].visited = createBitset(volume->cluster_count);
+    scan.sides[1].visited = createBitset(scan.sides[1].volume->cluster_count);
+    assert(scan.sides[0].visited != NULL && scan.sides[1].visited != NULL);
+    pthread_mutex_init(&scan.lock, NULL);
+
+    /* Every worker holds two buffers, together they take a table's share of the memory ceiling */
+    scan.compare_size = (size_t) (memoryShare((uint64_t) COMPARE_BUFFER_SIZE * 2 * threadCount()) / 2 / threadCount());
+
+    rootEntry(scan.sides[0].volume, &roots[0]);
+    rootEntry(scan.sides[1].volume, &roots[1]);
+
+    markVisited(&scan.sides[0], &roots[0]);
+    markVisited(&scan.sides[1], &roots[1]);
+
+    queue = createWorkQueue(compareDirectories, &scan);
+    pushWork(queue, createDiffWork("", 0, &roots[0], &roots[1]));
+    runWorkQueue(queue);
+    destroyWorkQueue(queue);
+
+    if(scan.change_count > 0){
+        qsort(scan.changes, scan.change_count, sizeof (DiffChange), compareChanges);
+    }
+    for(unsigned long i = 0; i < scan.change_count; i++){
+        printf("%c %s (%s)\n", scan.changes[i].kind, scan.changes[i].path, scan.changes[i].detail);
+        free(scan.changes[i].path);
+        free(scan.changes[i].detail);
+    }
+    printf("\n%lu change(s), %lu director%s compared, %lu identical, %lu content comparison(s)\n",
+           scan.change_count, scan.directories, scan.directories == 1 ? "y" : "ies",
+           scan.identical_directories, scan.content_compares);
+
+    free(scan.changes);
+    destroyBitset(scan.sides[0].visited);
+    destroyBitset(scan.sides[1].visited);
+    pthread_mutex_destroy(&scan.lock);
+    free(scan.sides[1].volume->ascii_volume_label);
+    free(scan.sides[1].volume);
+    cacheDrop(other_fd);
+    dentryDrop(other_fd);
+    close(other_fd);
+    return 0;
+}
@@ -0,0 +1,14 @@
+//
+// Structural comparison of the directory trees of two volumes.
+//
+
+#ifndef FSREADER_DIFF_H
+#define FSREADER_DIFF_H
+
+#include "exfat.h"
+
+
+int commandDiff(int volume_fd, exfat *volume, int argc, char *argv[]);
+
+
+#endif //FSREADER_DIFF_H
@@ -0,0 +1,852 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Read the directories of an exfat volume.
+// Directory clusters are read a whole cluster at a time
+// and every file entry set (file, stream extension and
+// file name entries) is collected into a DirectoryEntry
+// before it is handed to a callback, or returned by a
+// DirectoryIterator that can stop and resume anywhere.
+//-----------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <assert.h>
+
+#include "directory.h"
+#include "fat.h"
+#include "dentry.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_GATHER_SCAN 1
+#endif
+
+typedef struct EntrySetParser {
+
+    DirectoryEntry entry;
+    int in_set;
+    int remaining;          /* secondary entries still expected */
+    int name_characters;    /* characters of the name copied so far */
+    int have_stream;
+
+    /* checked once the stream extension is parsed, before any name is copied */
+    EntryCallback filter;
+    void *filter_context;
+    int rejected;
+
+} EntrySetParser ;
+
+typedef struct TreeWalk {
+
+    int volume_fd;
+    exfat *volume;
+    const uint32_t *fat;
+    const char *path;
+    int depth;
+    TreeCallback callback;
+    void *context;
+    int stopped;
+
+} TreeWalk ;
+
+struct DirectoryIterator {
+
+    int volume_fd;
+    exfat *volume;
+    const uint32_t *fat;
+    uint32_t first_cluster;
+    uint8_t general_flags;
+    int options;
+    uint32_t entries_per_cluster;
+    uint64_t max_clusters;
+
+    /* The next raw entry to look at */
+    uint32_t cluster;
+    uint64_t cluster_index;
+    uint32_t entry_index;
+    int loaded;             /* buffer holds the cluster */
+    int done;
+
+    EntrySetParser parser;
+    uint8_t *buffer;        /* one cluster, allocated with the iterator */
+
+};
+
+int isDirectory(const DirectoryEntry *entry){
+
+    return (entry->file_attributes & ATTRIBUTE_DIRECTORY) != 0;
+}
+
+/*------------------------------------------------------
+// entryName
+//
+// PURPOSE: Converts the name of a directory entry to an
+// ASCII string.
+// INPUT PARAMETERS:
+//     Takes in a pointer to a parsed DirectoryEntry.
+// OUTPUT PARAMETERS:
+//     Returns a heap allocated string the caller frees.
+//------------------------------------------------------*/
+char *entryName(DirectoryEntry *entry){
+
+    if(entry->name_length == 0){
+        return calloc(1, sizeof (char));
+    }
+    return unicode2ascii(entry->unicode_name, entry->name_length);
+}
+
+/*------------------------------------------------------
+// nameHash
+//
+// PURPOSE: Calculates the NameHash of a file name the way
+// the stream extension entry stores it, over the up-cased
+// 16 bit characters of the name.  Only ASCII letters are
+// up-cased.
+// INPUT PARAMETERS:
+//     Takes in an ASCII file name.
+// OUTPUT PARAMETERS:
+//     Returns the 16 bit name hash.
+//------------------------------------------------------*/
+uint16_t nameHash(const char *name){
+
+    uint16_t hash = 0;
+    uint16_t character;
+
+    for(; *name != '\0'; name++){
+        character = (uint16_t) toupper((unsigned char) *name);
+        hash = (uint16_t) (((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (character & 0xff));
+        hash = (uint16_t) (((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (character >> 8));
+    }
+    return hash;
+}
+
+/*------------------------------------------------------
+// entryTime
+//
+// PURPOSE: Converts an exFAT timestamp to a time_t.  The
+// timestamp is in local time, unless the UtcOffset field
+// is valid, in which case it is used to get to UTC.
+// INPUT PARAMETERS:
+//     Takes in the 32 bit timestamp and its UtcOffset byte.
+// OUTPUT PARAMETERS:
+//     Returns the time as seconds since the epoch.
+//------------------------------------------------------*/
+time_t entryTime(uint32_t timestamp, uint8_t utc_offset){
+
+    struct tm date;
+    int offset_minutes;
+
+    memset(&date, 0, sizeof (struct tm));
+    date.tm_sec = (int) (timestamp & 0x1f) * 2;
+    date.tm_min = (int) (timestamp >> 5) & 0x3f;
+    date.tm_hour = (int) (timestamp >> 11) & 0x1f;
+    date.tm_mday = (int) (timestamp >> 16) & 0x1f;
+    date.tm_mon = (int) ((timestamp >> 21) & 0x0f) - 1;
+    date.tm_year = (int) (timestamp >> 25) + 80;
+    date.tm_isdst = -1;
+
+    if((utc_offset & 0x80) == 0){
+        return mktime(&date);
+    }
+
+    /* 7 bit two's complement offset in 15 minute increments */
+    offset_minutes = ((utc_offset & 0x40) ? (int) (utc_offset & 0x7f) - 0x80 : (int) (utc_offset & 0x7f)) * 15;
+    date.tm_isdst = 0;
+    return timegm(&date) - (time_t) offset_minutes * 60;
+}
+
+/*------------------------------------------------------
+// entryTicks
+//
+// PURPOSE: Converts an exFAT timestamp and its 10ms
+// increment field (0 to 199, adding up to 1.99 seconds
+// to the 2 second resolution of the timestamp) to 10ms
+// ticks since the epoch.
+// INPUT PARAMETERS:
+//     Takes in the 32 bit timestamp, its 10msIncrement
+// byte (0 for the access time, which has none) and its
+// UtcOffset byte.
+// OUTPUT PARAMETERS:
+//     Returns the time in 10ms ticks, never negative.
+//------------------------------------------------------*/
+int64_t entryTicks(uint32_t timestamp, uint8_t increment_10ms, uint8_t utc_offset){
+
+    time_t seconds = entryTime(timestamp, utc_offset);
+
+    if(seconds < 0){
+        return 0;
+    }
+    return (int64_t) seconds * 100 + (increment_10ms < 200 ? increment_10ms : 0);
+}
+
+/*------------------------------------------------------
+// parseEntry
+//
+// PURPOSE: Feeds one 32 byte directory entry to the entry
+// set parser.  Only live entry sets are collected, or only
+// deleted ones when WALK_DELETED is given.
+// INPUT PARAMETERS:
+//     Takes in the parser state, the raw entry, the cluster
+// and index where the entry was read and the walk options.
+// OUTPUT PARAMETERS:
+//     Returns 1 when the entry completes an entry set that
+// is now held in parser->entry, 0 otherwise.
+//------------------------------------------------------*/
+static int parseEntry(EntrySetParser *parser, const uint8_t *raw, uint32_t cluster, uint32_t index, int options){
+
+    uint8_t type = raw[0];
+    uint8_t base_type = type | ENTRY_IN_USE;
+    int wanted_in_use = (options & WALK_DELETED) == 0;
+    DirectoryEntry *entry = &parser->entry;
+    int characters;
+
+    if(((type & ENTRY_IN_USE) != 0) != wanted_in_use){
+        parser->in_set = 0;
+        return 0;
+    }
+
+    if(base_type == ENTRY_TYPE_FILE){
+        memset(entry, 0, sizeof (DirectoryEntry) - sizeof (entry->unicode_name));
+        entry->entry_type = type;
+        entry->secondary_count = raw[1];
+        memcpy(&entry->set_checksum, raw + 2, 2);
+        memcpy(&entry->file_attributes, raw + 4, 2);
+        memcpy(&entry->create_timestamp, raw + 8, 4);
+        memcpy(&entry->modify_timestamp, raw + 12, 4);
+        memcpy(&entry->access_timestamp, raw + 16, 4);
+        entry->create_10ms = raw[20];
+        entry->modify_10ms = raw[21];
+        entry->create_utc_offset = raw[22];
+        entry->modify_utc_offset = raw[23];
+        entry->access_utc_offset = raw[24];
+        entry->entry_cluster = cluster;
+        entry->entry_index = index;
+
+        parser->remaining = raw[1];
+        parser->name_characters = 0;
+        parser->have_stream = 0;
+        parser->rejected = 0;
+        parser->in_set = parser->remaining >= 2;
+        return 0;
+    }
+
+    /* A primary entry (TypeCategory bit clear) ends any set in progress */
+    if(!parser->in_set || (base_type & 0x40) == 0){
+        parser->in_set = 0;
+        return 0;
+    }
+
+    if(base_type == ENTRY_TYPE_STREAM_EXTENSION && !parser->have_stream){
+        entry->general_flags = raw[1];
+        entry->name_length = raw[3];
+        memcpy(&entry->name_hash, raw + 4, 2);
+        memcpy(&entry->valid_data_length, raw + 8, 8);
+        memcpy(&entry->first_cluster, raw + 20, 4);
+        memcpy(&entry->data_length, raw + 24, 8);
+        parser->have_stream = 1;
+
+        if(parser->filter != NULL && parser->filter(entry, parser->filter_context) != WALK_CONTINUE){
+            parser->rejected = 1;
+        }
+    }
+    else if(base_type == ENTRY_TYPE_FILE_NAME && parser->have_stream && !parser->rejected){
+        characters = entry->name_length - parser->name_characters;
+        if(characters > NAME_CHARACTERS_PER_ENTRY){
+            characters = NAME_CHARACTERS_PER_ENTRY;
+        }
+        if(characters > 0){
+            memcpy(entry->unicode_name + parser->name_characters, raw + 2, characters * 2);
+            parser->name_characters += characters;
+        }
+    }
+
+    parser->remaining--;
+    if(parser->remaining == 0){
+        parser->in_set = 0;
+        if(parser->have_stream && !parser->rejected){
+            entry->name_length = (uint8_t) parser->name_characters;
+            entry->unicode_name[entry->name_length] = 0;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*------------------------------------------------------
+// readDirectory
+//
+// PURPOSE: Reads every cluster of a directory into one
+// buffer so its entries can be scanned in bulk.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct, the in-memory FAT
+// (may be NULL), the first cluster, DataLength (0 when
+// unknown) and stream extension flags of the directory,
+// and a pointer that receives a heap allocated array of
+// the cluster numbers read (may be NULL) along with a
+// pointer that receives the number of clusters read.
+// OUTPUT PARAMETERS:
+//     Returns a heap allocated buffer of cluster_total
+// clusters, or NULL if nothing could be read.  The caller
+// frees the buffer and the cluster array.
+//------------------------------------------------------*/
+uint8_t *readDirectory(int volume_fd, exfat *volume, const uint32_t *fat, uint32_t first_cluster,
+                       uint64_t data_length, uint8_t general_flags, uint32_t **clusters, uint32_t *cluster_total){
+
+    uint32_t cluster_bytes = clusterBytes(volume);
+    uint64_t max_clusters = volume->cluster_count;
+    uint32_t capacity = 4;
+    uint32_t count = 0;
+    uint32_t cluster = first_cluster;
+    uint8_t *buffer = malloc((size_t) capacity * cluster_bytes);
+    uint32_t *numbers = malloc(capacity * sizeof (uint32_t));
+
+    assert(buffer != NULL && numbers != NULL);
+
+    if(data_length > 0){
+        max_clusters = (data_length + cluster_bytes - 1) / cluster_bytes;
+    }
+
+    while(count < max_clusters && isValidCluster(volume, cluster)){
+        if(count == capacity){
+            capacity *= 2;
+            buffer = realloc(buffer, (size_t) capacity * cluster_bytes);
+            numbers = realloc(numbers, capacity * sizeof (uint32_t));
+            assert(buffer != NULL && numbers != NULL);
+        }
+        if(readBytesAs(volume_fd, buffer + (size_t) count * cluster_bytes, cluster_bytes,
+                       clusterOffset(volume, cluster), TRACE_DIRECTORY) != (ssize_t) cluster_bytes){
+            break;
+        }
+        numbers[count++] = cluster;
+
+        if((general_flags & FLAG_NO_FAT_CHAIN) != 0){
+            cluster++;
+        }
+        else {
+            cluster = readFatEntry(volume_fd, volume, fat, cluster);
+        }
+    }
+
+    if(count == 0){
+        free(buffer);
+        free(numbers);
+        buffer = NULL;
+        numbers = NULL;
+    }
+    if(clusters != NULL){
+        *clusters = numbers;
+    }
+    else {
+        free(numbers);
+    }
+    *cluster_total = count;
+    return buffer;
+}
+
+#ifdef HAVE_GATHER_SCAN
+/* Compares the type byte of 8 entries per step, gathering one dword from each 32 byte entry */
+__attribute__((target("avx2")))
+static uint32_t findEntriesGather(const uint8_t *entries, uint32_t entry_count, uint8_t type, uint32_t *matches){
+
+    const __m256i offsets = _mm256_setr_epi32(0, 32, 64, 96, 128, 160, 192, 224);
+    const __m256i type_mask = _mm256_set1_epi32(0xff);
+    const __m256i wanted = _mm256_set1_epi32(type);
+    uint32_t found = 0;
+    uint32_t i = 0;
+    __m256i types;
+    unsigned int mask;
+
+    for(; i + 8 <= entry_count; i += 8){
+        types = _mm256_i32gather_epi32((const int *) (entries + (size_t) i * ENTRY_SIZE), offsets, 1);
+        types = _mm256_cmpeq_epi32(_mm256_and_si256(types, type_mask), wanted);
+        mask = (unsigned int) _mm256_movemask_ps(_mm256_castsi256_ps(types));
+
+        while(mask != 0){
+            matches[found++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    for(; i < entry_count; i++){
+        if(entries[(size_t) i * ENTRY_SIZE] == type){
+            matches[found++] = i;
+        }
+    }
+    return found;
+}
+#endif
+
+/*------------------------------------------------------
+// findEntries
+//
+// PURPOSE: Finds every entry of a given type in a buffer of
+// directory entries.  When the CPU supports AVX2 the type
+// bytes of 8 entries are compared at once.
+// INPUT PARAMETERS:
+//     Takes in a buffer of 32 byte directory entries, the
+// number of entries, the entry type to look for and an
+// array of at least entry_count indexes to fill.
+// OUTPUT PARAMETERS:
+//     Returns the number of matching entry indexes written.
+//------------------------------------------------------*/
+uint32_t findEntries(const uint8_t *entries, uint32_t entry_count, uint8_t type, uint32_t *matches){
+
+    uint32_t found = 0;
+
+#ifdef HAVE_GATHER_SCAN
+    if(__builtin_cpu_supports("avx2")){
+        return findEntriesGather(entries, entry_count, type, matches);
+    }
+#endif
+    for(uint32_t i = 0; i < entry_count; i++){
+        if(entries[(size_t) i * ENTRY_SIZE] == type){
+            matches[found++] = i;
+        }
+    }
+    return found;
+}
+
+/*------------------------------------------------------
+// parseEntrySet
+//
+// PURPOSE: Parses the entry set that starts at a given
+// index of an in-memory buffer of directory entries.
+// INPUT PARAMETERS:
+//     Takes in the buffer of entries and its length in
+// entries, the index of the file entry, the walk options
+// (WALK_DELETED to parse a deleted set) and the entry to
+// fill.  entry_cluster is left 0 and entry_index holds the
+// index within the buffer.
+// OUTPUT PARAMETERS:
+//     Returns the number of entries the set used, or 0 if
+// no complete entry set starts at the index.
+//------------------------------------------------------*/
+uint32_t parseEntrySet(const uint8_t *entries, uint32_t entry_count, uint32_t index, int options,
+                       DirectoryEntry *entry){
+
+    EntrySetParser parser;
+    uint32_t i = index;
+
+    parser.in_set = 0;
+    parser.filter = NULL;
+    parseEntry(&parser, entries + (size_t) i * ENTRY_SIZE, 0, index, options);
+
+    for(i++; parser.in_set && i < entry_count; i++){
+        if(parseEntry(&parser, entries + (size_t) i * ENTRY_SIZE, 0, index, options)){
+            memcpy(entry, &parser.entry, sizeof (DirectoryEntry));
+            return i - index + 1;
+        }
+    }
+    return 0;
+}
+
+/*------------------------------------------------------
+// walkDirectory
+//
+// PURPOSE: Reads every cluster of a directory and calls
+// the callback once for each entry set found, in on-disk
+// order.  The walk stops at the end of directory marker,
+// when the directory's clusters run out or when the
+// callback returns WALK_STOP.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct, the in-memory FAT
+// (may be NULL), the first cluster, DataLength (0 when
+// unknown, as for the root directory) and the stream
+// extension flags of the directory, the walk options and
+// the callback with its context.
+// OUTPUT PARAMETERS:
+//     Returns 0 when the whole directory was read,
+// WALK_STOP if the callback stopped the walk, or -1 if a
+// cluster could not be read.
+//------------------------------------------------------*/
+int walkDirectory(int volume_fd, exfat *volume, const uint32_t *fat, uint32_t first_cluster,
+                  uint64_t data_length, uint8_t general_flags, int options,
+                  EntryCallback callback, void *context){
+
+    return walkDirectoryFiltered(volume_fd, volume, fat, first_cluster, data_length, general_flags,
+                                 options, NULL, callback, context);
+}
+
+/*------------------------------------------------------
+// walkDirectoryFiltered
+//
+// PURPOSE: Same as walkDirectory, but the filter is called
+// with the fields of the file and stream extension entries
+// as soon as they are parsed.  When the filter returns
+// anything but WALK_CONTINUE the name entries of the set
+// are skipped and the callback is not called for it.
+// INPUT PARAMETERS:
+//     Takes in the walkDirectory parameters along with the
+// filter, which receives the same context as the callback.
+// OUTPUT PARAMETERS:
+//     Returns the same values as walkDirectory.
+//------------------------------------------------------*/
+int walkDirectoryFiltered(int volume_fd, exfat *volume, const uint32_t *fat, uint32_t first_cluster,
+                          uint64_t data_length, uint8_t general_flags, int options,
+                          EntryCallback filter, EntryCallback callback, void *context){
+
+    DirectoryIterator *iterator;
+    DirectoryEntry *entry;
+    int status;
+    int result = 0;
+
+    assert(callback != NULL);
+
+    iterator = openDirectoryIterator(volume_fd, volume, fat, first_cluster, data_length, general_flags, options,
+                                     filter, context);
+    while((status = nextDirectoryEntry(iterator, &entry)) == 1){
+        if(callback(entry, context) == WALK_STOP){
+            result = WALK_STOP;
+            break;
+        }
+    }
+    if(status < 0){
+        result = -1;
+    }
+
+    closeDirectoryIterator(iterator);
+    return result;
+}
+
+/*------------------------------------------------------
+// openDirectoryIterator
+//
+// PURPOSE: Starts reading the entry sets of a directory
+// one at a time.  Clusters are read only as the entries
+// in them are asked for, so the first entries of a huge
+// directory cost no more than those of a small one.
+// INPUT PARAMETERS:
+//     Takes in the walkDirectoryFiltered parameters, less
+// the callback: the filter (may be NULL) is called with
+// filter_context.
+// OUTPUT PARAMETERS:
+//     Returns the iterator, closed with
+// closeDirectoryIterator.
+//------------------------------------------------------*/
+DirectoryIterator *openDirectoryIterator(int volume_fd, exfat *volume, const uint32_t *fat, uint32_t first_cluster,
+                                         uint64_t data_length, uint8_t general_flags, int options,
+                                         EntryCallback filter, void *filter_context){
+
+    uint32_t cluster_bytes = clusterBytes(volume);
+    DirectoryIterator *iterator = malloc(sizeof (DirectoryIterator) + cluster_bytes);
+
+    assert(iterator != NULL);
+    iterator->volume_fd = volume_fd;
+    iterator->volume = volume;
+    iterator->fat = fat;
+    iterator->first_cluster = first_cluster;
+    iterator->general_flags = general_flags;
+    iterator->options = options;
+    iterator->entries_per_cluster = cluster_bytes / ENTRY_SIZE;
+    iterator->max_clusters = data_length > 0 ? (data_length + cluster_bytes - 1) / cluster_bytes : volume->cluster_count;
+
+    iterator->cluster = first_cluster;
+    iterator->cluster_index = 0;
+    iterator->entry_index = 0;
+    iterator->loaded = 0;
+    iterator->done = 0;
+
+    iterator->parser.in_set = 0;
+    iterator->parser.filter = filter;
+    iterator->parser.filter_context = filter_context;
+    iterator->buffer = (uint8_t *) (iterator + 1);
+    return iterator;
+}
+
+void closeDirectoryIterator(DirectoryIterator *iterator){
+
+    free(iterator);
+}
+
+/*------------------------------------------------------
+// nextDirectoryEntry
+//
+// PURPOSE: Moves on to the next entry set of a directory.
+// INPUT PARAMETERS:
+//     Takes in the iterator and a pointer that receives
+// the entry, which stays valid until the next call.
+// OUTPUT PARAMETERS:
+//     Returns 1 for an entry, 0 at the end of the
+// directory, or -1 if a cluster could not be read.
+//------------------------------------------------------*/
+int nextDirectoryEntry(DirectoryIterator *iterator, DirectoryEntry **entry){
+
+    exfat *volume = iterator->volume;
+    uint32_t cluster_bytes = clusterBytes(volume);
+    const uint8_t *raw;
+    uint32_t index;
+
+    while(!iterator->done){
+        if(iterator->entry_index == iterator->entries_per_cluster){
+            iterator->cluster_index++;
+            iterator->entry_index = 0;
+            iterator->loaded = 0;
+            if(iterator->cluster_index >= iterator->max_clusters){
+                break;
+            }
+            if((iterator->general_flags & FLAG_NO_FAT_CHAIN) != 0){
+                iterator->cluster++;
+            }
+            else {
+                iterator->cluster = readFatEntry(iterator->volume_fd, volume, iterator->fat, iterator->cluster);
+            }
+        }
+        if(iterator->cluster_index >= iterator->max_clusters || !isValidCluster(volume, iterator->cluster)){
+            break;
+        }
+
+        if(!iterator->loaded){
+            if(readBytesAs(iterator->volume_fd, iterator->buffer, cluster_bytes, clusterOffset(volume, iterator->cluster),
+                           TRACE_DIRECTORY) != (ssize_t) cluster_bytes){
+                iterator->done = 1;
+                return -1;
+            }
+            iterator->loaded = 1;
+        }
+
+        index = iterator->entry_index++;
+        raw = iterator->buffer + index * ENTRY_SIZE;
+        if(raw[0] == ENTRY_TYPE_END_OF_DIRECTORY){
+            break;
+        }
+        if(parseEntry(&iterator->parser, raw, iterator->cluster, index, iterator->options)){
+            *entry = &iterator->parser.entry;
+            return 1;
+        }
+    }
+
+    iterator->done = 1;
+    return 0;
+}
+
+/* Tells where the next entry set will be looked for, after the one returned last */
+void directoryPosition(const DirectoryIterator *iterator, DirectoryPosition *position){
+
+    position->directory = iterator->first_cluster;
+    position->cluster_index = iterator->cluster_index;
+    position->cluster = iterator->cluster;
+    position->entry_index = iterator->entry_index;
+    position->done = iterator->done;
+}
+
+/*------------------------------------------------------
+// seekDirectory
+//
+// PURPOSE: Moves an iterator to a position taken earlier
+// with directoryPosition, possibly by another run.  The
+// position's cluster is checked by following the chain
+// from the first cluster through the FAT, so no cluster
+// of the directory before the position is read again.
+// INPUT PARAMETERS:
+//     Takes in the iterator and the position.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 if the position does not
+// belong to this directory or lies outside it.
+//------------------------------------------------------*/
+int seekDirectory(DirectoryIterator *iterator, const DirectoryPosition *position){
+
+    uint32_t cluster = iterator->first_cluster;
+
+    if(position->directory != iterator->first_cluster || position->cluster_index >= iterator->max_clusters ||
+       position->entry_index > iterator->entries_per_cluster || !isValidCluster(iterator->volume, position->cluster)){
+        return -1;
+    }
+
+    /* A cursor naming any other cluster would list entries of a directory it does not belong to */
+    if((iterator->general_flags & FLAG_NO_FAT_CHAIN) != 0){
+        cluster += (uint32_t) position->cluster_index;
+    }
+    else {
+        for(uint64_t i = 0; i < position->cluster_index && isValidCluster(iterator->volume, cluster); i++){
+            cluster = readFatEntry(iterator->volume_fd, iterator->volume, iterator->fat, cluster);
+        }
+    }
+    if(cluster != position->cluster){
+        return -1;
+    }
+    iterator->cluster = position->cluster;
+    iterator->cluster_index = position->cluster_index;
+    iterator->entry_index = position->entry_index;
+    iterator->loaded = 0;
+    iterator->done = position->done;
+    iterator->parser.in_set = 0;
+    return 0;
+}
+
+static int walkTreeEntry(DirectoryEntry *entry, void *context){
+
+    TreeWalk *walk = context;
+    TreeWalk child;
+    char *name = entryName(entry);
+    char *path;
+    int result;
+
+    assert(name != NULL);
+    path = malloc(strlen(walk->path) + strlen(name) + 2);
+    assert(path != NULL);
+    sprintf(path, "%s/%s", walk->path, name);
+    free(name);
+
+    result = walk->callback(path, entry, walk->context);
+
+    if(result == WALK_STOP){
+        walk->stopped = 1;
+    }
+    else if(result != WALK_SKIP && isDirectory(entry) && walk->depth < MAX_TREE_DEPTH){
+        child = *walk;
+        child.path = path;
+        child.depth = walk->depth + 1;
+
+        walkDirectory(walk->volume_fd, walk->volume, walk->fat, entry->first_cluster,
+                      entry->data_length, entry->general_flags, 0, walkTreeEntry, &child);
+        walk->stopped = child.stopped;
+    }
+
+    free(path);
+    return walk->stopped ? WALK_STOP : WALK_CONTINUE;
+}
+
+/*------------------------------------------------------
+// walkTree
+//
+// PURPOSE: Walks a directory and all of its subdirectories
+// depth first, calling the callback with the full path of
+// every entry before descending into it.  A callback may
+// return WALK_SKIP to leave a directory unvisited or
+// WALK_STOP to end the walk.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct, the in-memory FAT
+// (may be NULL), the path of the starting directory ("" for
+// the root), its first cluster, DataLength and stream
+// extension flags, and the callback with its context.
+// OUTPUT PARAMETERS:
+//     Returns WALK_STOP if the callback stopped the walk,
+// otherwise 0.
+//------------------------------------------------------*/
+int walkTree(int volume_fd, exfat *volume, const uint32_t *fat, const char *path, uint32_t first_cluster,
+             uint64_t data_length, uint8_t general_flags, TreeCallback callback, void *context){
+
+    TreeWalk walk;
+
+    walk.volume_fd = volume_fd;
+    walk.volume = volume;
+    walk.fat = fat;
+    walk.path = path;
+    walk.depth = 0;
+    walk.callback = callback;
+    walk.context = context;
+    walk.stopped = 0;
+
+    walkDirectory(volume_fd, volume, fat, first_cluster, data_length, general_flags, 0, walkTreeEntry, &walk);
+
+    return walk.stopped ? WALK_STOP : 0;
+}
+
+typedef struct PathLookup {
+
+    const char *name;
+    uint16_t hash;
+    uint8_t length;
+    DirectoryEntry *found;
+
+} PathLookup ;
+
+/* Compares the stored hash and length first so other names are never copied or decoded */
+static int matchNameHash(DirectoryEntry *entry, void *context){
+
+    PathLookup *lookup = context;
+
+    if(entry->name_hash != lookup->hash || entry->name_length != lookup->length){
+        return WALK_SKIP;
+    }
+    return WALK_CONTINUE;
+}
+
+static int matchName(DirectoryEntry *entry, void *context){
+
+    PathLookup *lookup = context;
+    char *name = entryName(entry);
+    int result = WALK_CONTINUE;
+
+    if(name != NULL && strcasecmp(name, lookup->name) == 0){
+        memcpy(lookup->found, entry, sizeof (DirectoryEntry));
+        lookup->name = NULL;
+        result = WALK_STOP;
+    }
+    free(name);
+    return result;
+}
+
+/* Describes the root directory as a DirectoryEntry, it has no entry set of its own */
+void rootEntry(exfat *volume, DirectoryEntry *entry){
+
+    memset(entry, 0, sizeof (DirectoryEntry));
+    entry->entry_type = ENTRY_TYPE_FILE;
+    entry->file_attributes = ATTRIBUTE_DIRECTORY;
+    entry->first_cluster = volume->root_cluster;
+}
+
+/*------------------------------------------------------
+// resolvePath
+//
+// PURPOSE: Finds the entry set of a path such as
+// "/text/numbers/1.txt", one directory at a time.  Names
+// are compared without regard to case, as exFAT does.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct, the in-memory FAT
+// (may be NULL), the path and the entry to fill.  "/" or
+// "" resolve to the root directory.  The dentry cache
+// answers instead when it is open.
+// OUTPUT PARAMETERS:
+//     Returns 0 if the path was found, -1 otherwise.
+//------------------------------------------------------*/
+int resolvePath(int volume_fd, exfat *volume, const uint32_t *fat, const char *path, DirectoryEntry *entry){
+
+    PathLookup lookup;
+    DirectoryEntry directory;
+    char *copy;
+    char *component;
+    char *save = NULL;
+    int result = 0;
+
+    if(dentryCaching()){
+        return dentryResolve(volume_fd, volume, fat, path, entry);
+    }
+
+    copy = strdup(path);
+    assert(copy != NULL);
+    rootEntry(volume, entry);
+
+    for(component = strtok_r(copy, "/", &save); component != NULL && result == 0;
+        component = strtok_r(NULL, "/", &save)){
+
+        if(strcmp(component, ".") == 0){
+            continue;
+        }
+        if(!isDirectory(entry) || strlen(component) > MAX_NAME_LENGTH){
+            result = -1;
+            break;
+        }
+
+        directory = *entry;
+        lookup.name = component;
+        lookup.hash = nameHash(component);
+        lookup.length = (uint8_t) strlen(component);
+        lookup.found = entry;
+
+        walkDirectoryFiltered(volume_fd, volume, fat, directory.first_cluster, directory.data_length,
+                              directory.general_flags, 0, matchNameHash, matchName, &lookup);
+        if(lookup.name != NULL){
+            result = -1;
+        }
+    }
+
+    free(copy);
+    return result;
+}
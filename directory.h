@@ -0,0 +1,121 @@
+//
+// Parsing of directory entry sets and walks over directories and trees.
+//
+
+#ifndef FSREADER_DIRECTORY_H
+#define FSREADER_DIRECTORY_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "exfat.h"
+
+#define MAX_NAME_LENGTH 255
+#define NAME_CHARACTERS_PER_ENTRY 15
+#define MAX_TREE_DEPTH 128
+
+/* Callback results */
+#define WALK_CONTINUE 0
+#define WALK_SKIP 1     /* tree walks only: do not descend into this directory */
+#define WALK_STOP 2
+
+/* walk options */
+#define WALK_DELETED 0x01   /* report entry sets whose InUse bit is clear instead of live ones */
+
+/* A file entry set (0x85 + 0xC0 + 0xC1...) as one record */
+typedef struct DirectoryEntry {
+
+    uint8_t  entry_type;        /* 0x85, or 0x05 once deleted */
+    uint8_t  secondary_count;
+    uint16_t set_checksum;
+    uint16_t file_attributes;
+
+    uint32_t create_timestamp;
+    uint32_t modify_timestamp;
+    uint32_t access_timestamp;
+    uint8_t  create_10ms;
+    uint8_t  modify_10ms;
+    uint8_t  create_utc_offset;
+    uint8_t  modify_utc_offset;
+    uint8_t  access_utc_offset;
+
+    uint8_t  general_flags;
+    uint8_t  name_length;
+    uint16_t name_hash;
+    uint64_t valid_data_length;
+    uint32_t first_cluster;
+    uint64_t data_length;
+
+    /* where the file entry was found */
+    uint32_t entry_cluster;
+    uint32_t entry_index;
+
+    uint16_t unicode_name[MAX_NAME_LENGTH + 1];
+
+} DirectoryEntry ;
+
+/* Where a DirectoryIterator stands, enough to resume it without the clusters before */
+typedef struct DirectoryPosition {
+
+    uint32_t directory;         /* first cluster of the directory */
+    uint64_t cluster_index;     /* of the cluster within the directory */
+    uint32_t cluster;
+    uint32_t entry_index;       /* of the next entry within the cluster */
+    int done;
+
+} DirectoryPosition ;
+
+typedef struct DirectoryIterator DirectoryIterator;
+
+typedef int (*EntryCallback)(DirectoryEntry *entry, void *context);
+
+typedef int (*TreeCallback)(const char *path, DirectoryEntry *entry, void *context);
+
+
+int isDirectory(const DirectoryEntry *entry);
+
+uint16_t nameHash(const char *name);
+
+time_t entryTime(uint32_t timestamp, uint8_t utc_offset);
+
+int64_t entryTicks(uint32_t timestamp, uint8_t increment_10ms, uint8_t utc_offset);
+
+void rootEntry(exfat *volume, DirectoryEntry *entry);
+
+int resolvePath(int volume_fd, exfat *volume, const uint32_t *fat, const char *path, DirectoryEntry *entry);
+
+char *entryName(DirectoryEntry *entry);
+
+uint8_t *readDirectory(int volume_fd, exfat *volume, const uint32_t *fat, uint32_t first_cluster,
+                       uint64_t data_length, uint8_t general_flags, uint32_t **clusters, uint32_t *cluster_total);
+
+uint32_t findEntries(const uint8_t *entries, uint32_t entry_count, uint8_t type, uint32_t *matches);
+
+uint32_t parseEntrySet(const uint8_t *entries, uint32_t entry_count, uint32_t index, int options,
+                       DirectoryEntry *entry);
+
+int walkDirectory(int volume_fd, exfat *volume, const uint32_t *fat, uint32_t first_cluster,
+                  uint64_t data_length, uint8_t general_flags, int options,
+                  EntryCallback callback, void *context);
+
+int walkDirectoryFiltered(int volume_fd, exfat *volume, const uint32_t *fat, uint32_t first_cluster,
+                          uint64_t data_length, uint8_t general_flags, int options,
+                          EntryCallback filter, EntryCallback callback, void *context);
+
+DirectoryIterator *openDirectoryIterator(int volume_fd, exfat *volume, const uint32_t *fat, uint32_t first_cluster,
+                                         uint64_t data_length, uint8_t general_flags, int options,
+                                         EntryCallback filter, void *filter_context);
+
+void closeDirectoryIterator(DirectoryIterator *iterator);
+
+int nextDirectoryEntry(DirectoryIterator *iterator, DirectoryEntry **entry);
+
+void directoryPosition(const DirectoryIterator *iterator, DirectoryPosition *position);
+
+int seekDirectory(DirectoryIterator *iterator, const DirectoryPosition *position);
+
+int walkTree(int volume_fd, exfat *volume, const uint32_t *fat, const char *path, uint32_t first_cluster,
+             uint64_t data_length, uint8_t general_flags, TreeCallback callback, void *context);
+
+
+#endif //FSREADER_DIRECTORY_H
@@ -0,0 +1,480 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Implement the "du" command.  Sizes come only
+// from the DataLength of the stream extension entries,
+// rounded up to whole clusters for the allocated size,
+// so no FAT chain or file data is ever read.  Directories
+// are scanned in parallel from a work queue, each one
+// counts the subdirectories still running below it and
+// the last to finish adds the totals into its parent,
+// so the rollup happens bottom-up without a second pass.
+// The largest files are kept in a bounded min heap.
+// A directory whose first cluster was already scanned,
+// or that lies MAX_TREE_DEPTH below the root, is not
+// scanned again, so a looped tree still ends.  Under a
+// memory ceiling no more directories are queued once
+// their nodes would outgrow their share, and the report
+// is marked partial.
+//-----------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "du.h"
+#include "bitset.h"
+#include "directory.h"
+#include "workqueue.h"
+#include "memory.h"
+
+#define DEFAULT_TOP_FILES 10
+
+typedef struct DuDirectory {
+
+    struct DuDirectory *parent;
+    struct DuDirectory *next;       /* every directory, for the report */
+    char *path;
+    unsigned int depth;
+
+    /* Totals of the whole subtree once pending reaches 0 */
+    uint64_t logical_bytes;
+    uint64_t allocated_bytes;
+    uint64_t file_count;
+
+    /* Own scan plus the subdirectories that have not finished */
+    unsigned int pending;
+
+    DirectoryEntry entry;
+
+} DuDirectory ;
+
+typedef struct DuFile {
+
+    uint64_t logical_bytes;
+    uint64_t allocated_bytes;
+    char *path;
+
+} DuFile ;
+
+typedef struct DuScan {
+
+    int volume_fd;
+    exfat *volume;
+    uint64_t cluster_size;
+
+    DuDirectory *directories;
+    Bitset *visited;        /* first clusters of the directories already queued */
+    uint64_t directory_bytes;   /* held by the nodes and paths of the directories */
+    unsigned long directory_count;
+    int truncated;          /* a directory was left out to stay under the memory ceiling */
+
+    /* Min heap of the largest files, floor is its smallest size once full */
+    DuFile *top;
+    unsigned int top_count;
+    unsigned int top_capacity;
+    uint64_t top_floor;
+    int top_full;
+
+    pthread_mutex_t lock;
+
+} DuScan ;
+
+/* Context of one directory walk */
+typedef struct DuWalk {
+
+    DuScan *scan;
+    WorkQueue *queue;
+    DuDirectory *directory;
+
+    uint64_t logical_bytes;
+    uint64_t allocated_bytes;
+    uint64_t file_count;
+
+} DuWalk ;
+
+static uint64_t allocatedBytes(const DuScan *scan, uint64_t data_length){
+
+    return (data_length + scan->cluster_size - 1) / scan->cluster_size * scan->cluster_size;
+}
+
+static DuDirectory *createDuDirectory(DuScan *scan, DuDirectory *parent, const char *path, DirectoryEntry *entry){
+
+    DuDirectory *directory = calloc(1, sizeof (DuDirectory));
+
+    assert(directory != NULL);
+    __atomic_add_fetch(&scan->directory_count, 1, __ATOMIC_RELAXED);
+    directory->parent = parent;
+    directory->path = strdup(path);
+    directory->depth = parent == NULL ? 0 : parent->depth + 1;
+    directory->pending = 1;
+    directory->entry = *entry;
+
+    /* The clusters holding the directory's own entries */
+    directory->allocated_bytes = allocatedBytes(scan, entry->data_length);
+
+    if(parent != NULL){
+        __atomic_add_fetch(&parent->pending, 1, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&scan->lock);
+    directory->next = scan->directories;
+    scan->directories = directory;
+    pthread_mutex_unlock(&scan->lock);
+
+    return directory;
+}
+
+/*------------------------------------------------------
+// finishDirectory
+//
+// PURPOSE: Drops one pending count of a directory.  The
+// caller that drops the last count owns the final
+// totals and adds them to the parent, moving up the tree
+// until a directory still has work running below it.
+// INPUT PARAMETERS:
+//    Takes in the directory whose scan or subdirectory
+// has finished.
+//------------------------------------------------------*/
+static void finishDirectory(DuDirectory *directory){
+
+    DuDirectory *parent;
+
+    while(directory != NULL && __atomic_sub_fetch(&directory->pending, 1, __ATOMIC_ACQ_REL) == 0){
+        parent = directory->parent;
+        if(parent != NULL){
+            __atomic_add_fetch(&parent->logical_bytes, directory->logical_bytes, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&parent->allocated_bytes, directory->allocated_bytes, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&parent->file_count, directory->file_count, __ATOMIC_RELAXED);
+        }
+        directory = parent;
+    }
+}
+
+static void siftDown(DuFile *heap, unsigned int count, unsigned int index){
+
+    unsigned int child;
+    DuFile swap;
+
+    while((child = 2 * index + 1) < count){
+        if(child + 1 < count && heap[child + 1].logical_bytes < heap[child].logical_bytes){
+            child++;
+        }
+        if(heap[index].logical_bytes <= heap[child].logical_bytes){
+            break;
+        }
+        swap = heap[index];
+        heap[index] = heap[child];
+        heap[child] = swap;
+        index = child;
+    }
+}
+
+static void siftUp(DuFile *heap, unsigned int index){
+
+    unsigned int parent;
+    DuFile swap;
+
+    while(index > 0){
+        parent = (index - 1) / 2;
+        if(heap[parent].logical_bytes <= heap[index].logical_bytes){
+            break;
+        }
+        swap = heap[index];
+        heap[index] = heap[parent];
+        heap[parent] = swap;
+        index = parent;
+    }
+}
+
+/* Only files above the floor of a full heap can enter it, checked without the lock first */
+static int isTopCandidate(DuScan *scan, uint64_t logical_bytes){
+
+    return scan->top_capacity > 0 &&
+           (!__atomic_load_n(&scan->top_full, __ATOMIC_RELAXED) ||
+            logical_bytes > __atomic_load_n(&scan->top_floor, __ATOMIC_RELAXED));
+}
+
+static void addTopFile(DuScan *scan, const char *path, uint64_t logical_bytes){
+
+    pthread_mutex_lock(&scan->lock);
+
+    if(scan->top_count < scan->top_capacity){
+        scan->top[scan->top_count].logical_bytes = logical_bytes;
+        scan->top[scan->top_count].allocated_bytes = allocatedBytes(scan, logical_bytes);
+        scan->top[scan->top_count].path = strdup(path);
+        siftUp(scan->top, scan->top_count);
+        scan->top_count++;
+    }
+    else if(logical_bytes > scan->top[0].logical_bytes){
+        free(scan->top[0].path);
+        scan->top[0].logical_bytes = logical_bytes;
+        scan->top[0].allocated_bytes = allocatedBytes(scan, logical_bytes);
+        scan->top[0].path = strdup(path);
+        siftDown(scan->top, scan->top_count, 0);
+    }
+
+    if(scan->top_count == scan->top_capacity){
+        __atomic_store_n(&scan->top_floor, scan->top[0].logical_bytes, __ATOMIC_RELAXED);
+        __atomic_store_n(&scan->top_full, 1, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&scan->lock);
+}
+
+/* Files are counted here, only directories and heap candidates need their names decoded */
+static int filterEntry(DirectoryEntry *entry, void *context){
+
+    DuWalk *walk = context;
+
+    if(isDirectory(entry)){
+        return WALK_CONTINUE;
+    }
+
+    walk->logical_bytes += entry->data_length;
+    walk->allocated_bytes += allocatedBytes(walk->scan, entry->data_length);
+    walk->file_count++;
+
+    return isTopCandidate(walk->scan, entry->data_length) ? WALK_CONTINUE : WALK_SKIP;
+}
+
+/* Reserves the memory of one more directory node, the report also holds a pointer to each */
+static int reserveDirectory(DuScan *scan, const char *path){
+
+    uint64_t bytes = sizeof (DuDirectory) + sizeof (DuDirectory *) + strlen(path) + 1;
+
+    if(!fitsMemory(__atomic_add_fetch(&scan->directory_bytes, bytes, __ATOMIC_RELAXED))){
+        __atomic_sub_fetch(&scan->directory_bytes, bytes, __ATOMIC_RELAXED);
+        __atomic_store_n(&scan->truncated, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+static int visitEntry(DirectoryEntry *entry, void *context){
+
+    DuWalk *walk = context;
+    char *name = entryName(entry);
+    char *path;
+
+    assert(name != NULL);
+    path = malloc(strlen(walk->directory->path) + strlen(name) + 2);
+    assert(path != NULL);
+    sprintf(path, "%s/%s", walk->directory->path, name);
+
+    if(isDirectory(entry)){
+        /* A directory already queued, or too deep, would loop forever */
+        if(walk->directory->depth < MAX_TREE_DEPTH && isValidCluster(walk->scan->volume, entry->first_cluster) &&
+           !testAndSetBit(walk->scan->visited, entry->first_cluster - FIRST_DATA_CLUSTER) &&
+           reserveDirectory(walk->scan, path)){
+            pushWork(walk->queue, createDuDirectory(walk->scan, walk->directory, path, entry));
+        }
+    }
+    else {
+        addTopFile(walk->scan, path, entry->data_length);
+    }
+
+    free(path);
+    free(name);
+    return WALK_CONTINUE;
+}
+
+static void scanDirectory(void *item, WorkQueue *queue, void *context){
+
+    DuWalk walk;
+    DuDirectory *directory = item;
+
+    memset(&walk, 0, sizeof (DuWalk));
+    walk.scan = context;
+    walk.queue = queue;
+    walk.directory = directory;
+
+    walkDirectoryFiltered(walk.scan->volume_fd, walk.scan->volume, NULL, directory->entry.first_cluster,
+                          directory->entry.data_length, directory->entry.general_flags, 0,
+                          filterEntry, visitEntry, &walk);
+
+    __atomic_add_fetch(&directory->logical_bytes, walk.logical_bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&directory->allocated_bytes, walk.allocated_bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&directory->file_count, walk.file_count, __ATOMIC_RELAXED);
+
+    finishDirectory(directory);
+}
+
+static int comparePaths(const void *a, const void *b){
+
+    const DuDirectory *first = *(DuDirectory * const *) a;
+    const DuDirectory *second = *(DuDirectory * const *) b;
+
+    return strcmp(first->path, second->path);
+}
+
+static int compareFileSizes(const void *a, const void *b){
+
+    const DuFile *first = a;
+    const DuFile *second = b;
+
+    if(first->logical_bytes != second->logical_bytes){
+        return first->logical_bytes < second->logical_bytes ? 1 : -1;
+    }
+    return strcmp(first->path, second->path);
+}
+
+static int parseCount(const char *option, const char *value, long *count){
+
+    char *end;
+
+    if(value == NULL){
+        printf("Missing value for '%s'\n", option);
+        return -1;
+    }
+    *count = strtol(value, &end, 10);
+    if(end == value || *end != '\0' || *count < 0){
+        printf("Invalid value for '%s': '%s'\n", option, value);
+        return -1;
+    }
+    return 0;
+}
+
+static void printReport(DuScan *scan, long max_depth){
+
+    DuDirectory **sorted;
+    unsigned long count = 0;
+    unsigned long i = 0;
+
+    for(DuDirectory *directory = scan->directories; directory != NULL; directory = directory->next){
+        count++;
+    }
+    sorted = malloc(count * sizeof (DuDirectory *));
+    assert(sorted != NULL);
+    for(DuDirectory *directory = scan->directories; directory != NULL; directory = directory->next){
+        sorted[i++] = directory;
+    }
+    qsort(sorted, count, sizeof (DuDirectory *), comparePaths);
+
+    printf("%15s %15s %15s %10s  %s\n", "Logical", "Allocated", "Slack", "Files", "Path");
+    for(i = 0; i < count; i++){
+        if(max_depth >= 0 && (long) sorted[i]->depth > max_depth){
+            continue;
+        }
+        printf("%15llu %15llu %15llu %10llu  %s\n", (unsigned long long) sorted[i]->logical_bytes,
+               (unsigned long long) sorted[i]->allocated_bytes,
+               (unsigned long long) (sorted[i]->allocated_bytes - sorted[i]->logical_bytes),
+               (unsigned long long) sorted[i]->file_count, sorted[i]->path[0] == '\0' ? "/" : sorted[i]->path);
+    }
+
+    if(scan->top_count > 0){
+        qsort(scan->top, scan->top_count, sizeof (DuFile), compareFileSizes);
+        printf("\nLargest %u file(s):\n", scan->top_count);
+        for(i = 0; i < scan->top_count; i++){
+            printf("%15llu %15llu  %s\n", (unsigned long long) scan->top[i].logical_bytes,
+                   (unsigned long long) scan->top[i].allocated_bytes, scan->top[i].path);
+        }
+    }
+
+    free(sorted);
+}
+
+/*------------------------------------------------------
+// commandDu
+//
+// PURPOSE: Runs "du [root] [--depth N] [--top N]",
+// printing for every directory below root the logical
+// bytes of its files, the bytes allocated to them and to
+// the directories themselves in whole clusters, the slack
+// between the two and the file count, all rolled up over
+// the subtree.  The N largest files follow (default 10).
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct and the arguments
+// that follow the command.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 for a bad root or option.
+//------------------------------------------------------*/
+int commandDu(int volume_fd, exfat *volume, int argc, char *argv[]){
+
+    DuScan scan;
+    DirectoryEntry root;
+    WorkQueue *queue;
+    DuDirectory *directory;
+    const char *root_path = "/";
+    char *start;
+    long max_depth = -1;
+    long top_files = DEFAULT_TOP_FILES;
+    int status = 0;
+
+    for(int i = 0; i < argc && status == 0; i++){
+        if(strcmp(argv[i], "--depth") == 0){
+            status = parseCount(argv[i], i + 1 < argc ? argv[i + 1] : NULL, &max_depth);
+            i++;
+        }
+        else if(strcmp(argv[i], "--top") == 0){
+            status = parseCount(argv[i], i + 1 < argc ? argv[i + 1] : NULL, &top_files);
+            i++;
+        }
+        else if(i == 0){
+            root_path = argv[i];
+        }
+        else {
+            printf("Invalid du option: '%s'\n", argv[i]);
+            status = -1;
+        }
+    }
+    if(status != 0){
+        return -1;
+    }
+
+    if(resolvePath(volume_fd, volume, NULL, root_path, &root) != 0 || !isDirectory(&root)){
+        printf("No such directory: '%s'\n", root_path);
+        return -1;
+    }
+
+    memset(&scan, 0, sizeof (DuScan));
+    scan.volume_fd = volume_fd;
+    scan.volume = volume;
+    scan.cluster_size = clusterBytes(volume);
+    scan.top_capacity = (unsigned int) top_files;
+    scan.top = calloc(scan.top_capacity + 1, sizeof (DuFile));
+    assert(scan.top != NULL);
+    scan.visited = createBitset(volume->cluster_count);
+    assert(scan.visited != NULL);
+    pthread_mutex_init(&scan.lock, NULL);
+
+    /* Paths are printed as "/dir/name", the root itself as "/" */
+    start = malloc(strlen(root_path) + 2);
+    assert(start != NULL);
+    sprintf(start, "%s%s", root_path[0] == '/' ? "" : "/", root_path);
+    while(strlen(start) > 0 && start[strlen(start) - 1] == '/'){
+        start[strlen(start) - 1] = '\0';
+    }
+
+    if(isValidCluster(volume, root.first_cluster)){
+        setBit(scan.visited, root.first_cluster - FIRST_DATA_CLUSTER);
+    }
+    queue = createWorkQueue(scanDirectory, &scan);
+    pushWork(queue, createDuDirectory(&scan, NULL, start, &root));
+    runWorkQueue(queue);
+
+    printReport(&scan, max_depth);
+    if(scan.truncated){
+        printf("\nScanning more than %lu directories needs more memory than --max-memory allows, "
+               "the totals are partial\n", scan.directory_count);
+        status = -1;
+    }
+
+    destroyWorkQueue(queue);
+    while(scan.directories != NULL){
+        directory = scan.directories;
+        scan.directories = directory->next;
+        free(directory->path);
+        free(directory);
+    }
+    for(unsigned int i = 0; i < scan.top_count; i++){
+        free(scan.top[i].path);
+    }
+    free(scan.top);
+    destroyBitset(scan.visited);
+    free(start);
+    pthread_mutex_destroy(&scan.lock);
+    return status;
+}
@@ -0,0 +1,14 @@
+//
+// Per-directory space usage and the largest files of a tree.
+//
+
+#ifndef FSREADER_DU_H
+#define FSREADER_DU_H
+
+#include "exfat.h"
+
+
+int commandDu(int volume_fd, exfat *volume, int argc, char *argv[]);
+
+
+#endif //FSREADER_DU_H
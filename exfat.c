@@ -4,7 +4,10 @@
 //
 // REMARKS: Implement a File System reader
 // that supports the exfat file system. Implements
-// support for 3 commands, info, list, and get.
+// support for the info, list, and get commands,
+// along with a read-only consistency check and
+// recovery of deleted and carved files, and find
+// and du searches over the directory tree.
 //-----------------------------------------*/
 
 #include <stdio.h>
@@ -13,53 +16,34 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <errno.h>
 
 #include <string.h>
 #include <assert.h>
 
+#include "exfat.h"
 #include "list.h"
-
-#define KILOBYTE_SIZE 1024
-#define ENTRY_SIZE 32   /* Bytes */
-
-#pragma pack(push)
-#pragma pack(1)
-typedef struct EXFAT{
-
-    uint32_t fat_offset;
-    uint32_t fat_length;
-
-    uint32_t cluster_heap_offset;  /* in # of sectors */
-    uint32_t cluster_count;
-
-    uint32_t root_cluster;
-    uint32_t serial_number;
-
-    /* 0x1 << cluster_size == cluster size in bytes */
-    uint8_t sector_size;
-    uint8_t cluster_size;
-
-    uint8_t number_of_fats;
-
-    uint8_t  label_length;
-    uint16_t unicode_volume_label;
-    uint8_t  entry_type;
-
-    /* This is the index of the first cluster of the cluster chain
-     * as the FAT describes (Look at the corresponding entry in the FAT,
-     * to build the cluster chain) */
-    uint32_t first_bitmap_cluster;
-    uint64_t first_bitmap_cluster_data_length;
-
-    /* bitmap of free clusters */
-
-    /* uint8_t cluster size */
-
-    char *ascii_volume_label;
-    unsigned long free_space;
-
-}exfat;
-#pragma pack(pop)
+#include "fat.h"
+#include "check.h"
+#include "undelete.h"
+#include "carve.h"
+#include "find.h"
+#include "du.h"
+#include "listing.h"
+#include "file.h"
+#include "freespace.h"
+#include "diff.h"
+#include "tar.h"
+#include "trace.h"
+#include "cache.h"
+#include "dentry.h"
+#include "extents.h"
+#include "memory.h"
+#include "grep.h"
+#include "rescue.h"
+#include "runindex.h"
+#include "image.h"
+#include "replay.h"
 
 /*------------------------------------------------------
 // sectorsToBytes
@@ -101,6 +85,157 @@ int clustersToBytes(exfat *volume, int number_of_clusters){
     return ((0x1<< volume->sector_size)*(0x1 << volume->cluster_size) * number_of_clusters);
 }
 
+/* Size of one cluster in bytes */
+uint32_t clusterBytes(exfat *volume){
+
+    assert(volume != NULL);
+
+    return (uint32_t) 0x1 << (volume->sector_size + volume->cluster_size);
+}
+
+/*------------------------------------------------------
+// clusterOffset
+//
+// PURPOSE: Calculates the byte offset of a cluster in the
+// volume, this is the offset to the Cluster Heap plus the
+// offset of the cluster within the heap.
+// INPUT PARAMETERS:
+//    Takes in a pointer to an exfat volume struct and a
+// cluster number (2 is the first cluster of the heap).
+// OUTPUT PARAMETERS:
+//     Returns the 64 bit byte offset of the cluster.
+//------------------------------------------------------*/
+uint64_t clusterOffset(exfat *volume, uint32_t cluster){
+
+    assert(volume != NULL);
+
+    return ((uint64_t) volume->cluster_heap_offset << volume->sector_size) +
+           ((uint64_t) (cluster - FIRST_DATA_CLUSTER) << (volume->sector_size + volume->cluster_size));
+}
+
+/* A cluster number is valid when it lies in [2, cluster_count + 1] */
+int isValidCluster(exfat *volume, uint32_t cluster){
+
+    return cluster >= FIRST_DATA_CLUSTER && (uint64_t) cluster <= (uint64_t) volume->cluster_count + 1;
+}
+
+/*------------------------------------------------------
+// readBytes
+//
+// PURPOSE: Reads length bytes at an absolute offset of
+// the volume without moving the file offset, retrying
+// short reads until the request is complete.
+// INPUT PARAMETERS:
+//    Takes in a file descriptor to an exfat volume, the
+// buffer to fill, the number of bytes to read and the
+// byte offset to read from.
+// OUTPUT PARAMETERS:
+//     Returns the number of bytes read, which is less than
+// length at the end of the volume, or -1 on an I/O error.
+//------------------------------------------------------*/
+ssize_t readBytes(int volume_fd, void *buffer, size_t length, uint64_t offset){
+
+    size_t total = 0;
+    ssize_t bytes;
+    uint64_t start = tracing() ? traceClock() : 0;
+
+    while(total < length){
+        bytes = pread(volume_fd, (uint8_t *) buffer + total, length - total, (off_t) (offset + total));
+        if(bytes < 0 && errno == EINTR){
+            continue;
+        }
+        if(bytes < 0){
+            traceRead(offset, length, -1, start);
+            return -1;
+        }
+        if(bytes == 0){
+            break;
+        }
+        total += bytes;
+    }
+    traceRead(offset, length, (int64_t) total, start);
+    return (ssize_t) total;
+}
+
+/*------------------------------------------------------
+// readBytesAs
+//
+// PURPOSE: Reads like readBytes, charging the read to a
+// given source in the trace.  Reads of anything but file
+// data go through the block cache when it is open, unless
+// they are large enough to fill it with one use blocks.
+// INPUT PARAMETERS:
+//    Takes in the readBytes parameters along with the
+// TraceSource of the read.
+// OUTPUT PARAMETERS:
+//     Returns what readBytes returns.
+//------------------------------------------------------*/
+ssize_t readBytesAs(int volume_fd, void *buffer, size_t length, uint64_t offset, TraceSource source){
+
+    TraceSource previous = traceSource(source);
+    ssize_t bytes;
+
+    if(source != TRACE_DATA && length <= CACHE_BYPASS_SIZE && caching()){
+        bytes = cacheRead(volume_fd, buffer, length, offset, source);
+    }
+    else {
+        bytes = readBytes(volume_fd, buffer, length, offset);
+    }
+
+    traceSource(previous);
+    return bytes;
+}
+
+/*------------------------------------------------------
+// cursorSeek
+//
+// PURPOSE: Moves a cursor to an absolute byte offset of
+// the volume, as lseek with SEEK_SET did for the file
+// offset.
+// INPUT PARAMETERS:
+//     Takes in the cursor and the new offset.
+//------------------------------------------------------*/
+void cursorSeek(VolumeCursor *cursor, uint64_t offset){
+
+    assert(cursor != NULL);
+
+    cursor->offset = offset;
+}
+
+/* Moves a cursor forward, as lseek with SEEK_CUR did */
+void cursorSkip(VolumeCursor *cursor, uint64_t bytes){
+
+    assert(cursor != NULL);
+
+    cursor->offset += bytes;
+}
+
+/*------------------------------------------------------
+// cursorRead
+//
+// PURPOSE: Reads at a cursor's offset and moves it past
+// the bytes read, the positional replacement for read on
+// a shared descriptor.  Any number of cursors may read
+// one volume descriptor at the same time.
+// INPUT PARAMETERS:
+//     Takes in the cursor, the buffer to fill and the
+// number of bytes to read.
+// OUTPUT PARAMETERS:
+//     Returns what readBytesAs returns.
+//------------------------------------------------------*/
+ssize_t cursorRead(VolumeCursor *cursor, void *buffer, size_t length){
+
+    ssize_t bytes;
+
+    assert(cursor != NULL);
+
+    bytes = readBytesAs(cursor->volume_fd, buffer, length, cursor->offset, cursor->source);
+    if(bytes > 0){
+        cursor->offset += (uint64_t) bytes;
+    }
+    return bytes;
+}
+
 /**
  * Convert a Unicode-formatted string containing only ASCII characters
  * into a regular ASCII-formatted string (16 bit chars to 8 bit
@@ -117,7 +252,7 @@ int clustersToBytes(exfat *volume, int number_of_clusters){
  *
  * returns: a heap allocated ASCII-formatted string.
  */
-static char *unicode2ascii( uint16_t *unicode_string, uint8_t length )
+char *unicode2ascii( uint16_t *unicode_string, uint8_t length )
 {
     assert( unicode_string != NULL );
     assert( length > 0 );
@@ -219,150 +354,52 @@ unsigned int numUnsetBits(uint32_t value){
     return result;
 }
 
-/*------------------------------------------------------
-// buildClusterChain
-//
-// PURPOSE: Given a file descriptor to an exfat volume,
-// along with a cluster head index to the cluster that
-// is the first in cluster of a cluster chain to build.
-// This method builds a list of cluster numbers that
-// makeup a cluster chain for the desired index location.
-// INPUT PARAMETERS:
-//     Takes in a file descriptor to an exfat volume,
-// along with an unsigned int that is the index of the
-// first cluster index of the cluster chain to be built.
-// OUTPUT PARAMETERS:
-//     Returns aa pointer to the cluster chain List.
-//------------------------------------------------------*/
-List *buildFatClusterChain(int volume_fd, exfat *volume, unsigned int cluster_heap_index){
-
-    // printf("\nBuilding cluster chain...\n");
-    // printf("Cluster heap index: %u\n", cluster_heap_index);
-
-    List *cluster_chain = malloc(sizeof (List));
-    insert(cluster_chain, cluster_heap_index);
-
-    unsigned int next_cluster = cluster_heap_index;
-    unsigned int cluster_number = 0;
-
-    unsigned long offset = volume->fat_offset * sectorsToBytes(volume, 1);
-    lseek(volume_fd, offset, SEEK_SET);
-
-    /* Seek passed FatEntry[0] and FatEntry[1] */
-    lseek(volume_fd, 8, SEEK_CUR);
-
-    while(next_cluster != -1){
-
-        /* calculating the offset like this ensures that if the clusters are not contiguous,
-         * the cluster chain will be built correctly */
-        offset = volume->fat_offset * sectorsToBytes(volume, 1);
-        offset += 4 * next_cluster;
-        lseek(volume_fd, offset, SEEK_SET);
-
-        read(volume_fd, (void *) &next_cluster, 4 );
-        printf("Next Cluster: %d\n", next_cluster);
-
-        /* Ensures the end of cluster chain marker is not added to the list */
-        if(next_cluster != -1){
-            insert(cluster_chain, next_cluster);
-            cluster_number++;
-        }
-    }
-
-    //printList(cluster_chain);
-    return cluster_chain;
-}
-
-List *buildClusterChain(int volume_fd, exfat *volume, unsigned int cluster_heap_index){
-
-    // printf("\nBuilding cluster chain...\n");
-    // printf("Cluster heap index: %u\n", cluster_heap_index);
-
-    List *cluster_chain = malloc(sizeof (List));
-    insert(cluster_chain, cluster_heap_index);
-
-    unsigned int next_cluster = cluster_heap_index;
-    unsigned int cluster_number = 0;
-
-    unsigned long offset = volume->fat_offset * sectorsToBytes(volume, 1);
-    lseek(volume_fd, offset, SEEK_SET);
-
-    /* Seek passed FatEntry[0] and FatEntry[1] */
-    lseek(volume_fd, 8, SEEK_CUR);
-
-    while(next_cluster != -1){
-
-        /* calculating the offset like this ensures that if the clusters are not contiguous,
-         * the cluster chain will be built correctly */
-        offset = volume->fat_offset * sectorsToBytes(volume, 1);
-        offset += 4 * next_cluster;
-        lseek(volume_fd, offset, SEEK_SET);
-
-        read(volume_fd, (void *) &next_cluster, 4 );
-        //printf("Next Cluster: %d\n", next_cluster);
-
-        /* Ensures the end of cluster chain marker is not added to the list */
-        if(next_cluster != -1){
-            insert(cluster_chain, next_cluster);
-            cluster_number++;
-        }
-    }
-
-    //printList(cluster_chain);
-    return cluster_chain;
-}
-
-
 /*------------------------------------------------------
 // calculateFreeSpace
 //
 // PURPOSE: Given a file descriptor to an exfat volume,
 // along with a pointer to an exfat volume struct and
-// a pointer to the bitmap cluster chain, this method
-// calculated the number of free KB of memory left on the
-// volume.
+// the number of good clusters in the bitmap's cluster
+// chain, this method calculated the number of free KB of
+// memory left on the volume.  The chain is followed one
+// cluster at a time rather than built up front.
 // INPUT PARAMETERS:
 //     Takes in a file descriptor to an exfat volume,
 // along with a pointer to an exfat volume struct and
-// a pointer to the bitmap cluster chain.
-// volume.
+// the length of the bitmap cluster chain.
 // OUTPUT PARAMETERS:
 //     Returns an unsigned long equal to the number of free
 // KB in the exfat volume.
 //------------------------------------------------------*/
-void calculateFreeSpace(int volume_fd, exfat *volume, List *bitmap_cluster_chain){
+void calculateFreeSpace(int volume_fd, exfat *volume, uint64_t bitmap_clusters){
 
     printf("\n\nCalculating free space...\n\n");
 
     unsigned long total_unset_bits = 0;
-    unsigned long offset =  (volume->cluster_heap_offset * sectorsToBytes(volume, 1));
-    int current_cluster_bytes_left;
-
-    unsigned int temp;
+    uint64_t offset;
+    uint32_t cluster;
+    ChainIterator bitmap_cluster_chain;
+    uint32_t cluster_bytes = clusterBytes(volume);
+    uint32_t *bitmap = malloc(cluster_bytes);
 
-   // unsigned long offset = volume->fat_offset * sectorsToBytes(volume, 1);
+    assert(bitmap != NULL);
 
-    while(bitmap_cluster_chain->size > 0){
-
-        current_cluster_bytes_left = clustersToBytes(volume, 1);
+    startChain(&bitmap_cluster_chain, volume_fd, volume, NULL, volume->first_bitmap_cluster, bitmap_clusters);
+    while((cluster = nextChainCluster(&bitmap_cluster_chain)) != END_OF_CHAIN){
 
         /*Calculate the offset to the heap in number of bytes */
-        offset =  (volume->cluster_heap_offset * sectorsToBytes(volume, 1));
-        offset += (getData(bitmap_cluster_chain) * clustersToBytes(volume,1));
-
-        lseek(volume_fd, (long) offset, SEEK_SET);
-
-        while(current_cluster_bytes_left >= 4){
+        offset =  ((uint64_t) volume->cluster_heap_offset * sectorsToBytes(volume, 1));
+        offset += ((uint64_t) cluster * clustersToBytes(volume,1));
 
-            read(volume_fd, &temp ,4);
+        /* Bytes past the end of the volume count as free, as the word by word reads did */
+        memset(bitmap, 0, cluster_bytes);
+        readBytesAs(volume_fd, bitmap, cluster_bytes, offset, TRACE_BITMAP);
 
-            //printf("Temp: %x\n", temp);
-            total_unset_bits += numUnsetBits(temp);
-
-            temp = 0;
-            current_cluster_bytes_left -= 4;
+        for(uint32_t i = 0; i < cluster_bytes / 4; i++){
+            total_unset_bits += numUnsetBits(bitmap[i]);
         }
     }
+    free(bitmap);
 
     volume->free_space = total_unset_bits * clustersToBytes(volume, 1)/KILOBYTE_SIZE;
     printf("\nFree Space KB: %lu\n\n", volume->free_space);
@@ -392,7 +429,7 @@ void commandInfo(exfat *volume){
 
 void commandGet(exfat *volume){ }
 
-unsigned int offsetUpkeep(int volume_fd, exfat *volume, List *cluster_chain, unsigned int bytes_read){
+unsigned int offsetUpkeep(VolumeCursor *cursor, exfat *volume, ChainIterator *cluster_chain, unsigned int bytes_read){
 
     unsigned int bytes = bytes_read;
     unsigned long offset;
@@ -400,14 +437,14 @@ unsigned int offsetUpkeep(int volume_fd, exfat *volume, List *cluster_chain, uns
     if(bytes_read >= clustersToBytes(volume,1)){
 
         offset =  ((volume->cluster_heap_offset * sectorsToBytes(volume, 1)) +
-                ((0x1<< volume->sector_size)*(0x1 << volume->cluster_size))*(getData(cluster_chain)-2));
-        lseek(volume_fd, offset, SEEK_SET);
+                ((0x1<< volume->sector_size)*(0x1 << volume->cluster_size))*(nextChainCluster(cluster_chain)-2));
+        cursorSeek(cursor, offset);
         bytes = 0;
     }
     return bytes;
 }
 
-void commandList(int volume_fd, exfat *volume){
+void commandList(int volume_fd, exfat *volume, FILE *output){
 
     /* This will seek back to the directory entry after the bitmap allocation table entry */
     unsigned long offset = rootDirectory(volume);
@@ -421,111 +458,123 @@ void commandList(int volume_fd, exfat *volume){
     uint16_t file_attributes;
     char *file_name;
 
-    List *root = buildClusterChain(volume_fd, volume, volume->root_cluster);
-    //printList(root);
+    ChainError chain_error;
+    ChainIterator chain;
+    ChainIterator *root = &chain;
+    VolumeCursor cursor = {volume_fd, 0, TRACE_DIRECTORY};
+    uint8_t entry_type = volume->entry_type;   /* the bitmap entry readVolume stopped at */
+
+    /* Check the chain first so a bad one is reported up front, then follow it lazily */
+    walkClusterChain(volume_fd, volume, NULL, volume->root_cluster, UINT64_MAX, NULL, NULL, &chain_error);
+    startChain(root, volume_fd, volume, NULL, volume->root_cluster, chain_error.length);
 
-    getData(root);  /* Pop the first cluster because we are already in it and won't be needing it */
+    if(chain_error.status != CHAIN_OK){
+        fprintf(output, "The root directory's cluster chain %s at cluster %u, listing the first %llu cluster(s)\n",
+                chainStatusString(chain_error.status), chain_error.cluster, (unsigned long long) chain_error.length);
+    }
 
-    lseek(volume_fd, (long) offset, SEEK_SET);
+    nextChainCluster(root);  /* Pop the first cluster because we are already in it and won't be needing it */
 
+    cursorSeek(&cursor, offset);
 
-    while(volume->entry_type != 0){
-        bytes_read = offsetUpkeep(volume_fd, volume, root, bytes_read + 1);
-        read(volume_fd, (void * ) &volume->entry_type, 1);
+
+    while(entry_type != 0){
+        bytes_read = offsetUpkeep(&cursor, volume, root, bytes_read + 1);
+        cursorRead(&cursor, (void * ) &entry_type, 1);
         bytes_read++;
 
-        //printf("HEX %x\n", volume->entry_type);
+        //printf("HEX %x\n", entry_type);
 
         /* If it is a file */
-        if(volume->entry_type == 0x85){
+        if(entry_type == 0x85){
             /* File */
 
-            lseek(volume_fd, 3, SEEK_CUR);
+            cursorSkip(&cursor, 3);
             bytes_read += 3;
-            bytes_read = offsetUpkeep(volume_fd, volume, root, bytes_read);
+            bytes_read = offsetUpkeep(&cursor, volume, root, bytes_read);
 
-            read(volume_fd, (void *) &file_attributes, 2);
+            cursorRead(&cursor, (void *) &file_attributes, 2);
             bytes_read += 2;
-            bytes_read = offsetUpkeep(volume_fd, volume, root, bytes_read);
+            bytes_read = offsetUpkeep(&cursor, volume, root, bytes_read);
 
-            lseek(volume_fd, 26, SEEK_CUR);
+            cursorSkip(&cursor, 26);
             bytes_read += 26;
-            bytes_read = offsetUpkeep(volume_fd, volume, root, bytes_read);
+            bytes_read = offsetUpkeep(&cursor, volume, root, bytes_read);
 
-            lseek(volume_fd, 3, SEEK_CUR);
-            read(volume_fd, (void *) &file_name_length, 1);
+            cursorSkip(&cursor, 3);
+            cursorRead(&cursor, (void *) &file_name_length, 1);
             bytes_read += 4;
-            bytes_read = offsetUpkeep(volume_fd, volume, root, bytes_read);
+            bytes_read = offsetUpkeep(&cursor, volume, root, bytes_read);
 
-            lseek(volume_fd, 16, SEEK_CUR);
-            read(volume_fd, (void *) &file_first_cluster, 4);
+            cursorSkip(&cursor, 16);
+            cursorRead(&cursor, (void *) &file_first_cluster, 4);
             bytes_read += 20;
-            bytes_read = offsetUpkeep(volume_fd, volume, root, bytes_read);
+            bytes_read = offsetUpkeep(&cursor, volume, root, bytes_read);
 
-            lseek(volume_fd, 10, SEEK_CUR);
+            cursorSkip(&cursor, 10);
             bytes_read += 10;
-            bytes_read = offsetUpkeep(volume_fd, volume, root, bytes_read);
+            bytes_read = offsetUpkeep(&cursor, volume, root, bytes_read);
 
             /* Read in the unicode volume label, storing it in a temporary label.  Convert to unicode, update the exfat struct label and free the temp label */
             temp_label = malloc(sizeof (char)*31); /* Set to 31 due to 30 readable chars and + 1 for NULL terminator */
             assert(temp_label != NULL);
 
-            read(volume_fd, (void *) temp_label, ENTRY_SIZE -2);
+            cursorRead(&cursor, (void *) temp_label, ENTRY_SIZE -2);
             file_name = unicode2ascii(temp_label, volume->label_length);
             bytes_read += ENTRY_SIZE -2;
-            bytes_read = offsetUpkeep(volume_fd, volume, root, bytes_read);
+            bytes_read = offsetUpkeep(&cursor, volume, root, bytes_read);
 
             file_attributes = file_attributes >> 4;
             if(bytes_read > 0){
                 if((file_attributes & 1) == 1){
-                    printf("Directory: ");
+                    fprintf(output, "Directory: ");
                 }
                 else {
-                    printf("File: ");
+                    fprintf(output, "File: ");
                 }
-                printf("%s\n", file_name);
+                fprintf(output, "%s\n", file_name);
             }
             free(temp_label);
 
         }
-        else if(volume->entry_type == 0xc0){
+        else if(entry_type == 0xc0){
             // printf("Stream extension\n");
-            lseek(volume_fd, 2, SEEK_CUR);
-            read(volume_fd, (void *) &file_name_length, 1);
+            cursorSkip(&cursor, 2);
+            cursorRead(&cursor, (void *) &file_name_length, 1);
             bytes_read += 3;
-            bytes_read = offsetUpkeep(volume_fd, volume, root, bytes_read);
-            lseek(volume_fd, 28, SEEK_CUR);
+            bytes_read = offsetUpkeep(&cursor, volume, root, bytes_read);
+            cursorSkip(&cursor, 28);
             // printf("File Name Length: %d\n", file_name_length);
         }
-        else if(volume->entry_type == 0xc1){
+        else if(entry_type == 0xc1){
            // printf("File Name\n");
 
-            lseek(volume_fd, 1,SEEK_CUR);
+            cursorSkip(&cursor, 1);
 
             /* Read in the unicode volume label, storing it in a temporary label.  Convert to unicode, update the exfat struct label and free the temp label */
             temp_label = malloc(sizeof (char)*31); /* Set to 31 due to 30 readable chars and + 1 for NULL terminator */
             assert(temp_label != NULL);
 
-            read(volume_fd, (void *) temp_label, ENTRY_SIZE -2);
+            cursorRead(&cursor, (void *) temp_label, ENTRY_SIZE -2);
             file_name = unicode2ascii(temp_label, volume->label_length);
             bytes_read += ENTRY_SIZE -2;
-            bytes_read = offsetUpkeep(volume_fd, volume, root, bytes_read);
+            bytes_read = offsetUpkeep(&cursor, volume, root, bytes_read);
 
             file_attributes = file_attributes >> 4;
             if((file_attributes & 1) == 1){
-                printf("Directory: ");
+                fprintf(output, "Directory: ");
             }
             else {
-                printf("File: ");
+                fprintf(output, "File: ");
 
             }
-            printf("%s\n", file_name);
+            fprintf(output, "%s\n", file_name);
             free(temp_label);
         }
         else{
-            lseek(volume_fd, ENTRY_SIZE -1, SEEK_CUR);
+            cursorSkip(&cursor, ENTRY_SIZE -1);
             bytes_read += ENTRY_SIZE -1;
-            bytes_read = offsetUpkeep(volume_fd, volume, root, bytes_read);
+            bytes_read = offsetUpkeep(&cursor, volume, root, bytes_read);
         }
     }
 }
@@ -550,15 +599,13 @@ exfat *readVolume(int volume_fd){
 
     assert(volume_fd > 0);
 
-    printf("\n\nReading the volume...\n\n");
-
     /* Volume label, Serial Number, Free Space, Cluster Size */
 
-    exfat *volume = malloc(sizeof (exfat));
-    List *bitmap_cluster_chain;
+    exfat *volume = calloc(1, sizeof (exfat));
     unsigned long offset;
     void *temp_label;
     int curr_volume;
+    VolumeCursor cursor = {volume_fd, 0, TRACE_BOOT};
 
     assert(volume != NULL);
 
@@ -566,61 +613,57 @@ exfat *readVolume(int volume_fd){
 
         /* Read Boot Sector (first 512 bytes) */
 
-        lseek(volume_fd, 80, SEEK_SET);
-        read(volume_fd,(void *) &volume->fat_offset, 4);
-        read(volume_fd, (void *) &volume->fat_length, 4);
+        cursorSeek(&cursor, 80);
+        cursorRead(&cursor, (void *) &volume->fat_offset, 4);
+        cursorRead(&cursor, (void *) &volume->fat_length, 4);
 
-        read(volume_fd, (void *) &volume->cluster_heap_offset, 4);
-        read(volume_fd, (void *) &volume->cluster_count, 4);
+        cursorRead(&cursor, (void *) &volume->cluster_heap_offset, 4);
+        cursorRead(&cursor, (void *) &volume->cluster_count, 4);
 
         /* First cluster of the root directory located at offset 96 */
-        read(volume_fd, (void *) &volume->root_cluster, 4);
+        cursorRead(&cursor, (void *) &volume->root_cluster, 4);
 
         /* Volume serial number located at offset 100 */
-        read(volume_fd, (void *) &volume->serial_number, 4);
+        cursorRead(&cursor, (void *) &volume->serial_number, 4);
 
         /* Volume cluster size located at offset 108 */
-        lseek(volume_fd, 4, SEEK_CUR);
-        read(volume_fd, (void *) &volume->sector_size, 1);
-        read(volume_fd, (void *) &volume->cluster_size, 1);
-        read(volume_fd, (void *) &volume->number_of_fats, 1);
+        cursorSkip(&cursor, 4);
+        cursorRead(&cursor, (void *) &volume->sector_size, 1);
+        cursorRead(&cursor, (void *) &volume->cluster_size, 1);
+        cursorRead(&cursor, (void *) &volume->number_of_fats, 1);
 
         /* Calculate the Offset to the Cluster Heap + the Offset of the Root Cluster */
         offset = rootDirectory(volume);
-        lseek(volume_fd, (long)offset, SEEK_SET);
+        cursorSeek(&cursor, offset);
+        cursor.source = TRACE_DIRECTORY;
 
         /* Read the length of the Volume Label */
-        read(volume_fd, (void *) &volume->entry_type,1);
-        read(volume_fd, (void *) &volume->label_length, 1);
+        cursorRead(&cursor, (void *) &volume->entry_type,1);
+        cursorRead(&cursor, (void *) &volume->label_length, 1);
 
         /* Read in the unicode volume label, storing it in a temporary label.  Convert to unicode, update the exfat struct label and free the temp label */
         temp_label = malloc(sizeof (char)*23); /* Set to 23 due to 22 readable chars and + 1 for NULL terminator */
         assert(temp_label != NULL);
-        read(volume_fd, (void *) temp_label, 22);
-        lseek(volume_fd, 8, SEEK_CUR);
+        cursorRead(&cursor, (void *) temp_label, 22);
+        cursorSkip(&cursor, 8);
         volume->ascii_volume_label = unicode2ascii(temp_label, volume->label_length);
         free(temp_label);
 
-        read(volume_fd, (void *) &volume->entry_type,1);
-        read(volume_fd, (void *) &curr_volume, 1);
+        cursorRead(&cursor, (void *) &volume->entry_type,1);
+        cursorRead(&cursor, (void *) &curr_volume, 1);
 
-        lseek(volume_fd, 18, SEEK_CUR);
+        cursorSkip(&cursor, 18);
 
         /* This is the index of the first cluster of the cluster chain
          * as the FAT describes (Look at the corresponding entry in the FAT,
          * to build the cluster chain) */
-        read(volume_fd, (void *) &volume->first_bitmap_cluster, 4);
-        read(volume_fd, (void *) &volume->first_bitmap_cluster_data_length, 8);
-
-        /* Create and build the allocation bitmap table cluster chain */
-        bitmap_cluster_chain = buildFatClusterChain(volume_fd, volume, volume->first_bitmap_cluster);
-
-        /* Calculate and update the exfat struct volume to contain the number of KB free */
-        calculateFreeSpace(volume_fd, volume, bitmap_cluster_chain);
+        cursorRead(&cursor, (void *) &volume->first_bitmap_cluster, 4);
+        cursorRead(&cursor, (void *) &volume->first_bitmap_cluster_data_length, 8);
     }
     return volume;
 }
 
+#ifndef FSREADER_NO_MAIN
 /*------------------------------------------------------
 // main
 //
@@ -647,29 +690,96 @@ int main(int argc, char *argv[]) {
     char *volume_name;
    // char full_path[30];
     int volume_fd;
+    int status = EXIT_SUCCESS;
     exfat *volume;
+    ChainError chain_error;
+    uint64_t cache_budget = DEFAULT_CACHE_BUDGET;
+    uint64_t dentry_budget = DEFAULT_DENTRY_BUDGET;
+    int cache_stats = 0;
+    int global_option;
+
+    /* Global options may appear anywhere, they are taken out before the command sees its arguments */
+    for(int i = 1; i < argc; i++){
+        global_option = 1;
+        if(strncmp(argv[i], "--trace=", 8) == 0){
+            if(traceOpen(argv[i] + 8) != 0){
+                printf("Unable to create trace file '%s'\n", argv[i] + 8);
+                return EXIT_FAILURE;
+            }
+        }
+        else if(strncmp(argv[i], "--cache=", 8) == 0){
+            cache_budget = strtoull(argv[i] + 8, NULL, 10) * KILOBYTE_SIZE * KILOBYTE_SIZE;
+        }
+        else if(strncmp(argv[i], "--dcache=", 9) == 0){
+            dentry_budget = strtoull(argv[i] + 9, NULL, 10) * KILOBYTE_SIZE * KILOBYTE_SIZE;
+        }
+        else if(strncmp(argv[i], "--max-memory=", 13) == 0){
+            setMemoryCeiling(strtoull(argv[i] + 13, NULL, 10) * KILOBYTE_SIZE * KILOBYTE_SIZE);
+        }
+        else if(strcmp(argv[i], "--cache-stats") == 0){
+            cache_stats = 1;
+        }
+        else {
+            global_option = 0;
+        }
 
-    /* Ensure the user passes 2 parameters to the scheduler (Number of CPUs and scheduler type) */
-    if (argc == 3) {
+        if(global_option){
+            memmove(&argv[i], &argv[i + 1], (argc - i) * sizeof (char *));
+            argc--;
+            i--;
+        }
+    }
+
+    /* Under a memory ceiling each cache gets at most its share */
+    cache_budget = memoryShare(cache_budget);
+    dentry_budget = memoryShare(dentry_budget);
+
+    if(cacheOpen(cache_budget) != 0){
+        printf("Unable to allocate a %llu MB block cache\n", (unsigned long long) (cache_budget / KILOBYTE_SIZE / KILOBYTE_SIZE));
+        traceClose();
+        return EXIT_FAILURE;
+    }
+    if(dentryOpen(dentry_budget) != 0){
+        printf("Unable to allocate a %llu MB dentry cache\n", (unsigned long long) (dentry_budget / KILOBYTE_SIZE / KILOBYTE_SIZE));
+        cacheClose();
+        traceClose();
+        return EXIT_FAILURE;
+    }
+
+    /* Ensure the user passes at least 2 parameters to the reader (the volume and the command) */
+    if (argc >= 3) {
 
         volume_name = argv[1];
         command = argv[2];
 
-        printf("\n\nReading Volume: %s, Command: %s\n", volume_name, command);
+        if ((argc == 3) && ((strcmp(command, "info") == 0) || (strcmp(command, "list") == 0) || (strcmp(command, "get") == 0))) {
 
-        volume_fd = open(volume_name, O_RDONLY);
+            printf("\n\nReading Volume: %s, Command: %s\n", volume_name, command);
 
-        if (volume_fd > 0) {
-            printf("Opening file: '%s'\n", volume_name);
+            volume_fd = open(volume_name, O_RDONLY);
 
-            if ((strcmp(command, "info") == 0) || (strcmp(command, "list") == 0) || (strcmp(command, "get") == 0)) {
+            if (volume_fd > 0) {
+                printf("Opening file: '%s'\n", volume_name);
 
                 printf("Supported command");
 
                 /* Able to open file and the command is valid, do work */
 
+                printf("\n\nReading the volume...\n\n");
                 volume = readVolume(volume_fd);
 
+                /* Check the allocation bitmap table cluster chain */
+                walkClusterChain(volume_fd, volume, NULL, volume->first_bitmap_cluster,
+                        (volume->first_bitmap_cluster_data_length + clusterBytes(volume) - 1) / clusterBytes(volume),
+                        NULL, NULL, &chain_error);
+                if(chain_error.status != CHAIN_OK){
+                    printf("The allocation bitmap's cluster chain %s at cluster %u\n",
+                           chainStatusString(chain_error.status), chain_error.cluster);
+                }
+
+                /* Calculate and update the exfat struct volume to contain the number of KB free */
+                calculateFreeSpace(volume_fd, volume, chain_error.length);
+
                 displayMetadata(volume);
 
                 if(strcmp(command, "info") == 0){
@@ -678,7 +788,7 @@ int main(int argc, char *argv[]) {
                 }
                 else if(strcmp(command, "list") == 0){
                     printf("Processing command: list...\n");
-                    commandList(volume_fd, volume);
+                    commandList(volume_fd, volume, stdout);
                 }
                 else if(strcmp(command, "get") == 0){
                     printf("Processing command: get...\n");
@@ -686,17 +796,141 @@ int main(int argc, char *argv[]) {
                 }
 
             } else {
-                printf("Unsupported command");
+                printf("Unable to open file: '%s'\n", volume_name);
+            }
+
+            printf("\nProgram completed normally.\n\n");
+
+        } else if ((strcmp(command, "check") == 0) || (strcmp(command, "list") == 0) || (strcmp(command, "undelete") == 0) ||
+                   (strcmp(command, "carve") == 0) || (strcmp(command, "find") == 0) || (strcmp(command, "du") == 0) ||
+                   (strcmp(command, "timeline") == 0) || (strcmp(command, "get") == 0) ||
+                   (strcmp(command, "free") == 0) || (strcmp(command, "diff") == 0) ||
+                   (strcmp(command, "tar") == 0) || (strcmp(command, "replay") == 0) ||
+                   (strcmp(command, "stat") == 0) || (strcmp(command, "extents") == 0) ||
+                   (strcmp(command, "image") == 0) ||
+                   (strcmp(command, "tree") == 0) || (strcmp(command, "grep") == 0) ||
+                   (strcmp(command, "rescue") == 0)) {
+
+            /* Commands past the original three print only their own output */
+            volume_fd = open(volume_name, O_RDONLY);
+
+            if (volume_fd > 0) {
+                traceBegin("read volume");
+                volume = readVolume(volume_fd);
+                traceEnd();
+
+                /* Commands that follow most chains of the volume index the FAT's runs once up front */
+                if((strcmp(command, "tree") == 0) || (strcmp(command, "du") == 0) || (strcmp(command, "find") == 0) ||
+                   (strcmp(command, "extents") == 0) || (strcmp(command, "tar") == 0) ||
+                   (strcmp(command, "grep") == 0) || (strcmp(command, "rescue") == 0)){
+                    runIndexOpen(volume_fd, volume);
+                }
+
+                traceBegin(command);
+                if(strcmp(command, "check") == 0){
+                    status = commandCheck(volume_fd, volume) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+                else if(strcmp(command, "list") == 0 && strcmp(argv[3], "--deleted") == 0){
+                    status = commandUndelete(volume_fd, volume, NULL) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+                else if(strcmp(command, "list") == 0){
+                    status = commandListLong(volume_fd, volume, argc - 3, argv + 3) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+                else if(strcmp(command, "undelete") == 0){
+                    status = commandUndelete(volume_fd, volume, argc > 3 ? argv[3] : ".") == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+                else if(strcmp(command, "carve") == 0){
+                    status = commandCarve(volume_fd, volume, argc > 3 ? argv[3] : ".") == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+                else if(strcmp(command, "find") == 0){
+                    status = commandFind(volume_fd, volume, argc - 3, argv + 3) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+                else if(strcmp(command, "du") == 0){
+                    status = commandDu(volume_fd, volume, argc - 3, argv + 3) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+                else if(strcmp(command, "get") == 0){
+                    status = commandGetRange(volume_fd, volume, argc - 3, argv + 3) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+                else if(strcmp(command, "free") == 0){
+                    status = commandFree(volume_fd, volume, argc - 3, argv + 3) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+                else if(strcmp(command, "diff") == 0){
+                    status = commandDiff(volume_fd, volume, argc - 3, argv + 3) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+                else if(strcmp(command, "tar") == 0){
+                    status = commandTar(volume_fd, volume, argc - 3, argv + 3) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+                else if(strcmp(command, "replay") == 0){
+                    status = commandReplay(volume_fd, volume, argc - 3, argv + 3) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+                else if(strcmp(command, "stat") == 0){
+                    status = commandStat(volume_fd, volume, argc - 3, argv + 3) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+                else if(strcmp(command, "extents") == 0){
+                    status = commandExtents(volume_fd, volume, argc - 3, argv + 3) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+                else if(strcmp(command, "image") == 0){
+                    status = commandImage(volume_fd, volume, argc - 3, argv + 3) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+                else if(strcmp(command, "tree") == 0){
+                    status = commandTree(volume_fd, volume, argc - 3, argv + 3) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+                else if(strcmp(command, "grep") == 0){
+                    status = commandGrep(volume_fd, volume, argc - 3, argv + 3) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+                else if(strcmp(command, "rescue") == 0){
+                    status = commandRescue(volume_fd, volume, argc - 3, argv + 3) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+                else if(strcmp(command, "timeline") == 0){
+                    status = commandTimeline(volume_fd, volume, argc - 3, argv + 3) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+                else {
+                    printf("Unsupported option: '%s'\n", argv[3]);
+                    status = EXIT_FAILURE;
+                }
+                traceEnd();
+
+            } else {
+                printf("Unable to open file: '%s'\n", volume_name);
+                status = EXIT_FAILURE;
             }
 
         } else {
-            printf("Unable to open file: '%s'\n", volume_name);
+            printf("Unsupported command");
+            status = EXIT_FAILURE;
         }
 
     } else {
         printf("\nPlease provide the program the volume to read, along with the command to run.\n\n\nExample: ./exfat volumeName info\n");
+        printf("\nCommands: info, list [--deleted], get, check, undelete [output directory],\n"
+               "          carve [output directory], list --long [--sort=mtime|size|name] [-r] [path],\n"
+               "          list --long --limit N [--after cursor] [path] (one page, then \"Cursor: ...\"),\n"
+               "          find <root> [-name glob] [-iname glob] [-size [+-]N[ckMG]] [-mtime [+-]days] [-type f|d]\n"
+               "          du [root] [--depth N] [--top N], timeline [path],\n"
+               "          get <path> [--offset N] [--length N] [--sparse] [output file],\n"
+               "          get <path>... --directory <output directory>, stat <path>...,\n"
+               "          extents <path> [-r] (JSON: logical, physical and length in bytes, flags),\n"
+               "          image <destination> (sparse copy of the metadata and allocated clusters),\n"
+               "          tree [path] [--depth N], grep [-E|--hex] <pattern> [path] [-e <pattern>]...,\n"
+               "          free [--extents] [--range first-last]..., diff <other volume>,\n"
+               "          rescue <path> <output directory> [--map file] [--retries N] (reads around bad sectors),\n"
+               "          tar <path> > archive.tar, replay <trace.json> [--backend=pread|mmap|direct] [--paced]\n"
+               "Any command takes --trace=file.json to write a Chrome trace of its reads, --cache=MB to size\n"
+               "the metadata block cache (0 turns it off), --dcache=MB to size the path lookup cache and\n"
+               "--cache-stats to print the counters of both.  --max-memory=MB bounds the memory a run\n"
+               "may use, following chains and directories as it goes instead of holding them.\n");
     }
 
-    printf("\nProgram completed normally.\n\n");
-    return EXIT_SUCCESS;
+    if(cache_stats){
+        printCacheStats(stderr);
+        printDentryStats(stderr);
+        printRunIndexStats(stderr);
+        printMemoryStats(stderr);
+    }
+    runIndexClose();
+    dentryClose();
+    cacheClose();
+    traceClose();
+    return status;
 }
+#endif //FSREADER_NO_MAIN
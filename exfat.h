@@ -0,0 +1,124 @@
+//
+// Shared exFAT volume definitions used by every command module.
+//
+
+#ifndef FSREADER_EXFAT_H
+#define FSREADER_EXFAT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "list.h"
+#include "trace.h"
+
+#define KILOBYTE_SIZE 1024
+#define ENTRY_SIZE 32   /* Bytes */
+#define FAT_ENTRY_SIZE 4   /* Bytes */
+
+/* Cluster numbering starts at 2, FatEntry[0] and FatEntry[1] are reserved */
+#define FIRST_DATA_CLUSTER 2
+#define END_OF_CHAIN 0xFFFFFFFF
+#define BAD_CLUSTER 0xFFFFFFF7
+
+/* Directory entry types, the high bit (InUse) is cleared when an entry is deleted */
+#define ENTRY_TYPE_END_OF_DIRECTORY 0x00
+#define ENTRY_TYPE_BITMAP 0x81
+#define ENTRY_TYPE_UPCASE 0x82
+#define ENTRY_TYPE_VOLUME_LABEL 0x83
+#define ENTRY_TYPE_FILE 0x85
+#define ENTRY_TYPE_STREAM_EXTENSION 0xc0
+#define ENTRY_TYPE_FILE_NAME 0xc1
+#define ENTRY_IN_USE 0x80
+
+#define ATTRIBUTE_READ_ONLY 0x01
+#define ATTRIBUTE_HIDDEN 0x02
+#define ATTRIBUTE_SYSTEM 0x04
+#define ATTRIBUTE_DIRECTORY 0x10
+#define ATTRIBUTE_ARCHIVE 0x20
+
+/* GeneralSecondaryFlags of the stream extension entry */
+#define FLAG_ALLOCATION_POSSIBLE 0x01
+#define FLAG_NO_FAT_CHAIN 0x02
+
+#pragma pack(push)
+#pragma pack(1)
+typedef struct EXFAT{
+
+    uint32_t fat_offset;
+    uint32_t fat_length;
+
+    uint32_t cluster_heap_offset;  /* in # of sectors */
+    uint32_t cluster_count;
+
+    uint32_t root_cluster;
+    uint32_t serial_number;
+
+    /* 0x1 << cluster_size == cluster size in bytes */
+    uint8_t sector_size;
+    uint8_t cluster_size;
+
+    uint8_t number_of_fats;
+
+    uint8_t  label_length;
+    uint16_t unicode_volume_label;
+    uint8_t  entry_type;
+
+    /* This is the index of the first cluster of the cluster chain
+     * as the FAT describes (Look at the corresponding entry in the FAT,
+     * to build the cluster chain) */
+    uint32_t first_bitmap_cluster;
+    uint64_t first_bitmap_cluster_data_length;
+
+    /* bitmap of free clusters */
+
+    /* uint8_t cluster size */
+
+    char *ascii_volume_label;
+    unsigned long free_space;
+
+}exfat;
+#pragma pack(pop)
+
+/* A read position owned by one operation, so concurrent readers of a volume never share the descriptor's offset */
+typedef struct VolumeCursor {
+
+    int volume_fd;
+    uint64_t offset;
+    TraceSource source;
+
+} VolumeCursor ;
+
+int sectorsToBytes(exfat *volume, int number_of_sectors);
+
+int clustersToBytes(exfat *volume, int number_of_clusters);
+
+uint32_t clusterBytes(exfat *volume);
+
+uint64_t clusterOffset(exfat *volume, uint32_t cluster);
+
+int isValidCluster(exfat *volume, uint32_t cluster);
+
+ssize_t readBytes(int volume_fd, void *buffer, size_t length, uint64_t offset);
+
+ssize_t readBytesAs(int volume_fd, void *buffer, size_t length, uint64_t offset, TraceSource source);
+
+void cursorSeek(VolumeCursor *cursor, uint64_t offset);
+
+void cursorSkip(VolumeCursor *cursor, uint64_t bytes);
+
+ssize_t cursorRead(VolumeCursor *cursor, void *buffer, size_t length);
+
+char *unicode2ascii(uint16_t *unicode_string, uint8_t length);
+
+unsigned long rootDirectory(exfat *volume_data);
+
+unsigned int numUnsetBits(uint32_t value);
+
+void calculateFreeSpace(int volume_fd, exfat *volume, uint64_t bitmap_clusters);
+
+exfat *readVolume(int volume_fd);
+
+void commandList(int volume_fd, exfat *volume, FILE *output);
+
+#endif //FSREADER_EXFAT_H
@@ -0,0 +1,498 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: exfatc, the command line client of exfatd.
+// Each run connects to the daemon's socket, sends one
+// request for an image and prints the answer: the
+// volume's info, the stat of some paths, a directory's
+// entries, or a file's bytes.  With --fd a get takes the
+// image's descriptor and the extents of the range from
+// the daemon and reads the data itself.
+//-----------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <assert.h>
+
+#include "protocol.h"
+
+#define COPY_BUFFER_SIZE (1024 * 1024)
+#define TIME_BUFFER_SIZE 32
+
+static const char *statusString(uint8_t status){
+
+    switch(status){
+        case STATUS_OK:
+            return "ok";
+        case STATUS_BAD_REQUEST:
+            return "bad request";
+        case STATUS_NO_IMAGE:
+            return "no such image";
+        case STATUS_NOT_FOUND:
+            return "no such file or directory";
+        case STATUS_NOT_DIRECTORY:
+            return "not a directory";
+        case STATUS_IS_DIRECTORY:
+            return "is a directory";
+        case STATUS_IO_ERROR:
+            return "unable to read the volume";
+        default:
+            return "unknown status";
+    }
+}
+
+static int writeAll(int fd, const void *bytes, size_t length){
+
+    const uint8_t *next = bytes;
+    ssize_t written;
+
+    while(length > 0){
+        written = write(fd, next, length);
+        if(written < 0 && errno == EINTR){
+            continue;
+        }
+        if(written <= 0){
+            return -1;
+        }
+        next += written;
+        length -= (size_t) written;
+    }
+    return 0;
+}
+
+static int receiveAll(int fd, void *bytes, size_t length){
+
+    uint8_t *next = bytes;
+    ssize_t received;
+
+    while(length > 0){
+        received = recv(fd, next, length, 0);
+        if(received < 0 && errno == EINTR){
+            continue;
+        }
+        if(received <= 0){
+            return -1;
+        }
+        next += received;
+        length -= (size_t) received;
+    }
+    return 0;
+}
+
+static int connectDaemon(const char *socket_path){
+
+    struct sockaddr_un address;
+    int socket_fd;
+
+    if(strlen(socket_path) >= sizeof (address.sun_path)){
+        return -1;
+    }
+    memset(&address, 0, sizeof (address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+
+    socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(socket_fd >= 0 && connect(socket_fd, (struct sockaddr *) &address, sizeof (address)) != 0){
+        close(socket_fd);
+        socket_fd = -1;
+    }
+    return socket_fd;
+}
+
+/*------------------------------------------------------
+// request
+//
+// PURPOSE: Sends one request and reads the header of its
+// answer, along with a descriptor if one came with it.
+// INPUT PARAMETERS:
+//     Takes in the socket, the request type and flags, the
+// image name, the path (may be NULL), the range for a
+// get, and where to store the header and a passed
+// descriptor (may be NULL).
+// OUTPUT PARAMETERS:
+//     Returns 0 if a header arrived, -1 otherwise.
+//------------------------------------------------------*/
+static int request(int socket_fd, uint8_t type, uint16_t flags, const char *image, const char *path, uint64_t offset,
+                   uint64_t length, ResponseHeader *response, int *passed_fd){
+
+    RequestHeader header;
+    struct msghdr message;
+    struct iovec vector;
+    struct cmsghdr *control;
+    char control_buffer[CMSG_SPACE(sizeof (int))];
+    ssize_t received;
+
+    memset(&header, 0, sizeof (RequestHeader));
+    header.version = PROTOCOL_VERSION;
+    header.type = type;
+    header.flags = flags;
+    header.image_length = (uint16_t) strlen(image);
+    header.path_length = path != NULL ? (uint16_t) strlen(path) : 0;
+    header.offset = offset;
+    header.length = length;
+    if(strlen(image) > MAX_IMAGE_NAME || (path != NULL && strlen(path) > MAX_REQUEST_PATH) ||
+       writeAll(socket_fd, &header, sizeof (RequestHeader)) != 0 ||
+       writeAll(socket_fd, image, header.image_length) != 0 ||
+       (path != NULL && writeAll(socket_fd, path, header.path_length) != 0)){
+        return -1;
+    }
+
+    if(passed_fd != NULL){
+        *passed_fd = -1;
+    }
+    memset(&message, 0, sizeof (message));
+    vector.iov_base = response;
+    vector.iov_len = sizeof (ResponseHeader);
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control_buffer;
+    message.msg_controllen = sizeof (control_buffer);
+    do {
+        received = recvmsg(socket_fd, &message, MSG_CMSG_CLOEXEC);
+    } while(received < 0 && errno == EINTR);
+    if(received <= 0){
+        return -1;
+    }
+    for(control = CMSG_FIRSTHDR(&message); control != NULL; control = CMSG_NXTHDR(&message, control)){
+        if(control->cmsg_level == SOL_SOCKET && control->cmsg_type == SCM_RIGHTS && passed_fd != NULL){
+            memcpy(passed_fd, CMSG_DATA(control), sizeof (int));
+        }
+    }
+    if((size_t) received < sizeof (ResponseHeader) &&
+       receiveAll(socket_fd, (uint8_t *) response + received, sizeof (ResponseHeader) - (size_t) received) != 0){
+        return -1;
+    }
+    if(response->status != STATUS_OK){
+        fprintf(stderr, "exfatc: %s: %s\n", path != NULL ? path : image, statusString(response->status));
+        return -1;
+    }
+    return 0;
+}
+
+/* Reads the payload of an answer, which the caller frees */
+static uint8_t *receivePayload(int socket_fd, const ResponseHeader *response){
+
+    uint8_t *payload = malloc(response->length > 0 ? (size_t) response->length : 1);
+
+    assert(payload != NULL);
+    if(receiveAll(socket_fd, payload, (size_t) response->length) != 0){
+        free(payload);
+        return NULL;
+    }
+    return payload;
+}
+
+static void formatTime(int64_t seconds, char *buffer){
+
+    time_t time = (time_t) seconds;
+    struct tm parts;
+
+    if(gmtime_r(&time, &parts) == NULL || strftime(buffer, TIME_BUFFER_SIZE, "%Y-%m-%d %H:%M:%S", &parts) == 0){
+        strcpy(buffer, "-");
+    }
+}
+
+/* Prints the entries of a stat or list payload */
+static void printEntries(const uint8_t *payload, uint64_t length, uint32_t count){
+
+    const char letters[] = {'R', 'H', 'S', 'D', 'A'};
+    const uint16_t bits[] = {0x01, 0x02, 0x04, 0x10, 0x20};
+    WireEntry entry;
+    char attributes[6];
+    char modified[TIME_BUFFER_SIZE];
+    uint64_t position = 0;
+
+    for(uint32_t i = 0; i < count && position + sizeof (WireEntry) <= length; i++){
+        memcpy(&entry, payload + position, sizeof (WireEntry));
+        position += sizeof (WireEntry);
+        if(position + entry.name_length > length){
+            break;
+        }
+        for(int b = 0; b < 5; b++){
+            attributes[b] = (entry.attributes & bits[b]) != 0 ? letters[b] : '-';
+        }
+        attributes[5] = '\0';
+        formatTime(entry.modified, modified);
+        printf("%-5s %15llu %15llu %10u  %-19s  %.*s\n", attributes, (unsigned long long) entry.data_length,
+               (unsigned long long) entry.valid_data_length, entry.first_cluster, modified, (int) entry.name_length,
+               (const char *) payload + position);
+        position += entry.name_length;
+    }
+}
+
+static int printInfo(const char *image, const uint8_t *payload, uint64_t length){
+
+    WireInfo info;
+
+    if(length < sizeof (WireInfo)){
+        return -1;
+    }
+    memcpy(&info, payload, sizeof (WireInfo));
+    printf("Image:          %s (generation %llu, fingerprint %016llx)\n", image,
+           (unsigned long long) info.generation, (unsigned long long) info.fingerprint);
+    printf("Volume label:   %.*s\n", (int) (length - sizeof (WireInfo) < info.label_length ?
+                                             length - sizeof (WireInfo) : info.label_length),
+           (const char *) payload + sizeof (WireInfo));
+    printf("Serial number:  0x%08x\n", info.serial_number);
+    printf("Sector size:    %u bytes\n", info.sector_bytes);
+    printf("Cluster size:   %u bytes\n", info.cluster_bytes);
+    printf("Clusters:       %u, %u free (%llu KB)\n", info.cluster_count, info.free_clusters,
+           (unsigned long long) info.free_clusters * info.cluster_bytes / 1024);
+    printf("FAT:            %u at byte %llu, %s\n", info.number_of_fats, (unsigned long long) info.fat_offset,
+           info.fat_loaded ? "held in memory" : "read through the block cache");
+    printf("Cluster heap:   at byte %llu, root directory at cluster %u\n",
+           (unsigned long long) info.cluster_heap_offset, info.root_cluster);
+    return 0;
+}
+
+/* Writes length zero bytes */
+static int writeZeros(int output_fd, uint8_t *buffer, uint64_t length){
+
+    size_t piece;
+
+    memset(buffer, 0, COPY_BUFFER_SIZE);
+    while(length > 0){
+        piece = length < COPY_BUFFER_SIZE ? (size_t) length : COPY_BUFFER_SIZE;
+        if(writeAll(output_fd, buffer, piece) != 0){
+            return -1;
+        }
+        length -= piece;
+    }
+    return 0;
+}
+
+/*------------------------------------------------------
+// copyExtents
+//
+// PURPOSE: Writes a range of a file from the image's
+// descriptor, given the extents the daemon sent.  Parts
+// of the range no extent covers are written as zeros.
+// INPUT PARAMETERS:
+//     Takes in the image's descriptor, the payload (a
+// WireRange, then count WireExtents in file order), its
+// length and the output.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 if a read or write failed.
+//------------------------------------------------------*/
+static int copyExtents(int image_fd, const uint8_t *payload, uint64_t length, uint32_t count, int output_fd){
+
+    WireRange range;
+    WireExtent extent;
+    uint8_t *buffer;
+    uint64_t position;
+    uint64_t done;
+    size_t piece;
+    int result = 0;
+
+    if(length < sizeof (WireRange) + (uint64_t) count * sizeof (WireExtent)){
+        return -1;
+    }
+    memcpy(&range, payload, sizeof (WireRange));
+    buffer = malloc(COPY_BUFFER_SIZE);
+    assert(buffer != NULL);
+
+    position = range.offset;
+    for(uint32_t i = 0; result == 0 && i < count; i++){
+        memcpy(&extent, payload + sizeof (WireRange) + (size_t) i * sizeof (WireExtent), sizeof (WireExtent));
+        result = writeZeros(output_fd, buffer, extent.logical - position);
+        for(done = 0; result == 0 && done < extent.length; done += piece){
+            piece = extent.length - done < COPY_BUFFER_SIZE ? (size_t) (extent.length - done) : COPY_BUFFER_SIZE;
+            if(pread(image_fd, buffer, piece, (off_t) (extent.physical + done)) != (ssize_t) piece ||
+               writeAll(output_fd, buffer, piece) != 0){
+                result = -1;
+            }
+        }
+        position = extent.logical + extent.length;
+    }
+    if(result == 0){
+        result = writeZeros(output_fd, buffer, range.offset + range.length - position);
+    }
+    free(buffer);
+    return result;
+}
+
+/* Copies a streamed answer of length bytes to the output */
+static int copyStream(int socket_fd, uint64_t length, int output_fd){
+
+    uint8_t *buffer = malloc(COPY_BUFFER_SIZE);
+    size_t piece;
+    int result = 0;
+
+    assert(buffer != NULL);
+    while(result == 0 && length > 0){
+        piece = length < COPY_BUFFER_SIZE ? (size_t) length : COPY_BUFFER_SIZE;
+        if(receiveAll(socket_fd, buffer, piece) != 0 || writeAll(output_fd, buffer, piece) != 0){
+            result = -1;
+        }
+        length -= piece;
+    }
+    free(buffer);
+    return result;
+}
+
+static void usage(){
+
+    printf("Usage: exfatc [--socket path] <image> info\n"
+           "       exfatc [--socket path] <image> stat <path>...\n"
+           "       exfatc [--socket path] <image> list [path]\n"
+           "       exfatc [--socket path] <image> get <path> [--offset N] [--length N] [--fd] [output file]\n");
+}
+
+/*------------------------------------------------------
+// main
+//
+// PURPOSE: Runs one exfatc command against the daemon.
+// INPUT PARAMETERS:
+//     Takes in the command line arguments.
+// OUTPUT PARAMETERS:
+//     Returns EXIT_SUCCESS if every request succeeded.
+//------------------------------------------------------*/
+int main(int argc, char *argv[]){
+
+    ResponseHeader response;
+    const char *socket_path = DEFAULT_SOCKET_PATH;
+    const char *image;
+    const char *command;
+    const char *path = NULL;
+    const char *output_path = NULL;
+    uint8_t *payload;
+    uint64_t offset = 0;
+    uint64_t length = UINT64_MAX;
+    uint16_t flags = 0;
+    int socket_fd;
+    int image_fd = -1;
+    int output_fd = STDOUT_FILENO;
+    int status = EXIT_SUCCESS;
+    int first = 1;
+
+    if(argc > 2 && strcmp(argv[1], "--socket") == 0){
+        socket_path = argv[2];
+        argc -= 2;
+        argv += 2;
+    }
+    if(argc < 3){
+        usage();
+        return EXIT_FAILURE;
+    }
+    image = argv[1];
+    command = argv[2];
+
+    socket_fd = connectDaemon(socket_path);
+    if(socket_fd < 0){
+        fprintf(stderr, "exfatc: unable to connect to '%s'\n", socket_path);
+        return EXIT_FAILURE;
+    }
+
+    if(strcmp(command, "info") == 0 && argc == 3){
+        if(request(socket_fd, REQUEST_INFO, 0, image, NULL, 0, 0, &response, NULL) != 0 ||
+           (payload = receivePayload(socket_fd, &response)) == NULL){
+            status = EXIT_FAILURE;
+        }
+        else {
+            status = printInfo(image, payload, response.length) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+            free(payload);
+        }
+    }
+    else if(strcmp(command, "stat") == 0 && argc > 3){
+        /* One connection carries every request in turn */
+        for(int i = 3; i < argc; i++){
+            if(request(socket_fd, REQUEST_STAT, 0, image, argv[i], 0, 0, &response, NULL) != 0 ||
+               (payload = receivePayload(socket_fd, &response)) == NULL){
+                status = EXIT_FAILURE;
+                continue;
+            }
+            if(first){
+                printf("%-5s %15s %15s %10s  %-19s  %s\n", "Attr", "Size", "Valid", "Cluster", "Modified (UTC)",
+                       "Name");
+                first = 0;
+            }
+            printEntries(payload, response.length, response.count);
+            free(payload);
+        }
+    }
+    else if(strcmp(command, "list") == 0 && argc <= 4){
+        if(request(socket_fd, REQUEST_LIST, 0, image, argc == 4 ? argv[3] : "/", 0, 0, &response, NULL) != 0 ||
+           (payload = receivePayload(socket_fd, &response)) == NULL){
+            status = EXIT_FAILURE;
+        }
+        else {
+            printEntries(payload, response.length, response.count);
+            free(payload);
+        }
+    }
+    else if(strcmp(command, "get") == 0 && argc > 3){
+        for(int i = 3; i < argc; i++){
+            if(strcmp(argv[i], "--offset") == 0 && i + 1 < argc){
+                offset = strtoull(argv[++i], NULL, 0);
+            }
+            else if(strcmp(argv[i], "--length") == 0 && i + 1 < argc){
+                length = strtoull(argv[++i], NULL, 0);
+            }
+            else if(strcmp(argv[i], "--fd") == 0){
+                flags |= GET_PASS_FD;
+            }
+            else if(path == NULL){
+                path = argv[i];
+            }
+            else if(output_path == NULL){
+                output_path = argv[i];
+            }
+            else {
+                usage();
+                close(socket_fd);
+                return EXIT_FAILURE;
+            }
+        }
+        if(path == NULL){
+            usage();
+            close(socket_fd);
+            return EXIT_FAILURE;
+        }
+        if(output_path != NULL){
+            output_fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if(output_fd < 0){
+                fprintf(stderr, "exfatc: unable to create '%s'\n", output_path);
+                close(socket_fd);
+                return EXIT_FAILURE;
+            }
+        }
+
+        if(request(socket_fd, REQUEST_GET, flags, image, path, offset, length, &response, &image_fd) != 0){
+            status = EXIT_FAILURE;
+        }
+        else if((flags & GET_PASS_FD) == 0){
+            status = copyStream(socket_fd, response.length, output_fd) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        else if(image_fd < 0 || (payload = receivePayload(socket_fd, &response)) == NULL){
+            status = EXIT_FAILURE;
+        }
+        else {
+            status = copyExtents(image_fd, payload, response.length, response.count, output_fd) == 0 ?
+                     EXIT_SUCCESS : EXIT_FAILURE;
+            free(payload);
+        }
+        if(image_fd >= 0){
+            close(image_fd);
+        }
+        if(status != EXIT_SUCCESS){
+            fprintf(stderr, "exfatc: unable to get '%s'\n", path);
+        }
+        if(output_fd != STDOUT_FILENO && close(output_fd) != 0){
+            status = EXIT_FAILURE;
+        }
+    }
+    else {
+        usage();
+        status = EXIT_FAILURE;
+    }
+
+    close(socket_fd);
+    return status;
+}
@@ -0,0 +1,942 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: exfatd, a long-running daemon that opens its
+// images once and answers info, stat, list and get
+// requests from local clients over a Unix domain socket
+// (see protocol.h).  An event loop waits on the listening
+// socket and every idle connection; a connection with a
+// request ready is handed to a pool of workers, one
+// request at a time, and goes back to the loop after the
+// answer.  Every worker shares each image's geometry and
+// in-memory FAT along with the block and dentry caches.
+// A get is answered with the file's bytes, or, when the
+// client asks for it, with the image's descriptor and the
+// extents of the range so the client reads them itself.
+// Before each request the image file is fingerprinted,
+// and an image that changed on disk is loaded again;
+// requests already running finish on the old copy.
+//-----------------------------------------*/
+#define _GNU_SOURCE     /* accept4 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <assert.h>
+
+#include "exfat.h"
+#include "protocol.h"
+#include "directory.h"
+#include "file.h"
+#include "fat.h"
+#include "bitset.h"
+#include "cache.h"
+#include "dentry.h"
+#include "memory.h"
+#include "parallel.h"
+
+#define MAX_EVENTS 64
+#define LISTEN_BACKLOG 128
+#define CLIENT_TIMEOUT_SECONDS 30   /* a client stalled mid-request or mid-answer is dropped */
+#define OEM_NAME_OFFSET 3
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+/* One load of an image, kept until the last request using it ends */
+typedef struct ImageState {
+
+    int volume_fd;
+    exfat *volume;
+    uint32_t *fat;              /* NULL when it does not fit under the memory ceiling */
+    uint32_t free_clusters;
+    uint64_t fingerprint;
+    uint64_t generation;
+    int references;             /* the image's own, plus one per request */
+
+} ImageState ;
+
+typedef struct Image {
+
+    char *name;
+    char *path;
+    pthread_mutex_t lock;       /* guards state, loading and the references, never held over a load */
+    ImageState *state;
+    int loading;                /* a request is loading the image again */
+
+} Image ;
+
+typedef struct Daemon {
+
+    Image *images;
+    int image_count;
+    int listen_fd;
+    int epoll_fd;
+
+    /* Connections with a request ready, waiting for a worker */
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    int *queue;
+    int queue_capacity;
+    int queue_head;
+    int queue_count;
+    int stopping;
+
+    uint64_t requests;
+    uint64_t reloads;
+
+} Daemon ;
+
+/* A growing payload */
+typedef struct Payload {
+
+    uint8_t *bytes;
+    size_t length;
+    size_t capacity;
+
+} Payload ;
+
+/* The entries of a directory as they are encoded */
+typedef struct Listing {
+
+    Payload payload;
+    uint32_t count;
+
+} Listing ;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void requestStop(int signal_number){
+
+    (void) signal_number;
+    stop_requested = 1;
+}
+
+static void appendPayload(Payload *payload, const void *bytes, size_t length){
+
+    if(payload->length + length > payload->capacity){
+        payload->capacity = payload->capacity == 0 ? 4096 : payload->capacity;
+        while(payload->length + length > payload->capacity){
+            payload->capacity *= 2;
+        }
+        payload->bytes = realloc(payload->bytes, payload->capacity);
+        assert(payload->bytes != NULL);
+    }
+    memcpy(payload->bytes + payload->length, bytes, length);
+    payload->length += length;
+}
+
+static int sendAll(int fd, const void *bytes, size_t length){
+
+    const uint8_t *next = bytes;
+    ssize_t sent;
+
+    while(length > 0){
+        sent = send(fd, next, length, MSG_NOSIGNAL);
+        if(sent < 0 && errno == EINTR){
+            continue;
+        }
+        if(sent <= 0){
+            return -1;
+        }
+        next += sent;
+        length -= (size_t) sent;
+    }
+    return 0;
+}
+
+/* Returns 0 once length bytes arrived, 1 if the client closed before the first, -1 otherwise */
+static int receiveAll(int fd, void *bytes, size_t length){
+
+    uint8_t *next = bytes;
+    size_t done = 0;
+    ssize_t received;
+
+    while(done < length){
+        received = recv(fd, next + done, length - done, 0);
+        if(received < 0 && errno == EINTR){
+            continue;
+        }
+        if(received == 0 && done == 0){
+            return 1;
+        }
+        if(received <= 0){
+            return -1;
+        }
+        done += (size_t) received;
+    }
+    return 0;
+}
+
+/*------------------------------------------------------
+// sendResponse
+//
+// PURPOSE: Sends a response header and its payload, with
+// a descriptor attached to the header when one is given.
+// INPUT PARAMETERS:
+//     Takes in the client, the status, the record count,
+// the payload (may be NULL), its length and the
+// descriptor to pass, or -1 for none.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 if the client went away.
+//------------------------------------------------------*/
+static int sendResponse(int client_fd, uint8_t status, uint32_t count, const void *payload, uint64_t length,
+                        int pass_fd){
+
+    ResponseHeader header;
+    struct msghdr message;
+    struct iovec vector;
+    struct cmsghdr *control;
+    char control_buffer[CMSG_SPACE(sizeof (int))];
+    ssize_t sent;
+
+    memset(&header, 0, sizeof (ResponseHeader));
+    header.version = PROTOCOL_VERSION;
+    header.status = status;
+    header.count = count;
+    header.length = length;
+
+    if(pass_fd < 0){
+        if(sendAll(client_fd, &header, sizeof (ResponseHeader)) != 0){
+            return -1;
+        }
+    }
+    else {
+        memset(&message, 0, sizeof (message));
+        memset(control_buffer, 0, sizeof (control_buffer));
+        vector.iov_base = &header;
+        vector.iov_len = sizeof (ResponseHeader);
+        message.msg_iov = &vector;
+        message.msg_iovlen = 1;
+        message.msg_control = control_buffer;
+        message.msg_controllen = sizeof (control_buffer);
+        control = CMSG_FIRSTHDR(&message);
+        control->cmsg_level = SOL_SOCKET;
+        control->cmsg_type = SCM_RIGHTS;
+        control->cmsg_len = CMSG_LEN(sizeof (int));
+        memcpy(CMSG_DATA(control), &pass_fd, sizeof (int));
+
+        do {
+            sent = sendmsg(client_fd, &message, MSG_NOSIGNAL);
+        } while(sent < 0 && errno == EINTR);
+        if(sent < 0){
+            return -1;
+        }
+        /* The descriptor went with the first byte, the rest of the header follows plainly */
+        if((size_t) sent < sizeof (ResponseHeader) &&
+           sendAll(client_fd, (uint8_t *) &header + sent, sizeof (ResponseHeader) - (size_t) sent) != 0){
+            return -1;
+        }
+    }
+    return payload != NULL && length > 0 ? sendAll(client_fd, payload, (size_t) length) : 0;
+}
+
+/* Hashes what changes when an image file is replaced or written to */
+static uint64_t fingerprint(const struct stat *status){
+
+    uint64_t fields[] = {(uint64_t) status->st_dev, (uint64_t) status->st_ino, (uint64_t) status->st_size,
+                         (uint64_t) status->st_mtim.tv_sec, (uint64_t) status->st_mtim.tv_nsec,
+                         (uint64_t) status->st_ctim.tv_sec, (uint64_t) status->st_ctim.tv_nsec};
+    const uint8_t *bytes = (const uint8_t *) fields;
+    uint64_t hash = FNV_OFFSET;
+
+    for(size_t i = 0; i < sizeof (fields); i++){
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+static void destroyState(ImageState *state){
+
+    /* The caches are keyed by descriptor, so they are emptied before its number can be reused */
+    cacheDrop(state->volume_fd);
+    dentryDrop(state->volume_fd);
+    free(state->fat);
+    free(state->volume->ascii_volume_label);
+    free(state->volume);
+    close(state->volume_fd);
+    free(state);
+}
+
+/*------------------------------------------------------
+// loadState
+//
+// PURPOSE: Opens an image and reads what every request
+// shares: the volume's geometry, its FAT when it fits in
+// memory, and the free cluster count.
+// INPUT PARAMETERS:
+//     Takes in the image.
+// OUTPUT PARAMETERS:
+//     Returns the new state with one reference, or NULL if
+// the image could not be opened or is not an exFAT
+// volume.
+//------------------------------------------------------*/
+static ImageState *loadState(Image *image){
+
+    ImageState *state;
+    Bitset *bitmap;
+    struct stat status;
+    char oem_name[8];
+    int volume_fd = open(image->path, O_RDONLY | O_CLOEXEC);
+
+    if(volume_fd < 0 || fstat(volume_fd, &status) != 0){
+        fprintf(stderr, "exfatd: unable to open '%s'\n", image->path);
+        if(volume_fd >= 0){
+            close(volume_fd);
+        }
+        return NULL;
+    }
+    if(readBytes(volume_fd, oem_name, sizeof (oem_name), OEM_NAME_OFFSET) != (ssize_t) sizeof (oem_name) ||
+       memcmp(oem_name, "EXFAT   ", sizeof (oem_name)) != 0){
+        fprintf(stderr, "exfatd: '%s' is not an exFAT volume\n", image->path);
+        close(volume_fd);
+        return NULL;
+    }
+
+    state = calloc(1, sizeof (ImageState));
+    assert(state != NULL);
+    state->volume_fd = volume_fd;
+    state->fingerprint = fingerprint(&status);
+    state->references = 1;
+    state->volume = readVolume(volume_fd);
+
+    if(state->volume->sector_size < 9 || state->volume->sector_size > 12 ||
+       state->volume->sector_size + state->volume->cluster_size > 25 || state->volume->cluster_count == 0){
+        fprintf(stderr, "exfatd: '%s' is not an exFAT volume\n", image->path);
+        destroyState(state);
+        return NULL;
+    }
+
+    if(fitsMemory(((uint64_t) state->volume->cluster_count + FIRST_DATA_CLUSTER) * FAT_ENTRY_SIZE)){
+        state->fat = loadFat(volume_fd, state->volume);
+    }
+    bitmap = loadAllocationBitmap(volume_fd, state->volume, state->fat);
+    if(bitmap != NULL){
+        state->free_clusters = state->volume->cluster_count - (uint32_t) countSetBits(bitmap, 0, bitmap->size);
+        destroyBitset(bitmap);
+    }
+    return state;
+}
+
+static void releaseState(Image *image, ImageState *state){
+
+    int last;
+
+    pthread_mutex_lock(&image->lock);
+    last = --state->references == 0;
+    pthread_mutex_unlock(&image->lock);
+
+    if(last){
+        destroyState(state);
+    }
+}
+
+/*------------------------------------------------------
+// acquireState
+//
+// PURPOSE: Hands a request the current load of an image,
+// loading it again first if the file's fingerprint no
+// longer matches.  The load runs outside the image's
+// lock, one at a time, while other requests go on with
+// the old state.  It is swapped in only if the file still
+// has the fingerprint it was loaded at; a load that
+// fails, or that the file changed under, is dropped and
+// the old one keeps answering until the next request.
+// INPUT PARAMETERS:
+//     Takes in the daemon and the image.
+// OUTPUT PARAMETERS:
+//     Returns the state, released with releaseState, or
+// NULL if the image has never loaded.
+//------------------------------------------------------*/
+static ImageState *acquireState(Daemon *daemon, Image *image){
+
+    ImageState *state;
+    ImageState *fresh = NULL;
+    ImageState *retired = NULL;
+    struct stat status;
+    int stale;
+
+    stale = stat(image->path, &status) == 0;
+    pthread_mutex_lock(&image->lock);
+    stale = stale && !image->loading && (image->state == NULL || fingerprint(&status) != image->state->fingerprint);
+    if(stale){
+        image->loading = 1;
+    }
+    pthread_mutex_unlock(&image->lock);
+
+    if(stale){
+        fresh = loadState(image);
+        pthread_mutex_lock(&image->lock);
+        image->loading = 0;
+        if(fresh != NULL && stat(image->path, &status) == 0 && fingerprint(&status) == fresh->fingerprint){
+            retired = image->state;
+            fresh->generation = retired != NULL ? retired->generation + 1 : 1;
+            image->state = fresh;
+            fresh = NULL;
+            if(retired != NULL && --retired->references != 0){
+                retired = NULL;     /* the last request using it destroys it */
+            }
+            if(image->state->generation > 1){
+                fprintf(stderr, "exfatd: reloaded '%s' (generation %llu)\n", image->name,
+                        (unsigned long long) image->state->generation);
+                __atomic_add_fetch(&daemon->reloads, 1, __ATOMIC_RELAXED);
+            }
+        }
+        pthread_mutex_unlock(&image->lock);
+    }
+
+    pthread_mutex_lock(&image->lock);
+    state = image->state;
+    if(state != NULL){
+        state->references++;
+    }
+    pthread_mutex_unlock(&image->lock);
+
+    /* Closing and emptying the caches of a load waits for no one */
+    if(fresh != NULL){
+        destroyState(fresh);
+    }
+    if(retired != NULL){
+        destroyState(retired);
+    }
+    return state;
+}
+
+static void encodeEntry(Payload *payload, DirectoryEntry *entry){
+
+    WireEntry wire;
+    char *name = entryName(entry);
+
+    assert(name != NULL);
+    memset(&wire, 0, sizeof (WireEntry));
+    wire.data_length = entry->data_length;
+    wire.valid_data_length = entry->valid_data_length;
+    wire.created = (int64_t) entryTime(entry->create_timestamp, entry->create_utc_offset);
+    wire.modified = (int64_t) entryTime(entry->modify_timestamp, entry->modify_utc_offset);
+    wire.accessed = (int64_t) entryTime(entry->access_timestamp, entry->access_utc_offset);
+    wire.first_cluster = entry->first_cluster;
+    wire.attributes = entry->file_attributes;
+    wire.general_flags = entry->general_flags;
+    wire.name_length = (uint16_t) strlen(name);
+    appendPayload(payload, &wire, sizeof (WireEntry));
+    appendPayload(payload, name, wire.name_length);
+    free(name);
+}
+
+static int encodeListed(DirectoryEntry *entry, void *context){
+
+    Listing *listing = context;
+
+    encodeEntry(&listing->payload, entry);
+    listing->count++;
+    return WALK_CONTINUE;
+}
+
+static int answerInfo(int client_fd, ImageState *state){
+
+    WireInfo info;
+    exfat *volume = state->volume;
+    const char *label = volume->ascii_volume_label != NULL ? volume->ascii_volume_label : "";
+    Payload payload = {NULL, 0, 0};
+    int result;
+
+    memset(&info, 0, sizeof (WireInfo));
+    info.fingerprint = state->fingerprint;
+    info.generation = state->generation;
+    info.fat_offset = (uint64_t) volume->fat_offset << volume->sector_size;
+    info.cluster_heap_offset = (uint64_t) volume->cluster_heap_offset << volume->sector_size;
+    info.cluster_count = volume->cluster_count;
+    info.free_clusters = state->free_clusters;
+    info.cluster_bytes = clusterBytes(volume);
+    info.sector_bytes = (uint32_t) 1 << volume->sector_size;
+    info.root_cluster = volume->root_cluster;
+    info.serial_number = volume->serial_number;
+    info.number_of_fats = volume->number_of_fats;
+    info.fat_loaded = state->fat != NULL;
+    info.label_length = (uint16_t) strlen(label);
+    appendPayload(&payload, &info, sizeof (WireInfo));
+    appendPayload(&payload, label, info.label_length);
+
+    result = sendResponse(client_fd, STATUS_OK, 1, payload.bytes, payload.length, -1);
+    free(payload.bytes);
+    return result;
+}
+
+static int answerStat(int client_fd, ImageState *state, const char *path){
+
+    DirectoryEntry entry;
+    Payload payload = {NULL, 0, 0};
+    int result;
+
+    if(resolvePath(state->volume_fd, state->volume, state->fat, path, &entry) != 0){
+        return sendResponse(client_fd, STATUS_NOT_FOUND, 0, NULL, 0, -1);
+    }
+    encodeEntry(&payload, &entry);
+    result = sendResponse(client_fd, STATUS_OK, 1, payload.bytes, payload.length, -1);
+    free(payload.bytes);
+    return result;
+}
+
+static int answerList(int client_fd, ImageState *state, const char *path){
+
+    DirectoryEntry entry;
+    Listing listing = {{NULL, 0, 0}, 0};
+    int result;
+
+    if(resolvePath(state->volume_fd, state->volume, state->fat, path, &entry) != 0){
+        return sendResponse(client_fd, STATUS_NOT_FOUND, 0, NULL, 0, -1);
+    }
+    if(!isDirectory(&entry)){
+        return sendResponse(client_fd, STATUS_NOT_DIRECTORY, 0, NULL, 0, -1);
+    }
+    if(walkDirectory(state->volume_fd, state->volume, state->fat, entry.first_cluster, entry.data_length,
+                     entry.general_flags, 0, encodeListed, &listing) < 0){
+        result = sendResponse(client_fd, STATUS_IO_ERROR, 0, NULL, 0, -1);
+    }
+    else {
+        result = sendResponse(client_fd, STATUS_OK, listing.count, listing.payload.bytes, listing.payload.length, -1);
+    }
+    free(listing.payload.bytes);
+    return result;
+}
+
+/*------------------------------------------------------
+// answerGet
+//
+// PURPOSE: Answers a get of a byte range of a file.  The
+// range is cut to the file's size.  Without GET_PASS_FD
+// its bytes follow the header; with it the header carries
+// the image's descriptor and the payload is the range and
+// the extents that hold its data before ValidDataLength.
+// INPUT PARAMETERS:
+//     Takes in the client, the image state, the path and
+// the request.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 if the connection can not
+// go on.
+//------------------------------------------------------*/
+static int answerGet(int client_fd, ImageState *state, const char *path, const RequestHeader *request){
+
+    DirectoryEntry entry;
+    ExfatFile *file;
+    Payload payload = {NULL, 0, 0};
+    WireRange range;
+    WireExtent wire;
+    const Extent *extent;
+    uint64_t cluster_bytes = clusterBytes(state->volume);
+    uint64_t valid_end;
+    uint64_t start;
+    uint64_t end;
+    uint32_t count = 0;
+    int result;
+
+    if(resolvePath(state->volume_fd, state->volume, state->fat, path, &entry) != 0){
+        return sendResponse(client_fd, STATUS_NOT_FOUND, 0, NULL, 0, -1);
+    }
+    if(isDirectory(&entry)){
+        return sendResponse(client_fd, STATUS_IS_DIRECTORY, 0, NULL, 0, -1);
+    }
+
+    range.offset = request->offset < entry.data_length ? request->offset : entry.data_length;
+    range.length = entry.data_length - range.offset;
+    if(request->length < range.length){
+        range.length = request->length;
+    }
+    file = openEntry(state->volume_fd, state->volume, state->fat, &entry);
+
+    if((request->flags & GET_PASS_FD) == 0){
+        result = sendResponse(client_fd, STATUS_OK, 0, NULL, range.length, -1);
+        if(result == 0 && range.length > 0){
+            result = extractFile(file, client_fd, range.offset, range.length, 0);
+        }
+        closeFile(file);
+        return result;
+    }
+
+    valid_end = entry.valid_data_length < range.offset + range.length ? entry.valid_data_length :
+                range.offset + range.length;
+    appendPayload(&payload, &range, sizeof (WireRange));
+    do {
+        for(uint32_t i = 0; i < file->extent_count; i++){
+            extent = &file->extents[i];
+            start = extent->file_cluster * cluster_bytes;
+            end = start + (uint64_t) extent->length * cluster_bytes;
+            if(start < range.offset){
+                start = range.offset;
+            }
+            if(end > valid_end){
+                end = valid_end;
+            }
+            if(start < end){
+                wire.logical = start;
+                wire.physical = clusterOffset(state->volume, extent->first_cluster) +
+                                (start - extent->file_cluster * cluster_bytes);
+                wire.length = end - start;
+                appendPayload(&payload, &wire, sizeof (WireExtent));
+                count++;
+            }
+        }
+    } while(nextExtents(file));
+    closeFile(file);
+
+    result = sendResponse(client_fd, STATUS_OK, count, payload.bytes, payload.length, state->volume_fd);
+    free(payload.bytes);
+    return result;
+}
+
+static Image *findImage(Daemon *daemon, const char *name){
+
+    for(int i = 0; i < daemon->image_count; i++){
+        if(strcmp(daemon->images[i].name, name) == 0){
+            return &daemon->images[i];
+        }
+    }
+    return NULL;
+}
+
+/*------------------------------------------------------
+// serveRequest
+//
+// PURPOSE: Reads one request from a client and answers it.
+// INPUT PARAMETERS:
+//     Takes in the daemon and the client's socket.
+// OUTPUT PARAMETERS:
+//     Returns 0 if the connection is ready for the next
+// request, -1 if it is closed or can not go on.
+//------------------------------------------------------*/
+static int serveRequest(Daemon *daemon, int client_fd){
+
+    RequestHeader request;
+    char name[MAX_IMAGE_NAME + 1];
+    char path[MAX_REQUEST_PATH + 1];
+    Image *image;
+    ImageState *state;
+    int result;
+
+    if(receiveAll(client_fd, &request, sizeof (RequestHeader)) != 0){
+        return -1;
+    }
+    if(request.version != PROTOCOL_VERSION || request.image_length > MAX_IMAGE_NAME ||
+       request.path_length > MAX_REQUEST_PATH){
+        sendResponse(client_fd, STATUS_BAD_REQUEST, 0, NULL, 0, -1);
+        return -1;
+    }
+    if(receiveAll(client_fd, name, request.image_length) < 0 ||
+       receiveAll(client_fd, path, request.path_length) < 0){
+        return -1;
+    }
+    name[request.image_length] = '\0';
+    path[request.path_length] = '\0';
+    if(request.path_length == 0){
+        strcpy(path, "/");
+    }
+    __atomic_add_fetch(&daemon->requests, 1, __ATOMIC_RELAXED);
+
+    image = findImage(daemon, name);
+    state = image != NULL ? acquireState(daemon, image) : NULL;
+    if(state == NULL){
+        return sendResponse(client_fd, STATUS_NO_IMAGE, 0, NULL, 0, -1);
+    }
+
+    switch(request.type){
+        case REQUEST_INFO:
+            result = answerInfo(client_fd, state);
+            break;
+        case REQUEST_STAT:
+            result = answerStat(client_fd, state, path);
+            break;
+        case REQUEST_LIST:
+            result = answerList(client_fd, state, path);
+            break;
+        case REQUEST_GET:
+            result = answerGet(client_fd, state, path, &request);
+            break;
+        default:
+            result = sendResponse(client_fd, STATUS_BAD_REQUEST, 0, NULL, 0, -1);
+            break;
+    }
+    releaseState(image, state);
+    return result;
+}
+
+/* Puts a connection back on the event loop's watch, for its next request */
+static int watchConnection(Daemon *daemon, int client_fd, int operation){
+
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof (event));
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.fd = client_fd;
+    return epoll_ctl(daemon->epoll_fd, operation, client_fd, &event);
+}
+
+static void queueConnection(Daemon *daemon, int client_fd){
+
+    pthread_mutex_lock(&daemon->lock);
+    if(daemon->queue_count == daemon->queue_capacity){
+        int *queue = malloc((size_t) daemon->queue_capacity * 2 * sizeof (int));
+
+        assert(queue != NULL);
+        for(int i = 0; i < daemon->queue_count; i++){
+            queue[i] = daemon->queue[(daemon->queue_head + i) % daemon->queue_capacity];
+        }
+        free(daemon->queue);
+        daemon->queue = queue;
+        daemon->queue_head = 0;
+        daemon->queue_capacity *= 2;
+    }
+    daemon->queue[(daemon->queue_head + daemon->queue_count) % daemon->queue_capacity] = client_fd;
+    daemon->queue_count++;
+    pthread_cond_signal(&daemon->ready);
+    pthread_mutex_unlock(&daemon->lock);
+}
+
+static void *runWorker(void *context){
+
+    Daemon *daemon = context;
+    int client_fd;
+
+    for(;;){
+        pthread_mutex_lock(&daemon->lock);
+        while(daemon->queue_count == 0 && !daemon->stopping){
+            pthread_cond_wait(&daemon->ready, &daemon->lock);
+        }
+        if(daemon->stopping){
+            pthread_mutex_unlock(&daemon->lock);
+            break;
+        }
+        client_fd = daemon->queue[daemon->queue_head];
+        daemon->queue_head = (daemon->queue_head + 1) % daemon->queue_capacity;
+        daemon->queue_count--;
+        pthread_mutex_unlock(&daemon->lock);
+
+        if(serveRequest(daemon, client_fd) != 0 || watchConnection(daemon, client_fd, EPOLL_CTL_MOD) != 0){
+            close(client_fd);
+        }
+    }
+    return NULL;
+}
+
+static void acceptConnections(Daemon *daemon){
+
+    struct timeval timeout = {CLIENT_TIMEOUT_SECONDS, 0};
+    int client_fd;
+
+    while((client_fd = accept4(daemon->listen_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0){
+        setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+        setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+        if(watchConnection(daemon, client_fd, EPOLL_CTL_ADD) != 0){
+            close(client_fd);
+        }
+    }
+}
+
+/* Binds the listening socket, replacing a stale one left by an earlier run */
+static int openSocket(const char *socket_path){
+
+    struct sockaddr_un address;
+    struct stat status;
+    int listen_fd;
+
+    if(strlen(socket_path) >= sizeof (address.sun_path)){
+        fprintf(stderr, "exfatd: socket path too long: '%s'\n", socket_path);
+        return -1;
+    }
+    memset(&address, 0, sizeof (address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+
+    if(lstat(socket_path, &status) == 0 && S_ISSOCK(status.st_mode)){
+        unlink(socket_path);
+    }
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &address, sizeof (address)) != 0 ||
+       chmod(socket_path, 0600) != 0 || listen(listen_fd, LISTEN_BACKLOG) != 0){
+        fprintf(stderr, "exfatd: unable to listen on '%s'\n", socket_path);
+        if(listen_fd >= 0){
+            close(listen_fd);
+        }
+        return -1;
+    }
+    return listen_fd;
+}
+
+/*------------------------------------------------------
+// main
+//
+// PURPOSE: Runs "exfatd [--socket path] [--workers N]
+// [--cache=MB] [--dcache=MB] [--max-memory=MB] image...",
+// where each image is a path, known to clients by its
+// file name, or name=path.  Every image is loaded before
+// the socket opens; SIGINT or SIGTERM stops the daemon.
+// INPUT PARAMETERS:
+//     Takes in the command line arguments.
+// OUTPUT PARAMETERS:
+//     Returns EXIT_SUCCESS after a clean stop.
+//------------------------------------------------------*/
+int main(int argc, char *argv[]){
+
+    Daemon daemon;
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event event;
+    struct sigaction action;
+    sigset_t stop_signals;
+    pthread_t *workers;
+    const char *socket_path = DEFAULT_SOCKET_PATH;
+    const char *separator;
+    unsigned int worker_count = threadCount();
+    uint64_t cache_budget = DEFAULT_CACHE_BUDGET;
+    uint64_t dentry_budget = DEFAULT_DENTRY_BUDGET;
+    Image *image;
+    int ready;
+
+    memset(&daemon, 0, sizeof (Daemon));
+    daemon.images = calloc((size_t) argc, sizeof (Image));
+    assert(daemon.images != NULL);
+
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "--socket") == 0 && i + 1 < argc){
+            socket_path = argv[++i];
+        }
+        else if(strcmp(argv[i], "--workers") == 0 && i + 1 < argc){
+            worker_count = (unsigned int) strtoul(argv[++i], NULL, 10);
+        }
+        else if(strncmp(argv[i], "--cache=", 8) == 0){
+            cache_budget = strtoull(argv[i] + 8, NULL, 10) * KILOBYTE_SIZE * KILOBYTE_SIZE;
+        }
+        else if(strncmp(argv[i], "--dcache=", 9) == 0){
+            dentry_budget = strtoull(argv[i] + 9, NULL, 10) * KILOBYTE_SIZE * KILOBYTE_SIZE;
+        }
+        else if(strncmp(argv[i], "--max-memory=", 13) == 0){
+            setMemoryCeiling(strtoull(argv[i] + 13, NULL, 10) * KILOBYTE_SIZE * KILOBYTE_SIZE);
+        }
+        else if(argv[i][0] == '-'){
+            daemon.image_count = 0;
+            break;
+        }
+        else {
+            image = &daemon.images[daemon.image_count++];
+            separator = strchr(argv[i], '=');
+            if(separator != NULL){
+                image->name = strndup(argv[i], (size_t) (separator - argv[i]));
+                image->path = strdup(separator + 1);
+            }
+            else {
+                separator = strrchr(argv[i], '/');
+                image->name = strdup(separator != NULL ? separator + 1 : argv[i]);
+                image->path = strdup(argv[i]);
+            }
+            assert(image->name != NULL && image->path != NULL);
+            pthread_mutex_init(&image->lock, NULL);
+        }
+    }
+    if(daemon.image_count == 0 || worker_count == 0){
+        printf("Usage: exfatd [--socket path] [--workers N] [--cache=MB] [--dcache=MB] [--max-memory=MB] "
+               "[name=]image...\n");
+        return EXIT_FAILURE;
+    }
+
+    if(cacheOpen(memoryShare(cache_budget)) != 0 || dentryOpen(memoryShare(dentry_budget)) != 0){
+        fprintf(stderr, "exfatd: unable to allocate the caches\n");
+        return EXIT_FAILURE;
+    }
+    for(int i = 0; i < daemon.image_count; i++){
+        if(findImage(&daemon, daemon.images[i].name) != &daemon.images[i]){
+            fprintf(stderr, "exfatd: two images are named '%s'\n", daemon.images[i].name);
+            return EXIT_FAILURE;
+        }
+        daemon.images[i].state = loadState(&daemon.images[i]);
+        if(daemon.images[i].state == NULL){
+            return EXIT_FAILURE;
+        }
+        daemon.images[i].state->generation = 1;
+    }
+
+    daemon.listen_fd = openSocket(socket_path);
+    if(daemon.listen_fd < 0){
+        return EXIT_FAILURE;
+    }
+    daemon.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    memset(&event, 0, sizeof (event));
+    event.events = EPOLLIN;
+    event.data.fd = daemon.listen_fd;
+    if(daemon.epoll_fd < 0 || epoll_ctl(daemon.epoll_fd, EPOLL_CTL_ADD, daemon.listen_fd, &event) != 0){
+        fprintf(stderr, "exfatd: unable to start the event loop\n");
+        return EXIT_FAILURE;
+    }
+
+    /* No SA_RESTART, so a stop request interrupts epoll_wait */
+    memset(&action, 0, sizeof (action));
+    action.sa_handler = requestStop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* The workers leave SIGINT and SIGTERM to the event loop's thread */
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
+    pthread_mutex_init(&daemon.lock, NULL);
+    pthread_cond_init(&daemon.ready, NULL);
+    daemon.queue_capacity = MAX_EVENTS;
+    daemon.queue = malloc((size_t) daemon.queue_capacity * sizeof (int));
+    workers = malloc(worker_count * sizeof (pthread_t));
+    assert(daemon.queue != NULL && workers != NULL);
+    for(unsigned int i = 0; i < worker_count; i++){
+        pthread_create(&workers[i], NULL, runWorker, &daemon);
+    }
+    pthread_sigmask(SIG_UNBLOCK, &stop_signals, NULL);
+    fprintf(stderr, "exfatd: serving %d image(s) on '%s' with %u worker(s)\n", daemon.image_count, socket_path,
+            worker_count);
+
+    while(!stop_requested){
+        ready = epoll_wait(daemon.epoll_fd, events, MAX_EVENTS, -1);
+        for(int i = 0; i < ready; i++){
+            if(events[i].data.fd == daemon.listen_fd){
+                acceptConnections(&daemon);
+            }
+            else {
+                queueConnection(&daemon, events[i].data.fd);
+            }
+        }
+    }
+
+    pthread_mutex_lock(&daemon.lock);
+    daemon.stopping = 1;
+    pthread_cond_broadcast(&daemon.ready);
+    pthread_mutex_unlock(&daemon.lock);
+    for(unsigned int i = 0; i < worker_count; i++){
+        pthread_join(workers[i], NULL);
+    }
+    for(int i = 0; i < daemon.queue_count; i++){
+        close(daemon.queue[(daemon.queue_head + i) % daemon.queue_capacity]);
+    }
+    close(daemon.epoll_fd);
+    close(daemon.listen_fd);
+    unlink(socket_path);
+
+    fprintf(stderr, "exfatd: answered %llu request(s), %llu reload(s)\n", (unsigned long long) daemon.requests,
+            (unsigned long long) daemon.reloads);
+    for(int i = 0; i < daemon.image_count; i++){
+        destroyState(daemon.images[i].state);
+        pthread_mutex_destroy(&daemon.images[i].lock);
+        free(daemon.images[i].name);
+        free(daemon.images[i].path);
+    }
+    free(daemon.images);
+    free(daemon.queue);
+    free(workers);
+    dentryClose();
+    cacheClose();
+    return EXIT_SUCCESS;
+}
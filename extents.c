@@ -0,0 +1,284 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Implement "extents", the physical layout of
+// files as JSON in the manner of the FIEMAP ioctl.  Each
+// file's cluster chain is followed once into its extent
+// index and every extent is printed with its offset in
+// the file, its byte offset in the image (from the
+// cluster heap offset) and its length, so other programs
+// can read file data straight from the image.  Extents
+// are cut at DataLength, and at ValidDataLength, past
+// which the data reads as zeros whatever the clusters
+// hold.
+//-----------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "extents.h"
+#include "directory.h"
+#include "file.h"
+
+/* Extent flags, printed by name */
+#define EXTENT_LAST 0x01            /* the final extent of the file */
+#define EXTENT_UNWRITTEN 0x02       /* past ValidDataLength, reads as zeros */
+#define EXTENT_CONTIGUOUS 0x04      /* NoFatChain, the clusters follow each other without a FAT chain */
+
+typedef struct ExtentsListing {
+
+    int volume_fd;
+    exfat *volume;
+    uint64_t files;
+
+} ExtentsListing ;
+
+/* Returns the length of the well-formed UTF-8 sequence at text, 0 if its first byte starts none */
+static int utf8Length(const unsigned char *text){
+
+    uint32_t code_point;
+    int length;
+
+    if(text[0] < 0x80){
+        return 1;
+    }
+    if(text[0] >= 0xc2 && text[0] <= 0xdf){
+        length = 2;
+        code_point = text[0] & 0x1f;
+    }
+    else if(text[0] >= 0xe0 && text[0] <= 0xef){
+        length = 3;
+        code_point = text[0] & 0x0f;
+    }
+    else if(text[0] >= 0xf0 && text[0] <= 0xf4){
+        length = 4;
+        code_point = text[0] & 0x07;
+    }
+    else {
+        return 0;
+    }
+
+    /* The NUL ending the string is not a continuation byte, so the loop never reads past it */
+    for(int i = 1; i < length; i++){
+        if((text[i] & 0xc0) != 0x80){
+            return 0;
+        }
+        code_point = (code_point << 6) | (text[i] & 0x3f);
+    }
+
+    /* Overlong forms, UTF-16 surrogates and anything past U+10FFFF are not valid */
+    if((length == 3 && code_point < 0x800) || (length == 4 && code_point < 0x10000) ||
+       (code_point >= 0xd800 && code_point <= 0xdfff) || code_point > 0x10ffff){
+        return 0;
+    }
+    return length;
+}
+
+/* Prints text as a JSON string, bytes outside any well-formed UTF-8 sequence as \u00XX */
+static void printJsonString(const char *text){
+
+    const unsigned char *at = (const unsigned char *) text;
+    int length;
+
+    putchar('"');
+    while(*at != '\0'){
+        length = utf8Length(at);
+        if(*at == '"' || *at == '\\'){
+            printf("\\%c", *at);
+        }
+        else if(*at < 0x20 || length == 0){
+            printf("\\u%04x", *at);
+            length = 1;
+        }
+        else {
+            fwrite(at, 1, (size_t) length, stdout);
+        }
+        at += length;
+    }
+    putchar('"');
+}
+
+static void printFlags(int flags){
+
+    const char *separator = "";
+
+    printf("\"flags\":[");
+    if(flags & EXTENT_CONTIGUOUS){
+        printf("%s\"contiguous\"", separator);
+        separator = ",";
+    }
+    if(flags & EXTENT_UNWRITTEN){
+        printf("%s\"unwritten\"", separator);
+        separator = ",";
+    }
+    if(flags & EXTENT_LAST){
+        printf("%s\"last\"", separator);
+    }
+    putchar(']');
+}
+
+static void printExtent(int *count, uint64_t logical, uint64_t physical, uint64_t length, int flags){
+
+    printf("%s{\"logical\":%llu,\"physical\":%llu,\"length\":%llu,", *count > 0 ? "," : "",
+           (unsigned long long) logical, (unsigned long long) physical, (unsigned long long) length);
+    printFlags(flags);
+    putchar('}');
+    (*count)++;
+}
+
+/*------------------------------------------------------
+// printFileExtents
+//
+// PURPOSE: Prints one file as a JSON object: its path,
+// sizes, first cluster and extents.  Each extent of the
+// chain is clipped to DataLength and split where
+// ValidDataLength falls.  "mapped" is the number of
+// bytes the extents cover, less than "size" when the
+// chain ends early.  The extents are printed a window at
+// a time, so a file of any length takes bounded memory.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct, the path to print
+// and the file's entry.
+//------------------------------------------------------*/
+static void printFileExtents(int volume_fd, exfat *volume, const char *path, const DirectoryEntry *entry){
+
+    ExfatFile *file = openEntry(volume_fd, volume, NULL, entry);
+    uint64_t cluster_bytes = clusterBytes(volume);
+    uint64_t size = entry->data_length;
+    uint64_t valid = entry->valid_data_length < size ? entry->valid_data_length : size;
+    uint64_t mapped = 0;
+    uint64_t start;
+    uint64_t end;
+    uint64_t physical;
+    int contiguous = (entry->general_flags & FLAG_NO_FAT_CHAIN) != 0 ? EXTENT_CONTIGUOUS : 0;
+    int count = 0;
+    int last;
+    const Extent *extent;
+
+    printf("{\"path\":");
+    printJsonString(path);
+    printf(",\"directory\":%s,\"size\":%llu,\"valid_data_length\":%llu,\"first_cluster\":%u,",
+           isDirectory(entry) ? "true" : "false", (unsigned long long) size,
+           (unsigned long long) entry->valid_data_length, entry->first_cluster);
+    printFlags(contiguous);
+    printf(",\"extents\":[");
+
+    do {
+        for(uint32_t i = 0; i < file->extent_count; i++){
+            extent = &file->extents[i];
+            start = extent->file_cluster * cluster_bytes;
+            end = start + (uint64_t) extent->length * cluster_bytes;
+            if(end > size){
+                end = size;
+            }
+            if(start >= end){
+                continue;
+            }
+            physical = clusterOffset(volume, extent->first_cluster);
+            mapped += end - start;
+            last = file->complete && i == file->extent_count - 1 ? EXTENT_LAST : 0;
+
+            if(start < valid && valid < end){
+                printExtent(&count, start, physical, valid - start, contiguous);
+                printExtent(&count, valid, physical + (valid - start), end - valid,
+                            contiguous | EXTENT_UNWRITTEN | last);
+            }
+            else {
+                printExtent(&count, start, physical, end - start,
+                            contiguous | (start >= valid ? EXTENT_UNWRITTEN : 0) | last);
+            }
+        }
+    } while(nextExtents(file));
+
+    printf("],\"mapped\":%llu}", (unsigned long long) mapped);
+    closeFile(file);
+}
+
+static int listEntry(const char *path, DirectoryEntry *entry, void *context){
+
+    ExtentsListing *listing = context;
+
+    if(isDirectory(entry)){
+        return WALK_CONTINUE;
+    }
+    printf("%s\n", listing->files == 0 ? "" : ",");
+    printFileExtents(listing->volume_fd, listing->volume, path, entry);
+    listing->files++;
+    return WALK_CONTINUE;
+}
+
+/*------------------------------------------------------
+// commandExtents
+//
+// PURPOSE: Runs "extents <path> [-r]", printing the
+// extents of a file (or of the directory's own clusters)
+// as a JSON object, or with -r a JSON array of the
+// extents of every file below a directory, one file per
+// line.  Physical offsets are byte offsets into the
+// image.  Messages go to standard error.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct and the arguments
+// that follow the command.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 otherwise.
+//------------------------------------------------------*/
+int commandExtents(int volume_fd, exfat *volume, int argc, char *argv[]){
+
+    ExtentsListing listing;
+    DirectoryEntry entry;
+    const char *path = NULL;
+    char *prefix;
+    int recursive = 0;
+
+    for(int i = 0; i < argc; i++){
+        if(strcmp(argv[i], "-r") == 0){
+            recursive = 1;
+        }
+        else if(path == NULL){
+            path = argv[i];
+        }
+        else {
+            fprintf(stderr, "Invalid extents option: '%s'\n", argv[i]);
+            return -1;
+        }
+    }
+    if(path == NULL){
+        fprintf(stderr, "Usage: extents <path> [-r]\n");
+        return -1;
+    }
+    if(resolvePath(volume_fd, volume, NULL, path, &entry) != 0){
+        fprintf(stderr, "No such file or directory: '%s'\n", path);
+        return -1;
+    }
+
+    if(!recursive){
+        printFileExtents(volume_fd, volume, path, &entry);
+        putchar('\n');
+        return 0;
+    }
+    if(!isDirectory(&entry)){
+        fprintf(stderr, "Not a directory: '%s'\n", path);
+        return -1;
+    }
+
+    /* Paths below the directory are printed as the directory's path plus their own */
+    prefix = strdup(path);
+    assert(prefix != NULL);
+    while(strlen(prefix) > 0 && prefix[strlen(prefix) - 1] == '/'){
+        prefix[strlen(prefix) - 1] = '\0';
+    }
+
+    listing.volume_fd = volume_fd;
+    listing.volume = volume;
+    listing.files = 0;
+    putchar('[');
+    walkTree(volume_fd, volume, NULL, prefix, entry.first_cluster, entry.data_length, entry.general_flags,
+             listEntry, &listing);
+    printf("\n]\n");
+
+    free(prefix);
+    return 0;
+}
@@ -0,0 +1,14 @@
+//
+// FIEMAP style JSON listing of where files lie in the image.
+//
+
+#ifndef FSREADER_EXTENTS_H
+#define FSREADER_EXTENTS_H
+
+#include "exfat.h"
+
+
+int commandExtents(int volume_fd, exfat *volume, int argc, char *argv[]);
+
+
+#endif //FSREADER_EXTENTS_H
@@ -0,0 +1,363 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Load the File Allocation Table and the
+// allocation bitmap of an exfat volume into memory so
+// that commands which visit every cluster do not seek
+// back to the volume for each FAT entry, and walk
+// single cluster chains with bounds and loop detection.
+//-----------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "fat.h"
+#include "parallel.h"
+#include "runindex.h"
+
+#define FAT_READ_SIZE (8 * KILOBYTE_SIZE * KILOBYTE_SIZE)
+
+typedef struct FatLoad {
+
+    int volume_fd;
+    uint64_t fat_start;     /* byte offset of FatEntry[0] */
+    uint8_t *destination;
+    int failed;
+
+} FatLoad ;
+
+static void loadFatSlice(uint64_t start, uint64_t end, void *context){
+
+    FatLoad *load = context;
+    uint64_t length;
+
+    while(start < end){
+        length = end - start;
+        if(length > FAT_READ_SIZE){
+            length = FAT_READ_SIZE;
+        }
+        if(readBytesAs(load->volume_fd, load->destination + start, length, load->fat_start + start, TRACE_FAT) != (ssize_t) length){
+            load->failed = 1;
+        }
+        start += length;
+    }
+}
+
+/*------------------------------------------------------
+// loadFat
+//
+// PURPOSE: Reads the first FAT of the volume into memory,
+// every thread reads its own slice of the table.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume along
+// with a pointer to the exfat volume struct.
+// OUTPUT PARAMETERS:
+//     Returns a heap allocated array of cluster_count + 2
+// FAT entries indexed by cluster number, or NULL if the
+// FAT could not be read.  The caller frees the array.
+//------------------------------------------------------*/
+uint32_t *loadFat(int volume_fd, exfat *volume){
+
+    FatLoad load;
+    uint64_t entries = (uint64_t) volume->cluster_count + FIRST_DATA_CLUSTER;
+    uint32_t *fat = malloc(entries * FAT_ENTRY_SIZE);
+
+    if(fat != NULL){
+        load.volume_fd = volume_fd;
+        load.fat_start = (uint64_t) volume->fat_offset * sectorsToBytes(volume, 1);
+        load.destination = (uint8_t *) fat;
+        load.failed = 0;
+
+        traceBegin("load FAT");
+        parallelRanges(entries * FAT_ENTRY_SIZE, loadFatSlice, &load);
+        traceEnd();
+
+        if(load.failed){
+            free(fat);
+            fat = NULL;
+        }
+    }
+    return fat;
+}
+
+/*------------------------------------------------------
+// readFatEntry
+//
+// PURPOSE: Returns the FAT entry for a cluster, either
+// from an in-memory FAT, from the volume's run index, or
+// by reading the entry from the volume when there is
+// neither.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct, the in-memory FAT
+// (may be NULL) and the cluster whose entry is wanted.
+// OUTPUT PARAMETERS:
+//     Returns the FAT entry, END_OF_CHAIN if the cluster
+// is outside the FAT or the entry could not be read.
+//------------------------------------------------------*/
+uint32_t readFatEntry(int volume_fd, exfat *volume, const uint32_t *fat, uint32_t cluster){
+
+    const RunIndex *runs;
+    uint32_t entry = END_OF_CHAIN;
+    uint64_t offset;
+
+    if(cluster < (uint64_t) volume->cluster_count + FIRST_DATA_CLUSTER){
+        if(fat != NULL){
+            entry = fat[cluster];
+        }
+        else if(cluster >= FIRST_DATA_CLUSTER && (runs = runIndexFor(volume_fd)) != NULL){
+            entry = runIndexEntry(runs, cluster);
+        }
+        else {
+            offset = (uint64_t) volume->fat_offset * sectorsToBytes(volume, 1);
+            offset += (uint64_t) FAT_ENTRY_SIZE * cluster;
+            if(readBytesAs(volume_fd, &entry, FAT_ENTRY_SIZE, offset, TRACE_FAT) != FAT_ENTRY_SIZE){
+                entry = END_OF_CHAIN;
+            }
+        }
+    }
+    return entry;
+}
+
+/*------------------------------------------------------
+// findCycleStart
+//
+// PURPOSE: Once a cycle of length cycle_length has been
+// found in a chain, walks the chain again to find the
+// first cluster on the cycle and the cluster whose FAT
+// entry links back to it.  Only runs on corrupt chains.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct, the in-memory FAT
+// (may be NULL), the chain's first cluster, the cycle
+// length and the ChainError to fill in.
+//------------------------------------------------------*/
+static void findCycleStart(int volume_fd, exfat *volume, const uint32_t *fat, uint32_t first_cluster,
+                           uint64_t cycle_length, ChainError *error){
+
+    uint32_t tortoise = first_cluster;
+    uint32_t hare = first_cluster;
+    uint64_t start = 0;
+
+    for(uint64_t i = 0; i < cycle_length; i++){
+        hare = readFatEntry(volume_fd, volume, fat, hare);
+    }
+    while(tortoise != hare){
+        tortoise = readFatEntry(volume_fd, volume, fat, tortoise);
+        hare = readFatEntry(volume_fd, volume, fat, hare);
+        start++;
+    }
+
+    /* The last cluster of the loop is cycle_length - 1 clusters past its start */
+    error->value = tortoise;
+    error->cluster = tortoise;
+    for(uint64_t i = 1; i < cycle_length; i++){
+        error->cluster = readFatEntry(volume_fd, volume, fat, error->cluster);
+    }
+    error->length = start + cycle_length;
+}
+
+/*------------------------------------------------------
+// walkClusterChain
+//
+// PURPOSE: Follows a cluster chain through the FAT,
+// calling visit for each cluster.  The walk is bounded:
+// it stops after max_clusters clusters (at most the
+// number of clusters on the volume), at an entry outside
+// the heap or a bad cluster, and at a loop, which is
+// found with Brent's algorithm in constant memory and a
+// single comparison per cluster.  When the chain loops,
+// visit may already have seen up to twice its length of
+// clusters; error->length is the number that are
+// distinct, and callers keep only those.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct, the in-memory FAT
+// (may be NULL), the first cluster of the chain, the
+// most clusters it may have (from its DataLength, or
+// UINT64_MAX when unknown), the visitor (may be NULL)
+// with its context and a ChainError to fill in (may be
+// NULL).
+// OUTPUT PARAMETERS:
+//     Returns CHAIN_OK when the chain ends properly, or
+// the ChainStatus that stopped the walk.
+//------------------------------------------------------*/
+ChainStatus walkClusterChain(int volume_fd, exfat *volume, const uint32_t *fat, uint32_t first_cluster,
+                             uint64_t max_clusters, ChainVisitor visit, void *context, ChainError *error){
+
+    ChainError result = {CHAIN_OK, 0, first_cluster, first_cluster};
+    uint32_t cluster = first_cluster;
+    uint32_t next;
+    uint32_t tortoise = first_cluster;
+    uint64_t power = 1;
+    uint64_t lambda = 1;
+
+    if(max_clusters > volume->cluster_count){
+        max_clusters = volume->cluster_count;
+    }
+
+    if(!isValidCluster(volume, first_cluster)){
+        result.status = CHAIN_OUT_OF_RANGE;
+    }
+
+    while(result.status == CHAIN_OK){
+
+        if(result.length == max_clusters){
+            result.status = CHAIN_TOO_LONG;
+            result.value = cluster;
+            break;
+        }
+        if(visit != NULL){
+            visit(cluster, context);
+        }
+        result.length++;
+        result.cluster = cluster;
+
+        next = readFatEntry(volume_fd, volume, fat, cluster);
+        result.value = next;
+        if(next == END_OF_CHAIN){
+            break;
+        }
+        if(next == BAD_CLUSTER){
+            result.status = CHAIN_BAD_CLUSTER;
+        }
+        else if(!isValidCluster(volume, next)){
+            result.status = CHAIN_OUT_OF_RANGE;
+        }
+        else if(next == tortoise){
+            result.status = CHAIN_CYCLE;
+            findCycleStart(volume_fd, volume, fat, first_cluster, lambda, &result);
+        }
+        else {
+            /* Brent: the tortoise jumps to the hare each time the distance reaches a power of two */
+            if(lambda == power){
+                tortoise = next;
+                power *= 2;
+                lambda = 0;
+            }
+            lambda++;
+            cluster = next;
+        }
+    }
+
+    if(error != NULL){
+        *error = result;
+    }
+    return result.status;
+}
+
+const char *chainStatusString(ChainStatus status){
+
+    switch(status){
+        case CHAIN_OK:
+            return "ok";
+        case CHAIN_OUT_OF_RANGE:
+            return "links outside the cluster heap";
+        case CHAIN_BAD_CLUSTER:
+            return "links to a bad cluster";
+        case CHAIN_CYCLE:
+            return "loops back on itself";
+        case CHAIN_TOO_LONG:
+            return "has more clusters than its length allows";
+    }
+    return "unknown error";
+}
+
+/*------------------------------------------------------
+// startChain
+//
+// PURPOSE: Sets up an iterator over the clusters of a
+// chain, so a chain of any length is followed in constant
+// memory.  The length is the number of good clusters
+// walkClusterChain found (ChainError.length), which keeps
+// the iterator from running into a loop or off the heap.
+// INPUT PARAMETERS:
+//     Takes in the iterator, a file descriptor to an exfat
+// volume, a pointer to the exfat volume struct, the
+// in-memory FAT (may be NULL), the first cluster of the
+// chain and the number of clusters to hand out.
+//------------------------------------------------------*/
+void startChain(ChainIterator *chain, int volume_fd, exfat *volume, const uint32_t *fat, uint32_t first_cluster,
+                uint64_t length){
+
+    chain->volume_fd = volume_fd;
+    chain->volume = volume;
+    chain->fat = fat;
+    chain->cluster = first_cluster;
+    chain->remaining = length;
+}
+
+/* Returns the next cluster of the chain, END_OF_CHAIN once all have been handed out */
+uint32_t nextChainCluster(ChainIterator *chain){
+
+    uint32_t cluster = chain->cluster;
+
+    if(chain->remaining == 0){
+        return END_OF_CHAIN;
+    }
+    chain->remaining--;
+    if(chain->remaining > 0){
+        chain->cluster = readFatEntry(chain->volume_fd, chain->volume, chain->fat, cluster);
+    }
+    return cluster;
+}
+
+/*------------------------------------------------------
+// loadAllocationBitmap
+//
+// PURPOSE: Reads the allocation bitmap into a Bitset where
+// bit (cluster - 2) is set when the cluster is in use.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct and the in-memory
+// FAT (may be NULL) used to follow the bitmap's chain.
+// OUTPUT PARAMETERS:
+//     Returns the Bitset, or NULL if the bitmap could not
+// be read.  The caller destroys the Bitset.
+//------------------------------------------------------*/
+Bitset *loadAllocationBitmap(int volume_fd, exfat *volume, const uint32_t *fat){
+
+    Bitset *bitmap = createBitset(volume->cluster_count);
+    uint8_t *bytes;
+    uint64_t length = (volume->cluster_count + 7) / 8;
+    uint64_t copied = 0;
+    uint64_t chunk;
+    uint64_t steps = 0;
+    uint32_t cluster = volume->first_bitmap_cluster;
+
+    if(bitmap == NULL){
+        return NULL;
+    }
+    if(volume->first_bitmap_cluster_data_length < length){
+        length = volume->first_bitmap_cluster_data_length;
+    }
+
+    bytes = (uint8_t *) bitmap->words;
+    traceBegin("load bitmap");
+    while(copied < length && isValidCluster(volume, cluster) && steps < volume->cluster_count){
+        chunk = length - copied;
+        if(chunk > clusterBytes(volume)){
+            chunk = clusterBytes(volume);
+        }
+        if(readBytesAs(volume_fd, bytes + copied, chunk, clusterOffset(volume, cluster), TRACE_BITMAP) != (ssize_t) chunk){
+            break;
+        }
+        copied += chunk;
+        cluster = readFatEntry(volume_fd, volume, fat, cluster);
+        steps++;
+    }
+    traceEnd();
+
+    if(copied < length){
+        printf("Unable to read the allocation bitmap\n");
+        destroyBitset(bitmap);
+        return NULL;
+    }
+
+    /* Bits past the last cluster are undefined on disk, never report them as used */
+    if(volume->cluster_count % 64 != 0){
+        bitmap->words[bitmap->word_count - 1] &= ((uint64_t) 1 << (volume->cluster_count % 64)) - 1;
+    }
+    return bitmap;
+}
@@ -0,0 +1,65 @@
+//
+// In-memory copies of the File Allocation Table and the allocation bitmap.
+//
+
+#ifndef FSREADER_FAT_H
+#define FSREADER_FAT_H
+
+#include <stdint.h>
+
+#include "exfat.h"
+#include "bitset.h"
+
+/* Outcome of walking a cluster chain with walkClusterChain */
+typedef enum ChainStatus {
+
+    CHAIN_OK = 0,
+    CHAIN_OUT_OF_RANGE,     /* the chain starts at or links to a cluster outside the heap */
+    CHAIN_BAD_CLUSTER,      /* a FAT entry marks a bad cluster */
+    CHAIN_CYCLE,            /* the chain links back to one of its own clusters */
+    CHAIN_TOO_LONG          /* the chain has more clusters than the limit allowed */
+
+} ChainStatus ;
+
+typedef struct ChainError {
+
+    ChainStatus status;
+    uint64_t length;        /* clusters of the chain before the problem, each distinct */
+    uint32_t cluster;       /* last good cluster, whose FAT entry is the problem */
+    uint32_t value;         /* that FAT entry */
+
+} ChainError ;
+
+/* Called for each cluster of a chain in order */
+typedef void (*ChainVisitor)(uint32_t cluster, void *context);
+
+/* Hands out the clusters of a chain one at a time, reading the FAT as it goes */
+typedef struct ChainIterator {
+
+    int volume_fd;
+    exfat *volume;
+    const uint32_t *fat;
+    uint32_t cluster;       /* the next cluster to hand out */
+    uint64_t remaining;     /* clusters still to hand out */
+
+} ChainIterator ;
+
+
+uint32_t *loadFat(int volume_fd, exfat *volume);
+
+Bitset *loadAllocationBitmap(int volume_fd, exfat *volume, const uint32_t *fat);
+
+uint32_t readFatEntry(int volume_fd, exfat *volume, const uint32_t *fat, uint32_t cluster);
+
+ChainStatus walkClusterChain(int volume_fd, exfat *volume, const uint32_t *fat, uint32_t first_cluster,
+                             uint64_t max_clusters, ChainVisitor visit, void *context, ChainError *error);
+
+const char *chainStatusString(ChainStatus status);
+
+void startChain(ChainIterator *chain, int volume_fd, exfat *volume, const uint32_t *fat, uint32_t first_cluster,
+                uint64_t length);
+
+uint32_t nextChainCluster(ChainIterator *chain);
+
+
+#endif //FSREADER_FAT_H
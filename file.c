@@ -0,0 +1,726 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Implement random-access reads of files.
+// Opening a file follows its cluster chain once and
+// records it as a sorted list of extents (runs of
+// contiguous clusters).  A read at any offset then
+// binary searches the extents instead of walking the
+// chain from the first cluster, and reads each extent
+// it covers with a single positional read.  Under a
+// memory ceiling the index is a window over the chain
+// that slides forward as the file is read.
+//-----------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <assert.h>
+
+#include "file.h"
+#include "fat.h"
+#include "cache.h"
+#include "memory.h"
+#include "runindex.h"
+
+#define FAT_WINDOW_ENTRIES (16 * KILOBYTE_SIZE)
+#define GET_BUFFER_SIZE (KILOBYTE_SIZE * KILOBYTE_SIZE)
+#define MIN_READAHEAD (256 * KILOBYTE_SIZE)
+#define MAX_READAHEAD (16 * KILOBYTE_SIZE * KILOBYTE_SIZE)
+#define MIN_EXTENT_WINDOW 16
+
+/* A block of FAT entries read at once while following a chain without an in-memory FAT */
+typedef struct FatWindow {
+
+    int volume_fd;
+    exfat *volume;
+    const uint32_t *fat;
+    uint32_t *entries;
+    uint64_t first;
+    uint64_t count;
+
+} FatWindow ;
+
+static uint32_t nextCluster(FatWindow *window, uint32_t cluster){
+
+    uint64_t fat_entries = (uint64_t) window->volume->cluster_count + FIRST_DATA_CLUSTER;
+    uint64_t offset;
+
+    if(window->fat != NULL || cluster >= fat_entries){
+        return readFatEntry(window->volume_fd, window->volume, window->fat, cluster);
+    }
+
+    if(cluster < window->first || cluster >= window->first + window->count){
+        window->first = cluster - cluster % FAT_WINDOW_ENTRIES;
+        window->count = fat_entries - window->first;
+        if(window->count > FAT_WINDOW_ENTRIES){
+            window->count = FAT_WINDOW_ENTRIES;
+        }
+        offset = (uint64_t) window->volume->fat_offset * sectorsToBytes(window->volume, 1);
+        offset += window->first * FAT_ENTRY_SIZE;
+        if(readBytesAs(window->volume_fd, window->entries, window->count * FAT_ENTRY_SIZE, offset, TRACE_FAT) !=
+           (ssize_t) (window->count * FAT_ENTRY_SIZE)){
+            window->count = 0;
+            return END_OF_CHAIN;
+        }
+    }
+    return window->entries[cluster - window->first];
+}
+
+/* Adds consecutive clusters to the window, returns -1 if they need a new extent and the window is full */
+static int addClusters(ExfatFile *file, uint64_t file_cluster, uint32_t cluster, uint32_t count){
+
+    Extent *last = file->extent_count > 0 ? &file->extents[file->extent_count - 1] : NULL;
+
+    if(last != NULL && (uint64_t) last->first_cluster + last->length == cluster &&
+       (uint64_t) last->length + count <= UINT32_MAX){
+        last->length += count;
+        return 0;
+    }
+    if(file->extent_count == file->extent_limit){
+        return -1;
+    }
+
+    if(file->extent_count == file->extent_capacity){
+        file->extent_capacity = file->extent_capacity == 0 ? 16 : file->extent_capacity * 2;
+        if(file->extent_capacity > file->extent_limit){
+            file->extent_capacity = file->extent_limit;
+        }
+        file->extents = realloc(file->extents, file->extent_capacity * sizeof (Extent));
+        assert(file->extents != NULL);
+    }
+    file->extents[file->extent_count].file_cluster = file_cluster;
+    file->extents[file->extent_count].first_cluster = cluster;
+    file->extents[file->extent_count].length = count;
+    file->extent_count++;
+    return 0;
+}
+
+/* Follows a chain through the run index a run at a time, returns the cluster of the file it stopped at */
+static uint64_t followRuns(ExfatFile *file, const RunIndex *runs, uint64_t n, uint64_t needed, uint32_t *cluster){
+
+    const FatRun *run;
+    uint64_t stretch;
+    uint32_t next;
+
+    while(n < needed && isValidCluster(file->volume, *cluster)){
+        run = findRun(runs, *cluster);
+
+        /* A free cluster in a chain is the chain's last, as its entry links nowhere */
+        stretch = run != NULL ? (uint64_t) run->first + run->length - *cluster : 1;
+        next = run != NULL ? run->next : 0;
+        if(stretch > needed - n){
+            stretch = needed - n;
+            next = *cluster + (uint32_t) stretch;
+        }
+        if(addClusters(file, n, *cluster, (uint32_t) stretch) != 0){
+            break;
+        }
+        n += stretch;
+        *cluster = next;
+    }
+    return n;
+}
+
+/*------------------------------------------------------
+// buildExtents
+//
+// PURPOSE: Follows the cluster chain of a file from a
+// given cluster, merging consecutive clusters into the
+// extents of a new window.  Only as many clusters as
+// DataLength needs are followed, so a chain that loops
+// can not run away; a chain that ends early leaves the
+// rest of the file without extents.  When the window is
+// full the point to carry on from is kept instead.  With
+// a run index the chain is followed a run at a time.
+// INPUT PARAMETERS:
+//     Takes in the file, the index of the cluster within
+// the file to start at and the cluster of the volume it
+// is in.
+//------------------------------------------------------*/
+static void buildExtents(ExfatFile *file, uint64_t file_cluster, uint32_t cluster){
+
+    FatWindow window;
+    uint64_t cluster_bytes = clusterBytes(file->volume);
+    uint64_t needed = (file->entry.data_length + cluster_bytes - 1) / cluster_bytes;
+    int contiguous = (file->entry.general_flags & FLAG_NO_FAT_CHAIN) != 0;
+    const RunIndex *runs = file->fat == NULL && !contiguous ? runIndexFor(file->volume_fd) : NULL;
+    uint64_t n;
+
+    /* A new window reuses the array of the one before */
+    file->extent_count = 0;
+
+    if(runs != NULL){
+        n = followRuns(file, runs, file_cluster, needed, &cluster);
+    }
+    else {
+        window.volume_fd = file->volume_fd;
+        window.volume = file->volume;
+        window.fat = file->fat;
+        window.first = 0;
+        window.count = 0;
+        window.entries = file->fat == NULL && !contiguous ? malloc(FAT_WINDOW_ENTRIES * FAT_ENTRY_SIZE) : NULL;
+        assert(file->fat != NULL || contiguous || window.entries != NULL);
+
+        for(n = file_cluster; n < needed && isValidCluster(file->volume, cluster); n++){
+            if(addClusters(file, n, cluster, 1) != 0){
+                break;
+            }
+            cluster = contiguous ? cluster + 1 : nextCluster(&window, cluster);
+        }
+        free(window.entries);
+    }
+    file->complete = n >= needed || !isValidCluster(file->volume, cluster);
+    file->resume_file_cluster = n;
+    file->resume_cluster = cluster;
+}
+
+/*------------------------------------------------------
+// openEntry
+//
+// PURPOSE: Opens the file described by a directory entry
+// for random-access reads, building its extent index, or
+// the first window of it under a memory ceiling.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct, the in-memory FAT
+// (may be NULL) and the file's entry.
+// OUTPUT PARAMETERS:
+//     Returns the opened ExfatFile, closed with closeFile.
+//------------------------------------------------------*/
+ExfatFile *openEntry(int volume_fd, exfat *volume, const uint32_t *fat, const DirectoryEntry *entry){
+
+    ExfatFile *file = calloc(1, sizeof (ExfatFile));
+
+    assert(file != NULL);
+    file->volume_fd = volume_fd;
+    file->volume = volume;
+    file->entry = *entry;
+    file->fat = fat;
+    file->extent_limit = UINT32_MAX;
+    if(memoryCeiling() != 0){
+        file->extent_limit = memoryShare(UINT64_MAX) / sizeof (Extent) < UINT32_MAX ?
+                             (uint32_t) (memoryShare(UINT64_MAX) / sizeof (Extent)) : UINT32_MAX - 1;
+        if(file->extent_limit < MIN_EXTENT_WINDOW){
+            file->extent_limit = MIN_EXTENT_WINDOW;
+        }
+    }
+
+    buildExtents(file, 0, entry->first_cluster);
+    return file;
+}
+
+/*------------------------------------------------------
+// openFile
+//
+// PURPOSE: Opens a file by path for random-access reads.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct, the in-memory FAT
+// (may be NULL) and the path of the file.
+// OUTPUT PARAMETERS:
+//     Returns the opened ExfatFile, or NULL if the path
+// does not exist or is a directory.
+//------------------------------------------------------*/
+ExfatFile *openFile(int volume_fd, exfat *volume, const uint32_t *fat, const char *path){
+
+    DirectoryEntry entry;
+
+    if(resolvePath(volume_fd, volume, fat, path, &entry) != 0 || isDirectory(&entry)){
+        return NULL;
+    }
+    return openEntry(volume_fd, volume, fat, &entry);
+}
+
+void closeFile(ExfatFile *file){
+
+    if(file != NULL){
+        free(file->extents);
+        free(file);
+    }
+}
+
+/* Binary searches the window for the extent that holds a cluster of the file, -1 if none does */
+static int64_t searchWindow(const ExfatFile *file, uint64_t file_cluster){
+
+    int64_t low = 0;
+    int64_t high = (int64_t) file->extent_count - 1;
+    int64_t middle;
+    const Extent *extent;
+
+    while(low <= high){
+        middle = low + (high - low) / 2;
+        extent = &file->extents[middle];
+
+        if(file_cluster < extent->file_cluster){
+            high = middle - 1;
+        }
+        else if(file_cluster >= extent->file_cluster + extent->length){
+            low = middle + 1;
+        }
+        else {
+            return middle;
+        }
+    }
+    return -1;
+}
+
+/*------------------------------------------------------
+// nextExtents
+//
+// PURPOSE: Replaces the window with the extents that
+// follow it, so every extent of a file can be visited in
+// order whatever its length.
+// INPUT PARAMETERS:
+//     Takes in the opened file.
+// OUTPUT PARAMETERS:
+//     Returns 1 if the window moved on, 0 if it already
+// reached the end of the chain.
+//------------------------------------------------------*/
+int nextExtents(ExfatFile *file){
+
+    if(file->complete){
+        return 0;
+    }
+    buildExtents(file, file->resume_file_cluster, file->resume_cluster);
+    return 1;
+}
+
+/*------------------------------------------------------
+// findExtent
+//
+// PURPOSE: Finds the extent that holds a cluster of the
+// file.  When the whole chain is held this is a binary
+// search; a window slides forward to reach clusters past
+// it, and starts over from the first cluster to reach
+// ones before it.  Extent pointers taken earlier do not
+// survive a call.
+// INPUT PARAMETERS:
+//     Takes in the file and the index of the cluster
+// within the file.
+// OUTPUT PARAMETERS:
+//     Returns the index of the extent, or -1 if the
+// cluster is past the end of the chain.
+//------------------------------------------------------*/
+int64_t findExtent(ExfatFile *file, uint64_t file_cluster){
+
+    int64_t index = searchWindow(file, file_cluster);
+
+    if(index >= 0 || file->extent_limit == UINT32_MAX){
+        return index;
+    }
+    if(file->extent_count > 0 && file_cluster < file->extents[0].file_cluster){
+        buildExtents(file, 0, file->entry.first_cluster);
+        index = searchWindow(file, file_cluster);
+    }
+    while(index < 0 && file_cluster >= file->resume_file_cluster && nextExtents(file)){
+        index = searchWindow(file, file_cluster);
+    }
+    return index;
+}
+
+/*------------------------------------------------------
+// adviseAhead
+//
+// PURPOSE: Tracks whether a file is read sequentially and,
+// while it is, tells the kernel about the clusters the
+// next reads will need, following the extents.  The
+// window doubles with every sequential read.  Hints stop
+// at the end of the extent window rather than move it.
+// INPUT PARAMETERS:
+//     Takes in the file, the offset and length of the read
+// being made and the valid length of the file.
+//------------------------------------------------------*/
+static void adviseAhead(ExfatFile *file, uint64_t offset, uint64_t length, uint64_t valid_length){
+
+    uint64_t cluster_bytes = clusterBytes(file->volume);
+    uint64_t start;
+    uint64_t limit;
+    uint64_t extent_end;
+    const Extent *extent;
+    int64_t index;
+
+    if(offset == file->next_offset){
+        file->readahead = file->readahead == 0 ? MIN_READAHEAD : file->readahead * 2;
+        if(file->readahead > MAX_READAHEAD){
+            file->readahead = MAX_READAHEAD;
+        }
+    }
+    else {
+        file->readahead = 0;
+        file->advised_end = 0;
+    }
+    file->next_offset = offset + length;
+    if(file->readahead == 0){
+        return;
+    }
+
+    start = file->advised_end > offset + length ? file->advised_end : offset + length;
+    limit = offset + length + file->readahead;
+    if(limit > valid_length){
+        limit = valid_length;
+    }
+
+    while(start < limit){
+        index = searchWindow(file, start / cluster_bytes);
+        if(index < 0){
+            break;
+        }
+        extent = &file->extents[index];
+        extent_end = (extent->file_cluster + extent->length) * cluster_bytes;
+        if(extent_end > limit){
+            extent_end = limit;
+        }
+        cacheAdvise(file->volume_fd, clusterOffset(file->volume, extent->first_cluster +
+                    (uint32_t) (start / cluster_bytes - extent->file_cluster)) + start % cluster_bytes,
+                    extent_end - start);
+        start = extent_end;
+    }
+    if(start > file->advised_end){
+        file->advised_end = start;
+    }
+}
+
+/*------------------------------------------------------
+// readFile
+//
+// PURPOSE: Reads up to length bytes of a file starting at
+// offset.  Bytes at or past ValidDataLength were never
+// written and are returned as zeros without a read.
+// INPUT PARAMETERS:
+//     Takes in the opened file, the buffer to fill, the
+// number of bytes wanted and the offset to start at.
+// OUTPUT PARAMETERS:
+//     Returns the number of bytes read, less than length
+// only at the end of the file, or -1 if the cluster
+// chain ends early or the volume could not be read.
+//------------------------------------------------------*/
+ssize_t readFile(ExfatFile *file, void *buffer, size_t length, uint64_t offset){
+
+    uint64_t cluster_bytes = clusterBytes(file->volume);
+    uint64_t valid_length = file->entry.valid_data_length;
+    uint8_t *destination = buffer;
+    const Extent *extent;
+    uint64_t file_cluster;
+    uint64_t extent_end;
+    uint64_t chunk;
+    int64_t index;
+    size_t copied = 0;
+
+    if(offset >= file->entry.data_length){
+        return 0;
+    }
+    if(length > file->entry.data_length - offset){
+        length = file->entry.data_length - offset;
+    }
+    if(valid_length > file->entry.data_length){
+        valid_length = file->entry.data_length;
+    }
+    adviseAhead(file, offset, length, valid_length);
+
+    while(copied < length){
+        chunk = length - copied;
+
+        if(offset >= valid_length){
+            memset(destination + copied, 0, chunk);
+            copied += chunk;
+            break;
+        }
+
+        file_cluster = offset / cluster_bytes;
+        index = findExtent(file, file_cluster);
+        if(index < 0){
+            return -1;
+        }
+        extent = &file->extents[index];
+
+        /* As far as the extent, and the valid data, reach */
+        extent_end = (extent->file_cluster + extent->length) * cluster_bytes;
+        if(chunk > extent_end - offset){
+            chunk = extent_end - offset;
+        }
+        if(chunk > valid_length - offset){
+            chunk = valid_length - offset;
+        }
+
+        if(readBytes(file->volume_fd, destination + copied, chunk,
+                     clusterOffset(file->volume, extent->first_cluster + (uint32_t) (file_cluster - extent->file_cluster)) +
+                     offset % cluster_bytes) != (ssize_t) chunk){
+            return -1;
+        }
+        copied += chunk;
+        offset += chunk;
+    }
+    return (ssize_t) copied;
+}
+
+static int isZero(const uint8_t *bytes, size_t length){
+
+    return length == 0 || (bytes[0] == 0 && memcmp(bytes, bytes + 1, length - 1) == 0);
+}
+
+static int writeAll(int output_fd, const uint8_t *bytes, size_t length, uint64_t *position){
+
+    ssize_t written;
+
+    while(length > 0){
+        written = position != NULL ? pwrite(output_fd, bytes, length, (off_t) *position) : write(output_fd, bytes, length);
+        if(written <= 0){
+            return -1;
+        }
+        bytes += written;
+        length -= (size_t) written;
+        if(position != NULL){
+            *position += (uint64_t) written;
+        }
+    }
+    return 0;
+}
+
+/*------------------------------------------------------
+// extractFile
+//
+// PURPOSE: Copies a byte range of a file to an output
+// descriptor.  When the output is a regular file only
+// the bytes before ValidDataLength are read and written;
+// the rest of the range, which reads as zeros, is left
+// as a hole by setting the output's size with ftruncate.
+// With EXTRACT_SPARSE_ZEROS, clusters of valid data that
+// are entirely zero are skipped over as holes as well.
+// Other outputs (pipes, terminals) get every byte.
+// INPUT PARAMETERS:
+//     Takes in the opened file, the output descriptor
+// (written from its current offset), the range of the
+// file to copy and the EXTRACT_ options.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 if the read or a write
+// failed.
+//------------------------------------------------------*/
+int extractFile(ExfatFile *file, int output_fd, uint64_t offset, uint64_t length, int options){
+
+    struct stat output;
+    uint64_t cluster_bytes = clusterBytes(file->volume);
+    uint64_t valid_end = file->entry.valid_data_length;
+    uint64_t start = offset;
+    uint64_t end;
+    uint64_t read_end;
+    uint64_t base;
+    uint64_t position;
+    uint64_t piece;
+    uint8_t *buffer;
+    size_t buffer_size = (size_t) memoryShare(GET_BUFFER_SIZE);
+    ssize_t count;
+    int seekable;
+    int result = 0;
+
+    if(offset >= file->entry.data_length){
+        return 0;
+    }
+    end = length < file->entry.data_length - offset ? offset + length : file->entry.data_length;
+    if(valid_end > end){
+        valid_end = end;
+    }
+
+    seekable = fstat(output_fd, &output) == 0 && S_ISREG(output.st_mode) && lseek(output_fd, 0, SEEK_CUR) >= 0;
+    base = seekable ? (uint64_t) lseek(output_fd, 0, SEEK_CUR) : 0;
+    position = base;
+
+    /* Everything past ValidDataLength only has to be read on a stream */
+    read_end = seekable ? valid_end : end;
+
+    buffer = malloc(buffer_size);
+    assert(buffer != NULL);
+
+    while(result == 0 && offset < read_end){
+        count = readFile(file, buffer, read_end - offset < buffer_size ? (size_t) (read_end - offset) : buffer_size, offset);
+        if(count <= 0){
+            result = -1;
+            break;
+        }
+
+        if(!seekable){
+            result = writeAll(output_fd, buffer, (size_t) count, NULL);
+        }
+        else if((options & EXTRACT_SPARSE_ZEROS) == 0){
+            result = writeAll(output_fd, buffer, (size_t) count, &position);
+        }
+        else {
+            /* Cluster sized pieces, aligned to the clusters of the file */
+            for(ssize_t done = 0; result == 0 && done < count; done += (ssize_t) piece){
+                piece = cluster_bytes - (offset + (uint64_t) done) % cluster_bytes;
+                if(piece > (uint64_t) (count - done)){
+                    piece = (uint64_t) (count - done);
+                }
+                if(isZero(buffer + done, (size_t) piece)){
+                    position += piece;
+                }
+                else {
+                    result = writeAll(output_fd, buffer + done, (size_t) piece, &position);
+                }
+            }
+        }
+        offset += (uint64_t) count;
+    }
+
+    /* The skipped zeros and the tail past ValidDataLength become holes */
+    if(result == 0 && seekable){
+        position = base + (end - start);
+        if(ftruncate(output_fd, (off_t) position) != 0 || lseek(output_fd, (off_t) position, SEEK_SET) < 0){
+            result = -1;
+        }
+    }
+
+    free(buffer);
+    return result;
+}
+
+static int parseOffset(const char *option, const char *value, uint64_t *number){
+
+    char *end;
+
+    if(value == NULL){
+        fprintf(stderr, "Missing value for '%s'\n", option);
+        return -1;
+    }
+    *number = strtoull(value, &end, 0);
+    if(end == value || *end != '\0'){
+        fprintf(stderr, "Invalid value for '%s': '%s'\n", option, value);
+        return -1;
+    }
+    return 0;
+}
+
+/* Copies one file to an output file, or to standard output when output_path is NULL */
+static int getOne(int volume_fd, exfat *volume, const char *path, const char *output_path,
+                  uint64_t offset, uint64_t length, int options){
+
+    ExfatFile *file;
+    int output_fd = STDOUT_FILENO;
+    int status = 0;
+
+    file = openFile(volume_fd, volume, NULL, path);
+    if(file == NULL){
+        fprintf(stderr, "No such file: '%s'\n", path);
+        return -1;
+    }
+    if(output_path != NULL){
+        output_fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(output_fd < 0){
+            fprintf(stderr, "Unable to create '%s'\n", output_path);
+            closeFile(file);
+            return -1;
+        }
+    }
+
+    if(extractFile(file, output_fd, offset, length, options) != 0){
+        fprintf(stderr, "Unable to copy '%s'\n", path);
+        status = -1;
+    }
+
+    if(output_fd != STDOUT_FILENO){
+        close(output_fd);
+    }
+    closeFile(file);
+    return status;
+}
+
+/*------------------------------------------------------
+// commandGetRange
+//
+// PURPOSE: Runs "get <path> [--offset N] [--length N]
+// [--sparse] [output file]", copying a byte range of a
+// file (the whole file by default) to the output file or
+// to standard output.  Data past ValidDataLength becomes
+// a hole when the output is a regular file, --sparse
+// turns all-zero clusters into holes too.  With
+// "--directory <dir>" every argument is a path and each
+// file is copied into dir under its own name; siblings
+// are resolved through the dentry cache, so their
+// directory is scanned once.  Messages go to standard
+// error so they never mix with the data.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct and the arguments
+// that follow the command.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 otherwise.
+//------------------------------------------------------*/
+int commandGetRange(int volume_fd, exfat *volume, int argc, char *argv[]){
+
+    const char **paths = calloc(argc + 1, sizeof (char *));
+    const char *directory = NULL;
+    const char *name;
+    char *output_path;
+    int path_count = 0;
+    uint64_t offset = 0;
+    uint64_t length = UINT64_MAX;
+    int options = 0;
+    int status = 0;
+
+    assert(paths != NULL);
+
+    for(int i = 0; i < argc && status == 0; i++){
+        if(strcmp(argv[i], "--offset") == 0){
+            status = parseOffset(argv[i], i + 1 < argc ? argv[i + 1] : NULL, &offset);
+            i++;
+        }
+        else if(strcmp(argv[i], "--length") == 0){
+            status = parseOffset(argv[i], i + 1 < argc ? argv[i + 1] : NULL, &length);
+            i++;
+        }
+        else if(strcmp(argv[i], "--sparse") == 0){
+            options |= EXTRACT_SPARSE_ZEROS;
+        }
+        else if(strcmp(argv[i], "--directory") == 0){
+            if(i + 1 >= argc){
+                fprintf(stderr, "Missing value for '%s'\n", argv[i]);
+                status = -1;
+            }
+            directory = argv[++i];
+        }
+        else {
+            paths[path_count++] = argv[i];
+        }
+    }
+    if(status == 0 && (path_count == 0 || (directory == NULL && path_count > 2))){
+        if(path_count > 2){
+            fprintf(stderr, "Invalid get option: '%s'\n", paths[2]);
+        }
+        else {
+            fprintf(stderr, "Usage: get <path> [--offset N] [--length N] [--sparse] [output file]\n"
+                            "       get <path>... [--offset N] [--length N] [--sparse] --directory <output directory>\n");
+        }
+        status = -1;
+    }
+    if(status != 0){
+        free(paths);
+        return -1;
+    }
+
+    if(directory == NULL){
+        status = getOne(volume_fd, volume, paths[0], paths[1], offset, length, options);
+        free(paths);
+        return status;
+    }
+
+    for(int i = 0; i < path_count; i++){
+        name = strrchr(paths[i], '/');
+        name = name != NULL ? name + 1 : paths[i];
+        if(*name == '\0'){
+            fprintf(stderr, "No file name in '%s'\n", paths[i]);
+            status = -1;
+            continue;
+        }
+        output_path = malloc(strlen(directory) + strlen(name) + 2);
+        assert(output_path != NULL);
+        sprintf(output_path, "%s/%s", directory, name);
+        if(getOne(volume_fd, volume, paths[i], output_path, offset, length, options) != 0){
+            status = -1;
+        }
+        free(output_path);
+    }
+    free(paths);
+    return status;
+}
@@ -0,0 +1,69 @@
+//
+// Random-access reads of files through an index of their extents.
+//
+
+#ifndef FSREADER_FILE_H
+#define FSREADER_FILE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "exfat.h"
+#include "directory.h"
+
+/* extractFile options */
+#define EXTRACT_SPARSE_ZEROS 0x01   /* all-zero clusters within the valid data become holes too */
+
+/* A run of contiguous clusters of a file */
+typedef struct Extent {
+
+    uint64_t file_cluster;      /* index of the run's first cluster within the file */
+    uint32_t first_cluster;
+    uint32_t length;            /* in clusters */
+
+} Extent ;
+
+typedef struct ExfatFile {
+
+    int volume_fd;
+    exfat *volume;
+    DirectoryEntry entry;
+
+    /* Sorted by file_cluster, so an offset is found by binary search.  Under a
+       memory ceiling only a window of at most extent_limit extents is held, and
+       the chain is followed on from the resume point when reads go past it. */
+    const uint32_t *fat;
+    Extent *extents;
+    uint32_t extent_count;
+    uint32_t extent_capacity;
+    uint32_t extent_limit;          /* UINT32_MAX when the whole chain is held */
+    uint64_t resume_file_cluster;   /* the first cluster of the file past the window */
+    uint32_t resume_cluster;        /* and the cluster of the volume it is in */
+    int complete;                   /* the window reaches the end of the chain */
+
+    /* Sequential reads are followed by readahead hints along the extents */
+    uint64_t next_offset;
+    uint64_t advised_end;       /* file offset the kernel has been told about up to */
+    uint64_t readahead;         /* window in bytes, 0 while reads are random */
+
+} ExfatFile ;
+
+
+ExfatFile *openEntry(int volume_fd, exfat *volume, const uint32_t *fat, const DirectoryEntry *entry);
+
+ExfatFile *openFile(int volume_fd, exfat *volume, const uint32_t *fat, const char *path);
+
+void closeFile(ExfatFile *file);
+
+int64_t findExtent(ExfatFile *file, uint64_t file_cluster);
+
+int nextExtents(ExfatFile *file);
+
+ssize_t readFile(ExfatFile *file, void *buffer, size_t length, uint64_t offset);
+
+int extractFile(ExfatFile *file, int output_fd, uint64_t offset, uint64_t length, int options);
+
+int commandGetRange(int volume_fd, exfat *volume, int argc, char *argv[]);
+
+
+#endif //FSREADER_FILE_H
@@ -0,0 +1,343 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Implement the "find" command.  Predicates on
+// the fields of the file and stream extension entries
+// (type, size and modification time) are pushed down
+// into the directory scanner, so a file that fails them
+// never has its name copied or decoded.  Name globs are
+// only matched for the files that pass.  Directories
+// are handed to a work queue so subtrees are walked in
+// parallel, matches are printed in no particular order.
+// A directory already queued, or MAX_TREE_DEPTH below
+// the root, is matched but not walked again, so a looped
+// tree still ends.
+//-----------------------------------------*/
+#define _GNU_SOURCE     /* FNM_CASEFOLD */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <time.h>
+#include <assert.h>
+
+#include "find.h"
+#include "bitset.h"
+#include "directory.h"
+#include "workqueue.h"
+
+#define SECONDS_PER_DAY 86400
+
+#define COMPARE_NONE 0
+#define COMPARE_LESS 1
+#define COMPARE_EQUAL 2
+#define COMPARE_GREATER 3
+
+typedef struct FindQuery {
+
+    const char *name_pattern;
+    int name_flags;         /* FNM_CASEFOLD for -iname */
+    char type;              /* 'f', 'd' or 0 for any */
+
+    int size_compare;
+    uint64_t size;
+
+    int mtime_compare;
+    long mtime_days;
+    time_t now;
+
+} FindQuery ;
+
+typedef struct FindWork {
+
+    char *path;
+    unsigned int depth;
+    DirectoryEntry directory;
+
+} FindWork ;
+
+typedef struct FindScan {
+
+    int volume_fd;
+    exfat *volume;
+    FindQuery query;
+    unsigned long matches;
+    Bitset *visited;        /* first clusters of the directories already queued */
+
+} FindScan ;
+
+/* Context of one directory walk */
+typedef struct FindDirectory {
+
+    FindScan *scan;
+    WorkQueue *queue;
+    const char *path;
+    unsigned int depth;
+
+} FindDirectory ;
+
+static int compareValue(int compare, uint64_t value, uint64_t wanted){
+
+    switch(compare){
+        case COMPARE_LESS:
+            return value < wanted;
+        case COMPARE_EQUAL:
+            return value == wanted;
+        case COMPARE_GREATER:
+            return value > wanted;
+        default:
+            return 1;
+    }
+}
+
+/* Checks every predicate that needs nothing but the file and stream extension entries */
+static int matchesFields(const FindQuery *query, DirectoryEntry *entry){
+
+    time_t modified;
+    long age_days;
+
+    if(query->type == 'f' && isDirectory(entry)){
+        return 0;
+    }
+    if(query->type == 'd' && !isDirectory(entry)){
+        return 0;
+    }
+    if(!compareValue(query->size_compare, entry->data_length, query->size)){
+        return 0;
+    }
+    if(query->mtime_compare != COMPARE_NONE){
+        modified = entryTime(entry->modify_timestamp, entry->modify_utc_offset);
+        age_days = modified > query->now ? 0 : (long) ((query->now - modified) / SECONDS_PER_DAY);
+        if(!compareValue(query->mtime_compare, (uint64_t) age_days, (uint64_t) query->mtime_days)){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Directories always pass the scanner, their names are needed to walk into them */
+static int filterEntry(DirectoryEntry *entry, void *context){
+
+    FindDirectory *directory = context;
+
+    if(isDirectory(entry) || matchesFields(&directory->scan->query, entry)){
+        return WALK_CONTINUE;
+    }
+    return WALK_SKIP;
+}
+
+static FindWork *createFindWork(const char *path, unsigned int depth, DirectoryEntry *directory){
+
+    FindWork *work = malloc(sizeof (FindWork));
+
+    assert(work != NULL);
+    work->path = strdup(path);
+    work->depth = depth;
+    work->directory = *directory;
+    return work;
+}
+
+static int visitEntry(DirectoryEntry *entry, void *context){
+
+    FindDirectory *directory = context;
+    FindScan *scan = directory->scan;
+    char *name = entryName(entry);
+    char *path;
+    int name_matches;
+
+    assert(name != NULL);
+    name_matches = scan->query.name_pattern == NULL ||
+                   fnmatch(scan->query.name_pattern, name, scan->query.name_flags) == 0;
+
+    if(name_matches || isDirectory(entry)){
+        path = malloc(strlen(directory->path) + strlen(name) + 2);
+        assert(path != NULL);
+        sprintf(path, "%s/%s", directory->path, name);
+
+        if(name_matches && matchesFields(&scan->query, entry)){
+            printf("%s\n", path);
+            __atomic_fetch_add(&scan->matches, 1, __ATOMIC_RELAXED);
+        }
+        /* A directory already queued, or too deep, would loop forever */
+        if(isDirectory(entry) && directory->depth < MAX_TREE_DEPTH &&
+           isValidCluster(scan->volume, entry->first_cluster) &&
+           !testAndSetBit(scan->visited, entry->first_cluster - FIRST_DATA_CLUSTER)){
+            pushWork(directory->queue, createFindWork(path, directory->depth + 1, entry));
+        }
+        free(path);
+    }
+
+    free(name);
+    return WALK_CONTINUE;
+}
+
+static void findInDirectory(void *item, WorkQueue *queue, void *context){
+
+    FindWork *work = item;
+    FindDirectory directory;
+
+    directory.scan = context;
+    directory.queue = queue;
+    directory.path = work->path;
+    directory.depth = work->depth;
+
+    walkDirectoryFiltered(directory.scan->volume_fd, directory.scan->volume, NULL,
+                          work->directory.first_cluster, work->directory.data_length,
+                          work->directory.general_flags, 0, filterEntry, visitEntry, &directory);
+
+    free(work->path);
+    free(work);
+}
+
+/*------------------------------------------------------
+// parseComparison
+//
+// PURPOSE: Parses a find style numeric argument: "+N"
+// (greater than), "-N" (less than) or "N" (exactly),
+// optionally followed by a k, M or G size suffix.
+// INPUT PARAMETERS:
+//     Takes in the argument, pointers that receive the
+// comparison and the value, and whether suffixes apply.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 if the argument is invalid.
+//------------------------------------------------------*/
+static int parseComparison(const char *argument, int *compare, uint64_t *value, int allow_suffix){
+
+    char *end;
+
+    *compare = COMPARE_EQUAL;
+    if(*argument == '+'){
+        *compare = COMPARE_GREATER;
+        argument++;
+    }
+    else if(*argument == '-'){
+        *compare = COMPARE_LESS;
+        argument++;
+    }
+
+    *value = strtoull(argument, &end, 10);
+    if(end == argument){
+        return -1;
+    }
+    if(allow_suffix && *end != '\0' && end[1] == '\0'){
+        switch(*end){
+            case 'c':
+                end++;
+                break;
+            case 'k':
+                *value *= KILOBYTE_SIZE;
+                end++;
+                break;
+            case 'M':
+                *value *= (uint64_t) KILOBYTE_SIZE * KILOBYTE_SIZE;
+                end++;
+                break;
+            case 'G':
+                *value *= (uint64_t) KILOBYTE_SIZE * KILOBYTE_SIZE * KILOBYTE_SIZE;
+                end++;
+                break;
+        }
+    }
+    return *end == '\0' ? 0 : -1;
+}
+
+static int parseQuery(int argc, char *argv[], FindQuery *query){
+
+    uint64_t days;
+    int valid;
+
+    memset(query, 0, sizeof (FindQuery));
+    query->now = time(NULL);
+
+    for(int i = 0; i < argc; i++){
+        if(i + 1 >= argc){
+            printf("Missing value for '%s'\n", argv[i]);
+            return -1;
+        }
+        valid = 1;
+        if(strcmp(argv[i], "-name") == 0 || strcmp(argv[i], "-iname") == 0){
+            query->name_pattern = argv[i + 1];
+            query->name_flags = argv[i][1] == 'i' ? FNM_CASEFOLD : 0;
+        }
+        else if(strcmp(argv[i], "-type") == 0){
+            query->type = argv[i + 1][0];
+            valid = strcmp(argv[i + 1], "f") == 0 || strcmp(argv[i + 1], "d") == 0;
+        }
+        else if(strcmp(argv[i], "-size") == 0){
+            valid = parseComparison(argv[i + 1], &query->size_compare, &query->size, 1) == 0;
+        }
+        else if(strcmp(argv[i], "-mtime") == 0){
+            valid = parseComparison(argv[i + 1], &query->mtime_compare, &days, 0) == 0;
+            query->mtime_days = (long) days;
+        }
+        else {
+            valid = 0;
+        }
+
+        if(!valid){
+            printf("Invalid find option: '%s %s'\n", argv[i], argv[i + 1]);
+            return -1;
+        }
+        i++;
+    }
+    return 0;
+}
+
+/*------------------------------------------------------
+// commandFind
+//
+// PURPOSE: Runs "find <root> [-name glob] [-iname glob]
+// [-size [+-]N[ckMG]] [-mtime [+-]days] [-type f|d]",
+// printing the path of every entry below root that
+// matches all of the predicates.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct and the arguments
+// that follow the command (the root, then predicates).
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 for a bad root or option.
+//------------------------------------------------------*/
+int commandFind(int volume_fd, exfat *volume, int argc, char *argv[]){
+
+    FindScan scan;
+    DirectoryEntry root;
+    WorkQueue *queue;
+    const char *root_path = argc > 0 ? argv[0] : "/";
+    char *start;
+
+    memset(&scan, 0, sizeof (FindScan));
+    scan.volume_fd = volume_fd;
+    scan.volume = volume;
+
+    if(parseQuery(argc > 0 ? argc - 1 : 0, argv + 1, &scan.query) != 0){
+        return -1;
+    }
+    if(resolvePath(volume_fd, volume, NULL, root_path, &root) != 0 || !isDirectory(&root)){
+        printf("No such directory: '%s'\n", root_path);
+        return -1;
+    }
+
+    /* Paths are printed as "/dir/name", without a trailing '/' on the root */
+    start = malloc(strlen(root_path) + 2);
+    assert(start != NULL);
+    sprintf(start, "%s%s", root_path[0] == '/' ? "" : "/", root_path);
+    while(strlen(start) > 0 && start[strlen(start) - 1] == '/'){
+        start[strlen(start) - 1] = '\0';
+    }
+
+    scan.visited = createBitset(volume->cluster_count);
+    assert(scan.visited != NULL);
+    if(isValidCluster(volume, root.first_cluster)){
+        setBit(scan.visited, root.first_cluster - FIRST_DATA_CLUSTER);
+    }
+
+    queue = createWorkQueue(findInDirectory, &scan);
+    pushWork(queue, createFindWork(start, 0, &root));
+    runWorkQueue(queue);
+
+    destroyWorkQueue(queue);
+    destroyBitset(scan.visited);
+    free(start);
+    return 0;
+}
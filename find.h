@@ -0,0 +1,14 @@
+//
+// Search of the directory tree by name, size, modification time and type.
+//
+
+#ifndef FSREADER_FIND_H
+#define FSREADER_FIND_H
+
+#include "exfat.h"
+
+
+int commandFind(int volume_fd, exfat *volume, int argc, char *argv[]);
+
+
+#endif //FSREADER_FIND_H
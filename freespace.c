@@ -0,0 +1,328 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Implement the FreeSpaceMap and the "free"
+// command.  One pass over the allocation bitmap counts
+// the free clusters of every 512 cluster block with
+// popcounts, and a Fenwick tree over the block counts
+// answers the free count of any cluster range in
+// O(log n).  Free runs are found with count trailing
+// zeros scans that skip whole blocks known to be fully
+// used (or fully free) from their counts.
+//-----------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "freespace.h"
+#include "fat.h"
+
+#define BLOCK_WORDS (FREE_BLOCK_BITS / 64)
+#define HISTOGRAM_BUCKETS 33
+#define MAX_RANGES 32
+
+static uint64_t blockBits(const FreeSpaceMap *map, uint64_t block){
+
+    uint64_t start = block * FREE_BLOCK_BITS;
+
+    return map->cluster_count - start < FREE_BLOCK_BITS ? map->cluster_count - start : FREE_BLOCK_BITS;
+}
+
+/*------------------------------------------------------
+// createFreeSpaceMap
+//
+// PURPOSE: Builds the block counts and the Fenwick tree
+// of an allocation bitmap in a single pass.
+// INPUT PARAMETERS:
+//    Takes in the allocation bitmap, which the map now
+// owns and frees with destroyFreeSpaceMap.
+// OUTPUT PARAMETERS:
+//     Returns the new FreeSpaceMap.
+//------------------------------------------------------*/
+FreeSpaceMap *createFreeSpaceMap(Bitset *bitmap){
+
+    FreeSpaceMap *map = calloc(1, sizeof (FreeSpaceMap));
+    uint64_t used;
+    uint64_t parent;
+
+    assert(map != NULL && bitmap != NULL);
+    map->bitmap = bitmap;
+    map->cluster_count = bitmap->size;
+    map->block_count = (bitmap->size + FREE_BLOCK_BITS - 1) / FREE_BLOCK_BITS;
+    map->block_free = malloc((map->block_count + 1) * sizeof (uint32_t));
+    map->fenwick = calloc(map->block_count + 1, sizeof (uint64_t));
+    assert(map->block_free != NULL && map->fenwick != NULL);
+
+    for(uint64_t block = 0; block < map->block_count; block++){
+        used = 0;
+        for(uint64_t word = block * BLOCK_WORDS; word < (block + 1) * BLOCK_WORDS && word < bitmap->word_count; word++){
+            used += __builtin_popcountll(bitmap->words[word]);
+        }
+        map->block_free[block] = (uint32_t) (blockBits(map, block) - used);
+        map->fenwick[block + 1] = map->block_free[block];
+    }
+
+    /* Linear time Fenwick construction, each node adds itself to its parent */
+    for(uint64_t i = 1; i <= map->block_count; i++){
+        parent = i + (i & (~i + 1));
+        if(parent <= map->block_count){
+            map->fenwick[parent] += map->fenwick[i];
+        }
+    }
+    return map;
+}
+
+void destroyFreeSpaceMap(FreeSpaceMap *map){
+
+    if(map != NULL){
+        destroyBitset(map->bitmap);
+        free(map->block_free);
+        free(map->fenwick);
+        free(map);
+    }
+}
+
+/* Free clusters in the blocks [0, block) */
+static uint64_t freeBeforeBlock(const FreeSpaceMap *map, uint64_t block){
+
+    uint64_t sum = 0;
+
+    while(block > 0){
+        sum += map->fenwick[block];
+        block &= block - 1;
+    }
+    return sum;
+}
+
+/*------------------------------------------------------
+// countFree
+//
+// PURPOSE: Counts the free clusters in a range.  Whole
+// blocks come from the Fenwick tree, only the partial
+// blocks at either end are counted from the bitmap.
+// INPUT PARAMETERS:
+//    Takes in the map along with the first and one past
+// the last bitmap index (cluster - 2) of the range.
+// OUTPUT PARAMETERS:
+//     Returns the number of free clusters in the range.
+//------------------------------------------------------*/
+uint64_t countFree(const FreeSpaceMap *map, uint64_t start, uint64_t end){
+
+    uint64_t first_block;
+    uint64_t last_block;
+
+    if(end > map->cluster_count){
+        end = map->cluster_count;
+    }
+    if(start >= end){
+        return 0;
+    }
+
+    first_block = (start + FREE_BLOCK_BITS - 1) / FREE_BLOCK_BITS;
+    last_block = end / FREE_BLOCK_BITS;
+
+    if(first_block >= last_block){
+        return (end - start) - countSetBits(map->bitmap, start, end);
+    }
+
+    return freeBeforeBlock(map, last_block) - freeBeforeBlock(map, first_block) +
+           countFree(map, start, first_block * FREE_BLOCK_BITS) +
+           countFree(map, last_block * FREE_BLOCK_BITS, end);
+}
+
+/*------------------------------------------------------
+// findNextFree
+//
+// PURPOSE: Finds the first free cluster at or after an
+// index, stepping over blocks with no free cluster by
+// their counts alone.
+// INPUT PARAMETERS:
+//    Takes in the map and the bitmap index to start at.
+// OUTPUT PARAMETERS:
+//     Returns the index of the free cluster, or the
+// cluster count if there is none.
+//------------------------------------------------------*/
+uint64_t findNextFree(const FreeSpaceMap *map, uint64_t start){
+
+    uint64_t block = start / FREE_BLOCK_BITS;
+    uint64_t found;
+
+    while(block < map->block_count){
+        if(map->block_free[block] != 0){
+            found = findNextClear(map->bitmap, start, (block + 1) * FREE_BLOCK_BITS);
+            if(found < (block + 1) * FREE_BLOCK_BITS && found < map->cluster_count){
+                return found;
+            }
+        }
+        block++;
+        start = block * FREE_BLOCK_BITS;
+    }
+    return map->cluster_count;
+}
+
+/* Same as findNextFree for the first used cluster, stepping over fully free blocks */
+static uint64_t findNextUsed(const FreeSpaceMap *map, uint64_t start){
+
+    uint64_t block = start / FREE_BLOCK_BITS;
+    uint64_t found;
+
+    while(block < map->block_count){
+        if(map->block_free[block] != blockBits(map, block)){
+            found = findNextSet(map->bitmap, start, (block + 1) * FREE_BLOCK_BITS);
+            if(found < (block + 1) * FREE_BLOCK_BITS && found < map->cluster_count){
+                return found;
+            }
+        }
+        block++;
+        start = block * FREE_BLOCK_BITS;
+    }
+    return map->cluster_count;
+}
+
+/* Bucket b holds runs of 2^b to 2^(b+1) - 1 clusters */
+static int histogramBucket(uint64_t length){
+
+    return 63 - __builtin_clzll(length);
+}
+
+static int parseRange(const char *value, uint64_t *first, uint64_t *last){
+
+    char *end;
+
+    *first = strtoull(value, &end, 0);
+    if(end == value || *end != '-'){
+        return -1;
+    }
+    value = end + 1;
+    *last = strtoull(value, &end, 0);
+    if(end == value || *end != '\0' || *last < *first){
+        return -1;
+    }
+    return 0;
+}
+
+static void printExtents(const FreeSpaceMap *map, uint64_t cluster_bytes){
+
+    uint64_t runs[HISTOGRAM_BUCKETS] = {0};
+    uint64_t clusters[HISTOGRAM_BUCKETS] = {0};
+    uint64_t run_count = 0;
+    uint64_t largest = 0;
+    uint64_t largest_start = 0;
+    uint64_t start;
+    uint64_t end = 0;
+    uint64_t length;
+    int bucket;
+    char label[48];
+
+    while((start = findNextFree(map, end)) < map->cluster_count){
+        end = findNextUsed(map, start);
+        length = end - start;
+
+        bucket = histogramBucket(length);
+        if(bucket >= HISTOGRAM_BUCKETS){
+            bucket = HISTOGRAM_BUCKETS - 1;
+        }
+        runs[bucket]++;
+        clusters[bucket] += length;
+        run_count++;
+
+        if(length > largest){
+            largest = length;
+            largest_start = start;
+        }
+    }
+
+    printf("Free runs: %llu\n", (unsigned long long) run_count);
+    if(run_count == 0){
+        return;
+    }
+    printf("Largest free run: %llu cluster(s) (%llu bytes) at cluster %llu\n\n", (unsigned long long) largest,
+           (unsigned long long) (largest * cluster_bytes), (unsigned long long) largest_start + FIRST_DATA_CLUSTER);
+
+    printf("%24s %12s %15s\n", "Run length (clusters)", "Runs", "Clusters");
+    for(int i = 0; i < HISTOGRAM_BUCKETS; i++){
+        if(runs[i] == 0){
+            continue;
+        }
+        if(i == 0){
+            snprintf(label, sizeof (label), "1");
+        }
+        else {
+            snprintf(label, sizeof (label), "%llu-%llu", 1ULL << i, (1ULL << (i + 1)) - 1);
+        }
+        printf("%24s %12llu %15llu\n", label, (unsigned long long) runs[i], (unsigned long long) clusters[i]);
+    }
+}
+
+/*------------------------------------------------------
+// commandFree
+//
+// PURPOSE: Runs "free [--extents] [--range first-last]...",
+// printing the free cluster total, with --extents the
+// number of free runs, the largest one and a histogram of
+// run lengths by powers of two, and for every --range the
+// free clusters between two cluster numbers (inclusive).
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct and the arguments
+// that follow the command.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 otherwise.
+//------------------------------------------------------*/
+int commandFree(int volume_fd, exfat *volume, int argc, char *argv[]){
+
+    FreeSpaceMap *map;
+    Bitset *bitmap;
+    uint64_t cluster_bytes = clusterBytes(volume);
+    uint64_t firsts[MAX_RANGES];
+    uint64_t lasts[MAX_RANGES];
+    uint64_t free_clusters;
+    int range_count = 0;
+    int extents = 0;
+
+    for(int i = 0; i < argc; i++){
+        if(strcmp(argv[i], "--extents") == 0){
+            extents = 1;
+        }
+        else if(strcmp(argv[i], "--range") == 0 && i + 1 < argc && range_count < MAX_RANGES &&
+                parseRange(argv[i + 1], &firsts[range_count], &lasts[range_count]) == 0){
+            range_count++;
+            i++;
+        }
+        else {
+            printf("Invalid free option: '%s'\n", argv[i]);
+            return -1;
+        }
+    }
+
+    bitmap = loadAllocationBitmap(volume_fd, volume, NULL);
+    if(bitmap == NULL){
+        return -1;
+    }
+    map = createFreeSpaceMap(bitmap);
+
+    free_clusters = countFree(map, 0, map->cluster_count);
+    printf("Free clusters: %llu of %llu (%llu KB, %llu byte clusters)\n", (unsigned long long) free_clusters,
+           (unsigned long long) map->cluster_count, (unsigned long long) (free_clusters * cluster_bytes / KILOBYTE_SIZE),
+           (unsigned long long) cluster_bytes);
+
+    if(extents){
+        printExtents(map, cluster_bytes);
+    }
+
+    for(int i = 0; i < range_count; i++){
+        if(firsts[i] < FIRST_DATA_CLUSTER || lasts[i] >= map->cluster_count + FIRST_DATA_CLUSTER){
+            printf("Clusters %llu-%llu: outside the cluster heap (clusters %d-%llu)\n", (unsigned long long) firsts[i],
+                   (unsigned long long) lasts[i], FIRST_DATA_CLUSTER,
+                   (unsigned long long) map->cluster_count + FIRST_DATA_CLUSTER - 1);
+            continue;
+        }
+        printf("Clusters %llu-%llu: %llu free of %llu\n", (unsigned long long) firsts[i], (unsigned long long) lasts[i],
+               (unsigned long long) countFree(map, firsts[i] - FIRST_DATA_CLUSTER, lasts[i] - FIRST_DATA_CLUSTER + 1),
+               (unsigned long long) (lasts[i] - firsts[i] + 1));
+    }
+
+    destroyFreeSpaceMap(map);
+    return 0;
+}
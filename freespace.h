@@ -0,0 +1,38 @@
+//
+// Layout of the free clusters: free runs and free counts over any cluster range.
+//
+
+#ifndef FSREADER_FREESPACE_H
+#define FSREADER_FREESPACE_H
+
+#include <stdint.h>
+
+#include "exfat.h"
+#include "bitset.h"
+
+#define FREE_BLOCK_BITS 512     /* clusters summarised by one block count */
+
+typedef struct FreeSpaceMap {
+
+    Bitset *bitmap;             /* bit (cluster - 2) set when the cluster is in use */
+    uint64_t cluster_count;
+
+    uint32_t *block_free;       /* free clusters per block */
+    uint64_t *fenwick;          /* prefix sums of block_free, 1 based */
+    uint64_t block_count;
+
+} FreeSpaceMap ;
+
+
+FreeSpaceMap *createFreeSpaceMap(Bitset *bitmap);
+
+void destroyFreeSpaceMap(FreeSpaceMap *map);
+
+uint64_t countFree(const FreeSpaceMap *map, uint64_t start, uint64_t end);
+
+uint64_t findNextFree(const FreeSpaceMap *map, uint64_t start);
+
+int commandFree(int volume_fd, exfat *volume, int argc, char *argv[]);
+
+
+#endif //FSREADER_FREESPACE_H
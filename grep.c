@@ -0,0 +1,565 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Implement the "grep" command, searching the
+// contents of files inside the image without extracting
+// them.  Files are read a large chunk at a time through
+// their extent index and searched in place: literals and
+// hex byte strings, up to MAX_PATTERNS of them at once,
+// with the vectorized PatternSet search, anything else
+// with a POSIX extended regex.  The tail of each chunk is
+// carried over to the next, so matches that straddle a
+// cluster or an extent boundary are found.  Directories
+// and files are handed to a work queue, so files are
+// searched in parallel and matches are printed in no
+// particular order across files, in order within one.
+// A directory already queued, or MAX_TREE_DEPTH below
+// the root, is not walked again, so a looped tree still
+// ends.
+//-----------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <regex.h>
+#include <assert.h>
+
+#include "grep.h"
+#include "bitset.h"
+#include "directory.h"
+#include "file.h"
+#include "pattern.h"
+#include "parallel.h"
+#include "workqueue.h"
+#include "memory.h"
+
+#define GREP_CHUNK_SIZE (4 * KILOBYTE_SIZE * KILOBYTE_SIZE)
+#define MIN_GREP_CHUNK_SIZE (64 * KILOBYTE_SIZE)
+#define GREP_REGEX_OVERLAP (64 * KILOBYTE_SIZE)    /* longest regex match found across chunks */
+#define REGEX_SPECIAL "\\.[]()*+?{}|^$"
+
+typedef struct GrepScan {
+
+    int volume_fd;
+    exfat *volume;
+
+    /* Literal patterns, or a regex when use_regex is set */
+    PatternSet patterns;
+    uint8_t *pattern_bytes[MAX_PATTERNS];
+    int use_regex;
+    regex_t regex;
+
+    size_t overlap;             /* bytes carried from one chunk to the next */
+    size_t chunk_size;
+    unsigned long matches;
+    unsigned long matched_files;
+    Bitset *visited;            /* first clusters of the directories already queued */
+
+} GrepScan ;
+
+typedef struct GrepWork {
+
+    char *path;
+    unsigned int depth;
+    DirectoryEntry entry;
+
+} GrepWork ;
+
+/* Context of one directory walk */
+typedef struct GrepDirectory {
+
+    GrepScan *scan;
+    WorkQueue *queue;
+    const char *path;
+    unsigned int depth;
+
+} GrepDirectory ;
+
+/* Where the chunk being searched lies in its file */
+typedef struct GrepChunk {
+
+    GrepScan *scan;
+    const char *path;
+    uint64_t base;              /* file offset of the first byte of the buffer */
+    size_t carry;               /* leading bytes already searched with the chunk before */
+    int at_end;                 /* the buffer ends where the file does */
+    uint64_t last_match;        /* so patterns matching at the same offset print once */
+    unsigned long matches;
+
+} GrepChunk ;
+
+static void reportMatch(GrepChunk *chunk, size_t position){
+
+    uint64_t offset = chunk->base + position;
+
+    if(chunk->matches > 0 && chunk->last_match == offset){
+        return;
+    }
+    chunk->last_match = offset;
+    chunk->matches++;
+    printf("%s:%llu\n", chunk->path, (unsigned long long) offset);
+}
+
+static int collectMatch(size_t position, int pattern, void *context){
+
+    GrepChunk *chunk = context;
+
+    /* Matches that end inside the carried bytes were reported with the chunk before */
+    if(position + chunk->scan->patterns.lengths[pattern] > chunk->carry){
+        reportMatch(chunk, position);
+    }
+    return 0;
+}
+
+/*------------------------------------------------------
+// searchRegex
+//
+// PURPOSE: Reports the non-empty, non-overlapping matches
+// of the regex in a buffer that may hold NUL bytes.  Only
+// matches that end past the carried bytes are reported.
+// INPUT PARAMETERS:
+//     Takes in the chunk, the buffer and its length.
+//------------------------------------------------------*/
+static void searchRegex(GrepChunk *chunk, const uint8_t *buffer, size_t length){
+
+    regmatch_t match;
+    size_t start = 0;
+    int flags;
+
+    while(start < length){
+        match.rm_so = (regoff_t) start;
+        match.rm_eo = (regoff_t) length;
+        flags = REG_STARTEND | (chunk->base + start > 0 ? REG_NOTBOL : 0) | (chunk->at_end ? 0 : REG_NOTEOL);
+        if(regexec(&chunk->scan->regex, (const char *) buffer, 1, &match, flags) != 0){
+            break;
+        }
+        if(match.rm_eo > match.rm_so && (size_t) match.rm_eo > chunk->carry){
+            reportMatch(chunk, (size_t) match.rm_so);
+        }
+        start = match.rm_eo > match.rm_so ? (size_t) match.rm_eo : (size_t) match.rm_so + 1;
+    }
+}
+
+/*------------------------------------------------------
+// searchFile
+//
+// PURPOSE: Reads a file from start to end in chunks of up
+// to chunk_size bytes, each read covering whole extents
+// where it can, and reports every match in it.  The last
+// overlap bytes of a chunk are searched again in front of
+// the next one.
+// INPUT PARAMETERS:
+//     Takes in the scan, the path to print and the file's
+// entry.
+//------------------------------------------------------*/
+static void searchFile(GrepScan *scan, const char *path, const DirectoryEntry *entry){
+
+    ExfatFile *file;
+    GrepChunk chunk;
+    uint64_t size = entry->data_length;
+    uint64_t offset = 0;
+    size_t wanted;
+    size_t keep;
+    ssize_t count;
+    uint8_t *buffer;
+
+    if(size == 0){
+        return;
+    }
+    file = openEntry(scan->volume_fd, scan->volume, NULL, entry);
+    wanted = size < scan->chunk_size ? (size_t) size : scan->chunk_size;
+    buffer = malloc(scan->overlap + wanted + 1);
+    assert(buffer != NULL);
+
+    chunk.scan = scan;
+    chunk.path = path;
+    chunk.carry = 0;
+    chunk.last_match = 0;
+    chunk.matches = 0;
+
+    while(offset < size){
+        if(wanted > size - offset){
+            wanted = (size_t) (size - offset);
+        }
+        count = readFile(file, buffer + chunk.carry, wanted, offset);
+        if(count <= 0){
+            fprintf(stderr, "Unable to read '%s' at offset %llu\n", path, (unsigned long long) offset);
+            break;
+        }
+        chunk.base = offset - chunk.carry;
+        chunk.at_end = offset + (uint64_t) count >= size;
+
+        if(scan->use_regex){
+            searchRegex(&chunk, buffer, chunk.carry + (size_t) count);
+        }
+        else {
+            searchPatterns(&scan->patterns, buffer, chunk.carry + (size_t) count, collectMatch, &chunk);
+        }
+
+        offset += (uint64_t) count;
+        keep = chunk.carry + (size_t) count < scan->overlap ? chunk.carry + (size_t) count : scan->overlap;
+        memmove(buffer, buffer + chunk.carry + (size_t) count - keep, keep);
+        chunk.carry = keep;
+    }
+
+    if(chunk.matches > 0){
+        __atomic_fetch_add(&scan->matches, chunk.matches, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&scan->matched_files, 1, __ATOMIC_RELAXED);
+    }
+    free(buffer);
+    closeFile(file);
+}
+
+static GrepWork *createGrepWork(const char *path, unsigned int depth, const DirectoryEntry *entry){
+
+    GrepWork *work = malloc(sizeof (GrepWork));
+
+    assert(work != NULL);
+    work->path = strdup(path);
+    assert(work->path != NULL);
+    work->depth = depth;
+    work->entry = *entry;
+    return work;
+}
+
+static int visitEntry(DirectoryEntry *entry, void *context){
+
+    GrepDirectory *directory = context;
+    GrepScan *scan = directory->scan;
+    char *name = entryName(entry);
+    char *path;
+
+    assert(name != NULL);
+    path = malloc(strlen(directory->path) + strlen(name) + 2);
+    assert(path != NULL);
+    sprintf(path, "%s/%s", directory->path, name);
+
+    if(isDirectory(entry)){
+        /* A directory already queued, or too deep, would loop forever */
+        if(directory->depth < MAX_TREE_DEPTH && isValidCluster(scan->volume, entry->first_cluster) &&
+           !testAndSetBit(scan->visited, entry->first_cluster - FIRST_DATA_CLUSTER)){
+            pushWork(directory->queue, createGrepWork(path, directory->depth + 1, entry));
+        }
+    }
+    else if(entry->data_length > 0){
+        pushWork(directory->queue, createGrepWork(path, directory->depth + 1, entry));
+    }
+
+    free(path);
+    free(name);
+    return WALK_CONTINUE;
+}
+
+/* Walks a directory, queueing what it holds, or searches a file */
+static void grepItem(void *item, WorkQueue *queue, void *context){
+
+    GrepWork *work = item;
+    GrepDirectory directory;
+
+    if(isDirectory(&work->entry)){
+        directory.scan = context;
+        directory.queue = queue;
+        directory.path = work->path;
+        directory.depth = work->depth;
+        walkDirectory(directory.scan->volume_fd, directory.scan->volume, NULL, work->entry.first_cluster,
+                      work->entry.data_length, work->entry.general_flags, 0, visitEntry, &directory);
+    }
+    else {
+        searchFile(context, work->path, &work->entry);
+    }
+
+    free(work->path);
+    free(work);
+}
+
+/* Parses "de ad be ef" or "deadbeef" into bytes, returns the count or -1 */
+static int parseHex(const char *text, uint8_t *bytes, size_t size){
+
+    size_t count = 0;
+    int high = -1;
+    int digit;
+
+    for(; *text != '\0'; text++){
+        if(isspace((unsigned char) *text)){
+            continue;
+        }
+        if(!isxdigit((unsigned char) *text) || count == size){
+            return -1;
+        }
+        digit = isdigit((unsigned char) *text) ? *text - '0' : tolower((unsigned char) *text) - 'a' + 10;
+        if(high < 0){
+            high = digit;
+        }
+        else {
+            bytes[count++] = (uint8_t) (high << 4 | digit);
+            high = -1;
+        }
+    }
+    return high < 0 && count > 0 ? (int) count : -1;
+}
+
+/* Adds a literal to the set, keeping its bytes with the scan */
+static int addLiteral(GrepScan *scan, const uint8_t *bytes, size_t length){
+
+    uint8_t *copy;
+
+    if(scan->patterns.count == MAX_PATTERNS || length == 0 || length > MAX_PATTERN_LENGTH){
+        return -1;
+    }
+    copy = malloc(length);
+    assert(copy != NULL);
+    memcpy(copy, bytes, length);
+    scan->pattern_bytes[scan->patterns.count] = copy;
+    return addPattern(&scan->patterns, copy, length);
+}
+
+/*------------------------------------------------------
+// addRegexLiterals
+//
+// PURPOSE: Takes a regex that is only literals separated
+// by '|' apart as literals for the vectorized search, so
+// the regex engine is only used where it is needed.
+// INPUT PARAMETERS:
+//     Takes in the scan and the regex.
+// OUTPUT PARAMETERS:
+//     Returns 0 if the regex was added as literals, -1 if
+// it needs the regex engine.
+//------------------------------------------------------*/
+static int addRegexLiterals(GrepScan *scan, const char *regex){
+
+    const char *start = regex;
+    const char *end;
+    int count = scan->patterns.count;
+
+    for(const char *c = regex; *c != '\0'; c++){
+        if(*c != '|' && strchr(REGEX_SPECIAL, *c) != NULL){
+            return -1;
+        }
+    }
+    for(;;){
+        end = strchr(start, '|');
+        if(end == NULL){
+            end = start + strlen(start);
+        }
+        if(end == start || addLiteral(scan, (const uint8_t *) start, (size_t) (end - start)) < 0){
+            break;
+        }
+        if(*end == '\0'){
+            return 0;
+        }
+        start = end + 1;
+    }
+
+    /* An empty alternative, or too many of them: leave it all to the regex */
+    while(scan->patterns.count > count){
+        free(scan->pattern_bytes[--scan->patterns.count]);
+    }
+    scan->patterns.max_length = 0;
+    for(int i = 0; i < count; i++){
+        if(scan->patterns.lengths[i] > scan->patterns.max_length){
+            scan->patterns.max_length = scan->patterns.lengths[i];
+        }
+    }
+    return -1;
+}
+
+/*------------------------------------------------------
+// compilePatterns
+//
+// PURPOSE: Turns the patterns given on the command line
+// into either a set of literals or one regex.  Hex
+// patterns are byte strings; regexes made of plain
+// alternatives become literals; any other regexes are
+// joined with '|' into a single extended regex.
+// INPUT PARAMETERS:
+//     Takes in the scan, the patterns and their number,
+// and whether they are regexes or hex.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 for an invalid pattern.
+//------------------------------------------------------*/
+static int compilePatterns(GrepScan *scan, char *patterns[], int count, int regex, int hex){
+
+    uint8_t bytes[MAX_PATTERN_LENGTH];
+    size_t length = 1;
+    char *joined;
+    char message[256];
+    int length_bytes;
+    int error;
+
+    initPatternSet(&scan->patterns);
+    scan->use_regex = 0;
+
+    for(int i = 0; i < count; i++){
+        if(hex){
+            length_bytes = parseHex(patterns[i], bytes, sizeof (bytes));
+            if(length_bytes < 0 || addLiteral(scan, bytes, (size_t) length_bytes) < 0){
+                fprintf(stderr, "Invalid hex pattern: '%s'\n", patterns[i]);
+                return -1;
+            }
+        }
+        else if(!regex || addRegexLiterals(scan, patterns[i]) != 0){
+            if(regex){
+                scan->use_regex = 1;
+            }
+            else if(addLiteral(scan, (const uint8_t *) patterns[i], strlen(patterns[i])) < 0){
+                fprintf(stderr, "Invalid pattern: '%s' (1 to %d bytes, at most %d patterns)\n", patterns[i],
+                        MAX_PATTERN_LENGTH, MAX_PATTERNS);
+                return -1;
+            }
+        }
+    }
+    if(!scan->use_regex){
+        scan->overlap = scan->patterns.max_length - 1;
+        return 0;
+    }
+
+    /* Once any pattern needs the engine they all go to it, as "(p1)|(p2)..." */
+    for(int i = 0; i < count; i++){
+        length += strlen(patterns[i]) + 3;
+    }
+    joined = malloc(length);
+    assert(joined != NULL);
+    joined[0] = '\0';
+    for(int i = 0; i < count; i++){
+        if(count > 1){
+            strcat(joined, i > 0 ? "|(" : "(");
+        }
+        strcat(joined, patterns[i]);
+        if(count > 1){
+            strcat(joined, ")");
+        }
+    }
+
+    error = regcomp(&scan->regex, joined, REG_EXTENDED);
+    if(error != 0){
+        regerror(error, &scan->regex, message, sizeof (message));
+        fprintf(stderr, "Invalid regex '%s': %s\n", joined, message);
+        free(joined);
+        scan->use_regex = 0;
+        return -1;
+    }
+    free(joined);
+    scan->overlap = GREP_REGEX_OVERLAP;
+    return 0;
+}
+
+static void freePatterns(GrepScan *scan){
+
+    for(int i = 0; i < scan->patterns.count; i++){
+        free(scan->pattern_bytes[i]);
+    }
+    if(scan->use_regex){
+        regfree(&scan->regex);
+    }
+}
+
+/*------------------------------------------------------
+// commandGrep
+//
+// PURPOSE: Runs "grep [-E] [--hex] <pattern> [path]
+// [-e <pattern>]...", printing "path:offset" for every
+// match in the files below path (the whole volume by
+// default), or in path itself when it is a file.  A
+// pattern is a literal string, with --hex a byte string
+// in hex and with -E an extended regex.  Offsets are in
+// bytes from the start of the file.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct and the arguments
+// that follow the command.
+// OUTPUT PARAMETERS:
+//     Returns 0 if anything matched, -1 if nothing did or
+// for a bad pattern, path or option.
+//------------------------------------------------------*/
+int commandGrep(int volume_fd, exfat *volume, int argc, char *argv[]){
+
+    GrepScan scan;
+    DirectoryEntry root;
+    WorkQueue *queue;
+    char **patterns = calloc(argc + 1, sizeof (char *));
+    const char *path = NULL;
+    char *start;
+    int pattern_count = 0;
+    int regex = 0;
+    int hex = 0;
+    unsigned int threads = threadCount();
+
+    assert(patterns != NULL);
+    memset(&scan, 0, sizeof (GrepScan));
+    scan.volume_fd = volume_fd;
+    scan.volume = volume;
+
+    for(int i = 0; i < argc; i++){
+        if(strcmp(argv[i], "-E") == 0){
+            regex = 1;
+        }
+        else if(strcmp(argv[i], "--hex") == 0){
+            hex = 1;
+        }
+        else if(strcmp(argv[i], "-e") == 0 && i + 1 < argc){
+            patterns[pattern_count++] = argv[++i];
+        }
+        else if(argv[i][0] != '-' && pattern_count == 0){
+            patterns[pattern_count++] = argv[i];
+        }
+        else if(argv[i][0] != '-' && path == NULL){
+            path = argv[i];
+        }
+        else {
+            fprintf(stderr, "Invalid grep option: '%s'\n", argv[i]);
+            free(patterns);
+            return -1;
+        }
+    }
+    if(pattern_count == 0 || (regex && hex)){
+        fprintf(stderr, "Usage: grep [-E|--hex] <pattern> [path] [-e <pattern>]...\n");
+        free(patterns);
+        return -1;
+    }
+    if(path == NULL){
+        path = "/";
+    }
+    if(compilePatterns(&scan, patterns, pattern_count, regex, hex) != 0){
+        freePatterns(&scan);
+        free(patterns);
+        return -1;
+    }
+    free(patterns);
+
+    if(resolvePath(volume_fd, volume, NULL, path, &root) != 0){
+        fprintf(stderr, "No such file or directory: '%s'\n", path);
+        freePatterns(&scan);
+        return -1;
+    }
+
+    /* Every thread holds one chunk, their buffers share a table's part of the memory ceiling */
+    scan.chunk_size = memoryShare((uint64_t) GREP_CHUNK_SIZE * threads) / threads;
+    if(scan.chunk_size < MIN_GREP_CHUNK_SIZE){
+        scan.chunk_size = MIN_GREP_CHUNK_SIZE;
+    }
+
+    /* Paths are printed as "/dir/name", without a trailing '/' on the root */
+    start = malloc(strlen(path) + 2);
+    assert(start != NULL);
+    sprintf(start, "%s%s", path[0] == '/' ? "" : "/", path);
+    while(isDirectory(&root) && strlen(start) > 0 && start[strlen(start) - 1] == '/'){
+        start[strlen(start) - 1] = '\0';
+    }
+
+    scan.visited = createBitset(volume->cluster_count);
+    assert(scan.visited != NULL);
+    if(isDirectory(&root) && isValidCluster(volume, root.first_cluster)){
+        setBit(scan.visited, root.first_cluster - FIRST_DATA_CLUSTER);
+    }
+
+    queue = createWorkQueue(grepItem, &scan);
+    pushWork(queue, createGrepWork(start, 0, &root));
+    runWorkQueue(queue);
+    destroyWorkQueue(queue);
+    destroyBitset(scan.visited);
+
+    fprintf(stderr, "%lu match(es) in %lu file(s)\n", scan.matches, scan.matched_files);
+    free(start);
+    freePatterns(&scan);
+    return scan.matches > 0 ? 0 : -1;
+}
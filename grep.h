@@ -0,0 +1,14 @@
+//
+// Parallel search of file contents for literals, byte strings and regexes.
+//
+
+#ifndef FSREADER_GREP_H
+#define FSREADER_GREP_H
+
+#include "exfat.h"
+
+
+int commandGrep(int volume_fd, exfat *volume, int argc, char *argv[]);
+
+
+#endif //FSREADER_GREP_H
@@ -0,0 +1,235 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Implement the "image" command, copying a
+// volume into a sparse image file.  Everything before
+// the cluster heap (the main and backup boot regions and
+// the FATs) is copied, then only the clusters the
+// allocation bitmap marks as in use, each run of
+// consecutive allocated clusters as one large request in
+// ascending order, to the same offsets.  Free clusters
+// are never read or written and stay holes in the
+// destination, so the copy takes time in proportion to
+// the used space rather than the volume size.  Runs move
+// with copy_file_range when the kernel allows it, and
+// with pread and pwrite through one buffer otherwise.
+//-----------------------------------------*/
+#define _GNU_SOURCE     /* copy_file_range */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <assert.h>
+
+#include "image.h"
+#include "fat.h"
+#include "bitset.h"
+#include "trace.h"
+#include "memory.h"
+
+#define IMAGE_BUFFER_SIZE (4 * KILOBYTE_SIZE * KILOBYTE_SIZE)
+#define VOLUME_LENGTH_OFFSET 72     /* VolumeLength in the boot sector, in sectors */
+
+typedef struct ImageCopy {
+
+    int volume_fd;
+    int output_fd;
+    int use_copy_file_range;
+    uint8_t *buffer;            /* buffer_size bytes, allocated on first use */
+    size_t buffer_size;
+    uint64_t bytes;
+    uint64_t runs;
+
+} ImageCopy ;
+
+static int writeAt(int output_fd, const uint8_t *bytes, size_t length, uint64_t offset){
+
+    ssize_t written;
+
+    while(length > 0){
+        written = pwrite(output_fd, bytes, length, (off_t) offset);
+        if(written < 0 && errno == EINTR){
+            continue;
+        }
+        if(written <= 0){
+            return -1;
+        }
+        bytes += written;
+        length -= (size_t) written;
+        offset += (uint64_t) written;
+    }
+    return 0;
+}
+
+/*------------------------------------------------------
+// copyRun
+//
+// PURPOSE: Copies a byte range of the volume to the same
+// offset of the image.  copy_file_range is used until
+// the kernel refuses it, after which ranges go through
+// the buffer.
+// INPUT PARAMETERS:
+//     Takes in the copy state, the byte offset and the
+// number of bytes.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 if the volume ended early
+// or a read or write failed.
+//------------------------------------------------------*/
+static int copyRun(ImageCopy *copy, uint64_t offset, uint64_t length){
+
+    loff_t source;
+    loff_t destination;
+    ssize_t moved;
+    size_t chunk;
+    uint64_t start;
+
+    copy->runs++;
+    while(length > 0){
+        chunk = length < (uint64_t) 1 << 30 ? (size_t) length : (size_t) 1 << 30;
+
+        if(copy->use_copy_file_range){
+            source = (loff_t) offset;
+            destination = (loff_t) offset;
+            start = tracing() ? traceClock() : 0;
+            moved = copy_file_range(copy->volume_fd, &source, copy->output_fd, &destination, chunk, 0);
+            traceRead(offset, chunk, moved, start);
+
+            if(moved < 0 && errno == EINTR){
+                continue;
+            }
+            if(moved < 0){
+                copy->use_copy_file_range = 0;
+                continue;
+            }
+            if(moved == 0){
+                return -1;
+            }
+        }
+        else {
+            if(copy->buffer == NULL){
+                copy->buffer = malloc(copy->buffer_size);
+                assert(copy->buffer != NULL);
+            }
+            if(chunk > copy->buffer_size){
+                chunk = copy->buffer_size;
+            }
+            moved = readBytesAs(copy->volume_fd, copy->buffer, chunk, offset, TRACE_DATA);
+            if(moved != (ssize_t) chunk || writeAt(copy->output_fd, copy->buffer, chunk, offset) != 0){
+                return -1;
+            }
+        }
+
+        offset += (uint64_t) moved;
+        length -= (uint64_t) moved;
+        copy->bytes += (uint64_t) moved;
+    }
+    return 0;
+}
+
+/*------------------------------------------------------
+// commandImage
+//
+// PURPOSE: Runs "image <destination>", writing a sparse
+// copy of the volume that holds its metadata and its
+// allocated clusters.  The destination is made as long
+// as the boot sector's VolumeLength.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct and the arguments
+// that follow the command.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 otherwise.
+//------------------------------------------------------*/
+int commandImage(int volume_fd, exfat *volume, int argc, char *argv[]){
+
+    ImageCopy copy;
+    Bitset *bitmap;
+    struct stat source_stat;
+    struct stat output_stat;
+    uint64_t volume_length;
+    uint64_t heap_offset = (uint64_t) volume->cluster_heap_offset << volume->sector_size;
+    uint64_t cluster_bytes = clusterBytes(volume);
+    uint64_t run_start;
+    uint64_t run_end;
+    uint64_t used_clusters;
+    int status = 0;
+
+    if(argc != 1){
+        printf("Usage: image <destination>\n");
+        return -1;
+    }
+    if(readBytesAs(volume_fd, &volume_length, sizeof (volume_length), VOLUME_LENGTH_OFFSET, TRACE_BOOT) !=
+       (ssize_t) sizeof (volume_length)){
+        printf("Unable to read the volume length\n");
+        return -1;
+    }
+    volume_length <<= volume->sector_size;
+
+    bitmap = loadAllocationBitmap(volume_fd, volume, NULL);
+    if(bitmap == NULL){
+        return -1;
+    }
+
+    copy.output_fd = open(argv[0], O_WRONLY | O_CREAT, 0644);
+    if(copy.output_fd < 0){
+        printf("Unable to create '%s'\n", argv[0]);
+        destroyBitset(bitmap);
+        return -1;
+    }
+    /* Truncating the volume onto itself would destroy it, so compare before truncating */
+    if(fstat(volume_fd, &source_stat) == 0 && fstat(copy.output_fd, &output_stat) == 0 &&
+       source_stat.st_dev == output_stat.st_dev && source_stat.st_ino == output_stat.st_ino){
+        printf("The destination is the volume itself\n");
+        close(copy.output_fd);
+        destroyBitset(bitmap);
+        return -1;
+    }
+    if(ftruncate(copy.output_fd, 0) != 0 || ftruncate(copy.output_fd, (off_t) volume_length) != 0){
+        printf("Unable to size '%s' to %llu bytes\n", argv[0], (unsigned long long) volume_length);
+        close(copy.output_fd);
+        destroyBitset(bitmap);
+        return -1;
+    }
+
+    copy.volume_fd = volume_fd;
+    copy.use_copy_file_range = 1;
+    copy.buffer = NULL;
+    copy.buffer_size = (size_t) memoryShare(IMAGE_BUFFER_SIZE);
+    copy.bytes = 0;
+    copy.runs = 0;
+
+    traceBegin("copy metadata");
+    status = copyRun(&copy, 0, heap_offset);
+    traceEnd();
+
+    traceBegin("copy clusters");
+    run_start = findNextSet(bitmap, 0, bitmap->size);
+    while(status == 0 && run_start < bitmap->size){
+        run_end = findNextClear(bitmap, run_start, bitmap->size);
+        status = copyRun(&copy, clusterOffset(volume, (uint32_t) (run_start + FIRST_DATA_CLUSTER)),
+                         (run_end - run_start) * cluster_bytes);
+        run_start = run_end < bitmap->size ? findNextSet(bitmap, run_end, bitmap->size) : bitmap->size;
+    }
+    traceEnd();
+
+    used_clusters = countSetBits(bitmap, 0, bitmap->size);
+    if(close(copy.output_fd) != 0 && status == 0){
+        status = -1;
+    }
+    if(status != 0){
+        printf("Unable to copy the volume to '%s'\n", argv[0]);
+    }
+    else {
+        printf("Copied %llu KB of %llu KB (%llu of %u clusters allocated) in %llu run(s) to '%s'\n",
+               (unsigned long long) copy.bytes / KILOBYTE_SIZE, (unsigned long long) volume_length / KILOBYTE_SIZE,
+               (unsigned long long) used_clusters, volume->cluster_count, (unsigned long long) copy.runs, argv[0]);
+    }
+
+    free(copy.buffer);
+    destroyBitset(bitmap);
+    return status;
+}
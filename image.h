@@ -0,0 +1,14 @@
+//
+// Allocation-aware copy of a volume into a sparse image file.
+//
+
+#ifndef FSREADER_IMAGE_H
+#define FSREADER_IMAGE_H
+
+#include "exfat.h"
+
+
+int commandImage(int volume_fd, exfat *volume, int argc, char *argv[]);
+
+
+#endif //FSREADER_IMAGE_H
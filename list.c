@@ -26,6 +26,7 @@ List *createList(){
 
     List *newList = malloc(sizeof (List));
     newList->first_node = NULL;
+    newList->last_node = NULL;
     newList->size = 0;
 
     return newList;
@@ -46,35 +47,64 @@ List *createList(){
 //------------------------------------------------------*/
 void insert( List *list, unsigned int data){
 
-    Node *curr_node;
+    Node *new_node = malloc(sizeof (Node));
+    assert(new_node != NULL);
+
+    new_node->data = data;
+    new_node->next_node = NULL;
+
     /*If we are adding to an empty list*/
     if(list->first_node == NULL){
-        list->first_node  = malloc(sizeof (Node));
-        assert(list->first_node != NULL);
+        list->first_node = new_node;
+    }
+    else {
+        list->last_node->next_node = new_node;
+    }
 
-        list->first_node->data = data;
-        list->first_node->next_node = NULL;
+    list->last_node = new_node;
+    list->size++;
+}
+
+/*------------------------------------------------------
+// truncateList
+//
+// PURPOSE: Given a pointer to a List, this method drops
+// every data item past the first size items.
+// INPUT PARAMETERS:
+//    Takes in a pointer to a List along with the number
+// of data items to keep.
+//------------------------------------------------------*/
+void truncateList(List *list, unsigned int size){
 
+    Node *curr_node = list->first_node;
+    Node *next_node;
+
+    if(size >= list->size){
+        return;
     }
-    else {
 
-        curr_node = list->first_node;
-        while(curr_node->next_node != NULL) {
+    if(size == 0){
+        list->first_node = NULL;
+        list->last_node = NULL;
+    }
+    else {
+        for(unsigned int i = 1; i < size; i++){
             curr_node = curr_node->next_node;
         }
-        curr_node->next_node = malloc(sizeof (Node));
-        assert(curr_node->next_node != NULL);
-
-        curr_node = curr_node->next_node;
-        curr_node->data = data;
-
+        list->last_node = curr_node;
+        next_node = curr_node->next_node;
         curr_node->next_node = NULL;
+        curr_node = next_node;
     }
 
-    list->size++;
+    while(curr_node != NULL){
+        next_node = curr_node->next_node;
+        free(curr_node);
+        curr_node = next_node;
+    }
+    list->size = size;
 }
 
-
 /*------------------------------------------------------
 // getData
 //
@@ -96,6 +126,7 @@ unsigned int getData(List *list){
     if(list->size == 1){
         result = list->first_node->data;
         list->first_node = NULL;
+        list->last_node = NULL;
         list->size--;
     }
     else if(list->size > 1){
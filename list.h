@@ -15,6 +15,7 @@
 typedef struct List {
 
     Node *first_node;
+    Node *last_node;    /* so insert appends without walking the list */
     unsigned int size;
 
 } List ;
@@ -24,6 +25,8 @@ List *createList();
 
 void insert(List *list, unsigned int data);
 
+void truncateList(List *list, unsigned int size);
+
 unsigned int getData(List *list);
 
 void printList(List *list);
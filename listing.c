@@ -0,0 +1,696 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Implement "list --long", "timeline", "stat"
+// and "tree".  Sorted listings and the timeline read the
+// entries into a Catalog and sort packed 64 bit keys (a
+// time, a size or the leading bytes of a name) with a
+// radix sort, so ordering millions of rows takes a few
+// linear passes.  Output is streamed in sorted order,
+// each path being rebuilt into a single buffer from the
+// catalog just before it is printed.  Unsorted listings
+// and trees need no catalog: they are printed during the
+// walk, holding only the directories on the way down.
+//-----------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+
+#include "listing.h"
+#include "catalog.h"
+#include "sort.h"
+#include "directory.h"
+#include "memory.h"
+
+#define PATH_BUFFER_SIZE 4096
+#define TIME_BUFFER_SIZE 32
+#define CURSOR_LENGTH 40
+
+#define SORT_NONE 0
+#define SORT_NAME 1
+#define SORT_MTIME 2
+#define SORT_SIZE 3
+
+/* tree connectors, one per level */
+#define TREE_INDENT 4
+#define TREE_BRANCH "|-- "
+#define TREE_LAST "`-- "
+#define TREE_PIPE "|   "
+#define TREE_SPACE "    "
+
+typedef struct LongListing {
+
+    int recursive;
+
+} LongListing ;
+
+typedef struct TreeListing {
+
+    int volume_fd;
+    exfat *volume;
+    int max_depth;
+    uint64_t directories;
+    uint64_t files;
+    char prefix[MAX_TREE_DEPTH * TREE_INDENT + 1];
+
+} TreeListing ;
+
+/* One directory being printed, its last entry is held back until it is known to be the last */
+typedef struct TreeLevel {
+
+    TreeListing *listing;
+    int depth;
+    int has_pending;
+    DirectoryEntry pending;
+
+} TreeLevel ;
+
+/* Timeline events, packed in the low bits of the row value */
+#define EVENT_MODIFIED 0
+#define EVENT_ACCESSED 1
+#define EVENT_CREATED 2
+#define EVENT_BITS 2
+
+/* Eight name bytes from offset, upper cased, big endian so keys order like the names */
+static uint64_t nameKey(const char *name, size_t length, size_t offset){
+
+    uint64_t key = 0;
+
+    for(size_t i = offset; i < offset + 8; i++){
+        key = (key << 8) | (i < length ? (uint8_t) toupper((unsigned char) name[i]) : 0);
+    }
+    return key;
+}
+
+/*------------------------------------------------------
+// sortByName
+//
+// PURPOSE: Sorts rows by name without regard to case.
+// The rows are radix sorted on the first eight bytes of
+// their names, then each run of rows sharing those bytes
+// is sorted again on the next eight.
+// INPUT PARAMETERS:
+//     Takes in the Catalog, a scratch key array and the
+// rows to sort, their number, and the name offset that
+// the keys start at.
+//------------------------------------------------------*/
+static void sortByName(const Catalog *catalog, uint64_t *keys, uint32_t *rows, uint64_t count, size_t offset){
+
+    const char *name;
+    uint64_t start = 0;
+    uint64_t end;
+
+    for(uint64_t i = 0; i < count; i++){
+        name = catalogName(catalog, rows[i]);
+        keys[i] = nameKey(name, strlen(name), offset);
+    }
+    radixSort(keys, rows, count);
+
+    while(start < count){
+        end = start + 1;
+        while(end < count && keys[end] == keys[start]){
+            end++;
+        }
+        /* A key ending in 0 means the names ended within it, they are equal */
+        if(end - start > 1 && (keys[start] & 0xff) != 0){
+            sortByName(catalog, keys + start, rows + start, end - start, offset + 8);
+        }
+        start = end;
+    }
+}
+
+static void formatAttributes(uint16_t attributes, char *buffer){
+
+    buffer[0] = (attributes & ATTRIBUTE_DIRECTORY) ? 'd' : '-';
+    buffer[1] = (attributes & ATTRIBUTE_READ_ONLY) ? 'r' : '-';
+    buffer[2] = (attributes & ATTRIBUTE_HIDDEN) ? 'h' : '-';
+    buffer[3] = (attributes & ATTRIBUTE_SYSTEM) ? 's' : '-';
+    buffer[4] = (attributes & ATTRIBUTE_ARCHIVE) ? 'a' : '-';
+    buffer[5] = '\0';
+}
+
+static void printLongLine(uint16_t file_attributes, uint64_t data_length, int64_t create_ticks,
+                          int64_t modify_ticks, int64_t access_ticks, const char *path){
+
+    char attributes[6];
+    char created[TIME_BUFFER_SIZE];
+    char modified[TIME_BUFFER_SIZE];
+    char accessed[TIME_BUFFER_SIZE];
+
+    formatAttributes(file_attributes, attributes);
+    formatTicks(create_ticks, created, TIME_BUFFER_SIZE);
+    formatTicks(modify_ticks, modified, TIME_BUFFER_SIZE);
+    formatTicks(access_ticks, accessed, TIME_BUFFER_SIZE);
+    printf("%-5s %15llu  %-22s  %-22s  %-22s  %s\n", attributes, (unsigned long long) data_length,
+           created, modified, accessed, path);
+}
+
+static int printLongEntry(const char *path, DirectoryEntry *entry, void *context){
+
+    LongListing *listing = context;
+
+    printLongLine(entry->file_attributes, entry->data_length,
+                  entryTicks(entry->create_timestamp, entry->create_10ms, entry->create_utc_offset),
+                  entryTicks(entry->modify_timestamp, entry->modify_10ms, entry->modify_utc_offset),
+                  entryTicks(entry->access_timestamp, 0, entry->access_utc_offset), path);
+    return listing->recursive ? WALK_CONTINUE : WALK_SKIP;
+}
+
+/*------------------------------------------------------
+// streamListLong
+//
+// PURPOSE: Prints "list --long" in directory order as the
+// tree is walked, the same rows a catalog would give but
+// in memory that only grows with the depth of the tree.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct, the path of the
+// directory and whether to descend into subdirectories.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 if path is not a directory.
+//------------------------------------------------------*/
+static int streamListLong(int volume_fd, exfat *volume, const char *path, int recursive){
+
+    LongListing listing;
+    DirectoryEntry root;
+    char *prefix;
+
+    if(resolvePath(volume_fd, volume, NULL, path, &root) != 0 || !isDirectory(&root)){
+        printf("No such directory: '%s'\n", path);
+        return -1;
+    }
+
+    /* Paths are printed as "/dir/name", as the catalog prints them */
+    prefix = malloc(strlen(path) + 2);
+    assert(prefix != NULL);
+    sprintf(prefix, "%s%s", path[0] == '/' ? "" : "/", path);
+    while(strlen(prefix) > 0 && prefix[strlen(prefix) - 1] == '/'){
+        prefix[strlen(prefix) - 1] = '\0';
+    }
+
+    listing.recursive = recursive;
+    printf("%-5s %15s  %-22s  %-22s  %-22s  %s\n", "Attr", "Size", "Created", "Modified", "Accessed", "Path");
+    walkTree(volume_fd, volume, NULL, prefix, root.first_cluster, root.data_length, root.general_flags,
+             printLongEntry, &listing);
+
+    free(prefix);
+    return 0;
+}
+
+/* The cursor of a page, hex digits of the directory, cluster index, cluster and entry index */
+static void formatCursor(const DirectoryPosition *position, char *buffer, size_t size){
+
+    snprintf(buffer, size, "%08x%016llx%08x%08x", position->directory, (unsigned long long) position->cluster_index,
+             position->cluster, position->entry_index);
+}
+
+static int parseCursor(const char *cursor, DirectoryPosition *position){
+
+    unsigned long long cluster_index;
+    int length = 0;
+
+    if(strlen(cursor) != CURSOR_LENGTH ||
+       sscanf(cursor, "%8x%16llx%8x%8x%n", &position->directory, &cluster_index, &position->cluster,
+              &position->entry_index, &length) != 4 || length != CURSOR_LENGTH){
+        return -1;
+    }
+    position->cluster_index = cluster_index;
+    position->done = 0;
+    return 0;
+}
+
+/*------------------------------------------------------
+// listPage
+//
+// PURPOSE: Prints one page of "list --long": at most
+// limit entries of a directory in directory order,
+// starting after the cursor of the page before.  Only
+// the clusters holding the page are read, so a page
+// deep into a huge directory comes as fast as the first.
+// A "Cursor:" line for the next page follows the rows
+// when more entries remain.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct, the path of the
+// directory, the page size and the cursor (NULL for the
+// first page).
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 for a bad path or cursor.
+//------------------------------------------------------*/
+static int listPage(int volume_fd, exfat *volume, const char *path, uint64_t limit, const char *cursor){
+
+    DirectoryIterator *iterator;
+    DirectoryPosition position;
+    DirectoryEntry directory;
+    DirectoryEntry *entry;
+    LongListing listing;
+    char *prefix;
+    char *full_path;
+    char *name;
+    char next[CURSOR_LENGTH + 1];
+    uint64_t count = 0;
+    int status;
+
+    if(resolvePath(volume_fd, volume, NULL, path, &directory) != 0 || !isDirectory(&directory)){
+        printf("No such directory: '%s'\n", path);
+        return -1;
+    }
+    iterator = openDirectoryIterator(volume_fd, volume, NULL, directory.first_cluster, directory.data_length,
+                                     directory.general_flags, 0, NULL, NULL);
+    if(cursor != NULL && (parseCursor(cursor, &position) != 0 || seekDirectory(iterator, &position) != 0)){
+        printf("Invalid cursor for '%s': '%s'\n", path, cursor);
+        closeDirectoryIterator(iterator);
+        return -1;
+    }
+
+    prefix = malloc(strlen(path) + 2);
+    full_path = malloc(PATH_BUFFER_SIZE);
+    assert(prefix != NULL && full_path != NULL);
+    sprintf(prefix, "%s%s", path[0] == '/' ? "" : "/", path);
+    while(strlen(prefix) > 0 && prefix[strlen(prefix) - 1] == '/'){
+        prefix[strlen(prefix) - 1] = '\0';
+    }
+
+    listing.recursive = 0;
+    printf("%-5s %15s  %-22s  %-22s  %-22s  %s\n", "Attr", "Size", "Created", "Modified", "Accessed", "Path");
+    while(count < limit && (status = nextDirectoryEntry(iterator, &entry)) == 1){
+        name = entryName(entry);
+        assert(name != NULL);
+        snprintf(full_path, PATH_BUFFER_SIZE, "%s/%s", prefix, name);
+        printLongEntry(full_path, entry, &listing);
+        free(name);
+        count++;
+    }
+
+    /* Only hand out a cursor if there is something after it */
+    if(count == limit){
+        directoryPosition(iterator, &position);
+        if(nextDirectoryEntry(iterator, &entry) == 1){
+            formatCursor(&position, next, sizeof (next));
+            printf("Cursor: %s\n", next);
+        }
+    }
+
+    free(full_path);
+    free(prefix);
+    closeDirectoryIterator(iterator);
+    return 0;
+}
+
+/*------------------------------------------------------
+// commandListLong
+//
+// PURPOSE: Runs "list --long [--sort=mtime|size|name]
+// [-r] [path]", printing the attributes, size, created,
+// modified and accessed times and path of every entry in
+// the directory (and below it with -r).  Names sort in
+// ascending order, times and sizes newest and largest
+// first; without --sort entries keep directory order and
+// are printed as they are found.  "--limit N [--after
+// cursor]" pages through one directory, see listPage.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct and the arguments
+// that follow the command.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 for a bad path or option.
+//------------------------------------------------------*/
+int commandListLong(int volume_fd, exfat *volume, int argc, char *argv[]){
+
+    Catalog *catalog;
+    CatalogEntry *row;
+    uint64_t *keys;
+    uint32_t *rows;
+    const char *path = "/";
+    int sort = SORT_NONE;
+    int recursive = 0;
+    int descending;
+    uint32_t index;
+    char *full_path;
+    char *end;
+    const char *after = NULL;
+    uint64_t limit = 0;
+
+    for(int i = 0; i < argc; i++){
+        if(strcmp(argv[i], "--long") == 0){
+            continue;
+        }
+        else if(strcmp(argv[i], "-r") == 0){
+            recursive = 1;
+        }
+        else if(strcmp(argv[i], "--sort=name") == 0){
+            sort = SORT_NAME;
+        }
+        else if(strcmp(argv[i], "--sort=mtime") == 0){
+            sort = SORT_MTIME;
+        }
+        else if(strcmp(argv[i], "--sort=size") == 0){
+            sort = SORT_SIZE;
+        }
+        else if(strcmp(argv[i], "--limit") == 0 && i + 1 < argc){
+            limit = strtoull(argv[++i], &end, 10);
+            if(*end != '\0' || limit == 0){
+                printf("Invalid limit: '%s'\n", argv[i]);
+                return -1;
+            }
+        }
+        else if(strcmp(argv[i], "--after") == 0 && i + 1 < argc){
+            after = argv[++i];
+        }
+        else if(argv[i][0] != '-'){
+            path = argv[i];
+        }
+        else {
+            printf("Invalid list option: '%s'\n", argv[i]);
+            return -1;
+        }
+    }
+
+    if(limit > 0 || after != NULL){
+        if(sort != SORT_NONE || recursive){
+            printf("--limit and --after page through one directory, without --sort or -r\n");
+            return -1;
+        }
+        return listPage(volume_fd, volume, path, limit > 0 ? limit : UINT64_MAX, after);
+    }
+    if(sort == SORT_NONE){
+        return streamListLong(volume_fd, volume, path, recursive);
+    }
+
+    catalog = buildCatalog(volume_fd, volume, path, recursive);
+    if(catalog == NULL){
+        printf("No such directory: '%s'\n", path);
+        return -1;
+    }
+    if(catalog->truncated){
+        printf("Sorting more than %u entries needs more memory than --max-memory allows, list without --sort\n",
+               catalog->count);
+        destroyCatalog(catalog);
+        return -1;
+    }
+
+    keys = malloc(((uint64_t) catalog->count + 1) * sizeof (uint64_t));
+    rows = malloc(((uint64_t) catalog->count + 1) * sizeof (uint32_t));
+    full_path = malloc(PATH_BUFFER_SIZE);
+    assert(keys != NULL && rows != NULL && full_path != NULL);
+
+    for(uint32_t i = 0; i < catalog->count; i++){
+        rows[i] = i;
+        if(sort == SORT_MTIME){
+            keys[i] = (uint64_t) catalog->entries[i].modify_ticks;
+        }
+        else if(sort == SORT_SIZE){
+            keys[i] = catalog->entries[i].data_length;
+        }
+    }
+
+    if(sort == SORT_NAME){
+        sortByName(catalog, keys, rows, catalog->count, 0);
+    }
+    else if(sort != SORT_NONE){
+        radixSort(keys, rows, catalog->count);
+    }
+    descending = sort == SORT_MTIME || sort == SORT_SIZE;
+
+    printf("%-5s %15s  %-22s  %-22s  %-22s  %s\n", "Attr", "Size", "Created", "Modified", "Accessed", "Path");
+    for(uint32_t i = 0; i < catalog->count; i++){
+        index = rows[descending ? catalog->count - 1 - i : i];
+        row = &catalog->entries[index];
+        printLongLine(row->file_attributes, row->data_length, row->create_ticks, row->modify_ticks,
+                      row->access_ticks, catalogPath(catalog, index, full_path, PATH_BUFFER_SIZE));
+    }
+
+    free(full_path);
+    free(keys);
+    free(rows);
+    destroyCatalog(catalog);
+    return 0;
+}
+
+/*------------------------------------------------------
+// commandTimeline
+//
+// PURPOSE: Runs "timeline [path]", merging the modified,
+// accessed and created times of every entry below path
+// (the whole volume by default) into one list in time
+// order.  Times an entry shares are printed on one line
+// with flags "m", "a" and "c" for modified, accessed and
+// created.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct and the arguments
+// that follow the command.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 for a bad path.
+//------------------------------------------------------*/
+int commandTimeline(int volume_fd, exfat *volume, int argc, char *argv[]){
+
+    Catalog *catalog;
+    CatalogEntry *row;
+    uint64_t *keys;
+    uint32_t *events;
+    uint64_t event_count;
+    uint64_t next;
+    uint32_t index;
+    const char *path = argc > 0 ? argv[0] : "/";
+    char flags[4];
+    char time[TIME_BUFFER_SIZE];
+    char *full_path;
+
+    catalog = buildCatalog(volume_fd, volume, path, 1);
+    if(catalog == NULL){
+        printf("No such directory: '%s'\n", path);
+        return -1;
+    }
+    if(catalog->truncated){
+        printf("A timeline of more than %u entries needs more memory than --max-memory allows\n", catalog->count);
+        destroyCatalog(catalog);
+        return -1;
+    }
+    assert(catalog->count < (UINT32_MAX >> EVENT_BITS));
+
+    event_count = (uint64_t) catalog->count * 3;
+    keys = malloc((event_count + 1) * sizeof (uint64_t));
+    events = malloc((event_count + 1) * sizeof (uint32_t));
+    full_path = malloc(PATH_BUFFER_SIZE);
+    assert(keys != NULL && events != NULL && full_path != NULL);
+
+    /* Added row by row, the stable sort keeps the events of one row with the same time together */
+    for(uint32_t i = 0; i < catalog->count; i++){
+        keys[3 * i] = (uint64_t) catalog->entries[i].modify_ticks;
+        events[3 * i] = (i << EVENT_BITS) | EVENT_MODIFIED;
+        keys[3 * i + 1] = (uint64_t) catalog->entries[i].access_ticks;
+        events[3 * i + 1] = (i << EVENT_BITS) | EVENT_ACCESSED;
+        keys[3 * i + 2] = (uint64_t) catalog->entries[i].create_ticks;
+        events[3 * i + 2] = (i << EVENT_BITS) | EVENT_CREATED;
+    }
+    radixSort(keys, events, event_count);
+
+    printf("%-22s  %-3s  %15s  %s\n", "Time (UTC)", "MAC", "Size", "Path");
+    for(uint64_t i = 0; i < event_count; i = next){
+        index = events[i] >> EVENT_BITS;
+        row = &catalog->entries[index];
+        strcpy(flags, "...");
+
+        for(next = i; next < event_count && keys[next] == keys[i] && (events[next] >> EVENT_BITS) == index; next++){
+            switch(events[next] & ((1 << EVENT_BITS) - 1)){
+                case EVENT_MODIFIED:
+                    flags[0] = 'm';
+                    break;
+                case EVENT_ACCESSED:
+                    flags[1] = 'a';
+                    break;
+                case EVENT_CREATED:
+                    flags[2] = 'c';
+                    break;
+            }
+        }
+
+        formatTicks((int64_t) keys[i], time, TIME_BUFFER_SIZE);
+        printf("%-22s  %-3s  %15llu  %s\n", time, flags, (unsigned long long) row->data_length,
+               catalogPath(catalog, index, full_path, PATH_BUFFER_SIZE));
+    }
+
+    free(full_path);
+    free(keys);
+    free(events);
+    destroyCatalog(catalog);
+    return 0;
+}
+
+/*------------------------------------------------------
+// commandStat
+//
+// PURPOSE: Runs "stat <path>...", printing the attributes,
+// size, valid data length, first cluster and times of
+// each path.  The paths are resolved one after another,
+// so with the dentry cache open siblings share a single
+// scan of their directory.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct and the arguments
+// that follow the command.
+// OUTPUT PARAMETERS:
+//     Returns 0 if every path was found, -1 otherwise.
+//------------------------------------------------------*/
+int commandStat(int volume_fd, exfat *volume, int argc, char *argv[]){
+
+    DirectoryEntry entry;
+    char attributes[6];
+    char created[TIME_BUFFER_SIZE];
+    char modified[TIME_BUFFER_SIZE];
+    char accessed[TIME_BUFFER_SIZE];
+    int status = 0;
+
+    if(argc == 0){
+        printf("Usage: stat <path>...\n");
+        return -1;
+    }
+
+    printf("%-5s %15s %15s %10s  %-22s  %-22s  %-22s  %s\n", "Attr", "Size", "Valid", "Cluster",
+           "Created", "Modified", "Accessed", "Path");
+    for(int i = 0; i < argc; i++){
+        if(resolvePath(volume_fd, volume, NULL, argv[i], &entry) != 0){
+            printf("No such file or directory: '%s'\n", argv[i]);
+            status = -1;
+            continue;
+        }
+
+        formatAttributes(entry.file_attributes, attributes);
+        formatTicks(entryTicks(entry.create_timestamp, entry.create_10ms, entry.create_utc_offset),
+                    created, TIME_BUFFER_SIZE);
+        formatTicks(entryTicks(entry.modify_timestamp, entry.modify_10ms, entry.modify_utc_offset),
+                    modified, TIME_BUFFER_SIZE);
+        formatTicks(entryTicks(entry.access_timestamp, 0, entry.access_utc_offset), accessed, TIME_BUFFER_SIZE);
+        printf("%-5s %15llu %15llu %10u  %-22s  %-22s  %-22s  %s\n", attributes,
+               (unsigned long long) entry.data_length, (unsigned long long) entry.valid_data_length,
+               entry.first_cluster, created, modified, accessed, argv[i]);
+    }
+    return status;
+}
+
+static void listTreeLevel(TreeListing *listing, int depth, const DirectoryEntry *directory);
+
+/*------------------------------------------------------
+// printTreeEntry
+//
+// PURPOSE: Prints one line of a tree, the connectors of
+// the levels above, the entry's own connector, its size
+// and name, then the directory's contents below it.
+// INPUT PARAMETERS:
+//     Takes in the listing, the depth of the entry, the
+// entry and whether it is the last in its directory.
+//------------------------------------------------------*/
+static void printTreeEntry(TreeListing *listing, int depth, DirectoryEntry *entry, int last){
+
+    char *name = entryName(entry);
+
+    assert(name != NULL);
+    listing->prefix[depth * TREE_INDENT] = '\0';
+    printf("%s%s[%12llu]  %s\n", listing->prefix, last ? TREE_LAST : TREE_BRANCH,
+           (unsigned long long) entry->data_length, name);
+    free(name);
+
+    if(!isDirectory(entry)){
+        listing->files++;
+        return;
+    }
+    listing->directories++;
+    if(depth + 1 < listing->max_depth){
+        memcpy(listing->prefix + depth * TREE_INDENT, last ? TREE_SPACE : TREE_PIPE, TREE_INDENT);
+        listTreeLevel(listing, depth + 1, entry);
+    }
+}
+
+static int treeEntry(DirectoryEntry *entry, void *context){
+
+    TreeLevel *level = context;
+
+    if(level->has_pending){
+        printTreeEntry(level->listing, level->depth, &level->pending, 0);
+    }
+    level->pending = *entry;
+    level->has_pending = 1;
+    return WALK_CONTINUE;
+}
+
+/* Prints the contents of a directory, each entry once the next one shows it was not the last */
+static void listTreeLevel(TreeListing *listing, int depth, const DirectoryEntry *directory){
+
+    TreeLevel level;
+
+    level.listing = listing;
+    level.depth = depth;
+    level.has_pending = 0;
+
+    walkDirectory(listing->volume_fd, listing->volume, NULL, directory->first_cluster, directory->data_length,
+                  directory->general_flags, 0, treeEntry, &level);
+    if(level.has_pending){
+        printTreeEntry(listing, depth, &level.pending, 1);
+    }
+    fflush(stdout);
+}
+
+/*------------------------------------------------------
+// commandTree
+//
+// PURPOSE: Runs "tree [path] [--depth N]", drawing the
+// directories below path (the root by default) with
+// their sizes, N levels deep at most, followed by the
+// number of directories and files.  Each directory is
+// read a cluster at a time and printed as it is read, so
+// memory grows only with the depth of the tree and the
+// output of a huge volume starts at once.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct and the arguments
+// that follow the command.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 for a bad path or option.
+//------------------------------------------------------*/
+int commandTree(int volume_fd, exfat *volume, int argc, char *argv[]){
+
+    TreeListing listing;
+    DirectoryEntry root;
+    const char *path = "/";
+    char *end;
+
+    listing.max_depth = MAX_TREE_DEPTH;
+    for(int i = 0; i < argc; i++){
+        if(strcmp(argv[i], "--depth") == 0 && i + 1 < argc){
+            listing.max_depth = (int) strtol(argv[++i], &end, 10);
+            if(*end != '\0' || listing.max_depth < 1){
+                printf("Invalid depth: '%s'\n", argv[i]);
+                return -1;
+            }
+            if(listing.max_depth > MAX_TREE_DEPTH){
+                listing.max_depth = MAX_TREE_DEPTH;
+            }
+        }
+        else if(argv[i][0] != '-'){
+            path = argv[i];
+        }
+        else {
+            printf("Invalid tree option: '%s'\n", argv[i]);
+            return -1;
+        }
+    }
+
+    if(resolvePath(volume_fd, volume, NULL, path, &root) != 0 || !isDirectory(&root)){
+        printf("No such directory: '%s'\n", path);
+        return -1;
+    }
+
+    listing.volume_fd = volume_fd;
+    listing.volume = volume;
+    listing.directories = 0;
+    listing.files = 0;
+
+    printf("%s\n", path);
+    listTreeLevel(&listing, 0, &root);
+    printf("\n%llu directories, %llu files\n", (unsigned long long) listing.directories,
+           (unsigned long long) listing.files);
+    return 0;
+}
@@ -0,0 +1,20 @@
+//
+// Long, sorted directory listings, trees and the MAC time timeline.
+//
+
+#ifndef FSREADER_LISTING_H
+#define FSREADER_LISTING_H
+
+#include "exfat.h"
+
+
+int commandListLong(int volume_fd, exfat *volume, int argc, char *argv[]);
+
+int commandTimeline(int volume_fd, exfat *volume, int argc, char *argv[]);
+
+int commandStat(int volume_fd, exfat *volume, int argc, char *argv[]);
+
+int commandTree(int volume_fd, exfat *volume, int argc, char *argv[]);
+
+
+#endif //FSREADER_LISTING_H
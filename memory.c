@@ -0,0 +1,76 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: The memory ceiling of a run.  By default
+// there is none and every command keeps what it likes in
+// memory.  With --max-memory the caches are sized to a
+// share of the ceiling, and code whose memory grows with
+// the volume (a whole FAT, an extent index, a sort over
+// every entry) asks fitsMemory first and streams, windows
+// or refuses instead.
+//-----------------------------------------*/
+#include <stdio.h>
+#include <sys/resource.h>
+
+#include "memory.h"
+#include "exfat.h"
+
+static uint64_t ceiling = 0;
+
+void setMemoryCeiling(uint64_t bytes){
+
+    ceiling = bytes;
+}
+
+/* Returns the ceiling in bytes, 0 when there is none */
+uint64_t memoryCeiling(){
+
+    return ceiling;
+}
+
+/*------------------------------------------------------
+// fitsMemory
+//
+// PURPOSE: Tells whether one table of a given size may be
+// held in memory under the ceiling.
+// INPUT PARAMETERS:
+//     Takes in the size of the table in bytes.
+// OUTPUT PARAMETERS:
+//     Returns 1 if there is no ceiling or the table fits
+// in its share of it, 0 otherwise.
+//------------------------------------------------------*/
+int fitsMemory(uint64_t bytes){
+
+    return ceiling == 0 || bytes <= ceiling / MEMORY_SHARE_DIVISOR;
+}
+
+/* Returns wanted, cut down to one table's share of the ceiling */
+uint64_t memoryShare(uint64_t wanted){
+
+    if(ceiling != 0 && wanted > ceiling / MEMORY_SHARE_DIVISOR){
+        return ceiling / MEMORY_SHARE_DIVISOR;
+    }
+    return wanted;
+}
+
+/* Returns the peak resident set size of the process in bytes */
+uint64_t peakMemory(){
+
+    struct rusage usage;
+
+    if(getrusage(RUSAGE_SELF, &usage) != 0){
+        return 0;
+    }
+    return (uint64_t) usage.ru_maxrss * KILOBYTE_SIZE;
+}
+
+void printMemoryStats(FILE *output){
+
+    if(ceiling != 0){
+        fprintf(output, "memory peak RSS %llu KB, ceiling %llu KB\n",
+                (unsigned long long) peakMemory() / KILOBYTE_SIZE, (unsigned long long) ceiling / KILOBYTE_SIZE);
+    }
+    else {
+        fprintf(output, "memory peak RSS %llu KB, no ceiling\n", (unsigned long long) peakMemory() / KILOBYTE_SIZE);
+    }
+}
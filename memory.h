@@ -0,0 +1,28 @@
+//
+// Optional ceiling on the memory a run may use, set with --max-memory.
+//
+
+#ifndef FSREADER_MEMORY_H
+#define FSREADER_MEMORY_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* The largest share of the ceiling any one table (a FAT, a cache, a sort) may take */
+#define MEMORY_SHARE_DIVISOR 4
+
+
+void setMemoryCeiling(uint64_t bytes);
+
+uint64_t memoryCeiling();
+
+int fitsMemory(uint64_t bytes);
+
+uint64_t memoryShare(uint64_t wanted);
+
+uint64_t peakMemory();
+
+void printMemoryStats(FILE *output);
+
+
+#endif //FSREADER_MEMORY_H
@@ -0,0 +1,121 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Run a range worker across all cores.
+// The range is cut into one contiguous slice per
+// thread so each thread touches its own memory.
+//-----------------------------------------*/
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "parallel.h"
+#include "trace.h"
+
+#define MAX_THREADS 64
+
+typedef struct RangeTask {
+
+    RangeWorker worker;
+    void *context;
+    uint64_t start;
+    uint64_t end;
+
+} RangeTask ;
+
+/*------------------------------------------------------
+// threadCount
+//
+// PURPOSE: Returns how many threads parallel work should
+// use.  This is the number of online cores unless the
+// EXFAT_THREADS environment variable overrides it.
+// OUTPUT PARAMETERS:
+//     Returns a thread count between 1 and MAX_THREADS.
+//------------------------------------------------------*/
+unsigned int threadCount(){
+
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    char *override = getenv("EXFAT_THREADS");
+
+    if(override != NULL){
+        count = atol(override);
+    }
+    if(count < 1){
+        count = 1;
+    }
+    if(count > MAX_THREADS){
+        count = MAX_THREADS;
+    }
+    return (unsigned int) count;
+}
+
+static void *runRangeTask(void *argument){
+
+    RangeTask *task = argument;
+
+    traceBegin("range slice");
+    task->worker(task->start, task->end, task->context);
+    traceEnd();
+    return NULL;
+}
+
+static void *startRangeTask(void *argument){
+
+    traceThreadName("range worker");
+    return runRangeTask(argument);
+}
+
+/*------------------------------------------------------
+// parallelRanges
+//
+// PURPOSE: Splits [0, count) into one slice per thread
+// and runs the worker on every slice, the calling thread
+// takes the last slice.  Returns once all slices finish.
+// INPUT PARAMETERS:
+//    Takes in the number of items, the worker to run and
+// a context pointer handed to every worker.
+//------------------------------------------------------*/
+void parallelRanges(uint64_t count, RangeWorker worker, void *context){
+
+    RangeTask tasks[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    int started[MAX_THREADS];
+    unsigned int threads_used = threadCount();
+    uint64_t slice;
+
+    assert(worker != NULL);
+
+    if((uint64_t) threads_used > count){
+        threads_used = count > 0 ? (unsigned int) count : 1;
+    }
+    slice = (count + threads_used - 1) / threads_used;
+
+    for(unsigned int i = 0; i < threads_used; i++){
+        tasks[i].worker = worker;
+        tasks[i].context = context;
+        tasks[i].start = i * slice;
+        tasks[i].end = (i + 1) * slice;
+        if(tasks[i].start > count){
+            tasks[i].start = count;
+        }
+        if(tasks[i].end > count){
+            tasks[i].end = count;
+        }
+    }
+
+    for(unsigned int i = 0; i + 1 < threads_used; i++){
+        /* Fall back to running the slice inline if the thread cannot start */
+        started[i] = pthread_create(&threads[i], NULL, startRangeTask, &tasks[i]) == 0;
+        if(!started[i]){
+            runRangeTask(&tasks[i]);
+        }
+    }
+    runRangeTask(&tasks[threads_used - 1]);
+
+    for(unsigned int i = 0; i + 1 < threads_used; i++){
+        if(started[i]){
+            pthread_join(threads[i], NULL);
+        }
+    }
+}
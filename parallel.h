@@ -0,0 +1,19 @@
+//
+// Helpers to split work across the available cores.
+//
+
+#ifndef FSREADER_PARALLEL_H
+#define FSREADER_PARALLEL_H
+
+#include <stdint.h>
+
+/* Called once per thread with the half open range [start, end) it owns */
+typedef void (*RangeWorker)(uint64_t start, uint64_t end, void *context);
+
+
+unsigned int threadCount();
+
+void parallelRanges(uint64_t count, RangeWorker worker, void *context);
+
+
+#endif //FSREADER_PARALLEL_H
@@ -0,0 +1,147 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Search a buffer for several byte patterns
+// in one pass.  With AVX2, 32 candidate positions are
+// filtered at once by comparing the first and the last
+// byte of every pattern, only the positions that pass
+// the filter are compared in full.
+//-----------------------------------------*/
+#include <string.h>
+#include <assert.h>
+
+#include "pattern.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_PATTERN_SIMD 1
+#endif
+
+#define BLOCK_SIZE 32
+
+void initPatternSet(PatternSet *set){
+
+    memset(set, 0, sizeof (PatternSet));
+}
+
+/*------------------------------------------------------
+// addPattern
+//
+// PURPOSE: Adds a pattern to a PatternSet.  The pattern
+// bytes are not copied and must outlive the set.
+// INPUT PARAMETERS:
+//     Takes in the set, the pattern and its length.
+// OUTPUT PARAMETERS:
+//     Returns the index of the pattern, reported to match
+// callbacks, or -1 if the set is full or the pattern is
+// empty or too long.
+//------------------------------------------------------*/
+int addPattern(PatternSet *set, const uint8_t *pattern, size_t length){
+
+    if(set->count == MAX_PATTERNS || length == 0 || length > MAX_PATTERN_LENGTH){
+        return -1;
+    }
+    set->patterns[set->count] = pattern;
+    set->lengths[set->count] = length;
+    if(length > set->max_length){
+        set->max_length = length;
+    }
+    return set->count++;
+}
+
+/* Reports every pattern that matches at one position */
+static int matchAt(const PatternSet *set, const uint8_t *buffer, size_t length, size_t position,
+                   MatchCallback callback, void *context){
+
+    for(int p = 0; p < set->count; p++){
+        if(position + set->lengths[p] <= length &&
+           buffer[position] == set->patterns[p][0] &&
+           memcmp(buffer + position, set->patterns[p], set->lengths[p]) == 0){
+            if(callback(position, p, context)){
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+#ifdef HAVE_PATTERN_SIMD
+__attribute__((target("avx2")))
+static int searchBlocks(const PatternSet *set, const uint8_t *buffer, size_t length, size_t *position,
+                        MatchCallback callback, void *context){
+
+    __m256i first[MAX_PATTERNS];
+    __m256i last[MAX_PATTERNS];
+    __m256i candidates;
+    uint32_t mask;
+    size_t i = 0;
+
+    for(int p = 0; p < set->count; p++){
+        first[p] = _mm256_set1_epi8((char) set->patterns[p][0]);
+        last[p] = _mm256_set1_epi8((char) set->patterns[p][set->lengths[p] - 1]);
+    }
+
+    /* Every block reads up to max_length - 1 bytes past its start */
+    for(; i + BLOCK_SIZE + set->max_length - 1 <= length; i += BLOCK_SIZE){
+        candidates = _mm256_setzero_si256();
+
+        for(int p = 0; p < set->count; p++){
+            __m256i head = _mm256_loadu_si256((const __m256i *) (buffer + i));
+            __m256i tail = _mm256_loadu_si256((const __m256i *) (buffer + i + set->lengths[p] - 1));
+            candidates = _mm256_or_si256(candidates,
+                                         _mm256_and_si256(_mm256_cmpeq_epi8(head, first[p]),
+                                                          _mm256_cmpeq_epi8(tail, last[p])));
+        }
+
+        mask = (uint32_t) _mm256_movemask_epi8(candidates);
+        while(mask != 0){
+            if(matchAt(set, buffer, length, i + __builtin_ctz(mask), callback, context)){
+                return 1;
+            }
+            mask &= mask - 1;
+        }
+    }
+    *position = i;
+    return 0;
+}
+#endif
+
+/*------------------------------------------------------
+// searchPatterns
+//
+// PURPOSE: Calls the callback, in order of position, for
+// every occurrence of every pattern that lies entirely
+// inside the buffer.  A caller streaming data should carry
+// the last max_length - 1 bytes over to the next buffer.
+// INPUT PARAMETERS:
+//     Takes in the set, the buffer and its length, and the
+// callback with its context.
+// OUTPUT PARAMETERS:
+//     Returns 1 if the callback stopped the search, else 0.
+//------------------------------------------------------*/
+int searchPatterns(const PatternSet *set, const uint8_t *buffer, size_t length,
+                   MatchCallback callback, void *context){
+
+    size_t position = 0;
+
+    assert(set != NULL && callback != NULL);
+
+    if(set->count == 0){
+        return 0;
+    }
+
+#ifdef HAVE_PATTERN_SIMD
+    if(__builtin_cpu_supports("avx2")){
+        if(searchBlocks(set, buffer, length, &position, callback, context)){
+            return 1;
+        }
+    }
+#endif
+
+    for(; position < length; position++){
+        if(matchAt(set, buffer, length, position, callback, context)){
+            return 1;
+        }
+    }
+    return 0;
+}
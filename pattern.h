@@ -0,0 +1,35 @@
+//
+// Vectorized search for several byte patterns at once.
+//
+
+#ifndef FSREADER_PATTERN_H
+#define FSREADER_PATTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_PATTERNS 32
+#define MAX_PATTERN_LENGTH 256
+
+typedef struct PatternSet {
+
+    int count;
+    const uint8_t *patterns[MAX_PATTERNS];
+    size_t lengths[MAX_PATTERNS];
+    size_t max_length;
+
+} PatternSet ;
+
+/* Return nonzero from the callback to stop the search */
+typedef int (*MatchCallback)(size_t offset, int pattern, void *context);
+
+
+void initPatternSet(PatternSet *set);
+
+int addPattern(PatternSet *set, const uint8_t *pattern, size_t length);
+
+int searchPatterns(const PatternSet *set, const uint8_t *buffer, size_t length,
+                   MatchCallback callback, void *context);
+
+
+#endif //FSREADER_PATTERN_H
@@ -0,0 +1,111 @@
+//
+// Binary protocol between exfatd and its clients over a Unix domain socket.
+//
+// A client sends a RequestHeader followed by the image name and the path, and
+// gets back a ResponseHeader followed by length bytes of payload.  Every field
+// is in the host's byte order, as both ends run on the same machine.
+//
+
+#ifndef FSREADER_PROTOCOL_H
+#define FSREADER_PROTOCOL_H
+
+#include <stdint.h>
+
+#define PROTOCOL_VERSION 1
+#define DEFAULT_SOCKET_PATH "/tmp/exfatd.sock"
+#define MAX_IMAGE_NAME 255
+#define MAX_REQUEST_PATH 4096
+
+/* Requests */
+#define REQUEST_INFO 1      /* payload: one WireInfo and the volume label */
+#define REQUEST_STAT 2      /* payload: one WireEntry and its name */
+#define REQUEST_LIST 3      /* payload: count WireEntry records, each followed by its name */
+#define REQUEST_GET 4       /* payload: the bytes of the range, or a WireRange and count WireExtents */
+
+#define GET_PASS_FD 0x01    /* send the image's descriptor and the range's extents instead of its bytes */
+
+/* Response status */
+#define STATUS_OK 0
+#define STATUS_BAD_REQUEST 1
+#define STATUS_NO_IMAGE 2
+#define STATUS_NOT_FOUND 3
+#define STATUS_NOT_DIRECTORY 4
+#define STATUS_IS_DIRECTORY 5
+#define STATUS_IO_ERROR 6
+
+#pragma pack(push)
+#pragma pack(1)
+typedef struct RequestHeader {
+
+    uint8_t  version;
+    uint8_t  type;
+    uint16_t flags;
+    uint16_t image_length;      /* bytes of the image name that follow */
+    uint16_t path_length;       /* bytes of the path after the name */
+    uint64_t offset;            /* get: the range of the file, length UINT64_MAX for all of it */
+    uint64_t length;
+
+} RequestHeader ;
+
+typedef struct ResponseHeader {
+
+    uint8_t  version;
+    uint8_t  status;
+    uint16_t reserved;
+    uint32_t count;             /* records in the payload */
+    uint64_t length;            /* bytes of payload that follow */
+
+} ResponseHeader ;
+
+typedef struct WireInfo {
+
+    uint64_t fingerprint;       /* of the image file the answers come from */
+    uint64_t generation;        /* times the image was loaded, 1 for the first */
+    uint64_t fat_offset;        /* in bytes */
+    uint64_t cluster_heap_offset;
+    uint32_t cluster_count;
+    uint32_t free_clusters;
+    uint32_t cluster_bytes;
+    uint32_t sector_bytes;
+    uint32_t root_cluster;
+    uint32_t serial_number;
+    uint8_t  number_of_fats;
+    uint8_t  fat_loaded;        /* the FAT is held in memory */
+    uint16_t label_length;
+
+} WireInfo ;
+
+typedef struct WireEntry {
+
+    uint64_t data_length;
+    uint64_t valid_data_length;
+    int64_t  created;           /* seconds since the epoch, UTC */
+    int64_t  modified;
+    int64_t  accessed;
+    uint32_t first_cluster;
+    uint16_t attributes;
+    uint8_t  general_flags;
+    uint8_t  reserved;
+    uint16_t name_length;
+
+} WireEntry ;
+
+/* The part of the file a passed descriptor answers; bytes no extent covers are zeros */
+typedef struct WireRange {
+
+    uint64_t offset;
+    uint64_t length;
+
+} WireRange ;
+
+typedef struct WireExtent {
+
+    uint64_t logical;           /* offset in the file */
+    uint64_t physical;          /* offset in the image */
+    uint64_t length;
+
+} WireExtent ;
+#pragma pack(pop)
+
+
+#endif //FSREADER_PROTOCOL_H
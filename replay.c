@@ -0,0 +1,569 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Implement the "replay" command, which issues
+// the reads recorded by --trace again against a volume
+// so I/O backends can be compared on exactly the same
+// access pattern.  Every recorded thread gets a replay
+// thread that issues its reads in order.  By default a
+// read waits until as many reads have completed as had
+// completed when it started in the recording, which
+// keeps the recorded overlap between threads without
+// keeping its timing; --paced issues every read at its
+// recorded time instead.  Reads go through pread, an
+// mmap of the volume, or pread with O_DIRECT.
+//-----------------------------------------*/
+#define _GNU_SOURCE     /* O_DIRECT */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <assert.h>
+
+#include "replay.h"
+#include "trace.h"
+
+#define DIRECT_ALIGNMENT 4096
+#define MAX_LINE_LENGTH 512
+
+#define BACKEND_PREAD 0
+#define BACKEND_MMAP 1
+#define BACKEND_DIRECT 2
+
+typedef struct ReplayRead {
+
+    uint64_t offset;
+    uint64_t length;
+    uint64_t start;             /* recorded start, ns since the trace opened */
+    uint64_t duration;          /* recorded latency in ns */
+    uint64_t wait_for;          /* reads completed in the recording when this one started */
+    uint64_t replayed;          /* replayed latency in ns */
+    int thread;
+    TraceSource source;
+    int failed;
+
+} ReplayRead ;
+
+typedef struct Replay {
+
+    int volume_fd;
+    int backend;
+    int paced;
+    const uint8_t *mapping;
+    uint64_t volume_size;
+
+    ReplayRead *reads;          /* grouped by thread, in recorded order within a thread */
+    uint64_t count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t progress;
+    uint64_t completed;
+    int waiting;
+    int aborted;                /* a replay thread could not start or get its buffer, the others stop */
+
+    uint64_t begin;             /* traceClock when the replay started */
+    atomic_uint_fast64_t checksum;
+
+} Replay ;
+
+typedef struct ReplayThread {
+
+    Replay *replay;
+    uint64_t first;
+    uint64_t count;
+
+} ReplayThread ;
+
+static uint64_t parseMicroseconds(const char *text){
+
+    char *end;
+    uint64_t whole = strtoull(text, &end, 10);
+    uint64_t nanoseconds = 0;
+    int digits = 0;
+
+    if(*end == '.'){
+        for(end++; *end >= '0' && *end <= '9' && digits < 3; end++, digits++){
+            nanoseconds = nanoseconds * 10 + (uint64_t) (*end - '0');
+        }
+        for(; digits < 3; digits++){
+            nanoseconds *= 10;
+        }
+    }
+    return whole * 1000 + nanoseconds;
+}
+
+/* Finds "key": on a trace line and returns the text after it, or NULL */
+static const char *fieldValue(const char *line, const char *key){
+
+    char pattern[32];
+    const char *found;
+
+    snprintf(pattern, sizeof (pattern), "\"%s\":", key);
+    found = strstr(line, pattern);
+    return found == NULL ? NULL : found + strlen(pattern);
+}
+
+/*------------------------------------------------------
+// parseRead
+//
+// PURPOSE: Parses one line of a trace written by --trace
+// into a ReplayRead.
+// INPUT PARAMETERS:
+//     Takes in the line and the ReplayRead to fill.
+// OUTPUT PARAMETERS:
+//     Returns 1 if the line is a read event, 0 otherwise.
+//------------------------------------------------------*/
+static int parseRead(const char *line, ReplayRead *read){
+
+    const char *category = fieldValue(line, "cat");
+    const char *thread = fieldValue(line, "tid");
+    const char *start = fieldValue(line, "ts");
+    const char *duration = fieldValue(line, "dur");
+    const char *offset = fieldValue(line, "offset");
+    const char *length = fieldValue(line, "length");
+
+    if(strncmp(line, "{\"name\":\"read\"", 14) != 0 || category == NULL || thread == NULL ||
+       start == NULL || duration == NULL || offset == NULL || length == NULL){
+        return 0;
+    }
+
+    memset(read, 0, sizeof (ReplayRead));
+    read->source = TRACE_DATA;
+    for(int source = 0; source < TRACE_SOURCES; source++){
+        if(strncmp(category + 1, traceSourceName(source), strlen(traceSourceName(source))) == 0 &&
+           category[1 + strlen(traceSourceName(source))] == '"'){
+            read->source = source;
+        }
+    }
+    read->thread = atoi(thread);
+    read->start = parseMicroseconds(start);
+    read->duration = parseMicroseconds(duration);
+    read->offset = strtoull(offset, NULL, 10);
+    read->length = strtoull(length, NULL, 10);
+    return 1;
+}
+
+static int compareThreadOrder(const void *a, const void *b){
+
+    const ReplayRead *x = a;
+    const ReplayRead *y = b;
+
+    if(x->thread != y->thread){
+        return x->thread < y->thread ? -1 : 1;
+    }
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+static int compareUint64(const void *a, const void *b){
+
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+/*------------------------------------------------------
+// loadTrace
+//
+// PURPOSE: Reads every read event of a trace, works out
+// how many reads each one waited for, and groups them by
+// thread.
+// INPUT PARAMETERS:
+//     Takes in the trace path and the Replay to fill.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 if the trace could not be
+// read or holds no reads.
+//------------------------------------------------------*/
+static int loadTrace(const char *path, Replay *replay){
+
+    FILE *trace = fopen(path, "r");
+    char line[MAX_LINE_LENGTH];
+    uint64_t capacity = 1024;
+    uint64_t *ends;
+    uint64_t low;
+    uint64_t high;
+    uint64_t middle;
+
+    if(trace == NULL){
+        return -1;
+    }
+
+    replay->reads = malloc(capacity * sizeof (ReplayRead));
+    assert(replay->reads != NULL);
+    replay->count = 0;
+    while(fgets(line, sizeof (line), trace) != NULL){
+        if(replay->count == capacity){
+            capacity *= 2;
+            replay->reads = realloc(replay->reads, capacity * sizeof (ReplayRead));
+            assert(replay->reads != NULL);
+        }
+        replay->count += (uint64_t) parseRead(line, &replay->reads[replay->count]);
+    }
+    fclose(trace);
+
+    if(replay->count == 0){
+        free(replay->reads);
+        replay->reads = NULL;
+        return -1;
+    }
+
+    /* wait_for counts the recorded reads that ended before this one started */
+    ends = malloc(replay->count * sizeof (uint64_t));
+    assert(ends != NULL);
+    for(uint64_t i = 0; i < replay->count; i++){
+        ends[i] = replay->reads[i].start + replay->reads[i].duration;
+    }
+    qsort(ends, replay->count, sizeof (uint64_t), compareUint64);
+    for(uint64_t i = 0; i < replay->count; i++){
+        low = 0;
+        high = replay->count;
+        while(low < high){
+            middle = low + (high - low) / 2;
+            if(ends[middle] < replay->reads[i].start){
+                low = middle + 1;
+            }
+            else {
+                high = middle;
+            }
+        }
+        replay->reads[i].wait_for = low;
+    }
+    free(ends);
+
+    qsort(replay->reads, replay->count, sizeof (ReplayRead), compareThreadOrder);
+    return 0;
+}
+
+static void sleepUntil(uint64_t target){
+
+    struct timespec pause;
+    uint64_t now = traceClock();
+
+    if(target > now){
+        pause.tv_sec = (time_t) ((target - now) / 1000000000ULL);
+        pause.tv_nsec = (long) ((target - now) % 1000000000ULL);
+        nanosleep(&pause, NULL);
+    }
+}
+
+/* Issues one read through the chosen backend, returning bytes read or -1 */
+static ssize_t issueRead(Replay *replay, ReplayRead *read, uint8_t *buffer){
+
+    uint64_t aligned;
+    uint64_t end;
+    uint64_t checksum = 0;
+    ssize_t bytes = -1;
+
+    if(replay->backend == BACKEND_MMAP){
+        if(read->offset < replay->volume_size){
+            end = read->offset + read->length;
+            if(end > replay->volume_size){
+                end = replay->volume_size;
+            }
+            memcpy(buffer, replay->mapping + read->offset, end - read->offset);
+            bytes = (ssize_t) (end - read->offset);
+        }
+    }
+    else if(replay->backend == BACKEND_DIRECT){
+        aligned = read->offset & ~(uint64_t) (DIRECT_ALIGNMENT - 1);
+        end = (read->offset + read->length + DIRECT_ALIGNMENT - 1) & ~(uint64_t) (DIRECT_ALIGNMENT - 1);
+        bytes = readBytes(replay->volume_fd, buffer, end - aligned, aligned);
+    }
+    else {
+        bytes = readBytes(replay->volume_fd, buffer, read->length, read->offset);
+    }
+
+    /* Touch what was read so a lazy backend cannot skip the work */
+    for(ssize_t i = 0; i < bytes; i += DIRECT_ALIGNMENT){
+        checksum += buffer[i];
+    }
+    atomic_fetch_add(&replay->checksum, checksum);
+    return bytes;
+}
+
+static void *replayThread(void *argument){
+
+    ReplayThread *thread = argument;
+    Replay *replay = thread->replay;
+    ReplayRead *read;
+    uint64_t largest = 0;
+    uint64_t start;
+    ssize_t bytes;
+    uint8_t *buffer;
+
+    for(uint64_t i = 0; i < thread->count; i++){
+        if(replay->reads[thread->first + i].length > largest){
+            largest = replay->reads[thread->first + i].length;
+        }
+    }
+    largest += 2 * DIRECT_ALIGNMENT;
+    traceThreadName("replay thread");
+    if(posix_memalign((void **) &buffer, DIRECT_ALIGNMENT, largest) != 0){
+        /* Reads of the other threads may wait on this one's, so nobody can go on */
+        pthread_mutex_lock(&replay->lock);
+        replay->aborted = 1;
+        pthread_cond_broadcast(&replay->progress);
+        pthread_mutex_unlock(&replay->lock);
+        return NULL;
+    }
+
+    for(uint64_t i = 0; i < thread->count; i++){
+        read = &replay->reads[thread->first + i];
+
+        if(replay->paced){
+            sleepUntil(replay->begin + read->start);
+        }
+        else {
+            pthread_mutex_lock(&replay->lock);
+            while(replay->completed < read->wait_for && !replay->aborted){
+                replay->waiting++;
+                pthread_cond_wait(&replay->progress, &replay->lock);
+                replay->waiting--;
+            }
+            pthread_mutex_unlock(&replay->lock);
+        }
+        if(replay->aborted){
+            break;
+        }
+
+        traceSource(read->source);
+        start = traceClock();
+        bytes = issueRead(replay, read, buffer);
+        read->replayed = traceClock() - start;
+        read->failed = bytes < 0;
+        if(replay->backend == BACKEND_MMAP){
+            /* No system call, so readBytes did not trace it */
+            traceRead(read->offset, read->length, bytes, start);
+        }
+
+        pthread_mutex_lock(&replay->lock);
+        replay->completed++;
+        if(replay->waiting > 0){
+            pthread_cond_broadcast(&replay->progress);
+        }
+        pthread_mutex_unlock(&replay->lock);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+static uint64_t percentile(uint64_t *values, uint64_t count, int percent){
+
+    return values[(count - 1) * (uint64_t) percent / 100];
+}
+
+/*------------------------------------------------------
+// printReport
+//
+// PURPOSE: Prints, for each source and overall, how many
+// reads were replayed and their recorded and replayed
+// latencies, then the wall time of both runs.
+// INPUT PARAMETERS:
+//     Takes in the finished Replay and its wall time.
+//------------------------------------------------------*/
+static void printReport(Replay *replay, uint64_t wall){
+
+    uint64_t *recorded = malloc(replay->count * sizeof (uint64_t));
+    uint64_t *replayed = malloc(replay->count * sizeof (uint64_t));
+    uint64_t first = UINT64_MAX;
+    uint64_t last = 0;
+    uint64_t total_bytes = 0;
+    uint64_t failed = 0;
+    uint64_t count;
+    uint64_t bytes;
+
+    assert(recorded != NULL && replayed != NULL);
+
+    printf("%-10s %10s %12s %10s %10s %10s %10s\n", "source", "reads", "bytes",
+           "rec p50us", "rec p99us", "new p50us", "new p99us");
+    for(int source = 0; source <= TRACE_SOURCES; source++){
+        count = 0;
+        bytes = 0;
+        for(uint64_t i = 0; i < replay->count; i++){
+            if(source == TRACE_SOURCES || replay->reads[i].source == (TraceSource) source){
+                recorded[count] = replay->reads[i].duration;
+                replayed[count] = replay->reads[i].replayed;
+                bytes += replay->reads[i].length;
+                count++;
+            }
+        }
+        if(count == 0){
+            continue;
+        }
+        qsort(recorded, count, sizeof (uint64_t), compareUint64);
+        qsort(replayed, count, sizeof (uint64_t), compareUint64);
+        printf("%-10s %10llu %12llu %10.1f %10.1f %10.1f %10.1f\n",
+               source == TRACE_SOURCES ? "total" : traceSourceName(source),
+               (unsigned long long) count, (unsigned long long) bytes,
+               percentile(recorded, count, 50) / 1000.0, percentile(recorded, count, 99) / 1000.0,
+               percentile(replayed, count, 50) / 1000.0, percentile(replayed, count, 99) / 1000.0);
+    }
+
+    for(uint64_t i = 0; i < replay->count; i++){
+        if(replay->reads[i].start < first){
+            first = replay->reads[i].start;
+        }
+        if(replay->reads[i].start + replay->reads[i].duration > last){
+            last = replay->reads[i].start + replay->reads[i].duration;
+        }
+        total_bytes += replay->reads[i].length;
+        failed += (uint64_t) replay->reads[i].failed;
+    }
+
+    printf("\nrecorded: %.3f ms of I/O, replayed: %.3f ms (%.1f MB/s)\n",
+           (last - first) / 1e6, wall / 1e6, wall > 0 ? total_bytes * 1e3 / wall : 0.0);
+    if(failed > 0){
+        printf("%llu read(s) failed\n", (unsigned long long) failed);
+    }
+
+    free(recorded);
+    free(replayed);
+}
+
+/*------------------------------------------------------
+// commandReplay
+//
+// PURPOSE: Implements "replay <trace.json> [--backend=
+// pread|mmap|direct] [--paced]".
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct, and the arguments
+// that follow the command name.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 on an error.
+//------------------------------------------------------*/
+int commandReplay(int volume_fd, exfat *volume, int argc, char *argv[]){
+
+    Replay replay;
+    ReplayThread *threads;
+    pthread_t *handles;
+    uint64_t thread_count = 0;
+    uint64_t started;
+    const char *path = NULL;
+    struct stat status;
+    int flags;
+    int result = 0;
+
+    (void) volume;
+    memset(&replay, 0, sizeof (Replay));
+    replay.volume_fd = volume_fd;
+    replay.backend = BACKEND_PREAD;
+
+    for(int i = 0; i < argc; i++){
+        if(strcmp(argv[i], "--backend=pread") == 0){
+            replay.backend = BACKEND_PREAD;
+        }
+        else if(strcmp(argv[i], "--backend=mmap") == 0){
+            replay.backend = BACKEND_MMAP;
+        }
+        else if(strcmp(argv[i], "--backend=direct") == 0){
+            replay.backend = BACKEND_DIRECT;
+        }
+        else if(strcmp(argv[i], "--paced") == 0){
+            replay.paced = 1;
+        }
+        else if(path == NULL && argv[i][0] != '-'){
+            path = argv[i];
+        }
+        else {
+            printf("Unknown replay option '%s'\n", argv[i]);
+            return -1;
+        }
+    }
+    if(path == NULL){
+        printf("Usage: replay <trace.json> [--backend=pread|mmap|direct] [--paced]\n");
+        return -1;
+    }
+    if(loadTrace(path, &replay) != 0){
+        printf("Unable to read any reads from trace '%s'\n", path);
+        return -1;
+    }
+
+    if(fstat(volume_fd, &status) != 0){
+        free(replay.reads);
+        return -1;
+    }
+    replay.volume_size = (uint64_t) status.st_size;
+
+    if(replay.backend == BACKEND_MMAP){
+        replay.mapping = mmap(NULL, replay.volume_size, PROT_READ, MAP_SHARED, volume_fd, 0);
+        if(replay.mapping == MAP_FAILED){
+            printf("Unable to map the volume\n");
+            result = -1;
+        }
+    }
+    else if(replay.backend == BACKEND_DIRECT){
+        flags = fcntl(volume_fd, F_GETFL);
+        if(flags < 0 || fcntl(volume_fd, F_SETFL, flags | O_DIRECT) != 0){
+            printf("The volume does not support O_DIRECT\n");
+            result = -1;
+        }
+    }
+
+    if(result == 0){
+        for(uint64_t i = 0; i < replay.count; i++){
+            thread_count += (uint64_t) (i == 0 || replay.reads[i].thread != replay.reads[i - 1].thread);
+        }
+        threads = calloc(thread_count, sizeof (ReplayThread));
+        handles = calloc(thread_count, sizeof (pthread_t));
+        assert(threads != NULL && handles != NULL);
+
+        thread_count = 0;
+        for(uint64_t i = 0; i < replay.count; i++){
+            if(i == 0 || replay.reads[i].thread != replay.reads[i - 1].thread){
+                threads[thread_count].replay = &replay;
+                threads[thread_count].first = i;
+                thread_count++;
+            }
+            threads[thread_count - 1].count++;
+        }
+
+        pthread_mutex_init(&replay.lock, NULL);
+        pthread_cond_init(&replay.progress, NULL);
+        replay.begin = traceClock();
+        traceBegin("replay");
+
+        for(started = 0; started < thread_count; started++){
+            if(pthread_create(&handles[started], NULL, replayThread, &threads[started]) != 0){
+                /* Reads of the other threads may wait on this one's, so nobody can go on */
+                pthread_mutex_lock(&replay.lock);
+                replay.aborted = 1;
+                pthread_cond_broadcast(&replay.progress);
+                pthread_mutex_unlock(&replay.lock);
+                break;
+            }
+        }
+        for(uint64_t i = 0; i < started; i++){
+            pthread_join(handles[i], NULL);
+        }
+
+        traceEnd();
+        if(replay.aborted){
+            printf("Unable to start %llu replay threads with their buffers\n", (unsigned long long) thread_count);
+            result = -1;
+        }
+        else {
+            printReport(&replay, traceClock() - replay.begin);
+        }
+
+        pthread_mutex_destroy(&replay.lock);
+        pthread_cond_destroy(&replay.progress);
+        free(threads);
+        free(handles);
+    }
+
+    if(replay.backend == BACKEND_MMAP && replay.mapping != MAP_FAILED){
+        munmap((void *) replay.mapping, replay.volume_size);
+    }
+    free(replay.reads);
+    return result;
+}
@@ -0,0 +1,14 @@
+//
+// Re-issuing the reads of a recorded trace against a volume.
+//
+
+#ifndef FSREADER_REPLAY_H
+#define FSREADER_REPLAY_H
+
+#include "exfat.h"
+
+
+int commandReplay(int volume_fd, exfat *volume, int argc, char *argv[]);
+
+
+#endif //FSREADER_REPLAY_H
@@ -0,0 +1,630 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Implement the "rescue" command, copying files
+// off failing media in the manner of ddrescue.  The
+// first pass reads every file in large chunks, and after
+// a read error skips ahead by a distance that doubles
+// with each error in a row, so healthy areas are copied
+// before any time is spent near damage.  Later passes
+// come back for what was left: the skipped areas are read
+// without skipping, the chunks that failed are bisected
+// down to the bad sectors, and the bad sectors are tried
+// again.  Each pass visits its regions in image order.
+// Output files are sized up front, so whatever could not
+// be read stays zeros, and the regions that never read
+// are written to a map.
+//-----------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <assert.h>
+
+#include "rescue.h"
+#include "directory.h"
+#include "file.h"
+#include "trace.h"
+#include "memory.h"
+
+#define RESCUE_CHUNK_SIZE (KILOBYTE_SIZE * KILOBYTE_SIZE)
+#define MAX_SKIP_SHIFT 6            /* skips grow up to 64 chunks */
+#define DEFAULT_RETRIES 1
+
+/* Region status, as in a ddrescue map */
+#define REGION_UNTRIED '?'          /* skipped over after a read error */
+#define REGION_UNTRIMMED '*'        /* a chunk that failed as a whole */
+#define REGION_BAD '-'              /* a sector that failed every read */
+
+typedef struct RescueTarget {
+
+    char *path;
+    char *output_path;
+
+} RescueTarget ;
+
+/* A range of the image not read yet, and where it goes */
+typedef struct BadRegion {
+
+    uint64_t offset;
+    uint64_t length;
+    uint64_t file_offset;
+    uint32_t target;
+    char status;
+
+} BadRegion ;
+
+typedef struct RegionList {
+
+    BadRegion *regions;
+    uint64_t count;
+    uint64_t capacity;
+
+} RegionList ;
+
+typedef struct Rescue {
+
+    int volume_fd;
+    exfat *volume;
+    uint32_t sector_bytes;
+    const char *output_directory;
+
+    RescueTarget *targets;
+    uint32_t target_count;
+    uint32_t target_capacity;
+    RegionList regions;
+    uint8_t *buffer;                /* chunk_size bytes */
+    uint64_t chunk_size;            /* a whole number of sectors */
+
+    /* The output the later passes last wrote to */
+    int output_fd;
+    uint32_t output_target;
+
+    uint64_t total;
+    uint64_t rescued;
+    uint64_t unmapped;              /* past the end of broken cluster chains */
+    uint64_t reads;
+    uint64_t read_errors;
+    int write_failed;
+
+    /* Skipping state of the copy pass, kept across the runs of a file */
+    uint64_t skip;
+    int failures;
+
+} Rescue ;
+
+typedef void (*RegionHandler)(Rescue *rescue, int output_fd, const BadRegion *region, RegionList *remaining);
+
+static void addRegion(RegionList *list, uint64_t offset, uint64_t length, uint64_t file_offset, uint32_t target,
+                      char status){
+
+    BadRegion *region;
+
+    if(list->count == list->capacity){
+        list->capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+        list->regions = realloc(list->regions, list->capacity * sizeof (BadRegion));
+        assert(list->regions != NULL);
+    }
+    region = &list->regions[list->count++];
+    region->offset = offset;
+    region->length = length;
+    region->file_offset = file_offset;
+    region->target = target;
+    region->status = status;
+}
+
+static int compareRegions(const void *first, const void *second){
+
+    const BadRegion *a = first;
+    const BadRegion *b = second;
+
+    return a->offset < b->offset ? -1 : a->offset > b->offset;
+}
+
+/* Sorts a list into image order and joins the regions that continue each other */
+static void mergeRegions(RegionList *list){
+
+    BadRegion *last;
+    const BadRegion *region;
+    uint64_t count = 0;
+
+    if(list->count == 0){
+        return;
+    }
+    qsort(list->regions, list->count, sizeof (BadRegion), compareRegions);
+    for(uint64_t i = 0; i < list->count; i++){
+        region = &list->regions[i];
+        last = count > 0 ? &list->regions[count - 1] : NULL;
+        if(last != NULL && last->target == region->target && last->status == region->status &&
+           last->offset + last->length == region->offset &&
+           last->file_offset + last->length == region->file_offset){
+            last->length += region->length;
+        }
+        else {
+            list->regions[count++] = *region;
+        }
+    }
+    list->count = count;
+}
+
+static int writeAt(int output_fd, const uint8_t *bytes, size_t length, uint64_t offset){
+
+    ssize_t written;
+
+    while(length > 0){
+        written = pwrite(output_fd, bytes, length, (off_t) offset);
+        if(written < 0 && errno == EINTR){
+            continue;
+        }
+        if(written <= 0){
+            return -1;
+        }
+        bytes += written;
+        length -= (size_t) written;
+        offset += (uint64_t) written;
+    }
+    return 0;
+}
+
+/*------------------------------------------------------
+// copyRange
+//
+// PURPOSE: Reads one range of the image, at most a chunk,
+// and writes it to its place in the output file.
+// INPUT PARAMETERS:
+//     Takes in the rescue, the output descriptor, the
+// image offset and length, and the offset in the file.
+// OUTPUT PARAMETERS:
+//     Returns 0 if the range was read, -1 if it was not.
+// A failed write is reported once and not retried.
+//------------------------------------------------------*/
+static int copyRange(Rescue *rescue, int output_fd, uint64_t offset, uint64_t length, uint64_t file_offset){
+
+    assert(length <= rescue->chunk_size);
+
+    rescue->reads++;
+    if(readBytesAs(rescue->volume_fd, rescue->buffer, (size_t) length, offset, TRACE_DATA) != (ssize_t) length){
+        rescue->read_errors++;
+        return -1;
+    }
+    if(writeAt(output_fd, rescue->buffer, (size_t) length, file_offset) != 0 && !rescue->write_failed){
+        printf("Unable to write the rescued data, is the output full?\n");
+        rescue->write_failed = 1;
+    }
+    rescue->rescued += length;
+    return 0;
+}
+
+/*------------------------------------------------------
+// copyRun
+//
+// PURPOSE: Copies a run of the image chunk by chunk.  A
+// chunk that fails is left for trimming.  When skipping,
+// each failure also passes over an untried area that
+// doubles with every failure in a row, up to
+// 2^MAX_SKIP_SHIFT chunks, and a good read resets it.
+// The skip carries on into the file's next run, since a
+// damaged area of the media rarely ends with an extent.
+// INPUT PARAMETERS:
+//     Takes in the rescue, the output descriptor, the
+// target, the run (image offset, length and file
+// offset), whether to skip, and the list that receives
+// what was not read.
+//------------------------------------------------------*/
+static void copyRun(Rescue *rescue, int output_fd, uint32_t target, uint64_t offset, uint64_t length,
+                    uint64_t file_offset, int skipping, RegionList *remaining){
+
+    uint64_t chunk;
+
+    while(length > 0){
+        if(skipping && rescue->skip > 0){
+            chunk = length < rescue->skip ? length : rescue->skip;
+            addRegion(remaining, offset, chunk, file_offset, target, REGION_UNTRIED);
+            rescue->skip -= chunk;
+        }
+        else {
+            chunk = length < rescue->chunk_size ? length : rescue->chunk_size;
+            if(copyRange(rescue, output_fd, offset, chunk, file_offset) == 0){
+                rescue->failures = 0;
+            }
+            else {
+                addRegion(remaining, offset, chunk, file_offset, target, REGION_UNTRIMMED);
+                if(skipping){
+                    rescue->skip = rescue->chunk_size << rescue->failures;
+                    if(rescue->failures < MAX_SKIP_SHIFT){
+                        rescue->failures++;
+                    }
+                }
+            }
+        }
+        offset += chunk;
+        file_offset += chunk;
+        length -= chunk;
+    }
+}
+
+static void fillRegion(Rescue *rescue, int output_fd, const BadRegion *region, RegionList *remaining){
+
+    copyRun(rescue, output_fd, region->target, region->offset, region->length, region->file_offset, 0, remaining);
+}
+
+/*------------------------------------------------------
+// trimRegion
+//
+// PURPOSE: Bisects a range that failed to read as a
+// whole: each half is read, and a half that fails is
+// split again, until only single bad sectors are left.
+// INPUT PARAMETERS:
+//     Takes in the rescue, the output descriptor, the
+// failed range and the list that receives the bad
+// sectors.
+//------------------------------------------------------*/
+static void trimRegion(Rescue *rescue, int output_fd, const BadRegion *region, RegionList *remaining){
+
+    BadRegion half;
+    uint64_t split;
+
+    if(region->length <= rescue->sector_bytes){
+        addRegion(remaining, region->offset, region->length, region->file_offset, region->target, REGION_BAD);
+        return;
+    }
+
+    split = region->length / 2 / rescue->sector_bytes * rescue->sector_bytes;
+    if(split == 0){
+        split = rescue->sector_bytes;
+    }
+    for(int side = 0; side < 2; side++){
+        half = *region;
+        if(side == 0){
+            half.length = split;
+        }
+        else {
+            half.offset += split;
+            half.file_offset += split;
+            half.length -= split;
+        }
+        /* Merged failures can be longer than a chunk, and those halves are split before any read */
+        if(half.length > rescue->chunk_size ||
+           copyRange(rescue, output_fd, half.offset, half.length, half.file_offset) != 0){
+            trimRegion(rescue, output_fd, &half, remaining);
+        }
+    }
+}
+
+static void retryRegion(Rescue *rescue, int output_fd, const BadRegion *region, RegionList *remaining){
+
+    uint64_t sector;
+
+    for(uint64_t done = 0; done < region->length; done += sector){
+        sector = region->length - done < rescue->sector_bytes ? region->length - done : rescue->sector_bytes;
+        if(copyRange(rescue, output_fd, region->offset + done, sector, region->file_offset + done) != 0){
+            addRegion(remaining, region->offset + done, sector, region->file_offset + done, region->target,
+                      REGION_BAD);
+        }
+    }
+}
+
+/* Opens the output of a target for the later passes, keeping the last one open */
+static int openTarget(Rescue *rescue, uint32_t target){
+
+    if(rescue->output_fd >= 0 && rescue->output_target == target){
+        return rescue->output_fd;
+    }
+    if(rescue->output_fd >= 0){
+        close(rescue->output_fd);
+    }
+    rescue->output_fd = open(rescue->targets[target].output_path, O_WRONLY);
+    rescue->output_target = target;
+    return rescue->output_fd;
+}
+
+static uint64_t regionBytes(const RegionList *list){
+
+    uint64_t bytes = 0;
+
+    for(uint64_t i = 0; i < list->count; i++){
+        bytes += list->regions[i].length;
+    }
+    return bytes;
+}
+
+/*------------------------------------------------------
+// runPass
+//
+// PURPOSE: Hands every region of one status to a handler,
+// in image order so the device reads forward, and keeps
+// what the handler could not read for the next pass.
+// INPUT PARAMETERS:
+//     Takes in the rescue, the pass number and name, the
+// status of the regions to work on and the handler.
+//------------------------------------------------------*/
+static void runPass(Rescue *rescue, int pass, const char *name, char status, RegionHandler handler){
+
+    RegionList remaining = {NULL, 0, 0};
+    BadRegion *region;
+    int output_fd;
+
+    for(uint64_t i = 0; i < rescue->regions.count; i++){
+        region = &rescue->regions.regions[i];
+        output_fd = region->status == status ? openTarget(rescue, region->target) : -1;
+        if(output_fd < 0){
+            addRegion(&remaining, region->offset, region->length, region->file_offset, region->target,
+                      region->status);
+            continue;
+        }
+        handler(rescue, output_fd, region, &remaining);
+    }
+
+    free(rescue->regions.regions);
+    rescue->regions = remaining;
+    mergeRegions(&rescue->regions);
+    printf("Pass %d (%s): %llu KB unread in %llu region(s)\n", pass, name,
+           (unsigned long long) regionBytes(&rescue->regions) / KILOBYTE_SIZE,
+           (unsigned long long) rescue->regions.count);
+}
+
+/*------------------------------------------------------
+// rescueFile
+//
+// PURPOSE: Creates the output of one file at its full
+// size and makes the first pass over it, copying every
+// extent up to ValidDataLength with skipping.
+// INPUT PARAMETERS:
+//     Takes in the rescue, the file's path in the volume,
+// the output path and the file's entry.
+//------------------------------------------------------*/
+static void rescueFile(Rescue *rescue, const char *path, const char *output_path, const DirectoryEntry *entry){
+
+    ExfatFile *file;
+    const Extent *extent;
+    RescueTarget *target;
+    uint64_t cluster_bytes = clusterBytes(rescue->volume);
+    uint64_t valid = entry->valid_data_length < entry->data_length ? entry->valid_data_length : entry->data_length;
+    uint64_t position = 0;
+    uint64_t start;
+    uint64_t length;
+    int output_fd;
+
+    output_fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(output_fd < 0 || ftruncate(output_fd, (off_t) entry->data_length) != 0){
+        printf("Unable to create '%s'\n", output_path);
+        if(output_fd >= 0){
+            close(output_fd);
+        }
+        return;
+    }
+
+    if(rescue->target_count == rescue->target_capacity){
+        rescue->target_capacity = rescue->target_capacity == 0 ? 64 : rescue->target_capacity * 2;
+        rescue->targets = realloc(rescue->targets, rescue->target_capacity * sizeof (RescueTarget));
+        assert(rescue->targets != NULL);
+    }
+    target = &rescue->targets[rescue->target_count];
+    target->path = strdup(path);
+    target->output_path = strdup(output_path);
+    assert(target->path != NULL && target->output_path != NULL);
+
+    rescue->skip = 0;
+    rescue->failures = 0;
+    file = openEntry(rescue->volume_fd, rescue->volume, NULL, entry);
+    do {
+        for(uint32_t i = 0; i < file->extent_count && position < valid; i++){
+            extent = &file->extents[i];
+            start = extent->file_cluster * cluster_bytes;
+            length = (uint64_t) extent->length * cluster_bytes;
+            if(length > valid - start){
+                length = valid - start;
+            }
+            copyRun(rescue, output_fd, rescue->target_count, clusterOffset(rescue->volume, extent->first_cluster),
+                    length, start, 1, &rescue->regions);
+            position = start + length;
+        }
+    } while(position < valid && nextExtents(file));
+    closeFile(file);
+
+    if(position < valid){
+        printf("The cluster chain of '%s' ends after %llu of %llu bytes\n", path, (unsigned long long) position,
+               (unsigned long long) valid);
+        rescue->unmapped += valid - position;
+    }
+    rescue->total += valid;
+    rescue->target_count++;
+    close(output_fd);
+}
+
+static int rescueEntry(const char *path, DirectoryEntry *entry, void *context){
+
+    Rescue *rescue = context;
+    char *output_path = malloc(strlen(rescue->output_directory) + strlen(path) + 2);
+
+    assert(output_path != NULL);
+    sprintf(output_path, "%s%s%s", rescue->output_directory, path[0] == '/' ? "" : "/", path);
+
+    if(isDirectory(entry)){
+        if(mkdir(output_path, 0755) != 0 && errno != EEXIST){
+            printf("Unable to create '%s'\n", output_path);
+            free(output_path);
+            return WALK_SKIP;
+        }
+    }
+    else {
+        rescueFile(rescue, path, output_path, entry);
+    }
+    free(output_path);
+    return WALK_CONTINUE;
+}
+
+/*------------------------------------------------------
+// writeMap
+//
+// PURPOSE: Writes the regions that were never read, one
+// per line: the image offset and length, the status, the
+// offset in the file and the file's path.
+// INPUT PARAMETERS:
+//     Takes in the rescue and the stream to write to.
+//------------------------------------------------------*/
+static void writeMap(Rescue *rescue, FILE *output){
+
+    const BadRegion *region;
+
+    fprintf(output, "# Rescue map: image offset, length, status (%c untried, %c untrimmed, %c bad), "
+                    "file offset, path\n", REGION_UNTRIED, REGION_UNTRIMMED, REGION_BAD);
+    for(uint64_t i = 0; i < rescue->regions.count; i++){
+        region = &rescue->regions.regions[i];
+        fprintf(output, "0x%010llx  0x%08llx  %c  0x%010llx  %s\n", (unsigned long long) region->offset,
+                (unsigned long long) region->length, region->status, (unsigned long long) region->file_offset,
+                rescue->targets[region->target].path);
+    }
+}
+
+/*------------------------------------------------------
+// commandRescue
+//
+// PURPOSE: Runs "rescue <path> <output directory> [--map
+// file] [--retries N]", copying the file at path, or
+// every file below the directory at path, into the
+// output directory while reading around bad sectors.
+// Unreadable data is left as zeros and listed in the map
+// file, or on standard output when no map is given.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct and the arguments
+// that follow the command.
+// OUTPUT PARAMETERS:
+//     Returns 0 if everything was read, -1 if some data
+// could not be, or for a bad path or option.
+//------------------------------------------------------*/
+int commandRescue(int volume_fd, exfat *volume, int argc, char *argv[]){
+
+    Rescue rescue;
+    DirectoryEntry entry;
+    FILE *map;
+    const char *path = NULL;
+    const char *map_path = NULL;
+    const char *name;
+    char *output_path;
+    char *end;
+    int retries = DEFAULT_RETRIES;
+    int pass = 1;
+    int status;
+
+    memset(&rescue, 0, sizeof (Rescue));
+    for(int i = 0; i < argc; i++){
+        if(strcmp(argv[i], "--map") == 0 && i + 1 < argc){
+            map_path = argv[++i];
+        }
+        else if(strcmp(argv[i], "--retries") == 0 && i + 1 < argc){
+            retries = (int) strtol(argv[++i], &end, 10);
+            if(*end != '\0' || retries < 0){
+                printf("Invalid retry count: '%s'\n", argv[i]);
+                return -1;
+            }
+        }
+        else if(argv[i][0] != '-' && path == NULL){
+            path = argv[i];
+        }
+        else if(argv[i][0] != '-' && rescue.output_directory == NULL){
+            rescue.output_directory = argv[i];
+        }
+        else {
+            printf("Invalid rescue option: '%s'\n", argv[i]);
+            return -1;
+        }
+    }
+    if(path == NULL || rescue.output_directory == NULL){
+        printf("Usage: rescue <path> <output directory> [--map file] [--retries N]\n");
+        return -1;
+    }
+    if(resolvePath(volume_fd, volume, NULL, path, &entry) != 0){
+        printf("No such file or directory: '%s'\n", path);
+        return -1;
+    }
+
+    rescue.volume_fd = volume_fd;
+    rescue.volume = volume;
+    rescue.sector_bytes = sectorsToBytes(volume, 1);
+    rescue.output_fd = -1;
+    /* Under a memory ceiling the chunk shrinks to its share, but never below a sector */
+    rescue.chunk_size = memoryShare(RESCUE_CHUNK_SIZE) / rescue.sector_bytes * rescue.sector_bytes;
+    if(rescue.chunk_size == 0){
+        rescue.chunk_size = rescue.sector_bytes;
+    }
+    rescue.buffer = malloc(rescue.chunk_size);
+    assert(rescue.buffer != NULL);
+
+    if(mkdir(rescue.output_directory, 0755) != 0 && errno != EEXIST){
+        printf("Unable to create '%s'\n", rescue.output_directory);
+        free(rescue.buffer);
+        return -1;
+    }
+
+    traceBegin("copy");
+    if(isDirectory(&entry)){
+        walkTree(volume_fd, volume, NULL, "", entry.first_cluster, entry.data_length, entry.general_flags,
+                 rescueEntry, &rescue);
+    }
+    else {
+        name = strrchr(path, '/');
+        name = name != NULL ? name + 1 : path;
+        output_path = malloc(strlen(rescue.output_directory) + strlen(name) + 2);
+        assert(output_path != NULL);
+        sprintf(output_path, "%s/%s", rescue.output_directory, name);
+        rescueFile(&rescue, path, output_path, &entry);
+        free(output_path);
+    }
+    traceEnd();
+    mergeRegions(&rescue.regions);
+    printf("Pass %d (copy): %llu KB unread in %llu region(s)\n", pass,
+           (unsigned long long) regionBytes(&rescue.regions) / KILOBYTE_SIZE,
+           (unsigned long long) rescue.regions.count);
+
+    /* The areas skipped over, then the failed chunks cut down to sectors, then the sectors again */
+    traceBegin("fill");
+    runPass(&rescue, ++pass, "fill", REGION_UNTRIED, fillRegion);
+    traceEnd();
+    traceBegin("trim");
+    runPass(&rescue, ++pass, "trim", REGION_UNTRIMMED, trimRegion);
+    traceEnd();
+    for(int retry = 0; retry < retries && rescue.regions.count > 0; retry++){
+        traceBegin("retry");
+        runPass(&rescue, ++pass, "retry", REGION_BAD, retryRegion);
+        traceEnd();
+    }
+    if(rescue.output_fd >= 0){
+        close(rescue.output_fd);
+    }
+
+    printf("Rescued %llu of %llu KB from %u file(s), %llu KB unreadable in %llu region(s), "
+           "%llu of %llu reads failed\n",
+           (unsigned long long) rescue.rescued / KILOBYTE_SIZE, (unsigned long long) rescue.total / KILOBYTE_SIZE,
+           rescue.target_count, (unsigned long long) (regionBytes(&rescue.regions) + rescue.unmapped) / KILOBYTE_SIZE,
+           (unsigned long long) rescue.regions.count, (unsigned long long) rescue.read_errors,
+           (unsigned long long) rescue.reads);
+
+    if(map_path != NULL){
+        map = fopen(map_path, "w");
+        if(map == NULL){
+            printf("Unable to create '%s'\n", map_path);
+        }
+        else {
+            writeMap(&rescue, map);
+            fclose(map);
+        }
+    }
+    else if(rescue.regions.count > 0){
+        writeMap(&rescue, stdout);
+    }
+
+    status = rescue.regions.count == 0 && rescue.unmapped == 0 && !rescue.write_failed ? 0 : -1;
+    for(uint32_t i = 0; i < rescue.target_count; i++){
+        free(rescue.targets[i].path);
+        free(rescue.targets[i].output_path);
+    }
+    free(rescue.targets);
+    free(rescue.regions.regions);
+    free(rescue.buffer);
+    return status;
+}
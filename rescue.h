@@ -0,0 +1,14 @@
+//
+// Extraction from failing media, reading around bad sectors in passes.
+//
+
+#ifndef FSREADER_RESCUE_H
+#define FSREADER_RESCUE_H
+
+#include "exfat.h"
+
+
+int commandRescue(int volume_fd, exfat *volume, int argc, char *argv[]);
+
+
+#endif //FSREADER_RESCUE_H
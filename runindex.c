@@ -0,0 +1,339 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Index the FAT as runs of clusters that link
+// to the cluster right after them (FAT[i] == i + 1), the
+// shape a chain has wherever its file is contiguous.
+// One sequential pass streams the whole table and finds
+// where runs break, eight entries per comparison with
+// AVX2, while free entries are skipped over the same
+// way.  The index then stands in for the FAT: a chain is
+// followed a run at a time, so the extents of any file
+// come from memory at a cost set by its fragments rather
+// than its length, and a single entry is one binary
+// search.  Only runs are kept, which on most volumes is
+// far smaller than the table itself.
+//-----------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "runindex.h"
+#include "memory.h"
+#include "trace.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_RUN_SIMD 1
+#endif
+
+#define RUN_READ_ENTRIES (KILOBYTE_SIZE * KILOBYTE_SIZE)   /* 4MB of the FAT per read */
+#define FREE_ENTRY 0
+
+/* The index the commands share, built for one volume */
+static RunIndex *active = NULL;
+static int active_fd = -1;
+
+#ifdef HAVE_RUN_SIMD
+__attribute__((target("avx2")))
+static uint64_t findBreakSimd(const uint32_t *entries, uint32_t first_cluster, uint64_t i, uint64_t count){
+
+    const __m256i step = _mm256_set1_epi32(8);
+    __m256i expected = _mm256_add_epi32(_mm256_set1_epi32((int) (first_cluster + i + 1)),
+                                        _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    uint32_t mask;
+
+    for(; i + 8 <= count; i += 8){
+        mask = (uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(
+                   _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *) (entries + i)), expected)));
+        if(mask != 0xff){
+            return i + (uint64_t) __builtin_ctz(~mask);
+        }
+        expected = _mm256_add_epi32(expected, step);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static uint64_t skipFreeSimd(const uint32_t *entries, uint64_t i, uint64_t count){
+
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i block;
+    uint32_t mask;
+
+    for(; i + 8 <= count; i += 8){
+        block = _mm256_loadu_si256((const __m256i *) (entries + i));
+        if(!_mm256_testz_si256(block, block)){
+            mask = (uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(block, zero)));
+            return i + (uint64_t) __builtin_ctz(~mask);
+        }
+    }
+    return i;
+}
+#endif
+
+/* Returns the first entry from i on that does not link to the next cluster, count if there is none */
+static uint64_t findBreak(const uint32_t *entries, uint32_t first_cluster, uint64_t i, uint64_t count){
+
+#ifdef HAVE_RUN_SIMD
+    if(__builtin_cpu_supports("avx2")){
+        i = findBreakSimd(entries, first_cluster, i, count);
+    }
+#endif
+    for(; i < count; i++){
+        if(entries[i] != first_cluster + (uint32_t) i + 1){
+            break;
+        }
+    }
+    return i;
+}
+
+/* Returns the first entry from i on that is not free, count if there is none */
+static uint64_t skipFree(const uint32_t *entries, uint64_t i, uint64_t count){
+
+#ifdef HAVE_RUN_SIMD
+    if(__builtin_cpu_supports("avx2")){
+        i = skipFreeSimd(entries, i, count);
+    }
+#endif
+    for(; i < count; i++){
+        if(entries[i] != FREE_ENTRY){
+            break;
+        }
+    }
+    return i;
+}
+
+/* Ends the open run at a cluster whose entry is next, returns -1 if the index is full */
+static int closeRun(RunIndex *index, uint32_t last, uint32_t next){
+
+    FatRun *run;
+
+    if(index->count == index->capacity){
+        if(index->count == index->limit){
+            return -1;
+        }
+        index->capacity = index->capacity == 0 ? 1024 : index->capacity * 2;
+        if(index->capacity > index->limit){
+            index->capacity = index->limit;
+        }
+        index->runs = realloc(index->runs, index->capacity * sizeof (FatRun));
+        assert(index->runs != NULL);
+    }
+    run = &index->runs[index->count++];
+    run->first = index->run_start;
+    run->length = last - index->run_start + 1;
+    run->next = next;
+    index->clusters += run->length;
+    index->open = 0;
+    return 0;
+}
+
+RunIndex *createRunIndex(uint64_t fat_entries, uint64_t limit){
+
+    RunIndex *index = calloc(1, sizeof (RunIndex));
+
+    assert(index != NULL);
+    index->end = fat_entries;
+    index->limit = limit;
+    return index;
+}
+
+/*------------------------------------------------------
+// scanFatEntries
+//
+// PURPOSE: Adds the next slice of the FAT to an index.
+// Runs that reach the end of the slice stay open for the
+// next one.  A free cluster starts no run, so free space
+// costs nothing, while a run that links into a free
+// cluster keeps it as its last.
+// INPUT PARAMETERS:
+//     Takes in the index, the FAT entries, the cluster of
+// the first of them and how many there are.  Slices are
+// scanned in order without gaps.
+// OUTPUT PARAMETERS:
+//     Returns 0, or -1 once the index has more runs than
+// its limit.
+//------------------------------------------------------*/
+int scanFatEntries(RunIndex *index, const uint32_t *entries, uint32_t first_cluster, uint64_t count){
+
+    uint64_t i = 0;
+
+    while(i < count){
+        if(!index->open){
+            if(entries[i] == FREE_ENTRY){
+                i = skipFree(entries, i, count);
+                continue;
+            }
+            index->run_start = first_cluster + (uint32_t) i;
+            index->open = 1;
+        }
+        i = findBreak(entries, first_cluster, i, count);
+        if(i == count){
+            break;
+        }
+        if(closeRun(index, first_cluster + (uint32_t) i, entries[i]) != 0){
+            return -1;
+        }
+        i++;
+    }
+
+    /* The table's last cluster links past its end */
+    if(index->open && first_cluster + count == index->end){
+        return closeRun(index, (uint32_t) (index->end - 1), (uint32_t) index->end);
+    }
+    return 0;
+}
+
+void destroyRunIndex(RunIndex *index){
+
+    if(index != NULL){
+        free(index->runs);
+        free(index);
+    }
+}
+
+/* Binary searches the index for the run holding a cluster, NULL if it is free */
+const FatRun *findRun(const RunIndex *index, uint32_t cluster){
+
+    uint64_t low = 0;
+    uint64_t high = index->count;
+    uint64_t middle;
+
+    /* The last run that starts at or before the cluster */
+    while(low < high){
+        middle = low + (high - low) / 2;
+        if(index->runs[middle].first <= cluster){
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    if(low == 0 || cluster - index->runs[low - 1].first >= index->runs[low - 1].length){
+        return NULL;
+    }
+    return &index->runs[low - 1];
+}
+
+/* Returns the FAT entry of a data cluster as the index has it */
+uint32_t runIndexEntry(const RunIndex *index, uint32_t cluster){
+
+    const FatRun *run = findRun(index, cluster);
+
+    if(run == NULL){
+        return FREE_ENTRY;
+    }
+    return cluster - run->first + 1 < run->length ? cluster + 1 : run->next;
+}
+
+/*------------------------------------------------------
+// loadRunIndex
+//
+// PURPOSE: Builds the run index of a volume's first FAT,
+// reading the table front to back in large slices.
+// Under a memory ceiling the index may take one share of
+// it; a volume too fragmented for that gets no index.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume along
+// with a pointer to the exfat volume struct.
+// OUTPUT PARAMETERS:
+//     Returns the index, destroyed with destroyRunIndex,
+// or NULL if the FAT could not be read or the index
+// would not fit.
+//------------------------------------------------------*/
+RunIndex *loadRunIndex(int volume_fd, exfat *volume){
+
+    RunIndex *index;
+    uint32_t *entries;
+    uint64_t fat_entries = (uint64_t) volume->cluster_count + FIRST_DATA_CLUSTER;
+    uint64_t offset = (uint64_t) volume->fat_offset * sectorsToBytes(volume, 1);
+    uint64_t limit = memoryCeiling() != 0 ? memoryShare(UINT64_MAX) / sizeof (FatRun) : UINT64_MAX;
+    uint64_t slice = memoryShare(RUN_READ_ENTRIES * FAT_ENTRY_SIZE) / FAT_ENTRY_SIZE;
+    uint64_t count;
+    int status = 0;
+
+    entries = malloc(slice * FAT_ENTRY_SIZE);
+    assert(entries != NULL);
+    index = createRunIndex(fat_entries, limit);
+
+    traceBegin("index FAT runs");
+    for(uint64_t cluster = FIRST_DATA_CLUSTER; status == 0 && cluster < fat_entries; cluster += count){
+        count = fat_entries - cluster;
+        if(count > slice){
+            count = slice;
+        }
+        if(readBytesAs(volume_fd, entries, count * FAT_ENTRY_SIZE, offset + cluster * FAT_ENTRY_SIZE, TRACE_FAT) !=
+           (ssize_t) (count * FAT_ENTRY_SIZE)){
+            status = -1;
+        }
+        else {
+            status = scanFatEntries(index, entries, (uint32_t) cluster, count);
+        }
+    }
+    traceEnd();
+
+    free(entries);
+    if(status != 0){
+        destroyRunIndex(index);
+        return NULL;
+    }
+    return index;
+}
+
+/*------------------------------------------------------
+// runIndexOpen
+//
+// PURPOSE: Builds the shared run index for a volume, which
+// readFatEntry and the extent index then use in place of
+// the FAT on disk.  Commands that follow most chains of a
+// volume open it; the rest read entries as they need them.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume along
+// with a pointer to the exfat volume struct.
+// OUTPUT PARAMETERS:
+//     Returns 0 if the index is ready, -1 if the volume
+// goes on without one.
+//------------------------------------------------------*/
+int runIndexOpen(int volume_fd, exfat *volume){
+
+    RunIndex *index;
+
+    if(active != NULL && active_fd == volume_fd){
+        return 0;
+    }
+    index = loadRunIndex(volume_fd, volume);
+    if(index == NULL){
+        return -1;
+    }
+    runIndexClose();
+    active = index;
+    active_fd = volume_fd;
+    return 0;
+}
+
+void runIndexClose(){
+
+    destroyRunIndex(active);
+    active = NULL;
+    active_fd = -1;
+}
+
+/* Returns the shared index if it was built for this volume, NULL otherwise */
+const RunIndex *runIndexFor(int volume_fd){
+
+    return active != NULL && active_fd == volume_fd ? active : NULL;
+}
+
+void printRunIndexStats(FILE *output){
+
+    if(active == NULL){
+        fprintf(output, "runs no index\n");
+        return;
+    }
+    fprintf(output, "runs %llu run(s) over %llu cluster(s), %.1f cluster(s) per run, %llu KB used\n",
+            (unsigned long long) active->count, (unsigned long long) active->clusters,
+            active->count > 0 ? (double) active->clusters / (double) active->count : 0.0,
+            (unsigned long long) active->capacity * sizeof (FatRun) / KILOBYTE_SIZE);
+}
@@ -0,0 +1,59 @@
+//
+// Index of the FAT's runs of linked clusters, built in one pass over the table.
+//
+
+#ifndef FSREADER_RUNINDEX_H
+#define FSREADER_RUNINDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "exfat.h"
+
+/* Clusters first to first + length - 1, each linked in the FAT to the one after it but the last */
+typedef struct FatRun {
+
+    uint32_t first;
+    uint32_t length;
+    uint32_t next;          /* FAT entry of the run's last cluster */
+
+} FatRun ;
+
+typedef struct RunIndex {
+
+    FatRun *runs;           /* ascending by first cluster */
+    uint64_t count;
+    uint64_t capacity;
+    uint64_t limit;         /* most runs the index may hold */
+    uint64_t clusters;      /* clusters inside the runs */
+
+    /* while scanning */
+    uint64_t end;           /* FAT entries in the table */
+    uint32_t run_start;
+    int open;
+
+} RunIndex ;
+
+
+RunIndex *createRunIndex(uint64_t fat_entries, uint64_t limit);
+
+int scanFatEntries(RunIndex *index, const uint32_t *entries, uint32_t first_cluster, uint64_t count);
+
+void destroyRunIndex(RunIndex *index);
+
+const FatRun *findRun(const RunIndex *index, uint32_t cluster);
+
+uint32_t runIndexEntry(const RunIndex *index, uint32_t cluster);
+
+RunIndex *loadRunIndex(int volume_fd, exfat *volume);
+
+int runIndexOpen(int volume_fd, exfat *volume);
+
+void runIndexClose();
+
+const RunIndex *runIndexFor(int volume_fd);
+
+void printRunIndexStats(FILE *output);
+
+
+#endif //FSREADER_RUNINDEX_H
@@ -0,0 +1,106 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Implement a least significant digit radix
+// sort over packed 64 bit keys, each carrying the index
+// of the row it was made from.  Sorting is linear in the
+// number of keys, so listings of millions of entries
+// are not bound by comparisons, and it is stable, so
+// rows with equal keys keep the order they were given.
+//-----------------------------------------*/
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "sort.h"
+
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RADIX_PASSES (64 / RADIX_BITS)
+
+/*------------------------------------------------------
+// radixSort
+//
+// PURPOSE: Sorts keys in ascending order, moving each
+// row index along with its key.  The histograms of every
+// digit are counted in a single read of the keys, and a
+// digit that is the same in every key is skipped, so
+// keys that only use their low bytes take fewer passes.
+// INPUT PARAMETERS:
+//    Takes in the keys, the row index of each key and the
+// number of keys.
+// OUTPUT PARAMETERS:
+//     The keys and rows are sorted in place.
+//------------------------------------------------------*/
+void radixSort(uint64_t *keys, uint32_t *rows, uint64_t count){
+
+    uint64_t (*histogram)[RADIX_BUCKETS];
+    uint64_t *key_buffer;
+    uint32_t *row_buffer;
+    uint64_t *source_keys = keys;
+    uint32_t *source_rows = rows;
+    uint64_t *target_keys;
+    uint32_t *target_rows;
+    uint64_t *swap_keys;
+    uint32_t *swap_rows;
+    uint64_t offset;
+    uint64_t bucket_count;
+    unsigned int digit;
+
+    if(count < 2){
+        return;
+    }
+
+    histogram = calloc(RADIX_PASSES, sizeof (*histogram));
+    key_buffer = malloc(count * sizeof (uint64_t));
+    row_buffer = malloc(count * sizeof (uint32_t));
+    assert(histogram != NULL && key_buffer != NULL && row_buffer != NULL);
+
+    for(uint64_t i = 0; i < count; i++){
+        for(int pass = 0; pass < RADIX_PASSES; pass++){
+            histogram[pass][(keys[i] >> (pass * RADIX_BITS)) & (RADIX_BUCKETS - 1)]++;
+        }
+    }
+
+    target_keys = key_buffer;
+    target_rows = row_buffer;
+
+    for(int pass = 0; pass < RADIX_PASSES; pass++){
+
+        /* Every key has the same digit, the pass would not move anything */
+        if(histogram[pass][(keys[0] >> (pass * RADIX_BITS)) & (RADIX_BUCKETS - 1)] == count){
+            continue;
+        }
+
+        offset = 0;
+        for(int bucket = 0; bucket < RADIX_BUCKETS; bucket++){
+            bucket_count = histogram[pass][bucket];
+            histogram[pass][bucket] = offset;
+            offset += bucket_count;
+        }
+
+        for(uint64_t i = 0; i < count; i++){
+            digit = (source_keys[i] >> (pass * RADIX_BITS)) & (RADIX_BUCKETS - 1);
+            offset = histogram[pass][digit]++;
+            target_keys[offset] = source_keys[i];
+            target_rows[offset] = source_rows[i];
+        }
+
+        swap_keys = source_keys;
+        swap_rows = source_rows;
+        source_keys = target_keys;
+        source_rows = target_rows;
+        target_keys = swap_keys;
+        target_rows = swap_rows;
+    }
+
+    /* An odd number of passes leaves the result in the buffers */
+    if(source_keys != keys){
+        memcpy(keys, source_keys, count * sizeof (uint64_t));
+        memcpy(rows, source_rows, count * sizeof (uint32_t));
+    }
+
+    free(histogram);
+    free(key_buffer);
+    free(row_buffer);
+}
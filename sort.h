@@ -0,0 +1,14 @@
+//
+// Radix sort of 64 bit keys carrying a 32 bit row index.
+//
+
+#ifndef FSREADER_SORT_H
+#define FSREADER_SORT_H
+
+#include <stdint.h>
+
+
+void radixSort(uint64_t *keys, uint32_t *rows, uint64_t count);
+
+
+#endif //FSREADER_SORT_H
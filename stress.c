@@ -0,0 +1,314 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Stress test of many readers sharing one opened
+// volume.  Every operation is first run on one thread to
+// get its reference output, then on all threads at once
+// over the same descriptor, block cache and dentry cache,
+// each thread comparing every output byte for byte with
+// the reference.  Threads start the operations at
+// different points and read files in chunks of different
+// sizes, so their reads interleave.  Any difference means
+// a read depended on state another reader could change.
+// The report goes to stderr, as calculateFreeSpace
+// prints its progress to stdout on every run.
+//
+// Usage: ./stress <volume> [--threads N] [--rounds N] [--cache=MB]
+//-----------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "exfat.h"
+#include "cache.h"
+#include "dentry.h"
+#include "directory.h"
+#include "fat.h"
+#include "file.h"
+
+#define DEFAULT_THREADS 8
+#define DEFAULT_ROUNDS 4
+#define MAX_STRESS_THREADS 256
+#define REFERENCE_CHUNK (64 * KILOBYTE_SIZE)
+
+typedef struct Stress Stress;
+
+/* Writes everything the operation produces to output, reading files in chunks of the given size */
+typedef void (*Operation)(Stress *stress, FILE *output, size_t chunk);
+
+typedef struct StressOperation {
+
+    const char *name;
+    Operation run;
+
+    /* the single threaded output */
+    char *reference;
+    size_t reference_length;
+
+    uint64_t runs;
+    uint64_t mismatches;
+
+} StressOperation ;
+
+typedef struct Stress {
+
+    int volume_fd;
+    exfat *volume;
+
+    /* every path on the volume, files marked, gathered single threaded */
+    char **paths;
+    uint8_t *is_file;
+    uint64_t path_count;
+    uint64_t path_capacity;
+
+    StressOperation *operations;
+    unsigned int operation_count;
+    unsigned int rounds;
+
+} Stress ;
+
+typedef struct StressThread {
+
+    Stress *stress;
+    unsigned int index;
+    pthread_t thread;
+
+} StressThread ;
+
+static int collectPath(const char *path, DirectoryEntry *entry, void *context){
+
+    Stress *stress = context;
+
+    if(stress->path_count == stress->path_capacity){
+        stress->path_capacity = stress->path_capacity == 0 ? 256 : stress->path_capacity * 2;
+        stress->paths = realloc(stress->paths, stress->path_capacity * sizeof (char *));
+        stress->is_file = realloc(stress->is_file, stress->path_capacity);
+        assert(stress->paths != NULL && stress->is_file != NULL);
+    }
+    stress->paths[stress->path_count] = strdup(path);
+    assert(stress->paths[stress->path_count] != NULL);
+    stress->is_file[stress->path_count] = !isDirectory(entry);
+    stress->path_count++;
+    return WALK_CONTINUE;
+}
+
+/* The boot sector and the free space, read again through the shared descriptor */
+static void stressInfo(Stress *stress, FILE *output, size_t chunk){
+
+    exfat *volume = readVolume(stress->volume_fd);
+    uint64_t bitmap_clusters = (volume->first_bitmap_cluster_data_length + clusterBytes(volume) - 1) /
+                               clusterBytes(volume);
+
+    (void) chunk;
+    calculateFreeSpace(stress->volume_fd, volume, bitmap_clusters);
+    fprintf(output, "%s %u %lu %u %u %u %u %u\n", volume->ascii_volume_label, volume->serial_number,
+            volume->free_space, volume->fat_offset, volume->cluster_heap_offset, volume->cluster_count,
+            volume->root_cluster, volume->first_bitmap_cluster);
+    free(volume->ascii_volume_label);
+    free(volume);
+}
+
+/* The root directory as "list" prints it, read through a VolumeCursor */
+static void stressList(Stress *stress, FILE *output, size_t chunk){
+
+    (void) chunk;
+    commandList(stress->volume_fd, stress->volume, output);
+}
+
+/* Every path looked up through the dentry cache */
+static void stressStat(Stress *stress, FILE *output, size_t chunk){
+
+    DirectoryEntry entry;
+    char *name;
+
+    (void) chunk;
+    for(uint64_t i = 0; i < stress->path_count; i++){
+        if(resolvePath(stress->volume_fd, stress->volume, NULL, stress->paths[i], &entry) != 0){
+            fprintf(output, "%s not found\n", stress->paths[i]);
+            continue;
+        }
+        name = entryName(&entry);
+        fprintf(output, "%s %s %04x %02x %llu %llu %u %08x %08x %08x\n", stress->paths[i], name,
+                entry.file_attributes, entry.general_flags, (unsigned long long) entry.data_length,
+                (unsigned long long) entry.valid_data_length, entry.first_cluster,
+                entry.create_timestamp, entry.modify_timestamp, entry.access_timestamp);
+        free(name);
+    }
+}
+
+/* Every file's bytes through readFile, chunk bytes at a time */
+static void stressRead(Stress *stress, FILE *output, size_t chunk){
+
+    char *buffer = malloc(chunk);
+    ExfatFile *file;
+    uint64_t offset;
+    ssize_t bytes;
+
+    assert(buffer != NULL);
+
+    for(uint64_t i = 0; i < stress->path_count; i++){
+        if(!stress->is_file[i]){
+            continue;
+        }
+        file = openFile(stress->volume_fd, stress->volume, NULL, stress->paths[i]);
+        if(file == NULL){
+            fprintf(output, "%s not opened\n", stress->paths[i]);
+            continue;
+        }
+        fprintf(output, "%s\n", stress->paths[i]);
+        offset = 0;
+        while((bytes = readFile(file, buffer, chunk, offset)) > 0){
+            fwrite(buffer, 1, (size_t) bytes, output);
+            offset += (uint64_t) bytes;
+        }
+        if(bytes < 0){
+            fprintf(output, "\n%s read error at %llu\n", stress->paths[i], (unsigned long long) offset);
+        }
+        closeFile(file);
+    }
+    free(buffer);
+}
+
+/* Runs an operation into memory, the caller frees the output */
+static char *runOperation(Stress *stress, StressOperation *operation, size_t chunk, size_t *length){
+
+    char *data = NULL;
+    FILE *output = open_memstream(&data, length);
+
+    assert(output != NULL);
+    operation->run(stress, output, chunk);
+    fclose(output);
+    return data;
+}
+
+static void *runThread(void *argument){
+
+    StressThread *thread = argument;
+    Stress *stress = thread->stress;
+    StressOperation *operation;
+    size_t chunk;
+    size_t length;
+    size_t at;
+    char *data;
+
+    for(unsigned int round = 0; round < stress->rounds; round++){
+        for(unsigned int k = 0; k < stress->operation_count; k++){
+            /* Odd chunk sizes so reads end mid cluster, different on every thread */
+            chunk = 1 + (thread->index * 7919u + round * 104729u + k * 4099u) % (2 * REFERENCE_CHUNK);
+            operation = &stress->operations[(k + thread->index) % stress->operation_count];
+            data = runOperation(stress, operation, chunk, &length);
+
+            if(length != operation->reference_length || memcmp(data, operation->reference, length) != 0){
+                for(at = 0; at < length && at < operation->reference_length && data[at] == operation->reference[at]; at++);
+                fprintf(stderr, "thread %u round %u: %s differs at byte %zu (%zu bytes, %zu expected)\n",
+                        thread->index, round, operation->name, at, length, operation->reference_length);
+                __atomic_fetch_add(&operation->mismatches, 1, __ATOMIC_RELAXED);
+            }
+            __atomic_fetch_add(&operation->runs, 1, __ATOMIC_RELAXED);
+            free(data);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]){
+
+    StressOperation operations[] = {
+        {"info",     stressInfo, NULL, 0, 0, 0},
+        {"list",     stressList, NULL, 0, 0, 0},
+        {"stat",     stressStat, NULL, 0, 0, 0},
+        {"readFile", stressRead, NULL, 0, 0, 0},
+    };
+    StressThread threads[MAX_STRESS_THREADS];
+    Stress stress;
+    unsigned int thread_count = DEFAULT_THREADS;
+    uint64_t cache_budget = DEFAULT_CACHE_BUDGET;
+    uint64_t mismatches = 0;
+    const char *volume_name = NULL;
+
+    memset(&stress, 0, sizeof (Stress));
+    stress.operations = operations;
+    stress.operation_count = sizeof (operations) / sizeof (operations[0]);
+    stress.rounds = DEFAULT_ROUNDS;
+
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc){
+            thread_count = (unsigned int) strtoul(argv[++i], NULL, 10);
+        }
+        else if(strcmp(argv[i], "--rounds") == 0 && i + 1 < argc){
+            stress.rounds = (unsigned int) strtoul(argv[++i], NULL, 10);
+        }
+        else if(strncmp(argv[i], "--cache=", 8) == 0){
+            cache_budget = strtoull(argv[i] + 8, NULL, 10) * KILOBYTE_SIZE * KILOBYTE_SIZE;
+        }
+        else if(volume_name == NULL){
+            volume_name = argv[i];
+        }
+    }
+    if(volume_name == NULL || thread_count == 0 || thread_count > MAX_STRESS_THREADS){
+        fprintf(stderr, "Usage: ./stress <volume> [--threads N (1-%d)] [--rounds N] [--cache=MB]\n", MAX_STRESS_THREADS);
+        return EXIT_FAILURE;
+    }
+
+    stress.volume_fd = open(volume_name, O_RDONLY);
+    if(stress.volume_fd < 0){
+        fprintf(stderr, "Unable to open file: '%s'\n", volume_name);
+        return EXIT_FAILURE;
+    }
+    if(cacheOpen(cache_budget) != 0 || dentryOpen(DEFAULT_DENTRY_BUDGET) != 0){
+        fprintf(stderr, "Unable to allocate the caches\n");
+        close(stress.volume_fd);
+        return EXIT_FAILURE;
+    }
+    if(freopen("/dev/null", "w", stdout) == NULL){
+        fprintf(stderr, "Unable to silence stdout\n");
+    }
+    stress.volume = readVolume(stress.volume_fd);
+
+    /* Reference outputs, one thread, before any reader shares the caches */
+    walkTree(stress.volume_fd, stress.volume, NULL, "", stress.volume->root_cluster, 0, 0, collectPath, &stress);
+    for(unsigned int k = 0; k < stress.operation_count; k++){
+        operations[k].reference = runOperation(&stress, &operations[k], REFERENCE_CHUNK, &operations[k].reference_length);
+    }
+    fprintf(stderr, "%llu path(s), %u thread(s), %u round(s)\n",
+            (unsigned long long) stress.path_count, thread_count, stress.rounds);
+
+    for(unsigned int i = 0; i < thread_count; i++){
+        threads[i].stress = &stress;
+        threads[i].index = i;
+        if(pthread_create(&threads[i].thread, NULL, runThread, &threads[i]) != 0){
+            fprintf(stderr, "Unable to start thread %u\n", i);
+            thread_count = i;
+            break;
+        }
+    }
+    for(unsigned int i = 0; i < thread_count; i++){
+        pthread_join(threads[i].thread, NULL);
+    }
+
+    for(unsigned int k = 0; k < stress.operation_count; k++){
+        fprintf(stderr, "%-10s %10zu byte(s) %6llu run(s) %6llu mismatch(es)\n", operations[k].name,
+                operations[k].reference_length, (unsigned long long) operations[k].runs,
+                (unsigned long long) operations[k].mismatches);
+        mismatches += operations[k].mismatches;
+        free(operations[k].reference);
+    }
+
+    for(uint64_t i = 0; i < stress.path_count; i++){
+        free(stress.paths[i]);
+    }
+    free(stress.paths);
+    free(stress.is_file);
+    free(stress.volume->ascii_volume_label);
+    free(stress.volume);
+    dentryClose();
+    cacheClose();
+    close(stress.volume_fd);
+
+    return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
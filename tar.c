@@ -0,0 +1,386 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Implement the "tar" command, writing a
+// subtree to standard output as a pax archive.  Every
+// entry gets a pax extended header carrying its full
+// path and its times to 10ms, then a ustar header.  File
+// bodies are moved extent by extent from the volume to
+// the output with copy_file_range (output is a file) or
+// splice (output is a pipe), falling back to pread and
+// write through one fixed buffer, so memory use does not
+// grow with the size of the tree or of its files.
+//-----------------------------------------*/
+#define _GNU_SOURCE     /* copy_file_range, splice */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "tar.h"
+#include "directory.h"
+#include "file.h"
+#include "trace.h"
+#include "memory.h"
+
+#define BLOCK_SIZE 512
+#define COPY_BUFFER_SIZE (256 * KILOBYTE_SIZE)
+#define PAX_BUFFER_SIZE 4096
+
+/* How file bodies reach the output, downgraded the first time the kernel refuses one */
+#define COPY_FILE_RANGE 0
+#define COPY_SPLICE 1
+#define COPY_READ_WRITE 2
+
+typedef struct TarHeader {
+
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+
+} TarHeader ;
+
+typedef struct TarWriter {
+
+    int volume_fd;
+    exfat *volume;
+    int output_fd;
+    int copy_method;
+    uint8_t *buffer;            /* buffer_size bytes, also the source of zeros */
+    size_t buffer_size;
+    unsigned long entries;
+    int failed;
+
+} TarWriter ;
+
+static int writeAll(TarWriter *writer, const void *data, size_t length){
+
+    const uint8_t *bytes = data;
+    ssize_t written;
+
+    while(length > 0 && !writer->failed){
+        written = write(writer->output_fd, bytes, length);
+        if(written < 0 && errno == EINTR){
+            continue;
+        }
+        if(written <= 0){
+            writer->failed = 1;
+            break;
+        }
+        bytes += written;
+        length -= (size_t) written;
+    }
+    return writer->failed ? -1 : 0;
+}
+
+static int writeZeros(TarWriter *writer, uint64_t length){
+
+    size_t chunk;
+
+    memset(writer->buffer, 0, writer->buffer_size);
+    while(length > 0 && !writer->failed){
+        chunk = length < writer->buffer_size ? (size_t) length : writer->buffer_size;
+        writeAll(writer, writer->buffer, chunk);
+        length -= chunk;
+    }
+    return writer->failed ? -1 : 0;
+}
+
+/*------------------------------------------------------
+// copyRange
+//
+// PURPOSE: Copies bytes of the volume to the output
+// without passing them through user space when the
+// kernel allows it.  copy_file_range is tried first, then
+// splice, then pread and write; a method the kernel
+// refuses is not tried again for later ranges.
+// INPUT PARAMETERS:
+//    Takes in the writer, the byte offset on the volume
+// and the number of bytes to copy.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 if the copy failed.
+//------------------------------------------------------*/
+static int copyRange(TarWriter *writer, uint64_t offset, uint64_t length){
+
+    loff_t source = (loff_t) offset;
+    ssize_t moved;
+    size_t chunk;
+    uint64_t position;
+    uint64_t start;
+
+    while(length > 0 && !writer->failed){
+        chunk = length < (uint64_t) 1 << 30 ? (size_t) length : (size_t) 1 << 30;
+
+        if(writer->copy_method == COPY_READ_WRITE){
+            if(chunk > writer->buffer_size){
+                chunk = writer->buffer_size;
+            }
+            if(readBytes(writer->volume_fd, writer->buffer, chunk, (uint64_t) source) != (ssize_t) chunk ||
+               writeAll(writer, writer->buffer, chunk) != 0){
+                writer->failed = 1;
+                break;
+            }
+            source += (loff_t) chunk;
+            length -= chunk;
+            continue;
+        }
+
+        /* These read the volume in the kernel, so they are traced here rather than in readBytes */
+        position = (uint64_t) source;
+        start = tracing() ? traceClock() : 0;
+        if(writer->copy_method == COPY_FILE_RANGE){
+            moved = copy_file_range(writer->volume_fd, &source, writer->output_fd, NULL, chunk, 0);
+        }
+        else {
+            moved = splice(writer->volume_fd, &source, writer->output_fd, NULL, chunk, SPLICE_F_MORE);
+        }
+        traceRead(position, chunk, moved, start);
+
+        if(moved > 0){
+            length -= (uint64_t) moved;
+        }
+        else if(moved < 0 && errno == EINTR){
+            continue;
+        }
+        else {
+            writer->copy_method++;
+        }
+    }
+    return writer->failed ? -1 : 0;
+}
+
+static void octal(char *field, size_t size, uint64_t value){
+
+    snprintf(field, size, "%0*llo", (int) size - 1, (unsigned long long) value);
+}
+
+/* Appends a "length key=value\n" record, the length counting its own digits */
+static size_t addRecord(char *buffer, size_t used, const char *key, const char *value){
+
+    size_t content = strlen(key) + strlen(value) + 3;
+    size_t length = content + 1;
+    char digits[24];
+
+    while(length != content + (size_t) snprintf(digits, sizeof (digits), "%zu", length)){
+        length = content + (size_t) snprintf(digits, sizeof (digits), "%zu", length);
+    }
+    if(used + length < PAX_BUFFER_SIZE){
+        used += (size_t) snprintf(buffer + used, PAX_BUFFER_SIZE - used, "%zu %s=%s\n", length, key, value);
+    }
+    return used;
+}
+
+static void formatPaxTime(int64_t ticks, char *buffer, size_t size){
+
+    snprintf(buffer, size, "%lld.%02d", (long long) (ticks / 100), (int) (ticks % 100));
+}
+
+static int writeHeader(TarWriter *writer, const char *name, char typeflag, uint64_t size, uint64_t mtime,
+                       unsigned int mode){
+
+    TarHeader header;
+    const uint8_t *bytes = (const uint8_t *) &header;
+    unsigned int checksum = 0;
+
+    memset(&header, 0, sizeof (TarHeader));
+    strncpy(header.name, name, sizeof (header.name) - 1);
+    octal(header.mode, sizeof (header.mode), mode);
+    octal(header.uid, sizeof (header.uid), 0);
+    octal(header.gid, sizeof (header.gid), 0);
+    /* Sizes past the 11 octal digits are carried by the pax header */
+    octal(header.size, sizeof (header.size), size < 077777777777ULL ? size : 0);
+    octal(header.mtime, sizeof (header.mtime), mtime);
+    header.typeflag = typeflag;
+    memcpy(header.magic, "ustar", 6);
+    memcpy(header.version, "00", 2);
+
+    memset(header.checksum, ' ', sizeof (header.checksum));
+    for(size_t i = 0; i < sizeof (TarHeader); i++){
+        checksum += bytes[i];
+    }
+    snprintf(header.checksum, sizeof (header.checksum), "%06o", checksum);
+
+    return writeAll(writer, &header, sizeof (TarHeader));
+}
+
+/*------------------------------------------------------
+// writeEntry
+//
+// PURPOSE: Writes the pax extended header and the ustar
+// header of one entry, followed by its body for a file.
+// Bytes past ValidDataLength are written as zeros.
+// INPUT PARAMETERS:
+//    Takes in the writer, the path of the entry within the
+// archive and its directory entry.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 if the output failed.
+//------------------------------------------------------*/
+static int writeEntry(TarWriter *writer, const char *name, DirectoryEntry *entry){
+
+    char pax[PAX_BUFFER_SIZE];
+    char value[64];
+    char short_name[100];
+    char *path;
+    size_t used = 0;
+    int directory = isDirectory(entry);
+    uint64_t size = directory ? 0 : entry->data_length;
+    uint64_t valid_length = entry->valid_data_length < size ? entry->valid_data_length : size;
+    uint64_t cluster_bytes = clusterBytes(writer->volume);
+    uint64_t position = 0;
+    uint64_t length;
+    int64_t modified = entryTicks(entry->modify_timestamp, entry->modify_10ms, entry->modify_utc_offset);
+    unsigned int mode = directory ? 0755 : 0644;
+    ExfatFile *file;
+    Extent *extent;
+
+    if(entry->file_attributes & ATTRIBUTE_READ_ONLY){
+        mode &= ~0222u;
+    }
+
+    path = malloc(strlen(name) + 2);
+    assert(path != NULL);
+    sprintf(path, "%s%s", name, directory ? "/" : "");
+
+    used = addRecord(pax, used, "path", path);
+    formatPaxTime(modified, value, sizeof (value));
+    used = addRecord(pax, used, "mtime", value);
+    formatPaxTime(entryTicks(entry->access_timestamp, 0, entry->access_utc_offset), value, sizeof (value));
+    used = addRecord(pax, used, "atime", value);
+    if(size >= 077777777777ULL){
+        snprintf(value, sizeof (value), "%llu", (unsigned long long) size);
+        used = addRecord(pax, used, "size", value);
+    }
+
+    snprintf(short_name, sizeof (short_name), "PaxHeaders/%.80s", path);
+    writeHeader(writer, short_name, 'x', used, (uint64_t) (modified / 100), 0644);
+    writeAll(writer, pax, used);
+    writeZeros(writer, (BLOCK_SIZE - used % BLOCK_SIZE) % BLOCK_SIZE);
+
+    writeHeader(writer, path, directory ? '5' : '0', size, (uint64_t) (modified / 100), mode);
+    free(path);
+
+    if(size > 0){
+        file = openEntry(writer->volume_fd, writer->volume, NULL, entry);
+
+        do {
+            for(uint32_t i = 0; i < file->extent_count && position < valid_length && !writer->failed; i++){
+                extent = &file->extents[i];
+                length = (uint64_t) extent->length * cluster_bytes;
+                if(length > valid_length - position){
+                    length = valid_length - position;
+                }
+                copyRange(writer, clusterOffset(writer->volume, extent->first_cluster), length);
+                position += length;
+            }
+        } while(position < valid_length && !writer->failed && nextExtents(file));
+        closeFile(file);
+
+        /* Never written on disk, or past the end of a broken chain */
+        writeZeros(writer, size - position);
+        writeZeros(writer, (BLOCK_SIZE - size % BLOCK_SIZE) % BLOCK_SIZE);
+    }
+
+    writer->entries++;
+    return writer->failed ? -1 : 0;
+}
+
+static int archiveEntry(const char *path, DirectoryEntry *entry, void *context){
+
+    TarWriter *writer = context;
+
+    /* Archive names are relative */
+    while(*path == '/'){
+        path++;
+    }
+    return writeEntry(writer, path, entry) == 0 ? WALK_CONTINUE : WALK_STOP;
+}
+
+/*------------------------------------------------------
+// commandTar
+//
+// PURPOSE: Runs "tar <path>", writing the file or the
+// directory tree at path to standard output as a pax
+// archive.  Names inside the archive start at the last
+// component of path, or at the top level for "/".
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct and the arguments
+// that follow the command.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 otherwise.
+//------------------------------------------------------*/
+int commandTar(int volume_fd, exfat *volume, int argc, char *argv[]){
+
+    TarWriter writer;
+    DirectoryEntry entry;
+    const char *path = argc > 0 ? argv[0] : "/";
+    const char *name;
+    char *top;
+
+    if(argc > 1){
+        fprintf(stderr, "Usage: tar <path> > archive.tar\n");
+        return -1;
+    }
+    if(isatty(STDOUT_FILENO)){
+        fprintf(stderr, "Refusing to write an archive to a terminal\n");
+        return -1;
+    }
+    if(resolvePath(volume_fd, volume, NULL, path, &entry) != 0){
+        fprintf(stderr, "No such file or directory: '%s'\n", path);
+        return -1;
+    }
+
+    memset(&writer, 0, sizeof (TarWriter));
+    writer.volume_fd = volume_fd;
+    writer.volume = volume;
+    writer.output_fd = STDOUT_FILENO;
+    writer.copy_method = COPY_FILE_RANGE;
+    writer.buffer_size = (size_t) memoryShare(COPY_BUFFER_SIZE);
+    writer.buffer = malloc(writer.buffer_size);
+    assert(writer.buffer != NULL);
+
+    /* The last component of the path, without trailing '/' */
+    top = strdup(path);
+    assert(top != NULL);
+    while(strlen(top) > 0 && top[strlen(top) - 1] == '/'){
+        top[strlen(top) - 1] = '\0';
+    }
+    name = strrchr(top, '/') != NULL ? strrchr(top, '/') + 1 : top;
+
+    if(name[0] != '\0'){
+        writeEntry(&writer, name, &entry);
+    }
+    if(isDirectory(&entry) && !writer.failed){
+        walkTree(volume_fd, volume, NULL, name, entry.first_cluster, entry.data_length, entry.general_flags,
+                 archiveEntry, &writer);
+    }
+
+    /* End of archive: two zero blocks */
+    writeZeros(&writer, 2 * BLOCK_SIZE);
+
+    if(writer.failed){
+        fprintf(stderr, "Unable to write the archive\n");
+    }
+
+    free(top);
+    free(writer.buffer);
+    return writer.failed ? -1 : 0;
+}
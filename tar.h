@@ -0,0 +1,14 @@
+//
+// Streaming export of a subtree as a pax archive.
+//
+
+#ifndef FSREADER_TAR_H
+#define FSREADER_TAR_H
+
+#include "exfat.h"
+
+
+int commandTar(int volume_fd, exfat *volume, int argc, char *argv[]);
+
+
+#endif //FSREADER_TAR_H
@@ -0,0 +1,245 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Write a Chrome trace of a run, viewable in
+// chrome://tracing or Perfetto.  Every read of the
+// volume becomes a complete event tagged with the part
+// of the reader that issued it (boot, FAT, bitmap,
+// directory or data), and phases and worker threads
+// become spans on their thread's track.  The source a
+// read is charged to is kept per thread, callers set it
+// around their reads with traceSource.  Events are
+// written one per line in a fixed field order so the
+// replay command can read them back.  When no trace is
+// open every call returns after a single test.
+//-----------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define MAX_SPAN_DEPTH 32
+
+typedef struct Span {
+
+    const char *name;
+    uint64_t start;
+
+} Span ;
+
+static FILE *trace_output = NULL;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t trace_start;
+static int trace_events;
+static atomic_int next_thread_id = 0;
+
+static _Thread_local int thread_id = 0;
+static _Thread_local TraceSource thread_source = TRACE_DATA;
+static _Thread_local Span spans[MAX_SPAN_DEPTH];
+static _Thread_local int span_depth = 0;
+
+static const char *source_names[TRACE_SOURCES] = {"boot", "fat", "bitmap", "directory", "data"};
+
+uint64_t traceClock(){
+
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+int tracing(){
+
+    return trace_output != NULL;
+}
+
+const char *traceSourceName(TraceSource source){
+
+    return source < TRACE_SOURCES ? source_names[source] : "unknown";
+}
+
+static int currentThread(){
+
+    if(thread_id == 0){
+        thread_id = atomic_fetch_add(&next_thread_id, 1) + 1;
+    }
+    return thread_id;
+}
+
+/* Starts a new line of the event array, the caller holds trace_lock */
+static void nextEvent(){
+
+    fputs(trace_events++ == 0 ? "\n" : ",\n", trace_output);
+}
+
+/* Microseconds since the trace opened, with the nanoseconds kept as decimals */
+static void printMicroseconds(const char *field, uint64_t nanoseconds){
+
+    fprintf(trace_output, ",\"%s\":%llu.%03llu", field,
+            (unsigned long long) (nanoseconds / 1000), (unsigned long long) (nanoseconds % 1000));
+}
+
+/*------------------------------------------------------
+// traceOpen
+//
+// PURPOSE: Starts writing a trace to a file.  The calling
+// thread is named "main".
+// INPUT PARAMETERS:
+//     Takes in the path of the trace file.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 if the file could not be
+// created.
+//------------------------------------------------------*/
+int traceOpen(const char *path){
+
+    trace_output = fopen(path, "w");
+    if(trace_output == NULL){
+        return -1;
+    }
+    trace_start = traceClock();
+    trace_events = 0;
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", trace_output);
+    traceThreadName("main");
+    return 0;
+}
+
+/*------------------------------------------------------
+// traceClose
+//
+// PURPOSE: Ends any spans still open on the calling
+// thread and finishes the trace file.  Every other
+// thread must be done with the trace.
+//------------------------------------------------------*/
+void traceClose(){
+
+    if(trace_output == NULL){
+        return;
+    }
+    while(span_depth > 0){
+        traceEnd();
+    }
+    fputs("\n]}\n", trace_output);
+    fclose(trace_output);
+    trace_output = NULL;
+}
+
+/*------------------------------------------------------
+// traceSource
+//
+// PURPOSE: Sets the source the calling thread's reads are
+// charged to until it is set again.
+// INPUT PARAMETERS:
+//     Takes in the new TraceSource.
+// OUTPUT PARAMETERS:
+//     Returns the previous source, for the caller to put
+// back once its reads are done.
+//------------------------------------------------------*/
+TraceSource traceSource(TraceSource source){
+
+    TraceSource previous = thread_source;
+
+    thread_source = source;
+    return previous;
+}
+
+/*------------------------------------------------------
+// traceRead
+//
+// PURPOSE: Records one read of the volume as a complete
+// event on the calling thread, charged to its current
+// source.
+// INPUT PARAMETERS:
+//     Takes in the byte offset and length asked for, the
+// number of bytes read (-1 on an error) and the
+// traceClock time the read started.
+//------------------------------------------------------*/
+void traceRead(uint64_t offset, uint64_t length, int64_t result, uint64_t start){
+
+    uint64_t end;
+    int thread;
+
+    if(trace_output == NULL){
+        return;
+    }
+    end = traceClock();
+    thread = currentThread();
+
+    pthread_mutex_lock(&trace_lock);
+    nextEvent();
+    fprintf(trace_output, "{\"name\":\"read\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d",
+            traceSourceName(thread_source), thread);
+    printMicroseconds("ts", start - trace_start);
+    printMicroseconds("dur", end - start);
+    fprintf(trace_output, ",\"args\":{\"offset\":%llu,\"length\":%llu,\"result\":%lld}}",
+            (unsigned long long) offset, (unsigned long long) length, (long long) result);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/*------------------------------------------------------
+// traceBegin
+//
+// PURPOSE: Opens a span on the calling thread's track,
+// closed by the matching traceEnd.  Spans nest.
+// INPUT PARAMETERS:
+//     Takes in the span's name, a string that outlives
+// the span and needs no JSON escaping.
+//------------------------------------------------------*/
+void traceBegin(const char *name){
+
+    if(trace_output == NULL){
+        return;
+    }
+    if(span_depth < MAX_SPAN_DEPTH){
+        spans[span_depth].name = name;
+        spans[span_depth].start = traceClock();
+    }
+    span_depth++;
+}
+
+void traceEnd(){
+
+    uint64_t end;
+    Span *span;
+
+    if(trace_output == NULL || span_depth == 0){
+        return;
+    }
+    end = traceClock();
+    span_depth--;
+    if(span_depth >= MAX_SPAN_DEPTH){
+        return;
+    }
+    span = &spans[span_depth];
+
+    pthread_mutex_lock(&trace_lock);
+    nextEvent();
+    fprintf(trace_output, "{\"name\":\"%s\",\"cat\":\"phase\",\"ph\":\"X\",\"pid\":1,\"tid\":%d",
+            span->name, currentThread());
+    printMicroseconds("ts", span->start - trace_start);
+    printMicroseconds("dur", end - span->start);
+    fputs("}", trace_output);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/*------------------------------------------------------
+// traceThreadName
+//
+// PURPOSE: Names the calling thread's track.
+// INPUT PARAMETERS:
+//     Takes in the name, which needs no JSON escaping.
+//------------------------------------------------------*/
+void traceThreadName(const char *name){
+
+    if(trace_output == NULL){
+        return;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    nextEvent();
+    fprintf(trace_output, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            currentThread(), name);
+    pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,44 @@
+//
+// Chrome trace (Perfetto) output of volume reads and phase spans.
+//
+
+#ifndef FSREADER_TRACE_H
+#define FSREADER_TRACE_H
+
+#include <stdint.h>
+
+/* Which part of the reader issued a read */
+typedef enum TraceSource {
+
+    TRACE_BOOT = 0,
+    TRACE_FAT,
+    TRACE_BITMAP,
+    TRACE_DIRECTORY,
+    TRACE_DATA,
+    TRACE_SOURCES
+
+} TraceSource ;
+
+
+int traceOpen(const char *path);
+
+void traceClose();
+
+int tracing();
+
+uint64_t traceClock();
+
+const char *traceSourceName(TraceSource source);
+
+TraceSource traceSource(TraceSource source);
+
+void traceRead(uint64_t offset, uint64_t length, int64_t result, uint64_t start);
+
+void traceBegin(const char *name);
+
+void traceEnd();
+
+void traceThreadName(const char *name);
+
+
+#endif //FSREADER_TRACE_H
@@ -0,0 +1,322 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Implement "list --deleted" and "undelete".
+// exFAT deletes an entry set by clearing the InUse bit
+// of each entry (0x85 becomes 0x05, 0xC0/0xC1 become
+// 0x40/0x41).  Every directory is read in bulk, the
+// deleted file entries are found with a vectorized
+// search of the entry type bytes and each set is
+// checked against the allocation bitmap.  A file whose
+// clusters are all still free is recoverable, assuming
+// its clusters were contiguous.
+//-----------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "undelete.h"
+#include "bitset.h"
+#include "directory.h"
+#include "fat.h"
+#include "file.h"
+
+#define DELETED_FILE_ENTRY (ENTRY_TYPE_FILE & ~ENTRY_IN_USE)
+
+typedef struct ScanTarget {
+
+    char *path;
+    uint32_t first_cluster;
+    uint64_t data_length;
+    uint8_t general_flags;
+
+} ScanTarget ;
+
+typedef struct DeletedScan {
+
+    int volume_fd;
+    exfat *volume;
+    Bitset *bitmap;
+    Bitset *scanned;    /* first clusters of directories already scanned */
+    const char *output_directory;   /* NULL to only list */
+
+    ScanTarget *targets;
+    uint64_t target_count;
+    uint64_t target_capacity;
+
+    uint64_t deleted;
+    uint64_t recoverable;
+    uint64_t recovered;
+
+} DeletedScan ;
+
+static void addTarget(DeletedScan *scan, const char *path, uint32_t first_cluster,
+                      uint64_t data_length, uint8_t general_flags){
+
+    ScanTarget *target;
+
+    if(scan->target_count == scan->target_capacity){
+        scan->target_capacity = scan->target_capacity == 0 ? 64 : scan->target_capacity * 2;
+        scan->targets = realloc(scan->targets, scan->target_capacity * sizeof (ScanTarget));
+        assert(scan->targets != NULL);
+    }
+    target = &scan->targets[scan->target_count++];
+    target->path = strdup(path);
+    target->first_cluster = first_cluster;
+    target->data_length = data_length;
+    target->general_flags = general_flags;
+}
+
+static int collectDirectory(const char *path, DirectoryEntry *entry, void *context){
+
+    if(isDirectory(entry)){
+        addTarget(context, path, entry->first_cluster, entry->data_length, entry->general_flags);
+    }
+    return WALK_CONTINUE;
+}
+
+/*------------------------------------------------------
+// clustersInUse
+//
+// PURPOSE: Counts how many of the clusters a deleted file
+// occupied, assuming they were contiguous, are allocated
+// again (or lie outside the cluster heap).
+// INPUT PARAMETERS:
+//     Takes in the scan state and the deleted entry.
+// OUTPUT PARAMETERS:
+//     Returns the number of clusters no longer free.
+//------------------------------------------------------*/
+static uint64_t clustersInUse(DeletedScan *scan, DirectoryEntry *entry){
+
+    uint32_t cluster_bytes = clusterBytes(scan->volume);
+    uint64_t clusters = (entry->data_length + cluster_bytes - 1) / cluster_bytes;
+    uint64_t in_use = 0;
+    uint64_t cluster;
+
+    for(uint64_t i = 0; i < clusters; i++){
+        cluster = (uint64_t) entry->first_cluster + i;
+        if(cluster > UINT32_MAX || !isValidCluster(scan->volume, (uint32_t) cluster) ||
+           testBit(scan->bitmap, cluster - FIRST_DATA_CLUSTER)){
+            in_use++;
+        }
+    }
+    return in_use;
+}
+
+/*------------------------------------------------------
+// recoverFile
+//
+// PURPOSE: Copies a deleted file's contiguous clusters into
+// the output directory.  The path is flattened into the
+// output file name by replacing '/' with '_'.  Paths that
+// flatten to a name already taken, "/a_b" and "/a/b" say,
+// get the entry's first cluster and then a count added.
+// INPUT PARAMETERS:
+//     Takes in the scan state, the deleted entry and its
+// path on the volume.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 otherwise.
+//------------------------------------------------------*/
+static int recoverFile(DeletedScan *scan, DirectoryEntry *entry, const char *path){
+
+    /* Room for ".c" and a cluster, then "~" and a count, after the name */
+    char *output_path = malloc(strlen(scan->output_directory) + strlen(path) + 32);
+    size_t name_length;
+    DirectoryEntry contiguous = *entry;
+    ExfatFile *file;
+    int output_fd;
+    int result = 0;
+
+    assert(output_path != NULL);
+
+    sprintf(output_path, "%s/%s", scan->output_directory, path[0] == '/' ? path + 1 : path);
+    for(char *c = output_path + strlen(scan->output_directory) + 1; *c != '\0'; c++){
+        if(*c == '/'){
+            *c = '_';
+        }
+    }
+    name_length = strlen(output_path);
+
+    /* Never overwrite a file, whether an earlier recovery or one already there */
+    output_fd = open(output_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if(output_fd < 0 && errno == EEXIST){
+        sprintf(output_path + name_length, ".c%u", entry->first_cluster);
+        output_fd = open(output_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    }
+    for(unsigned int copy = 2; output_fd < 0 && errno == EEXIST; copy++){
+        sprintf(output_path + name_length, ".c%u~%u", entry->first_cluster, copy);
+        output_fd = open(output_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    }
+    if(output_fd < 0){
+        printf("Unable to create '%s'\n", output_path);
+        result = -1;
+    }
+
+    if(result == 0){
+        /* The FAT entries of a deleted file are gone, its clusters are taken as contiguous */
+        contiguous.general_flags |= FLAG_NO_FAT_CHAIN;
+        file = openEntry(scan->volume_fd, scan->volume, NULL, &contiguous);
+        if(extractFile(file, output_fd, 0, entry->data_length, 0) != 0){
+            printf("Unable to copy '%s'\n", path);
+            result = -1;
+        }
+        closeFile(file);
+    }
+
+    if(output_fd >= 0){
+        close(output_fd);
+    }
+    if(result == 0){
+        printf("    recovered to %s\n", output_path);
+    }
+    free(output_path);
+    return result;
+}
+
+/*------------------------------------------------------
+// scanDirectory
+//
+// PURPOSE: Reads one directory in bulk and reports every
+// deleted entry set in it.  Deleted directories whose
+// clusters are still free are queued to be scanned too.
+// INPUT PARAMETERS:
+//     Takes in the scan state and the index of the target
+// directory to scan.
+//------------------------------------------------------*/
+static void scanDirectory(DeletedScan *scan, uint64_t target_index){
+
+    /* Copied since queueing a deleted directory may move the targets array */
+    ScanTarget target = scan->targets[target_index];
+    DirectoryEntry entry;
+    uint32_t *clusters;
+    uint32_t *matches;
+    uint32_t cluster_total;
+    uint32_t entry_count;
+    uint32_t match_count;
+    uint64_t clusters_needed;
+    uint64_t in_use;
+    uint32_t cluster_bytes = clusterBytes(scan->volume);
+    uint8_t *entries;
+    char *name;
+    char *path;
+
+    if(!isValidCluster(scan->volume, target.first_cluster) ||
+       testAndSetBit(scan->scanned, target.first_cluster - FIRST_DATA_CLUSTER)){
+        return;
+    }
+
+    entries = readDirectory(scan->volume_fd, scan->volume, NULL, target.first_cluster,
+                            target.data_length, target.general_flags, &clusters, &cluster_total);
+    if(entries == NULL){
+        return;
+    }
+
+    entry_count = cluster_total * (cluster_bytes / ENTRY_SIZE);
+    matches = malloc(entry_count * sizeof (uint32_t));
+    assert(matches != NULL);
+    match_count = findEntries(entries, entry_count, DELETED_FILE_ENTRY, matches);
+
+    for(uint32_t i = 0; i < match_count; i++){
+        if(parseEntrySet(entries, entry_count, matches[i], WALK_DELETED, &entry) == 0){
+            continue;
+        }
+
+        name = entryName(&entry);
+        path = malloc(strlen(target.path) + strlen(name) + 2);
+        assert(path != NULL);
+        sprintf(path, "%s/%s", target.path, name);
+        free(name);
+
+        clusters_needed = (entry.data_length + cluster_bytes - 1) / cluster_bytes;
+        in_use = clustersInUse(scan, &entry);
+        scan->deleted++;
+
+        printf("Deleted %s: %s (%llu bytes, cluster %u) ", isDirectory(&entry) ? "Directory" : "File",
+               path, (unsigned long long) entry.data_length, entry.first_cluster);
+
+        if(clusters_needed == 0){
+            printf("empty\n");
+        }
+        else if(in_use == 0){
+            printf("recoverable\n");
+            scan->recoverable++;
+
+            if(isDirectory(&entry)){
+                addTarget(scan, path, entry.first_cluster, entry.data_length, FLAG_NO_FAT_CHAIN);
+            }
+            else if(scan->output_directory != NULL && recoverFile(scan, &entry, path) == 0){
+                scan->recovered++;
+            }
+        }
+        else {
+            printf("overwritten (%llu of %llu clusters in use)\n",
+                   (unsigned long long) in_use, (unsigned long long) clusters_needed);
+        }
+        free(path);
+    }
+
+    free(matches);
+    free(clusters);
+    free(entries);
+}
+
+/*------------------------------------------------------
+// commandUndelete
+//
+// PURPOSE: Runs "list --deleted" (output_directory NULL)
+// and "undelete".  Every live directory, and every deleted
+// directory that is still intact, is scanned for deleted
+// entry sets.
+// INPUT PARAMETERS:
+//     Takes in a file descriptor to an exfat volume, a
+// pointer to the exfat volume struct and the directory to
+// recover files into, or NULL to only list them.
+// OUTPUT PARAMETERS:
+//     Returns 0 on success, -1 if the allocation bitmap
+// could not be read.
+//------------------------------------------------------*/
+int commandUndelete(int volume_fd, exfat *volume, const char *output_directory){
+
+    DeletedScan scan;
+
+    assert(volume != NULL);
+
+    memset(&scan, 0, sizeof (DeletedScan));
+    scan.volume_fd = volume_fd;
+    scan.volume = volume;
+    scan.output_directory = output_directory;
+
+    scan.bitmap = loadAllocationBitmap(volume_fd, volume, NULL);
+    if(scan.bitmap == NULL){
+        return -1;
+    }
+    scan.scanned = createBitset(volume->cluster_count);
+    assert(scan.scanned != NULL);
+
+    addTarget(&scan, "", volume->root_cluster, 0, 0);
+    walkTree(volume_fd, volume, NULL, "", volume->root_cluster, 0, 0, collectDirectory, &scan);
+
+    /* Deleted directories found along the way are appended to the targets */
+    for(uint64_t i = 0; i < scan.target_count; i++){
+        scanDirectory(&scan, i);
+    }
+
+    printf("\n%llu deleted entr%s, %llu recoverable", (unsigned long long) scan.deleted,
+           scan.deleted == 1 ? "y" : "ies", (unsigned long long) scan.recoverable);
+    if(output_directory != NULL){
+        printf(", %llu recovered", (unsigned long long) scan.recovered);
+    }
+    printf("\n");
+
+    for(uint64_t i = 0; i < scan.target_count; i++){
+        free(scan.targets[i].path);
+    }
+    free(scan.targets);
+    destroyBitset(scan.bitmap);
+    destroyBitset(scan.scanned);
+    return 0;
+}
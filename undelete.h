@@ -0,0 +1,14 @@
+//
+// Listing and recovery of deleted directory entry sets.
+//
+
+#ifndef FSREADER_UNDELETE_H
+#define FSREADER_UNDELETE_H
+
+#include "exfat.h"
+
+
+int commandUndelete(int volume_fd, exfat *volume, const char *output_directory);
+
+
+#endif //FSREADER_UNDELETE_H
@@ -0,0 +1,150 @@
+/*-----------------------------------------
+// NAME: Ryan Campbell
+//
+// REMARKS: Implement a WorkQueue, a stack of work
+// items drained by one thread per core.  Items are
+// taken last in first out so a tree walk stays close
+// to depth first and the queue stays small.  The
+// queue is finished once it is empty and no thread is
+// still processing an item that could push more.
+//-----------------------------------------*/
+#include <stdlib.h>
+#include <assert.h>
+
+#include "workqueue.h"
+#include "parallel.h"
+#include "trace.h"
+
+#define MAX_WORKERS 64
+
+/*------------------------------------------------------
+// createWorkQueue
+//
+// PURPOSE: Allocates an empty WorkQueue.
+// INPUT PARAMETERS:
+//    Takes in the function that processes each item and a
+// context pointer handed to every call.
+// OUTPUT PARAMETERS:
+//     Returns a pointer to the new WorkQueue.
+//------------------------------------------------------*/
+WorkQueue *createWorkQueue(WorkFunction function, void *context){
+
+    WorkQueue *queue = calloc(1, sizeof (WorkQueue));
+
+    assert(queue != NULL && function != NULL);
+
+    queue->function = function;
+    queue->context = context;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->ready, NULL);
+
+    return queue;
+}
+
+/*------------------------------------------------------
+// pushWork
+//
+// PURPOSE: Adds an item to the queue, waking a thread that
+// is waiting for work.  May be called from the work
+// function while the queue runs.
+// INPUT PARAMETERS:
+//    Takes in the queue and the item to add.
+//------------------------------------------------------*/
+void pushWork(WorkQueue *queue, void *item){
+
+    pthread_mutex_lock(&queue->lock);
+
+    if(queue->count == queue->capacity){
+        queue->capacity = queue->capacity == 0 ? 64 : queue->capacity * 2;
+        queue->items = realloc(queue->items, queue->capacity * sizeof (void *));
+        assert(queue->items != NULL);
+    }
+    queue->items[queue->count++] = item;
+
+    pthread_cond_signal(&queue->ready);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void *runWorker(void *argument){
+
+    WorkQueue *queue = argument;
+    void *item;
+
+    pthread_mutex_lock(&queue->lock);
+
+    for(;;){
+        while(queue->count == 0 && queue->active > 0){
+            pthread_cond_wait(&queue->ready, &queue->lock);
+        }
+        if(queue->count == 0){
+            /* Nothing queued and nothing running that could queue more */
+            pthread_cond_broadcast(&queue->ready);
+            break;
+        }
+
+        item = queue->items[--queue->count];
+        queue->active++;
+        pthread_mutex_unlock(&queue->lock);
+
+        traceBegin("work item");
+        queue->function(item, queue, queue->context);
+        traceEnd();
+
+        pthread_mutex_lock(&queue->lock);
+        queue->active--;
+        if(queue->active == 0 && queue->count == 0){
+            pthread_cond_broadcast(&queue->ready);
+        }
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+static void *startWorker(void *argument){
+
+    traceThreadName("queue worker");
+    return runWorker(argument);
+}
+
+/*------------------------------------------------------
+// runWorkQueue
+//
+// PURPOSE: Drains the queue with threadCount() threads,
+// the calling thread being one of them.  Returns once
+// every item, including the items pushed while running,
+// has been processed.
+// INPUT PARAMETERS:
+//    Takes in the queue to drain.
+//------------------------------------------------------*/
+void runWorkQueue(WorkQueue *queue){
+
+    pthread_t threads[MAX_WORKERS];
+    unsigned int workers = threadCount();
+    unsigned int started = 0;
+
+    if(workers > MAX_WORKERS){
+        workers = MAX_WORKERS;
+    }
+
+    for(unsigned int i = 1; i < workers; i++){
+        if(pthread_create(&threads[started], NULL, startWorker, queue) == 0){
+            started++;
+        }
+    }
+    runWorker(queue);
+
+    for(unsigned int i = 0; i < started; i++){
+        pthread_join(threads[i], NULL);
+    }
+}
+
+void destroyWorkQueue(WorkQueue *queue){
+
+    if(queue != NULL){
+        pthread_mutex_destroy(&queue->lock);
+        pthread_cond_destroy(&queue->ready);
+        free(queue->items);
+        free(queue);
+    }
+}
@@ -0,0 +1,40 @@
+//
+// Shared queue of work items drained by a pool of threads.
+//
+
+#ifndef FSREADER_WORKQUEUE_H
+#define FSREADER_WORKQUEUE_H
+
+#include <pthread.h>
+
+struct WorkQueue;
+
+/* Processes one item, and may push more items to the queue */
+typedef void (*WorkFunction)(void *item, struct WorkQueue *queue, void *context);
+
+typedef struct WorkQueue {
+
+    void **items;
+    unsigned long count;
+    unsigned long capacity;
+    unsigned int active;    /* threads currently processing an item */
+
+    WorkFunction function;
+    void *context;
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+
+} WorkQueue ;
+
+
+WorkQueue *createWorkQueue(WorkFunction function, void *context);
+
+void pushWork(WorkQueue *queue, void *item);
+
+void runWorkQueue(WorkQueue *queue);
+
+void destroyWorkQueue(WorkQueue *queue);
+
+
+#endif //FSREADER_WORKQUEUE_H